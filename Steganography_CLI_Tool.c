@@ -3,6 +3,53 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define STEG_O_BINARY O_BINARY
+#define steg_fseek _fseeki64
+typedef __int64 steg_off_t;
+#else
+#include <termios.h>
+#define STEG_O_BINARY 0
+#define steg_fseek fseeko
+typedef off_t steg_off_t;
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define STEG_HAVE_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define STEG_HAVE_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>  // SSSE3/AVX2 kernels are compiled with target attributes and chosen at runtime
+#define STEG_HAVE_X86_DISPATCH 1
+#endif
+#elif defined(__ARM_NEON) && defined(STEG_ENABLE_NEON)  // Not yet tested on ARM hardware; make USE_NEON=1 opts in
+#include <arm_neon.h>
+#define STEG_HAVE_NEON 1
+#endif
+#if defined(__ARM_FEATURE_CRC32) && defined(STEG_ENABLE_NEON)
+#include <arm_acle.h>
+#define STEG_HAVE_ARM_CRC32 1
+#endif
+#ifdef STEG_USE_ZLIB
+#include <zlib.h>
+#endif
 #include "stb_image_library/stb_image.h"
 #include "stb_image_library/stb_image_write.h"
 
@@ -23,318 +70,11440 @@ char *binaryToAscii(const char *binary_data);
  */
 char *messageToBinary(const char *message);
 
+// Byte <-> bit conversion. A payload byte is stored MSB first, one bit per carrier byte (a pixel
+// channel value, or a '0'/'1' character of the binary string form). Eight carriers are handled as one
+// 64-bit word whose lane i is the carrier at address i, whatever the host byte order.
+#define BIT_LANES 0x0101010101010101ULL   // The low bit of every lane
+#define BIT_CHARS 0x3030303030303030ULL   // '0' in every lane
+#define BIT_GATHER 0x8040201008040201ULL  // Moves lane i's low bit to bit 63 - i; no partial products collide
+
+// bit_lanes[v] has bit 7 - i of v in lane i
+#define BIT_SPREAD(v) ((((uint64_t)(v) >> 7) & 1) | ((((uint64_t)(v) >> 6) & 1) << 8) | ((((uint64_t)(v) >> 5) & 1) << 16) | \
+                       ((((uint64_t)(v) >> 4) & 1) << 24) | ((((uint64_t)(v) >> 3) & 1) << 32) | ((((uint64_t)(v) >> 2) & 1) << 40) | \
+                       ((((uint64_t)(v) >> 1) & 1) << 48) | (((uint64_t)(v) & 1) << 56))
+#define BIT_SPREAD4(v) BIT_SPREAD(v), BIT_SPREAD((v) + 1), BIT_SPREAD((v) + 2), BIT_SPREAD((v) + 3)
+#define BIT_SPREAD16(v) BIT_SPREAD4(v), BIT_SPREAD4((v) + 4), BIT_SPREAD4((v) + 8), BIT_SPREAD4((v) + 12)
+#define BIT_SPREAD64(v) BIT_SPREAD16(v), BIT_SPREAD16((v) + 16), BIT_SPREAD16((v) + 32), BIT_SPREAD16((v) + 48)
+static const uint64_t bit_lanes[256] = { BIT_SPREAD64(0), BIT_SPREAD64(64), BIT_SPREAD64(128), BIT_SPREAD64(192) };
+
+/**
+ * Loads eight bytes so that lane i holds the byte at address i.
+ *
+ * @param p The bytes.
+ * @return The word.
+ */
+static inline uint64_t load_lanes(const void *p) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/**
+ * Stores eight bytes so that the byte at address i comes from lane i.
+ *
+ * @param p The destination.
+ * @param word The word.
+ */
+static inline void store_lanes(void *p, uint64_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(p, &word, 8);
+}
+
+/**
+ * Reads a big-endian 32-bit value.
+ *
+ * @param p The four bytes.
+ * @return The value.
+ */
+static inline uint32_t read_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Collects the low bits of eight lanes into a byte, lane 0 becoming the most significant bit.
+ *
+ * @param word Eight carriers.
+ * @return The byte.
+ */
+static inline unsigned char gather_lanes(uint64_t word) {
+    return (unsigned char)(((word & BIT_LANES) * BIT_GATHER) >> 56);
+}
+
+/**
+ * Expands bytes into their '0'/'1' character form (8 characters per byte, MSB first).
+ *
+ * @param bytes The bytes.
+ * @param count The number of bytes.
+ * @param chars The output (8 * count characters, not terminated).
+ */
+void bytes_to_bit_chars(const unsigned char *bytes, size_t count, char *chars) {
+    for (size_t i = 0; i < count; i++) {
+        store_lanes(chars + i * 8, bit_lanes[bytes[i]] + BIT_CHARS);
+    }
+}
+
+/**
+ * Packs '0'/'1' characters back into bytes (8 characters per byte, MSB first).
+ *
+ * @param chars The characters.
+ * @param count The number of bytes to produce.
+ * @param bytes The output.
+ */
+void bit_chars_to_bytes(const char *chars, size_t count, unsigned char *bytes) {
+    for (size_t i = 0; i < count; i++) {
+        bytes[i] = gather_lanes(load_lanes(chars + i * 8));  // '1' is the only one of '0'/'1' with its low bit set
+    }
+}
+
+/**
+ * Writes payload bytes into the least significant bits of carrier bytes, 8 carriers per payload byte.
+ *
+ * @param carriers The carrier bytes (pixel channel values); only their low bits change.
+ * @param bytes The payload.
+ * @param count The number of payload bytes.
+ */
+void lsb_spread(unsigned char *carriers, const unsigned char *bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint64_t word = load_lanes(carriers + i * 8);
+        store_lanes(carriers + i * 8, (word & ~BIT_LANES) | bit_lanes[bytes[i]]);
+    }
+}
+
+/**
+ * Reads payload bytes from the least significant bits of carrier bytes, 8 carriers per payload byte.
+ *
+ * @param carriers The carrier bytes.
+ * @param bytes The output.
+ * @param count The number of payload bytes.
+ */
+void lsb_gather(const unsigned char *carriers, unsigned char *bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        bytes[i] = gather_lanes(load_lanes(carriers + i * 8));
+    }
+}
+
+// 16-bit images are held as big-endian samples, the byte order of PNG rows. Their carriers are the low
+// bytes of the samples, each holding a whole embedded byte: the high bytes, which are the 8-bit image,
+// never change, so a 16-bit carrier takes eight times the payload of an 8-bit one at 1/256 of the
+// amplitude. Embedding is a strided byte copy.
+
+/**
+ * Writes payload bytes into the low bytes of big-endian 16-bit samples, one byte per sample.
+ *
+ * @param samples The sample data; only the low bytes change.
+ * @param bytes The payload.
+ * @param count The number of payload bytes.
+ */
+void wide_spread(unsigned char *samples, const unsigned char *bytes, size_t count) {
+    size_t i = 0;
+#if defined(STEG_HAVE_SSE2)
+    const __m128i zero = _mm_setzero_si128(), high = _mm_set1_epi16(0x00FF);  // The first byte of each sample
+    for (; i + 16 <= count; i += 16) {
+        __m128i payload = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i *p = (__m128i *)(samples + i * 2);
+        __m128i lo = _mm_and_si128(_mm_loadu_si128(p), high), hi = _mm_and_si128(_mm_loadu_si128(p + 1), high);
+        _mm_storeu_si128(p, _mm_or_si128(lo, _mm_unpacklo_epi8(zero, payload)));
+        _mm_storeu_si128(p + 1, _mm_or_si128(hi, _mm_unpackhi_epi8(zero, payload)));
+    }
+#elif defined(STEG_HAVE_NEON)  // Only with STEG_ENABLE_NEON, untested on ARM hardware
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x2_t pair = vld2q_u8(samples + i * 2);  // val[0]: high bytes, val[1]: low bytes
+        pair.val[1] = vld1q_u8(bytes + i);
+        vst2q_u8(samples + i * 2, pair);
+    }
+#endif
+    for (; i < count; i++) samples[i * 2 + 1] = bytes[i];
+}
+
+/**
+ * Reads payload bytes from the low bytes of big-endian 16-bit samples, one byte per sample.
+ *
+ * @param samples The sample data.
+ * @param bytes The output.
+ * @param count The number of payload bytes.
+ */
+void wide_gather(const unsigned char *samples, unsigned char *bytes, size_t count) {
+    size_t i = 0;
+#if defined(STEG_HAVE_SSE2)
+    for (; i + 16 <= count; i += 16) {
+        const __m128i *p = (const __m128i *)(samples + i * 2);
+        __m128i lo = _mm_srli_epi16(_mm_loadu_si128(p), 8), hi = _mm_srli_epi16(_mm_loadu_si128(p + 1), 8);
+        _mm_storeu_si128((__m128i *)(bytes + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(STEG_HAVE_NEON)
+    for (; i + 16 <= count; i += 16) {
+        vst1q_u8(bytes + i, vld2q_u8(samples + i * 2).val[1]);
+    }
+#endif
+    for (; i < count; i++) bytes[i] = samples[i * 2 + 1];
+}
+
+// The "depth" of carriers that are plain bytes rather than samples: the payload chunk of the chunk carrier
+// mode, where each byte holds a whole embedded byte
+#define CARRIER_DEPTH_BYTES 0
+
+/**
+ * Returns how many embedded bytes an image's carriers hold: one per eight 8-bit samples, one per
+ * 16-bit sample, or one per byte of a payload chunk.
+ *
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16), or CARRIER_DEPTH_BYTES.
+ * @return The number of embedded byte positions.
+ */
+size_t carrier_slots(size_t pixel_bytes, int depth) {
+    if (depth == CARRIER_DEPTH_BYTES) return pixel_bytes;
+    return depth == 16 ? pixel_bytes / 2 : pixel_bytes / 8;
+}
+
+// Keyed scattering. With a key, embedded bit i is stored in carrier P(i) rather than carrier i, where P
+// is a pseudo-random permutation of all the carriers of the image. P is a Feistel network over pairs
+// (l, r) of digits in base a, a = ceil(sqrt(carriers)), with addition mod a in place of xor, so the
+// carrier count needs no padding to a power of two. The few values past the last carrier (fewer than
+// 2a of a^2) are walked on through the network until they land on a carrier. Encoder and decoder
+// compute any position directly, so no shuffled index table is built, whatever the image size. The
+// key hides where the bits are; it does not encrypt them. The carriers of a 16-bit image are whole low
+// bytes, so there embedded byte i goes to sample P(i).
+#define SCATTER_ROUNDS 4
+#define SCATTER_BATCH 64  // Carrier positions computed, and prefetched, before the carriers are touched
+
+#if defined(__GNUC__)
+#define SCATTER_PREFETCH(p, write) __builtin_prefetch((p), (write))
+#else
+#define SCATTER_PREFETCH(p, write) ((void)0)
+#endif
+
+// A scattering key, derived from a passphrase
+typedef struct {
+    int set;  // 0 for sequential embedding
+    uint64_t round_keys[SCATTER_ROUNDS];
+} steg_key;
+
+// The carriers of one image: their width and, with a key, their permutation
+typedef struct {
+    uint64_t round_keys[SCATTER_ROUNDS];
+    uint64_t carriers;  // Number of carriers
+    uint64_t side;      // The base a: the smallest a with a * a >= carriers
+    int keyed;          // 0 for sequential carriers
+    int depth;          // Bits per sample: 8 (a bit per carrier), 16 or CARRIER_DEPTH_BYTES (a byte per carrier)
+} steg_scatter;
+
+/**
+ * Derives a scattering key from a passphrase.
+ *
+ * @param passphrase The passphrase.
+ * @param key The key to fill in.
+ */
+void steg_key_derive(const char *passphrase, steg_key *key) {
+    uint64_t state = 0xCBF29CE484222325ULL;  // FNV-1a, then SplitMix64 steps for the round keys
+    for (const unsigned char *p = (const unsigned char *)passphrase; *p; p++) {
+        state = (state ^ *p) * 0x100000001B3ULL;
+    }
+    key->set = 1;
+    for (int r = 0; r < SCATTER_ROUNDS; r++) {
+        state += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        key->round_keys[r] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * Sets up the carriers of an image.
+ *
+ * @param scatter The carriers to fill in.
+ * @param key The key, or NULL.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16), or CARRIER_DEPTH_BYTES.
+ * @return scatter, or NULL for sequential carriers in 8-bit samples (no key).
+ */
+const steg_scatter *scatter_init(steg_scatter *scatter, const steg_key *key, size_t pixel_bytes, int depth) {
+    uint64_t carriers = depth == 16 ? pixel_bytes / 2 : pixel_bytes;
+    scatter->keyed = key && key->set && carriers > 0;
+    scatter->depth = depth == 16 || depth == CARRIER_DEPTH_BYTES ? depth : 8;
+    scatter->carriers = carriers;
+    if (!scatter->keyed) return scatter->depth != 8 ? scatter : NULL;
+    uint64_t low = 0, high = 1;
+    while (high * high < carriers) high <<= 1;
+    while (low + 1 < high) {  // Invariant: low * low < carriers <= high * high
+        uint64_t mid = low + (high - low) / 2;
+        if (mid * mid < carriers) low = mid;
+        else high = mid;
+    }
+    memcpy(scatter->round_keys, key->round_keys, sizeof(scatter->round_keys));
+    scatter->side = high;
+    return scatter;
+}
+
+/**
+ * Runs the Feistel network on one value. Each round adds a hash of r and the round key to l, mod a,
+ * and swaps the two: the hash is a multiplicative hash, scaled to [0, a) with a multiply.
+ *
+ * @param scatter The permutation.
+ * @param l The high digit.
+ * @param r The low digit.
+ * @return The permuted value, l * a + r (it may be past the last carrier).
+ */
+static inline uint64_t scatter_feistel(const steg_scatter *scatter, uint64_t l, uint64_t r) {
+    uint64_t side = scatter->side;
+    for (int round = 0; round < SCATTER_ROUNDS; round++) {
+        uint64_t hash = ((r ^ scatter->round_keys[round]) * 0x9E3779B97F4A7C15ULL) >> 32;
+        uint64_t sum = l + ((hash * side) >> 32);
+        l = r;
+        r = sum >= side ? sum - side : sum;
+    }
+    return l * side + r;
+}
+
+/**
+ * Maps a run of embedded positions (bits, or bytes in 16-bit samples) to their carriers and prefetches
+ * the carriers. The digits of the first position are found with one division; the next ones are counted
+ * on from it.
+ *
+ * @param scatter The permutation.
+ * @param pixels The image data, or NULL to leave the prefetching to the caller.
+ * @param first The first position.
+ * @param count The number of positions (at most SCATTER_BATCH).
+ * @param write 1 if the carriers will be written.
+ * @param positions The output.
+ */
+static inline void scatter_positions(const steg_scatter *scatter, const unsigned char *pixels, uint64_t first, size_t count, int write,
+                                     size_t *positions) {
+    uint64_t side = scatter->side, l = first / side, r = first % side;
+    for (size_t j = 0; j < count; j++) {
+        uint64_t x = scatter_feistel(scatter, l, r);
+        while (x >= scatter->carriers) {
+            x = scatter_feistel(scatter, x / side, x % side);
+        }
+        positions[j] = (size_t)x;
+        if (pixels) {
+            const unsigned char *carrier = scatter->depth == 16 ? pixels + x * 2 + 1 : pixels + x;
+            if (write) SCATTER_PREFETCH(carrier, 1);
+            else SCATTER_PREFETCH(carrier, 0);
+        }
+        if (++r == side) {
+            r = 0;
+            l++;
+        }
+    }
+}
+
+/**
+ * Writes payload bytes into the carriers of a run of embedded byte positions.
+ *
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples (lsb_spread).
+ * @param pixels The image data; only the low bits of the carriers change.
+ * @param offset The embedded byte position of the first byte.
+ * @param bytes The payload.
+ * @param count The number of payload bytes.
+ */
+void carrier_spread(const steg_scatter *scatter, unsigned char *pixels, size_t offset, const unsigned char *bytes, size_t count) {
+    if (!scatter) {
+        lsb_spread(pixels + offset * 8, bytes, count);
+        return;
+    }
+    size_t positions[SCATTER_BATCH];
+    if (scatter->depth != 8) {
+        int stride = scatter->depth == 16 ? 2 : 1, low = stride - 1;
+        if (!scatter->keyed) {
+            if (stride == 2) wide_spread(pixels + offset * 2, bytes, count);
+            else memcpy(pixels + offset, bytes, count);
+            return;
+        }
+        for (size_t done = 0; done < count;) {
+            size_t block = count - done < SCATTER_BATCH ? count - done : SCATTER_BATCH;
+            scatter_positions(scatter, pixels, offset + done, block, 1, positions);
+            for (size_t i = 0; i < block; i++) pixels[positions[i] * stride + low] = bytes[done + i];
+            done += block;
+        }
+        return;
+    }
+    for (size_t done = 0; done < count;) {
+        size_t block = count - done < SCATTER_BATCH / 8 ? count - done : SCATTER_BATCH / 8;
+        scatter_positions(scatter, pixels, (uint64_t)(offset + done) * 8, block * 8, 1, positions);
+        for (size_t i = 0; i < block * 8; i++) {
+            unsigned char *carrier = pixels + positions[i];
+            *carrier = (unsigned char)((*carrier & ~1u) | ((bytes[done + i / 8] >> (7 - i % 8)) & 1));
+        }
+        done += block;
+    }
+}
+
+/**
+ * Reads payload bytes from the carriers of a run of embedded byte positions.
+ *
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples (lsb_gather).
+ * @param pixels The image data.
+ * @param offset The embedded byte position of the first byte.
+ * @param bytes The output.
+ * @param count The number of payload bytes.
+ */
+void carrier_gather(const steg_scatter *scatter, const unsigned char *pixels, size_t offset, unsigned char *bytes, size_t count) {
+    if (!scatter) {
+        lsb_gather(pixels + offset * 8, bytes, count);
+        return;
+    }
+    size_t positions[SCATTER_BATCH];
+    if (scatter->depth != 8) {
+        int stride = scatter->depth == 16 ? 2 : 1, low = stride - 1;
+        if (!scatter->keyed) {
+            if (stride == 2) wide_gather(pixels + offset * 2, bytes, count);
+            else memcpy(bytes, pixels + offset, count);
+            return;
+        }
+        for (size_t done = 0; done < count;) {
+            size_t block = count - done < SCATTER_BATCH ? count - done : SCATTER_BATCH;
+            scatter_positions(scatter, pixels, offset + done, block, 0, positions);
+            for (size_t i = 0; i < block; i++) bytes[done + i] = pixels[positions[i] * stride + low];
+            done += block;
+        }
+        return;
+    }
+    for (size_t done = 0; done < count;) {
+        size_t block = count - done < SCATTER_BATCH / 8 ? count - done : SCATTER_BATCH / 8;
+        scatter_positions(scatter, pixels, (uint64_t)(offset + done) * 8, block * 8, 0, positions);
+        for (size_t i = 0; i < block; i++) {
+            unsigned char byte = 0;
+            for (int j = 0; j < 8; j++) {
+                byte = (unsigned char)((byte << 1) | (pixels[positions[i * 8 + j]] & 1));
+            }
+            bytes[done + i] = byte;
+        }
+        done += block;
+    }
+}
+
+// Frames. The carrier functions above take an image as one packed buffer. A frame describes image
+// rows that are not packed: rows padded out to a stride, as in GPU readback buffers; a sub-rectangle of
+// a larger canvas, given by its first pixel and the canvas stride; or rows anywhere in memory, given by
+// an array of row pointers. The embedded byte stream is laid over the rows as if they were packed, so a
+// message embedded through a frame reads back from the packed image of the same pixels and the other
+// way round. Padding and pixels outside the rows are never touched. The embedded bytes that lie wholly
+// in a row go through the packed kernels. An 8-bit row need not hold a whole number of embedded bytes,
+// so a byte whose eight carriers run past the end of a row is copied out, embedded and copied back.
+
+// Image rows that need not be packed
+typedef struct {
+    unsigned char *base;         // The first row, when rows is NULL
+    unsigned char *const *rows;  // Row pointers, or NULL for rows stride bytes apart from base
+    size_t stride;               // Bytes from the start of one row to the start of the next
+    size_t row_bytes;            // Image bytes in a row: width * channels * bytes per sample
+    size_t height;
+} steg_frame;
+
+/**
+ * Describes rows a fixed number of bytes apart: a padded buffer, or a sub-rectangle of a larger one.
+ *
+ * @param frame The frame to fill in.
+ * @param base The first image byte of the first row.
+ * @param row_bytes The image bytes in a row (whole samples).
+ * @param height The number of rows.
+ * @param stride The bytes from the start of one row to the start of the next.
+ * @return 1 on success, 0 if the rows would overlap.
+ */
+int steg_frame_strided(steg_frame *frame, unsigned char *base, size_t row_bytes, size_t height, size_t stride) {
+    if (stride < row_bytes && height > 1) {
+        printf("ERROR: A frame stride of %zu bytes is shorter than its %zu-byte rows.\n", stride, row_bytes);
+        return 0;
+    }
+    frame->base = base;
+    frame->rows = NULL;
+    frame->stride = stride;
+    frame->row_bytes = row_bytes;
+    frame->height = height;
+    return 1;
+}
+
+/**
+ * Describes rows given by an array of row pointers, in image order.
+ *
+ * @param frame The frame to fill in.
+ * @param rows The row pointers; the array must outlive the frame.
+ * @param row_bytes The image bytes in a row (whole samples).
+ * @param height The number of rows.
+ */
+void steg_frame_rows(steg_frame *frame, unsigned char *const *rows, size_t row_bytes, size_t height) {
+    frame->base = height > 0 ? rows[0] : NULL;
+    frame->rows = rows;
+    frame->stride = 0;
+    frame->row_bytes = row_bytes;
+    frame->height = height;
+}
+
+/**
+ * Returns a row of a frame.
+ *
+ * @param frame The frame.
+ * @param y The row.
+ * @return The first image byte of the row.
+ */
+static inline unsigned char *frame_row(const steg_frame *frame, size_t y) {
+    return frame->rows ? frame->rows[y] : frame->base + y * frame->stride;
+}
+
+/**
+ * Returns an image byte of a frame by its position in the packed image.
+ *
+ * @param frame The frame.
+ * @param index The position.
+ * @return The byte.
+ */
+static inline unsigned char *frame_at(const steg_frame *frame, size_t index) {
+    size_t y = index / frame->row_bytes;
+    return frame_row(frame, y) + (index - y * frame->row_bytes);
+}
+
+/**
+ * Tells whether a frame's rows are packed end to end, so the packed kernels can take it whole.
+ *
+ * @param frame The frame.
+ * @return 1 if the frame is one packed buffer.
+ */
+static inline int frame_is_packed(const steg_frame *frame) {
+    return !frame->rows && (frame->stride == frame->row_bytes || frame->height <= 1);
+}
+
+/**
+ * Describes a packed image as a frame of one row. The message functions take frames; this is how the
+ * packed ones hand them an image. A frame of const pixels must only be read.
+ *
+ * @param pixels The image data.
+ * @param pixel_bytes The size of the image data.
+ * @return The frame.
+ */
+static inline steg_frame frame_packed(const unsigned char *pixels, size_t pixel_bytes) {
+    steg_frame frame = { (unsigned char *)pixels, NULL, pixel_bytes, pixel_bytes, 1 };
+    return frame;
+}
+
+/**
+ * Returns the number of image bytes in a frame, the size of its packed image.
+ *
+ * @param frame The frame.
+ * @return The size.
+ */
+static inline size_t frame_bytes(const steg_frame *frame) {
+    return frame->row_bytes * frame->height;
+}
+
+/**
+ * Maps a run of keyed embedded positions to the carrier bytes of a frame and prefetches them.
+ *
+ * @param scatter The carriers (keyed).
+ * @param frame The frame.
+ * @param first The first position.
+ * @param count The number of positions (at most SCATTER_BATCH).
+ * @param write 1 if the carriers will be written.
+ * @param carriers The output.
+ */
+static inline void frame_keyed_carriers(const steg_scatter *scatter, const steg_frame *frame, uint64_t first, size_t count, int write,
+                                        unsigned char **carriers) {
+    size_t positions[SCATTER_BATCH];
+    size_t stride = scatter->depth == 16 ? 2 : 1, low = stride - 1;
+    scatter_positions(scatter, NULL, first, count, write, positions);
+    for (size_t i = 0; i < count; i++) {
+        carriers[i] = frame_at(frame, positions[i] * stride + low);
+        if (write) SCATTER_PREFETCH(carriers[i], 1);
+        else SCATTER_PREFETCH(carriers[i], 0);
+    }
+}
+
+/**
+ * Writes payload bytes into the carriers of a frame, at the embedded byte positions carrier_spread
+ * would use for the packed image.
+ *
+ * @param scatter The carriers of the packed image, or NULL for sequential carriers in 8-bit samples.
+ * @param frame The frame; only the low bits of its carriers change.
+ * @param offset The embedded byte position of the first byte.
+ * @param bytes The payload.
+ * @param count The number of payload bytes.
+ */
+void frame_spread(const steg_scatter *scatter, const steg_frame *frame, size_t offset, const unsigned char *bytes, size_t count) {
+    if (frame_is_packed(frame)) {
+        carrier_spread(scatter, frame->base, offset, bytes, count);
+        return;
+    }
+    int depth = scatter ? scatter->depth : 8;
+    if (scatter && scatter->keyed) {
+        unsigned char *carriers[SCATTER_BATCH];
+        size_t per_byte = depth == 8 ? 8 : 1;
+        for (size_t done = 0; done < count;) {
+            size_t block = count - done < SCATTER_BATCH / per_byte ? count - done : SCATTER_BATCH / per_byte;
+            frame_keyed_carriers(scatter, frame, (uint64_t)(offset + done) * per_byte, block * per_byte, 1, carriers);
+            for (size_t i = 0; i < block * per_byte; i++) {
+                if (per_byte == 1) *carriers[i] = bytes[done + i];
+                else *carriers[i] = (unsigned char)((*carriers[i] & ~1u) | ((bytes[done + i / 8] >> (7 - i % 8)) & 1));
+            }
+            done += block;
+        }
+        return;
+    }
+    size_t unit = depth == 8 ? 8 : depth == 16 ? 2 : 1;  // Carrier bytes per embedded byte
+    size_t index = offset * unit;
+    for (size_t done = 0; done < count;) {
+        size_t y = index / frame->row_bytes, x = index - y * frame->row_bytes;
+        size_t run = (frame->row_bytes - x) / unit;
+        if (run > count - done) run = count - done;
+        if (run > 0) {
+            carrier_spread(scatter, frame_row(frame, y) + x, 0, bytes + done, run);
+        } else {
+            unsigned char carriers[8];
+            run = 1;
+            for (size_t i = 0; i < unit; i++) carriers[i] = *frame_at(frame, index + i);
+            carrier_spread(scatter, carriers, 0, bytes + done, 1);
+            for (size_t i = 0; i < unit; i++) *frame_at(frame, index + i) = carriers[i];
+        }
+        done += run;
+        index += run * unit;
+    }
+}
+
+/**
+ * Reads payload bytes from the carriers of a frame, at the embedded byte positions carrier_gather
+ * would use for the packed image.
+ *
+ * @param scatter The carriers of the packed image, or NULL for sequential carriers in 8-bit samples.
+ * @param frame The frame; it is only read.
+ * @param offset The embedded byte position of the first byte.
+ * @param bytes The output.
+ * @param count The number of payload bytes.
+ */
+void frame_gather(const steg_scatter *scatter, const steg_frame *frame, size_t offset, unsigned char *bytes, size_t count) {
+    if (frame_is_packed(frame)) {
+        carrier_gather(scatter, frame->base, offset, bytes, count);
+        return;
+    }
+    int depth = scatter ? scatter->depth : 8;
+    if (scatter && scatter->keyed) {
+        unsigned char *carriers[SCATTER_BATCH];
+        size_t per_byte = depth == 8 ? 8 : 1;
+        for (size_t done = 0; done < count;) {
+            size_t block = count - done < SCATTER_BATCH / per_byte ? count - done : SCATTER_BATCH / per_byte;
+            frame_keyed_carriers(scatter, frame, (uint64_t)(offset + done) * per_byte, block * per_byte, 0, carriers);
+            for (size_t i = 0; i < block; i++) {
+                if (per_byte == 1) {
+                    bytes[done + i] = *carriers[i];
+                    continue;
+                }
+                unsigned char byte = 0;
+                for (int j = 0; j < 8; j++) {
+                    byte = (unsigned char)((byte << 1) | (*carriers[i * 8 + j] & 1));
+                }
+                bytes[done + i] = byte;
+            }
+            done += block;
+        }
+        return;
+    }
+    size_t unit = depth == 8 ? 8 : depth == 16 ? 2 : 1;
+    size_t index = offset * unit;
+    for (size_t done = 0; done < count;) {
+        size_t y = index / frame->row_bytes, x = index - y * frame->row_bytes;
+        size_t run = (frame->row_bytes - x) / unit;
+        if (run > count - done) run = count - done;
+        if (run > 0) {
+            carrier_gather(scatter, frame_row(frame, y) + x, 0, bytes + done, run);
+        } else {
+            unsigned char carriers[8];
+            run = 1;
+            for (size_t i = 0; i < unit; i++) carriers[i] = *frame_at(frame, index + i);
+            carrier_gather(scatter, carriers, 0, bytes + done, 1);
+        }
+        done += run;
+        index += run * unit;
+    }
+}
+
+// CRC32C (Castagnoli) of framed payloads: the SSE4.2 or ARMv8 crc32c instructions when available, else slicing-by-8
+#define CRC32C_POLY 0x82F63B78u  // Reflected polynomial
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *data, size_t length);
+
+static uint32_t crc32c_table[8][256];
+static crc32c_fn crc32c_kernel;
+static const char *crc32c_kernel_label = "slice8";
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Updates a CRC32C register with slicing-by-8 table lookups, eight input bytes per step.
+ *
+ * @param crc The register (already inverted).
+ * @param data The data.
+ * @param length The size of the data.
+ * @return The updated register.
+ */
+uint32_t crc32c_slice8(uint32_t crc, const unsigned char *data, size_t length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^ crc32c_table[5][(lo >> 16) & 0xFF] ^
+              crc32c_table[4][lo >> 24] ^ crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    }
+    while (length--) {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(STEG_HAVE_X86_DISPATCH) && defined(__x86_64__)
+/**
+ * Updates a CRC32C register with the SSE4.2 crc32 instruction.
+ *
+ * @param crc The register (already inverted).
+ * @param data The data.
+ * @param length The size of the data.
+ * @return The updated register.
+ */
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length) {
+    uint64_t wide = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+#if defined(STEG_HAVE_ARM_CRC32)
+/**
+ * Updates a CRC32C register with the ARMv8 crc32c instructions.
+ *
+ * @param crc The register (already inverted).
+ * @param data The data.
+ * @param length The size of the data.
+ * @return The updated register.
+ */
+uint32_t crc32c_armv8(uint32_t crc, const unsigned char *data, size_t length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Builds the slicing-by-8 tables and picks the fastest CRC32C kernel for this CPU (run once).
+ */
+static void crc32c_select(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+        }
+    }
+    crc32c_kernel = crc32c_slice8;
+#if defined(STEG_HAVE_X86_DISPATCH) && defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_kernel = crc32c_sse42;
+        crc32c_kernel_label = "sse4.2";
+    }
+#elif defined(STEG_HAVE_ARM_CRC32)
+    crc32c_kernel = crc32c_armv8;
+    crc32c_kernel_label = "armv8";
+#endif
+}
+
+/**
+ * Returns the name of the CRC32C kernel in use.
+ *
+ * @return "sse4.2", "armv8" or "slice8".
+ */
+const char *crc32c_kernel_name(void) {
+    pthread_once(&crc32c_once, crc32c_select);
+    return crc32c_kernel_label;
+}
+
+/**
+ * Computes or continues a CRC32C, like zlib's crc32(): start with 0 and pass each result to the next call.
+ *
+ * @param crc The CRC of the preceding data (0 to start).
+ * @param data The data.
+ * @param length The size of the data.
+ * @return The CRC of all the data so far.
+ */
+uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t length) {
+    pthread_once(&crc32c_once, crc32c_select);
+    return ~crc32c_kernel(~crc, data, length);
+}
+
+/**
+ * Multiplies two polynomials modulo the CRC32C polynomial (bit-reflected, as the CRC registers are).
+ *
+ * @param a The first polynomial.
+ * @param b The second polynomial.
+ * @return a * b mod P.
+ */
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit; bit >>= 1) {
+        if (a & bit) product ^= b;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+/**
+ * Combines the CRCs of two pieces of data into the CRC of their concatenation, like zlib's
+ * crc32_combine(). This lets a stream be checksummed before the header that precedes it is known.
+ *
+ * @param crc1 The CRC of the first piece.
+ * @param crc2 The CRC of the second piece.
+ * @param length2 The size of the second piece.
+ * @return The CRC of the first piece followed by the second.
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t length2) {
+    // Shift crc1 past length2 zero bytes: multiply by x^(8 * length2), squaring x^8 for each bit of length2
+    uint32_t power = 1u << 23;  // x^8
+    for (; length2; length2 >>= 1) {
+        if (length2 & 1) crc1 = crc32c_multiply(crc1, power);
+        power = crc32c_multiply(power, power);
+    }
+    return crc1 ^ crc2;
+}
+
+/**
+ * Reads payload bytes from carrier LSBs and folds them into a CRC32C in the same pass. The bytes are
+ * gathered in small blocks that are checksummed while they are still in L1.
+ *
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param frame The image rows.
+ * @param offset The embedded byte position of the first byte.
+ * @param bytes The output.
+ * @param count The number of payload bytes.
+ * @param crc The CRC of the preceding data.
+ * @return The CRC including the gathered bytes.
+ */
+uint32_t lsb_gather_crc32c(const steg_scatter *scatter, const steg_frame *frame, size_t offset, unsigned char *bytes, size_t count, uint32_t crc) {
+    for (size_t done = 0; done < count;) {
+        size_t block = count - done < 512 ? count - done : 512;
+        frame_gather(scatter, frame, offset + done, bytes + done, block);
+        crc = crc32c(crc, bytes + done, block);
+        done += block;
+    }
+    return crc;
+}
+
+/**
+ * Calculates a simple XOR checksum over a given data.
+ *
+ * @param data The data to calculate the checksum over.
+ * @param length The length of the data.
+ * @return The XOR checksum of the data.
+ */
+unsigned char calculate_checksum(const char* data, size_t length) {
+    unsigned char checksum = 0;
+    // Iterate over the data and apply XOR operation to each byte
+    for (size_t i = 0; i < length; i++) {
+        checksum ^= data[i];
+    }
+    return checksum;
+}
+
+/**
+ * Converts a range of image rows into their binary representation.
+ * Each row is independent, so callers may convert disjoint row ranges concurrently.
+ *
+ * @param image The image data.
+ * @param width The width of the image.
+ * @param channels The number of channels in the image.
+ * @param row_begin The first row to convert.
+ * @param row_end One past the last row to convert.
+ * @param binary_data The binary buffer for the whole image (8 characters per pixel value).
+ */
+void image_rows_to_binary(const unsigned char *image, int width, int channels, int row_begin, int row_end, char *binary_data) {
+    size_t row_bytes = (size_t)width * channels;
+
+    for (int y = row_begin; y < row_end; y++) {
+        // Convert each pixel value to its binary equivalent
+        bytes_to_bit_chars(image + (size_t)y * row_bytes, row_bytes, binary_data + (size_t)y * row_bytes * 8);
+    }
+}
+
+/**
+ * Converts an image into its binary representation.
+ *
+ * @param image The image data.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image.
+ * @param binary_size A pointer to store the size of the resulting binary data.
+ * @return The binary representation of the image.
+ */
+char *image_to_binary(unsigned char *image, int width, int height, int channels, int *binary_size) {
+    size_t buffer_size = (size_t)width * height * channels * 8;  // Each pixel's value represented in 8 bits
+    char *binary_data = (char *)malloc(buffer_size + 1);
+    
+    if (!binary_data) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+
+    image_rows_to_binary(image, width, channels, 0, height, binary_data);
+    binary_data[buffer_size] = '\0';  // Null-terminate so strlen() callers stay in bounds
+    *binary_size = (int)buffer_size;  // Store the size of the binary data
+    return binary_data;
+}
+
+/**
+ * Converts a given message into its binary representation.
+ *
+ * @param message The ASCII message to be converted into binary.
+ * @return The binary representation of the message as a string.
+ */
+char *messageToBinary(const char *message) {
+    int length = strlen(message);
+    int binaryLength = length * 8 + 1;  // Each character is 8 bits
+
+    char *messageBinary = (char *)malloc(binaryLength);
+    if (!messageBinary) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+
+    // Convert each character of the message into its binary form
+    bytes_to_bit_chars((const unsigned char *)message, length, messageBinary);
+
+    messageBinary[binaryLength - 1] = '\0';  // Null-terminate the string
+    return messageBinary;
+}
+
+/**
+ * Encodes a binary string with the given message and appends the checksum.
+ * This function is now modified to correctly embed individual bits of the message.
+ *
+ * @param binary_data The binary data to which the message is to be encoded.
+ * @param message The message to be encoded in binary.
+ * @return The binary string with the encoded message and checksum appended.
+ */
+char *encode_binary(char *binary_data, const char *message) {
+    char *binary_message = messageToBinary(message);
+    if (!binary_message) {
+        return NULL;
+    }
+
+    // Convert checksum to binary string
+    unsigned char checksum_val = calculate_checksum(binary_message, strlen(binary_message));
+    char checksum_binary[9]; // 8 bits + null terminator
+    for (int j = 0; j < 8; j++) {
+        checksum_binary[j] = ((checksum_val >> (7 - j)) & 1) ? '1' : '0';
+    }
+    checksum_binary[8] = '\0';
+
+    char end_marker_binary[] = "00000111"; // ASCII for BEL character (Bell)
+
+    int message_bits_len = strlen(binary_message);
+    int checksum_bits_len = strlen(checksum_binary);
+    int end_marker_bits_len = strlen(end_marker_binary);
+
+    int total_bits_to_embed = message_bits_len + checksum_bits_len + end_marker_bits_len;
+
+    int original_image_binary_len = strlen(binary_data); // Total number of '0'/'1' characters for the image
+
+    // Check if the image is large enough to embed the entire message + checksum + end marker
+    // We modify 1 LSB per 8-bit component representation in binary_data.
+    // So, we need at least `total_bits_to_embed` LSB positions.
+    if (original_image_binary_len < (total_bits_to_embed * 8)) { // Must have enough `char`s in `binary_data`
+        printf("Error: Image is too small to embed the message. Needs at least %d pixel LSBs (total %d image binary bits).\n", 
+               total_bits_to_embed, total_bits_to_embed * 8);
+        free(binary_message);
+        return NULL;
+    }
+
+    int current_embed_idx = 0; // Index for bits in `binary_message` / `checksum_binary` / `end_marker_binary`
+    int binary_data_lsb_idx = 7; // Index for LSB position in `binary_data` (0-7 for first byte, 8-15 for second, etc.)
+
+    // Embed message bits
+    for (int i = 0; i < message_bits_len; i++) {
+        // Embed the actual bit from binary_message (e.g., '0' or '1')
+        binary_data[binary_data_lsb_idx] = binary_message[current_embed_idx++];
+        binary_data_lsb_idx += 8; // Move to the LSB of the next 8-bit component
+    }
+
+    // Embed checksum bits
+    for (int i = 0; i < checksum_bits_len; i++) {
+        binary_data[binary_data_lsb_idx] = checksum_binary[i];
+        binary_data_lsb_idx += 8;
+    }
+
+    // Embed end marker bits
+    for (int i = 0; i < end_marker_bits_len; i++) {
+        binary_data[binary_data_lsb_idx] = end_marker_binary[i];
+        binary_data_lsb_idx += 8;
+    }
+    
+    free(binary_message);
+    return binary_data; // Return the modified binary_data string
+}
+
+/**
+ * Converts a range of rows of binary data back into image pixels.
+ * Each row is independent, so callers may convert disjoint row ranges concurrently.
+ *
+ * @param binary_data The binary buffer for the whole image (8 characters per pixel value).
+ * @param width The width of the image.
+ * @param channels The number of channels in the image.
+ * @param row_begin The first row to convert.
+ * @param row_end One past the last row to convert.
+ * @param image The image buffer to fill.
+ */
+void binary_rows_to_image(const char *binary_data, int width, int channels, int row_begin, int row_end, unsigned char *image) {
+    size_t row_bytes = (size_t)width * channels;
+
+    for (int y = row_begin; y < row_end; y++) {
+        bit_chars_to_bytes(binary_data + (size_t)y * row_bytes * 8, row_bytes, image + (size_t)y * row_bytes);
+    }
+}
+
+/**
+ * Converts binary data back into an image representation.
+ *
+ * @param binary_data The binary data to convert into an image.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image.
+ * @return The image data created from the binary data.
+ */
+unsigned char *binary_to_image(char *binary_data, int width, int height, int channels) {
+    size_t pixel_bytes = (size_t)width * height * channels;
+
+    // Ensure we don't read beyond the allocated binary_data
+    if (strlen(binary_data) < pixel_bytes * 8) {
+        printf("Warning: Ran out of binary data before filling image pixels. Image might be incomplete.\n");
+        return NULL;
+    }
+
+    unsigned char *image = (unsigned char *)malloc(pixel_bytes);
+    if (!image) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+
+    // Convert binary data back to image format
+    binary_rows_to_image(binary_data, width, channels, 0, height, image);
+    return image;
+}
+
+/**
+ * Decodes the binary data embedded in an image and extracts the message.
+ *
+ * @param image The binary data embedded in the image.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image.
+ * @return The decoded message in binary format.
+ */
+char *decode_image(char *image, int width, int height, int channels) {
+    int length = strlen(image);
+    // Allocate memory for the potential decoded message (max possible bits = total LSBs in image data)
+    char *result = (char *)malloc((length / 8) + 1); 
+    
+    if (!result) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+
+    int result_index = 0;
+    unsigned char extracted_checksum = 0;
+    const uint64_t end_marker = load_lanes("00000111");
+    
+    for (int i = 7; i < length; i += 8) {
+        result[result_index++] = image[i];
+
+        if ((result_index) % 8 == 0) {
+            // Check for end marker in the binary data (all eight characters compared as one word)
+            if (load_lanes(result + result_index - 8) == end_marker) {
+                // End marker found.
+                // The structure is: [MESSAGE BITS] [CHECKSUM BITS (8)] [END MARKER BITS (8)]
+                // `result_index` now includes the 8 bits of the end marker.
+
+                // Ensure enough bits for checksum (8) + end marker (8)
+                if (result_index < 16) { 
+                    printf("Error: End marker found, but not enough preceding data for checksum (requires 16 bits).\n");
+                    free(result);
+                    return NULL;
+                }
+
+                // Extract checksum (8 bits just before the end marker)
+                extracted_checksum = gather_lanes(load_lanes(result + result_index - 16));
+
+                // The message bits are everything before the checksum
+                int message_bit_length = result_index - 16;
+                if (message_bit_length < 0) { 
+                    // This scenario should ideally be caught by the result_index < 16 check above,
+                    // but as a safeguard.
+                    printf("Error: Negative message length calculated after extraction.\n");
+                    free(result);
+                    return NULL;
+                }
+
+                // Null-terminate the result string at the end of the actual message bits
+                result[message_bit_length] = '\0';
+
+                // Calculate checksum of the extracted message content (which is still in binary string format)
+                unsigned char calculated_checksum = calculate_checksum(result, message_bit_length);
+                
+                // Verify the checksum
+                if (calculated_checksum != extracted_checksum) {
+                    printf("Warning: Checksum verification failed! Message may be corrupted.\n");
+                    printf("Expected checksum: %02X, Got: %02X\n", extracted_checksum, calculated_checksum);
+                } else {
+                    printf("Checksum verification successful!\n");
+                }
+                
+                return result; // Return the binary string of the message
+            }
+        }
+    }
+
+    // If end marker is NOT found after iterating through all possible LSBs
+    printf("Error: End marker '00000111' not found in the image's LSBs.\n");
+    free(result); // Free the allocated memory since no message was found
+    return NULL;
+}
+
+/**
+ * Converts binary data into its corresponding ASCII characters.
+ *
+ * @param binary_data The binary data to be converted.
+ * @return The corresponding ASCII representation of the binary data.
+ */
+char *binaryToAscii(const char *binary_data) {
+    int length = strlen(binary_data);
+    if (length % 8 != 0) {
+        printf("Error: Binary data length should be a multiple of 8.\n");
+        return NULL;
+    }
+
+    int asciiLength = length / 8;
+    char *ascii_data = (char *)malloc(asciiLength + 1);
+    
+    if (!ascii_data) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+
+    // Convert each 8-bit segment into a corresponding ASCII character
+    bit_chars_to_bytes(binary_data, asciiLength, (unsigned char *)ascii_data);
+
+    ascii_data[asciiLength] = '\0';  // Null-terminate the string
+    return ascii_data;
+}
+
+/**
+ * Computes the legacy checksum of a message: calculate_checksum over its '0'/'1' form. The '0'
+ * characters cancel out in pairs, which leaves the parity of the message bits.
+ *
+ * @param message The message bytes.
+ * @param length The number of bytes.
+ * @return The checksum (0 or 1).
+ */
+unsigned char legacy_checksum(const char *message, size_t length) {
+    unsigned char folded = calculate_checksum(message, length);
+    folded ^= folded >> 4;
+    folded ^= folded >> 2;
+    folded ^= folded >> 1;
+    return folded & 1;
+}
+
+/**
+ * Finds the end marker of a legacy-format message: the first embedded 00000111 byte.
+ *
+ * @param frame The image rows.
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @return The embedded byte position of the marker, or the number of positions if there is none.
+ */
+size_t find_legacy_marker(const steg_frame *frame, const steg_scatter *scatter) {
+    size_t pixel_bytes = frame_bytes(frame);
+    unsigned char block[256];
+    size_t slots = carrier_slots(pixel_bytes, scatter ? scatter->depth : 8);
+    for (size_t k = 0; k < slots; k += sizeof(block)) {
+        size_t count = slots - k < sizeof(block) ? slots - k : sizeof(block);
+        frame_gather(scatter, frame, k, block, count);
+        const unsigned char *marker = (const unsigned char *)memchr(block, 0x07, count);
+        if (marker) return k + (size_t)(marker - block);
+    }
+    return slots;
+}
+
+/**
+ * Extracts a legacy-format message straight from pixel LSBs. The result is what decode_image followed
+ * by binaryToAscii returns: the bytes before the checksum that precedes the first 00000111 byte.
+ *
+ * @param frame The image rows.
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param checksum_ok A pointer set to 1 if the embedded checksum matches, 0 otherwise.
+ * @return The message (free with free()), or NULL if no message is found.
+ */
+char *extract_legacy_message(const steg_frame *frame, const steg_scatter *scatter, int *checksum_ok) {
+    size_t pixel_bytes = frame_bytes(frame);
+    size_t k = find_legacy_marker(frame, scatter);
+    if (k == 0 || k == carrier_slots(pixel_bytes, scatter ? scatter->depth : 8)) {
+        return NULL;  // No marker, or like decode_image, give up: there is no room for the checksum
+    }
+    char *message = (char *)malloc(k);
+    if (!message) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+    unsigned char checksum;
+    frame_gather(scatter, frame, 0, (unsigned char *)message, k - 1);
+    frame_gather(scatter, frame, k - 1, &checksum, 1);
+    *checksum_ok = checksum == legacy_checksum(message, k - 1);
+    message[k - 1] = '\0';
+    return message;
+}
+
+// Reed-Solomon forward error correction over GF(2^8): field polynomial 0x11D, generator roots
+// alpha^0 .. alpha^(parity - 1). A block of up to 255 bytes carries `parity` check bytes and
+// survives up to parity / 2 damaged bytes anywhere in the block.
+#define RS_MAX_PARITY 128
+
+static unsigned char gf_exp[512];  // Doubled so gf_exp[log a + log b] needs no reduction
+static unsigned char gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Builds the GF(2^8) exponent and logarithm tables (run once).
+ */
+static void gf_init(void) {
+    unsigned int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+}
+
+/**
+ * Multiplies two field elements.
+ *
+ * @param a The first element.
+ * @param b The second element.
+ * @return a * b.
+ */
+static inline unsigned char gf_mul(unsigned char a, unsigned char b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+/**
+ * Divides two field elements.
+ *
+ * @param a The dividend.
+ * @param b The divisor (not 0).
+ * @return a / b.
+ */
+static inline unsigned char gf_div(unsigned char a, unsigned char b) {
+    return a ? gf_exp[gf_log[a] + 255 - gf_log[b]] : 0;
+}
+
+// Multiplication tables for one redundancy level, so the inner loops are plain table lookups
+#define RS_STRIP 64  // Blocks processed side by side: one byte of each per row, the lanes of the SIMD kernels
+
+typedef struct {
+    int parity;
+    unsigned char generator[RS_MAX_PARITY + 1];     // Generator polynomial, highest degree first (generator[0] = 1)
+    unsigned char gen_mul[RS_MAX_PARITY][256];      // gen_mul[i][x] = x * generator[i + 1], for encoding
+    unsigned char root_mul[RS_MAX_PARITY][256];     // root_mul[i][x] = x * alpha^i, for the syndromes
+    unsigned char gen_nibbles[RS_MAX_PARITY][32];   // The products of generator[i + 1] with every low nibble, then every high nibble
+    unsigned char root_nibbles[RS_MAX_PARITY][32];  // The same split products for alpha^i
+} rs_codec;
+
+// A pass over the rows of a strip of RS_STRIP blocks; state holds one RS_STRIP-byte row per check byte
+typedef void (*rs_rows_fn)(const rs_codec *rs, const unsigned char *rows, size_t stride, int row_count, int width, unsigned char *state);
+
+/**
+ * Allocates the tables of a Reed-Solomon code.
+ *
+ * @param parity The number of check bytes per block (2 to RS_MAX_PARITY).
+ * @return The codec (free with free()), or NULL on failure.
+ */
+rs_codec *rs_codec_create(int parity) {
+    pthread_once(&gf_once, gf_init);
+    rs_codec *rs = (rs_codec *)calloc(1, sizeof(rs_codec));
+    if (!rs) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+    rs->parity = parity;
+
+    // The product of (x - alpha^i)
+    rs->generator[0] = 1;
+    for (int i = 0; i < parity; i++) {
+        for (int j = i + 1; j > 0; j--) {
+            rs->generator[j] ^= gf_mul(rs->generator[j - 1], gf_exp[i]);
+        }
+    }
+    for (int i = 0; i < parity; i++) {
+        for (int x = 0; x < 256; x++) {
+            rs->gen_mul[i][x] = gf_mul((unsigned char)x, rs->generator[i + 1]);
+            rs->root_mul[i][x] = gf_mul((unsigned char)x, gf_exp[i]);
+        }
+        for (int x = 0; x < 16; x++) {
+            rs->gen_nibbles[i][x] = rs->gen_mul[i][x];
+            rs->gen_nibbles[i][16 + x] = rs->gen_mul[i][x << 4];
+            rs->root_nibbles[i][x] = rs->root_mul[i][x];
+            rs->root_nibbles[i][16 + x] = rs->root_mul[i][x << 4];
+        }
+    }
+    return rs;
+}
+
+/**
+ * Runs the systematic encoder's shift register over data rows, for a strip of blocks side by side
+ * (portable scalar code).
+ *
+ * @param rs The codec.
+ * @param rows The first data row; byte c of a row belongs to block c.
+ * @param stride The distance between rows.
+ * @param row_count The number of data rows.
+ * @param width The number of blocks in the strip (at most RS_STRIP).
+ * @param state The remainders, highest degree first (parity + 1 rows of RS_STRIP bytes, the last one zero).
+ */
+void rs_encode_rows_scalar(const rs_codec *rs, const unsigned char *rows, size_t stride, int row_count, int width, unsigned char *state) {
+    unsigned char feedback[RS_STRIP];
+    for (int j = 0; j < row_count; j++) {
+        const unsigned char *row = rows + (size_t)j * stride;
+        for (int c = 0; c < width; c++) {
+            feedback[c] = row[c] ^ state[c];
+        }
+        for (int i = 0; i < rs->parity; i++) {
+            unsigned char *out = state + i * RS_STRIP;
+            const unsigned char *mul = rs->gen_mul[i];
+            for (int c = 0; c < width; c++) {
+                out[c] = out[RS_STRIP + c] ^ mul[feedback[c]];
+            }
+        }
+    }
+}
+
+/**
+ * Computes the syndromes of a strip of blocks side by side by Horner's rule (portable scalar code).
+ *
+ * @param rs The codec.
+ * @param rows The first row of the blocks; byte c of a row belongs to block c.
+ * @param stride The distance between rows.
+ * @param row_count The number of rows (the block length).
+ * @param width The number of blocks in the strip (at most RS_STRIP).
+ * @param state The syndromes (parity rows of RS_STRIP bytes, zero on entry).
+ */
+void rs_syndrome_rows_scalar(const rs_codec *rs, const unsigned char *rows, size_t stride, int row_count, int width, unsigned char *state) {
+    for (int i = 0; i < rs->parity; i++) {
+        unsigned char *syndrome = state + i * RS_STRIP;
+        const unsigned char *mul = rs->root_mul[i];
+        for (int j = 0; j < row_count; j++) {
+            const unsigned char *row = rows + (size_t)j * stride;
+            for (int c = 0; c < width; c++) {
+                syndrome[c] = mul[syndrome[c]] ^ row[c];
+            }
+        }
+    }
+}
+
+#ifdef STEG_HAVE_X86_DISPATCH
+/**
+ * Multiplies 16 field elements by a constant with two nibble lookups.
+ *
+ * @param low The low-nibble indices of the elements.
+ * @param high The high-nibble indices of the elements.
+ * @param nibbles The constant's 32-byte nibble product table.
+ * @return The products.
+ */
+__attribute__((target("ssse3"))) static inline __m128i gf_mul_nibbles_ssse3(__m128i low, __m128i high, const unsigned char *nibbles) {
+    return _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)nibbles), low),
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(nibbles + 16)), high));
+}
+
+/**
+ * SSSE3 version of rs_encode_rows_scalar: 16 blocks per register, products by pshufb nibble lookups.
+ */
+__attribute__((target("ssse3"))) static void rs_encode_rows_ssse3(const rs_codec *rs, const unsigned char *rows, size_t stride, int row_count, int width, unsigned char *state) {
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    int simd_width = width & ~15;
+    for (int j = 0; j < row_count; j++) {
+        const unsigned char *row = rows + (size_t)j * stride;
+        for (int c = 0; c < simd_width; c += 16) {
+            __m128i feedback = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(row + c)), _mm_loadu_si128((const __m128i *)(state + c)));
+            __m128i low = _mm_and_si128(feedback, mask), high = _mm_and_si128(_mm_srli_epi64(feedback, 4), mask);
+            for (int i = 0; i < rs->parity; i++) {
+                unsigned char *out = state + i * RS_STRIP + c;
+                __m128i next = _mm_loadu_si128((const __m128i *)(out + RS_STRIP));
+                _mm_storeu_si128((__m128i *)out, _mm_xor_si128(next, gf_mul_nibbles_ssse3(low, high, rs->gen_nibbles[i])));
+            }
+        }
+    }
+    if (width > simd_width) {
+        rs_encode_rows_scalar(rs, rows + simd_width, stride, row_count, width - simd_width, state + simd_width);
+    }
+}
+
+/**
+ * SSSE3 version of rs_syndrome_rows_scalar; each syndrome stays in a register for the whole block.
+ */
+__attribute__((target("ssse3"))) static void rs_syndrome_rows_ssse3(const rs_codec *rs, const unsigned char *rows, size_t stride, int row_count, int width, unsigned char *state) {
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    int simd_width = width & ~15;
+    for (int c = 0; c < simd_width; c += 16) {
+        for (int i = 0; i < rs->parity; i++) {
+            __m128i syndrome = _mm_loadu_si128((const __m128i *)(state + i * RS_STRIP + c));
+            for (int j = 0; j < row_count; j++) {
+                __m128i low = _mm_and_si128(syndrome, mask), high = _mm_and_si128(_mm_srli_epi64(syndrome, 4), mask);
+                syndrome = _mm_xor_si128(gf_mul_nibbles_ssse3(low, high, rs->root_nibbles[i]),
+                                         _mm_loadu_si128((const __m128i *)(rows + (size_t)j * stride + c)));
+            }
+            _mm_storeu_si128((__m128i *)(state + i * RS_STRIP + c), syndrome);
+        }
+    }
+    if (width > simd_width) {
+        rs_syndrome_rows_scalar(rs, rows + simd_width, stride, row_count, width - simd_width, state + simd_width);
+    }
+}
+#endif
+
+static rs_rows_fn rs_encode_rows = rs_encode_rows_scalar;
+static rs_rows_fn rs_syndrome_rows = rs_syndrome_rows_scalar;
+static const char *rs_kernel_label = "scalar";
+static pthread_once_t rs_kernel_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the Reed-Solomon row kernels for this CPU (run once).
+ */
+static void rs_kernel_select(void) {
+#ifdef STEG_HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        rs_encode_rows = rs_encode_rows_ssse3;
+        rs_syndrome_rows = rs_syndrome_rows_ssse3;
+        rs_kernel_label = "ssse3";
+    }
+#endif
+}
+
+/**
+ * Returns the name of the Reed-Solomon row kernels in use.
+ *
+ * @return "ssse3" or "scalar".
+ */
+const char *rs_kernel_name(void) {
+    pthread_once(&rs_kernel_once, rs_kernel_select);
+    return rs_kernel_label;
+}
+
+/**
+ * Corrects one block in place from its syndromes: Berlekamp-Massey, Chien search and Forney's formula.
+ *
+ * @param rs The codec.
+ * @param block The data bytes followed by the check bytes.
+ * @param block_len The size of the block (at most 255).
+ * @param syndromes The block's syndromes (rs->parity bytes, not all zero).
+ * @return The number of bytes corrected, or -1 if the block has more damage than the code can repair
+ *         (it is then left unchanged).
+ */
+int rs_decode_block(const rs_codec *rs, unsigned char *block, int block_len, const unsigned char *syndromes) {
+    int parity = rs->parity;
+
+    // Berlekamp-Massey: the error locator, lowest degree first
+    unsigned char locator[RS_MAX_PARITY + 1] = { 1 }, previous[RS_MAX_PARITY + 1] = { 1 }, saved[RS_MAX_PARITY + 1];
+    int errors = 0, shift = 1;
+    unsigned char previous_discrepancy = 1;
+    for (int r = 0; r < parity; r++) {
+        unsigned char discrepancy = syndromes[r];
+        for (int i = 1; i <= errors; i++) {
+            discrepancy ^= gf_mul(locator[i], syndromes[r - i]);
+        }
+        if (!discrepancy) {
+            shift++;
+            continue;
+        }
+        unsigned char scale = gf_div(discrepancy, previous_discrepancy);
+        int grow = 2 * errors <= r;
+        if (grow) memcpy(saved, locator, sizeof(saved));
+        for (int i = 0; i + shift <= parity; i++) {
+            locator[i + shift] ^= gf_mul(scale, previous[i]);
+        }
+        if (grow) {
+            errors = r + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            previous_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+    if (2 * errors > parity) return -1;
+
+    // Error evaluator: syndromes * locator mod x^parity, whose degree is below the error count
+    unsigned char evaluator[RS_MAX_PARITY];
+    for (int i = 0; i < errors; i++) {
+        unsigned char value = 0;
+        for (int j = 0; j <= i && j <= errors; j++) {
+            value ^= gf_mul(locator[j], syndromes[i - j]);
+        }
+        evaluator[i] = value;
+    }
+
+    // Chien search over every position (degree e is byte block_len - 1 - e): term i holds the log of
+    // locator[i] * alpha^(-e * i) and steps down by i per position. Forney gives the magnitudes.
+    int term_log[RS_MAX_PARITY / 2 + 1];
+    for (int i = 1; i <= errors; i++) {
+        term_log[i] = locator[i] ? gf_log[locator[i]] : -1;
+    }
+    int positions[RS_MAX_PARITY / 2];
+    unsigned char magnitudes[RS_MAX_PARITY / 2];
+    int found = 0;
+    for (int e = 0; e < block_len; e++) {
+        unsigned char value = 1;  // locator[0]
+        for (int i = 1; i <= errors; i++) {
+            if (term_log[i] < 0) continue;
+            value ^= gf_exp[term_log[i]];
+            term_log[i] -= i;
+            if (term_log[i] < 0) term_log[i] += 255;
+        }
+        if (value) continue;
+        int inverse_log = (255 - e) % 255;  // log of alpha^-e
+        unsigned char derivative = 0, numerator = 0;
+        for (int i = 1; i <= errors; i += 2) {
+            derivative ^= gf_mul(locator[i], gf_exp[(inverse_log * (i - 1)) % 255]);
+        }
+        for (int i = 0; i < errors; i++) {
+            numerator ^= gf_mul(evaluator[i], gf_exp[(inverse_log * i) % 255]);
+        }
+        if (!derivative || found == errors) return -1;
+        positions[found] = block_len - 1 - e;
+        magnitudes[found++] = gf_mul(gf_exp[e], gf_div(numerator, derivative));
+    }
+    if (found != errors) return -1;
+    for (int i = 0; i < found; i++) {
+        block[positions[i]] ^= magnitudes[i];
+    }
+    return found;
+}
+
+// Interleaved block layout of a protected payload. With `blocks` blocks of data_len data bytes, byte j
+// of block b is stored at j * blocks + b: the payload itself comes first, unchanged and zero-padded to
+// data_len rows, followed by `parity` rows of check bytes. A run of damaged carriers is spread over
+// many blocks, and the blocks can be processed side by side.
+typedef struct {
+    size_t blocks;
+    int data_len;   // Data bytes per block
+    int block_len;  // Data plus check bytes
+} rs_layout;
+
+/**
+ * Computes the block layout of a payload.
+ *
+ * @param length The size of the payload.
+ * @param parity The number of check bytes per block.
+ * @return The layout.
+ */
+rs_layout rs_layout_for(size_t length, int parity) {
+    rs_layout layout = { 0, 0, parity };
+    if (length) {
+        size_t max_data = (size_t)(255 - parity);
+        layout.blocks = (length + max_data - 1) / max_data;
+        layout.data_len = (int)((length + layout.blocks - 1) / layout.blocks);
+        layout.block_len = layout.data_len + parity;
+    }
+    return layout;
+}
+
+/**
+ * Adds the check rows of a protected payload whose data rows (the payload and its zero padding) are
+ * already in the carrier LSBs. Each strip of blocks is gathered back from the carriers, so the
+ * payload never has to be in memory as a whole.
+ *
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param frame The image rows.
+ * @param offset The embedded byte position of the payload's first byte.
+ * @param length The size of the payload.
+ * @param parity The number of check bytes per block.
+ * @return 1 on success, 0 on failure.
+ */
+int rs_encode_carriers(const steg_scatter *scatter, const steg_frame *frame, size_t offset, size_t length, int parity) {
+    rs_layout layout = rs_layout_for(length, parity);
+    rs_codec *rs = rs_codec_create(parity);
+    if (!rs) return 0;
+    pthread_once(&rs_kernel_once, rs_kernel_select);
+
+    unsigned char strip[255 * RS_STRIP], state[(RS_MAX_PARITY + 1) * RS_STRIP];
+    for (size_t b = 0; b < layout.blocks; b += RS_STRIP) {
+        int width = layout.blocks - b < RS_STRIP ? (int)(layout.blocks - b) : RS_STRIP;
+        for (int j = 0; j < layout.data_len; j++) {
+            frame_gather(scatter, frame, offset + j * layout.blocks + b, strip + j * RS_STRIP, width);
+        }
+        memset(state, 0, (size_t)(parity + 1) * RS_STRIP);
+        rs_encode_rows(rs, strip, RS_STRIP, layout.data_len, width, state);
+        for (int i = 0; i < parity; i++) {
+            frame_spread(scatter, frame, offset + (layout.data_len + i) * layout.blocks + b, state + i * RS_STRIP, width);
+        }
+    }
+    free(rs);
+    return 1;
+}
+
+/**
+ * Repairs an interleaved protected payload in place. Syndromes are computed for every block side by
+ * side; only damaged blocks are gathered and decoded one at a time.
+ *
+ * @param coded The protected form (blocks * block_len bytes); the payload is its first length bytes.
+ * @param length The size of the payload.
+ * @param parity The number of check bytes per block.
+ * @param corrected A pointer to store the number of bytes repaired, or -1 if a block was beyond repair.
+ * @return 1 on success, 0 on failure.
+ */
+int rs_decode_payload(unsigned char *coded, size_t length, int parity, long *corrected) {
+    rs_layout layout = rs_layout_for(length, parity);
+    rs_codec *rs = rs_codec_create(parity);
+    if (!rs) return 0;
+    pthread_once(&rs_kernel_once, rs_kernel_select);
+    *corrected = 0;
+
+    unsigned char state[RS_MAX_PARITY * RS_STRIP], block[255], syndromes[RS_MAX_PARITY];
+    for (size_t b = 0; b < layout.blocks; b += RS_STRIP) {
+        int width = layout.blocks - b < RS_STRIP ? (int)(layout.blocks - b) : RS_STRIP;
+        memset(state, 0, (size_t)parity * RS_STRIP);
+        rs_syndrome_rows(rs, coded + b, layout.blocks, layout.block_len, width, state);
+        for (int c = 0; c < width; c++) {
+            unsigned char any = 0;
+            for (int i = 0; i < parity; i++) {
+                syndromes[i] = state[i * RS_STRIP + c];
+                any |= syndromes[i];
+            }
+            if (!any) continue;
+            for (int j = 0; j < layout.block_len; j++) {
+                block[j] = coded[j * layout.blocks + b + c];
+            }
+            int fixed = rs_decode_block(rs, block, layout.block_len, syndromes);
+            if (fixed < 0) {
+                *corrected = -1;
+                continue;
+            }
+            if (*corrected >= 0) *corrected += fixed;
+            for (int j = 0; j < layout.block_len; j++) {
+                coded[j * layout.blocks + b + c] = block[j];
+            }
+        }
+    }
+    free(rs);
+    return 1;
+}
+
+// Payload encryption: ChaCha20-Poly1305 (RFC 8439) under a key derived from a passphrase with scrypt
+// (RFC 7914). Both are implemented here, so encryption needs no crypto library. scrypt is memory-hard:
+// a derivation fills 128 * r * N bytes and reads them back in a data-dependent order, so every guess of
+// the passphrase costs that much memory as well as time.
+#define CHACHA_KEY_BYTES 32
+#define CHACHA_NONCE_BYTES 12
+#define POLY1305_TAG_BYTES 16
+#define SCRYPT_SALT_BYTES 16
+#define STEG_KDF_SCRYPT 1
+#define SCRYPT_DEFAULT_LOG_N 15  // N = 32768, r = 8: 32 MB and about 0.1 s per derivation
+#define SCRYPT_DEFAULT_R 8
+#define SCRYPT_DEFAULT_P 1
+#define SCRYPT_MAX_MEMORY (1u << 30)  // Parameters read from an image may not ask for more
+#define SCRYPT_MAX_WORK (1u << 26)    // Nor for more than this many block mixes (p * r * N)
+
+static inline uint32_t rotl32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+/**
+ * Fills a buffer with random bytes from the operating system.
+ *
+ * @param out The buffer.
+ * @param length The number of bytes.
+ * @return 1 on success, 0 on failure.
+ */
+#ifdef _WIN32
+BOOLEAN NTAPI SystemFunction036(PVOID buffer, ULONG length);  // RtlGenRandom, exported by advapi32
+#ifdef _MSC_VER
+#pragma comment(lib, "advapi32.lib")
+#endif
+int steg_random_bytes(unsigned char *out, size_t length) {
+    return length <= 0xFFFFFFFFu && SystemFunction036(out, (ULONG)length);
+}
+#else
+int steg_random_bytes(unsigned char *out, size_t length) {
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (!random) return 0;
+    int ok = fread(out, 1, length, random) == length;
+    fclose(random);
+    return ok;
+}
+#endif
+
+// SHA-256 (FIPS 180-4), the hash under scrypt's PBKDF2 steps
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;  // Bytes hashed so far
+    unsigned char block[64];
+    size_t used;      // Bytes in block
+} sha256_ctx;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be,
+    0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa,
+    0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+    0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+    0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * Hashes one 64-byte block into a SHA-256 state.
+ *
+ * @param state The state.
+ * @param block The block.
+ */
+static void sha256_compress(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64], v[8];
+    for (int i = 0; i < 16; i++) {
+        w[i] = read_be32(block + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotl32(w[i - 15], 25) ^ rotl32(w[i - 15], 14) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotl32(w[i - 2], 15) ^ rotl32(w[i - 2], 13) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, state, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = v[7] + (rotl32(v[4], 26) ^ rotl32(v[4], 21) ^ rotl32(v[4], 7)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotl32(v[0], 30) ^ rotl32(v[0], 19) ^ rotl32(v[0], 10)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) {
+        state[i] += v[i];
+    }
+}
+
+/**
+ * Starts a SHA-256 hash.
+ *
+ * @param ctx The hash state.
+ */
+void sha256_init(sha256_ctx *ctx) {
+    static const uint32_t initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+/**
+ * Adds data to a SHA-256 hash.
+ *
+ * @param ctx The hash state.
+ * @param data The data.
+ * @param length The number of bytes.
+ */
+void sha256_update(sha256_ctx *ctx, const unsigned char *data, size_t length) {
+    ctx->length += length;
+    if (ctx->used) {
+        size_t take = 64 - ctx->used < length ? 64 - ctx->used : length;
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        length -= take;
+        if (ctx->used < 64) return;
+        sha256_compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    for (; length >= 64; data += 64, length -= 64) {
+        sha256_compress(ctx->state, data);
+    }
+    memcpy(ctx->block, data, length);
+    ctx->used = length;
+}
+
+/**
+ * Finishes a SHA-256 hash.
+ *
+ * @param ctx The hash state.
+ * @param digest The 32-byte digest.
+ */
+void sha256_final(sha256_ctx *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_compress(ctx->state, ctx->block);
+    for (int i = 0; i < 8; i++) {
+        for (int b = 0; b < 4; b++) {
+            digest[4 * i + b] = (unsigned char)(ctx->state[i] >> (24 - 8 * b));
+        }
+    }
+}
+
+/**
+ * Derives key material with PBKDF2-HMAC-SHA256 (RFC 8018). The HMAC pads are hashed once, and every
+ * block and iteration starts from copies of those states.
+ *
+ * @param password The password.
+ * @param password_len The size of the password.
+ * @param salt The salt.
+ * @param salt_len The size of the salt.
+ * @param iterations The iteration count.
+ * @param out The derived bytes.
+ * @param out_len The number of bytes to derive.
+ */
+void pbkdf2_sha256(const unsigned char *password, size_t password_len, const unsigned char *salt, size_t salt_len, uint32_t iterations,
+                   unsigned char *out, size_t out_len) {
+    unsigned char key[64] = { 0 }, pad[64], u[32], t[32], counter[4];
+    sha256_ctx inner, outer, ctx;
+    if (password_len > 64) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, password, password_len);
+        sha256_final(&ctx, key);
+    } else {
+        memcpy(key, password, password_len);
+    }
+    for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+    sha256_init(&inner);
+    sha256_update(&inner, pad, 64);
+    for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+    sha256_init(&outer);
+    sha256_update(&outer, pad, 64);
+
+    for (uint32_t block = 1; out_len; block++) {
+        for (int i = 0; i < 4; i++) counter[i] = (unsigned char)(block >> (24 - 8 * i));
+        ctx = inner;
+        sha256_update(&ctx, salt, salt_len);
+        sha256_update(&ctx, counter, 4);
+        sha256_final(&ctx, u);
+        ctx = outer;
+        sha256_update(&ctx, u, 32);
+        sha256_final(&ctx, u);
+        memcpy(t, u, 32);
+        for (uint32_t i = 1; i < iterations; i++) {
+            ctx = inner;
+            sha256_update(&ctx, u, 32);
+            sha256_final(&ctx, u);
+            ctx = outer;
+            sha256_update(&ctx, u, 32);
+            sha256_final(&ctx, u);
+            for (int j = 0; j < 32; j++) t[j] ^= u[j];
+        }
+        size_t take = out_len < 32 ? out_len : 32;
+        memcpy(out, t, take);
+        out += take;
+        out_len -= take;
+    }
+}
+
+/**
+ * Applies the Salsa20/8 core to a 64-byte block, in place.
+ *
+ * @param b The block as 16 words.
+ */
+static void salsa20_8(uint32_t b[16]) {
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        x[4] ^= rotl32(x[0] + x[12], 7);    x[8] ^= rotl32(x[4] + x[0], 9);
+        x[12] ^= rotl32(x[8] + x[4], 13);   x[0] ^= rotl32(x[12] + x[8], 18);
+        x[9] ^= rotl32(x[5] + x[1], 7);     x[13] ^= rotl32(x[9] + x[5], 9);
+        x[1] ^= rotl32(x[13] + x[9], 13);   x[5] ^= rotl32(x[1] + x[13], 18);
+        x[14] ^= rotl32(x[10] + x[6], 7);   x[2] ^= rotl32(x[14] + x[10], 9);
+        x[6] ^= rotl32(x[2] + x[14], 13);   x[10] ^= rotl32(x[6] + x[2], 18);
+        x[3] ^= rotl32(x[15] + x[11], 7);   x[7] ^= rotl32(x[3] + x[15], 9);
+        x[11] ^= rotl32(x[7] + x[3], 13);   x[15] ^= rotl32(x[11] + x[7], 18);
+        x[1] ^= rotl32(x[0] + x[3], 7);     x[2] ^= rotl32(x[1] + x[0], 9);
+        x[3] ^= rotl32(x[2] + x[1], 13);    x[0] ^= rotl32(x[3] + x[2], 18);
+        x[6] ^= rotl32(x[5] + x[4], 7);     x[7] ^= rotl32(x[6] + x[5], 9);
+        x[4] ^= rotl32(x[7] + x[6], 13);    x[5] ^= rotl32(x[4] + x[7], 18);
+        x[11] ^= rotl32(x[10] + x[9], 7);   x[8] ^= rotl32(x[11] + x[10], 9);
+        x[9] ^= rotl32(x[8] + x[11], 13);   x[10] ^= rotl32(x[9] + x[8], 18);
+        x[12] ^= rotl32(x[15] + x[14], 7);  x[13] ^= rotl32(x[12] + x[15], 9);
+        x[14] ^= rotl32(x[13] + x[12], 13); x[15] ^= rotl32(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; i++) {
+        b[i] += x[i];
+    }
+}
+
+/**
+ * scrypt's BlockMix: mixes 2r 64-byte blocks with Salsa20/8, writing the even results then the odd ones.
+ *
+ * @param in The input, 32r words.
+ * @param out The output, 32r words (not in).
+ * @param r The block size parameter.
+ */
+static void scrypt_block_mix(const uint32_t *in, uint32_t *out, uint32_t r) {
+    uint32_t x[16];
+    memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+    for (uint32_t i = 0; i < 2 * r; i++) {
+        for (int j = 0; j < 16; j++) x[j] ^= in[i * 16 + j];
+        salsa20_8(x);
+        memcpy(out + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+    }
+}
+
+/**
+ * Derives a key with scrypt (RFC 7914).
+ *
+ * @param password The password.
+ * @param password_len The size of the password.
+ * @param salt The salt.
+ * @param salt_len The size of the salt.
+ * @param log_n log2 of the cost parameter N.
+ * @param r The block size parameter.
+ * @param p The parallelization parameter.
+ * @param out The derived key.
+ * @param out_len The size of the key.
+ * @return 1 on success, 0 if the parameters are out of range or memory allocation fails.
+ */
+int scrypt_derive(const unsigned char *password, size_t password_len, const unsigned char *salt, size_t salt_len, int log_n, uint32_t r,
+                  uint32_t p, unsigned char *out, size_t out_len) {
+    if (log_n < 1 || log_n > 30 || r < 1 || r > 1024 || p < 1 || p > 64 || ((uint64_t)128 * r << log_n) > SCRYPT_MAX_MEMORY ||
+        ((uint64_t)p * r << log_n) > SCRYPT_MAX_WORK) {
+        return 0;
+    }
+    uint64_t n = (uint64_t)1 << log_n;
+    size_t words = (size_t)32 * r;  // One 128r-byte scrypt block
+    unsigned char *bytes = (unsigned char *)malloc(words * 4 * p);
+    uint32_t *x = (uint32_t *)malloc(words * 2 * sizeof(uint32_t));
+    uint32_t *v = (uint32_t *)malloc(words * n * sizeof(uint32_t));
+    int ok = bytes && x && v;
+    if (ok) {
+        pbkdf2_sha256(password, password_len, salt, salt_len, 1, bytes, words * 4 * p);
+        for (uint32_t block = 0; block < p; block++) {
+            unsigned char *b = bytes + words * 4 * block;
+            uint32_t *y = x + words;
+            for (size_t i = 0; i < words; i++) x[i] = load_le32(b + 4 * i);
+            for (uint64_t i = 0; i < n; i += 2) {
+                memcpy(v + i * words, x, words * sizeof(uint32_t));
+                scrypt_block_mix(x, y, r);
+                memcpy(v + (i + 1) * words, y, words * sizeof(uint32_t));
+                scrypt_block_mix(y, x, r);
+            }
+            for (uint64_t i = 0; i < n; i += 2) {
+                uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+                for (size_t k = 0; k < words; k++) x[k] ^= v[j * words + k];
+                scrypt_block_mix(x, y, r);
+                j = y[(2 * r - 1) * 16] & (n - 1);
+                for (size_t k = 0; k < words; k++) y[k] ^= v[j * words + k];
+                scrypt_block_mix(y, x, r);
+            }
+            for (size_t i = 0; i < words; i++) store_le32(b + 4 * i, x[i]);
+        }
+        pbkdf2_sha256(password, password_len, bytes, words * 4 * p, 1, out, out_len);
+        memset(v, 0, words * n * sizeof(uint32_t));
+        memset(bytes, 0, words * 4 * p);
+    }
+    free(bytes);
+    free(x);
+    free(v);
+    return ok;
+}
+
+// ChaCha20 keystream blocks. The state's word 12 is the block counter. The vector kernels run one block
+// per lane: four with SSE2, eight with AVX2 (chosen at runtime).
+#define CHACHA_QUARTER(a, b, c, d) \
+    a += b; d = rotl32(d ^ a, 16); \
+    c += d; b = rotl32(b ^ c, 12); \
+    a += b; d = rotl32(d ^ a, 8);  \
+    c += d; b = rotl32(b ^ c, 7)
+
+/**
+ * Generates ChaCha20 keystream blocks (scalar version).
+ *
+ * @param state The input state; its counter is that of the first block.
+ * @param out The keystream, 64 bytes per block.
+ * @param blocks The number of blocks.
+ */
+void chacha20_blocks_scalar(const uint32_t state[16], unsigned char *out, size_t blocks) {
+    for (size_t b = 0; b < blocks; b++, out += 64) {
+        uint32_t x[16];
+        memcpy(x, state, sizeof(x));
+        x[12] += (uint32_t)b;
+        for (int round = 0; round < 10; round++) {
+            CHACHA_QUARTER(x[0], x[4], x[8], x[12]);
+            CHACHA_QUARTER(x[1], x[5], x[9], x[13]);
+            CHACHA_QUARTER(x[2], x[6], x[10], x[14]);
+            CHACHA_QUARTER(x[3], x[7], x[11], x[15]);
+            CHACHA_QUARTER(x[0], x[5], x[10], x[15]);
+            CHACHA_QUARTER(x[1], x[6], x[11], x[12]);
+            CHACHA_QUARTER(x[2], x[7], x[8], x[13]);
+            CHACHA_QUARTER(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i++) {
+            store_le32(out + 4 * i, x[i] + state[i] + (i == 12 ? (uint32_t)b : 0));
+        }
+    }
+}
+
+#if defined(STEG_HAVE_SSE2)
+#define CHACHA_ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32((v), (n)), _mm_srli_epi32((v), 32 - (n)))
+#define CHACHA_QUARTER_SSE2(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = CHACHA_ROTL_SSE2(_mm_xor_si128(d, a), 16); \
+    c = _mm_add_epi32(c, d); b = CHACHA_ROTL_SSE2(_mm_xor_si128(b, c), 12); \
+    a = _mm_add_epi32(a, b); d = CHACHA_ROTL_SSE2(_mm_xor_si128(d, a), 8);  \
+    c = _mm_add_epi32(c, d); b = CHACHA_ROTL_SSE2(_mm_xor_si128(b, c), 7)
+
+/**
+ * Generates ChaCha20 keystream blocks four at a time: lane j of vector i holds word i of block j, and
+ * the words are transposed back into blocks at the end. The remainder goes to the scalar version.
+ *
+ * @param state The input state; its counter is that of the first block.
+ * @param out The keystream, 64 bytes per block.
+ * @param blocks The number of blocks.
+ */
+void chacha20_blocks_sse2(const uint32_t state[16], unsigned char *out, size_t blocks) {
+    size_t b = 0;
+    for (; b + 4 <= blocks; b += 4, out += 256) {
+        __m128i input[16], x[16];
+        for (int i = 0; i < 16; i++) {
+            input[i] = _mm_set1_epi32((int)state[i]);
+        }
+        input[12] = _mm_add_epi32(input[12], _mm_set_epi32((int)b + 3, (int)b + 2, (int)b + 1, (int)b));
+        memcpy(x, input, sizeof(x));
+        for (int round = 0; round < 10; round++) {
+            CHACHA_QUARTER_SSE2(x[0], x[4], x[8], x[12]);
+            CHACHA_QUARTER_SSE2(x[1], x[5], x[9], x[13]);
+            CHACHA_QUARTER_SSE2(x[2], x[6], x[10], x[14]);
+            CHACHA_QUARTER_SSE2(x[3], x[7], x[11], x[15]);
+            CHACHA_QUARTER_SSE2(x[0], x[5], x[10], x[15]);
+            CHACHA_QUARTER_SSE2(x[1], x[6], x[11], x[12]);
+            CHACHA_QUARTER_SSE2(x[2], x[7], x[8], x[13]);
+            CHACHA_QUARTER_SSE2(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i += 4) {
+            __m128i a = _mm_add_epi32(x[i], input[i]), c = _mm_add_epi32(x[i + 1], input[i + 1]);
+            __m128i e = _mm_add_epi32(x[i + 2], input[i + 2]), g = _mm_add_epi32(x[i + 3], input[i + 3]);
+            __m128i ac_lo = _mm_unpacklo_epi32(a, c), ac_hi = _mm_unpackhi_epi32(a, c);
+            __m128i eg_lo = _mm_unpacklo_epi32(e, g), eg_hi = _mm_unpackhi_epi32(e, g);
+            _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_unpacklo_epi64(ac_lo, eg_lo));
+            _mm_storeu_si128((__m128i *)(out + 64 + 4 * i), _mm_unpackhi_epi64(ac_lo, eg_lo));
+            _mm_storeu_si128((__m128i *)(out + 128 + 4 * i), _mm_unpacklo_epi64(ac_hi, eg_hi));
+            _mm_storeu_si128((__m128i *)(out + 192 + 4 * i), _mm_unpackhi_epi64(ac_hi, eg_hi));
+        }
+    }
+    if (b < blocks) {
+        uint32_t rest[16];
+        memcpy(rest, state, sizeof(rest));
+        rest[12] += (uint32_t)b;
+        chacha20_blocks_scalar(rest, out, blocks - b);
+    }
+}
+#endif
+
+#ifdef STEG_HAVE_X86_DISPATCH
+#define CHACHA_ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32((v), (n)), _mm256_srli_epi32((v), 32 - (n)))
+#define CHACHA_QUARTER_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = CHACHA_ROTL_AVX2(_mm256_xor_si256(b, c), 12);      \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);  \
+    c = _mm256_add_epi32(c, d); b = CHACHA_ROTL_AVX2(_mm256_xor_si256(b, c), 7)
+
+/**
+ * Generates ChaCha20 keystream blocks eight at a time, like chacha20_blocks_sse2(); the rotations by
+ * whole bytes are byte shuffles. The 4 x 4 transposes run within each 128-bit half, which holds word
+ * group i of blocks j and j + 4.
+ *
+ * @param state The input state; its counter is that of the first block.
+ * @param out The keystream, 64 bytes per block.
+ * @param blocks The number of blocks.
+ */
+__attribute__((target("avx2"))) void chacha20_blocks_avx2(const uint32_t state[16], unsigned char *out, size_t blocks) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14, 3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    size_t b = 0;
+    for (; b + 8 <= blocks; b += 8, out += 512) {
+        __m256i x[16];
+        for (int i = 0; i < 16; i++) {
+            x[i] = _mm256_set1_epi32((int)state[i]);
+        }
+        const __m256i counter = _mm256_add_epi32(x[12], _mm256_setr_epi32((int)b, (int)b + 1, (int)b + 2, (int)b + 3, (int)b + 4, (int)b + 5,
+                                                                          (int)b + 6, (int)b + 7));
+        x[12] = counter;
+        for (int round = 0; round < 10; round++) {
+            CHACHA_QUARTER_AVX2(x[0], x[4], x[8], x[12]);
+            CHACHA_QUARTER_AVX2(x[1], x[5], x[9], x[13]);
+            CHACHA_QUARTER_AVX2(x[2], x[6], x[10], x[14]);
+            CHACHA_QUARTER_AVX2(x[3], x[7], x[11], x[15]);
+            CHACHA_QUARTER_AVX2(x[0], x[5], x[10], x[15]);
+            CHACHA_QUARTER_AVX2(x[1], x[6], x[11], x[12]);
+            CHACHA_QUARTER_AVX2(x[2], x[7], x[8], x[13]);
+            CHACHA_QUARTER_AVX2(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i += 4) {
+            __m256i v[4];
+            for (int k = 0; k < 4; k++) {
+                v[k] = _mm256_add_epi32(x[i + k], i + k == 12 ? counter : _mm256_set1_epi32((int)state[i + k]));
+            }
+            __m256i ac_lo = _mm256_unpacklo_epi32(v[0], v[1]), ac_hi = _mm256_unpackhi_epi32(v[0], v[1]);
+            __m256i eg_lo = _mm256_unpacklo_epi32(v[2], v[3]), eg_hi = _mm256_unpackhi_epi32(v[2], v[3]);
+            __m256i rows[4] = { _mm256_unpacklo_epi64(ac_lo, eg_lo), _mm256_unpackhi_epi64(ac_lo, eg_lo), _mm256_unpacklo_epi64(ac_hi, eg_hi),
+                                _mm256_unpackhi_epi64(ac_hi, eg_hi) };
+            for (int j = 0; j < 4; j++) {
+                _mm_storeu_si128((__m128i *)(out + 64 * j + 4 * i), _mm256_castsi256_si128(rows[j]));
+                _mm_storeu_si128((__m128i *)(out + 64 * (j + 4) + 4 * i), _mm256_extracti128_si256(rows[j], 1));
+            }
+        }
+    }
+    if (b < blocks) {
+        uint32_t rest[16];
+        memcpy(rest, state, sizeof(rest));
+        rest[12] += (uint32_t)b;
+        chacha20_blocks_sse2(rest, out, blocks - b);
+    }
+}
+#endif
+
+typedef void (*chacha20_fn)(const uint32_t *state, unsigned char *out, size_t blocks);
+static chacha20_fn chacha20_kernel = chacha20_blocks_scalar;
+static const char *chacha20_kernel_label = "scalar";
+static pthread_once_t chacha20_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the ChaCha20 kernel for this CPU (run once).
+ */
+static void chacha20_select(void) {
+#if defined(STEG_HAVE_SSE2)
+    chacha20_kernel = chacha20_blocks_sse2;
+    chacha20_kernel_label = "sse2";
+#endif
+#ifdef STEG_HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        chacha20_kernel = chacha20_blocks_avx2;
+        chacha20_kernel_label = "avx2";
+    }
+#endif
+}
+
+/**
+ * Returns the name of the ChaCha20 kernel in use.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *chacha20_kernel_name(void) {
+    pthread_once(&chacha20_once, chacha20_select);
+    return chacha20_kernel_label;
+}
+
+/**
+ * Generates ChaCha20 keystream blocks with the fastest kernel for this CPU.
+ *
+ * @param state The input state; its counter is that of the first block.
+ * @param out The keystream, 64 bytes per block.
+ * @param blocks The number of blocks.
+ */
+void chacha20_blocks(const uint32_t state[16], unsigned char *out, size_t blocks) {
+    pthread_once(&chacha20_once, chacha20_select);
+    chacha20_kernel(state, out, blocks);
+}
+
+// Poly1305: h = (h + block) * r mod 2^130 - 5 for each 16-byte block. With a 128-bit type, h and r have
+// 44-bit limbs (three products per limb); otherwise 26-bit limbs keep every product within 64 bits.
+#if defined(__SIZEOF_INT128__)
+#define POLY1305_LIMBS64 1
+#define POLY1305_HIBIT ((uint64_t)1 << 40)
+#define POLY1305_MASK44 0xfffffffffffULL
+#define POLY1305_MASK42 0x3ffffffffffULL
+
+typedef struct {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+    unsigned char buffer[16];
+    size_t used;  // Bytes in buffer
+} poly1305_ctx;
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    return (uint64_t)load_le32(p) | (uint64_t)load_le32(p + 4) << 32;
+}
+
+/**
+ * Starts a Poly1305 MAC.
+ *
+ * @param ctx The MAC state.
+ * @param key The one-time key (32 bytes: r, then s).
+ */
+void poly1305_init(poly1305_ctx *ctx, const unsigned char *key) {
+    uint64_t t0 = load_le64(key), t1 = load_le64(key + 8);
+    ctx->r[0] = t0 & 0xffc0fffffffULL;
+    ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    ctx->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+    memset(ctx->h, 0, sizeof(ctx->h));
+    ctx->pad[0] = load_le64(key + 16);
+    ctx->pad[1] = load_le64(key + 24);
+    ctx->used = 0;
+}
+
+/**
+ * Adds whole 16-byte blocks to a Poly1305 MAC.
+ *
+ * @param ctx The MAC state.
+ * @param data The blocks.
+ * @param length The number of bytes (a multiple of 16).
+ * @param hibit POLY1305_HIBIT for full blocks, 0 for the padded last block.
+ */
+static void poly1305_blocks(poly1305_ctx *ctx, const unsigned char *data, size_t length, uint64_t hibit) {
+    const uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+    const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    for (; length >= 16; data += 16, length -= 16) {
+        uint64_t t0 = load_le64(data), t1 = load_le64(data + 8);
+        h0 += t0 & POLY1305_MASK44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & POLY1305_MASK44;
+        h2 += ((t1 >> 24) & POLY1305_MASK42) | hibit;
+        unsigned __int128 d0 = (unsigned __int128)h0 * r0 + (unsigned __int128)h1 * s2 + (unsigned __int128)h2 * s1;
+        unsigned __int128 d1 = (unsigned __int128)h0 * r1 + (unsigned __int128)h1 * r0 + (unsigned __int128)h2 * s2;
+        unsigned __int128 d2 = (unsigned __int128)h0 * r2 + (unsigned __int128)h1 * r1 + (unsigned __int128)h2 * r0;
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & POLY1305_MASK44;
+        d1 += c; c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & POLY1305_MASK44;
+        d2 += c; c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & POLY1305_MASK42;
+        h0 += c * 5; c = h0 >> 44; h0 &= POLY1305_MASK44;
+        h1 += c;
+    }
+    ctx->h[0] = h0; ctx->h[1] = h1; ctx->h[2] = h2;
+}
+#else
+#define POLY1305_HIBIT (1u << 24)
+
+typedef struct {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    unsigned char buffer[16];
+    size_t used;  // Bytes in buffer
+} poly1305_ctx;
+
+/**
+ * Starts a Poly1305 MAC.
+ *
+ * @param ctx The MAC state.
+ * @param key The one-time key (32 bytes: r, then s).
+ */
+void poly1305_init(poly1305_ctx *ctx, const unsigned char *key) {
+    ctx->r[0] = load_le32(key) & 0x3ffffff;
+    ctx->r[1] = (load_le32(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (load_le32(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (load_le32(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (load_le32(key + 12) >> 8) & 0x00fffff;
+    memset(ctx->h, 0, sizeof(ctx->h));
+    for (int i = 0; i < 4; i++) {
+        ctx->pad[i] = load_le32(key + 16 + 4 * i);
+    }
+    ctx->used = 0;
+}
+
+/**
+ * Adds whole 16-byte blocks to a Poly1305 MAC.
+ *
+ * @param ctx The MAC state.
+ * @param data The blocks.
+ * @param length The number of bytes (a multiple of 16).
+ * @param hibit POLY1305_HIBIT for full blocks, 0 for the padded last block.
+ */
+static void poly1305_blocks(poly1305_ctx *ctx, const unsigned char *data, size_t length, uint32_t hibit) {
+    const uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2], r3 = ctx->r[3], r4 = ctx->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+    for (; length >= 16; data += 16, length -= 16) {
+        h0 += load_le32(data) & 0x3ffffff;
+        h1 += (load_le32(data + 3) >> 2) & 0x3ffffff;
+        h2 += (load_le32(data + 6) >> 4) & 0x3ffffff;
+        h3 += (load_le32(data + 9) >> 6) & 0x3ffffff;
+        h4 += (load_le32(data + 12) >> 8) | hibit;
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+        uint32_t c = (uint32_t)(d0 >> 26);
+        h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    }
+    ctx->h[0] = h0; ctx->h[1] = h1; ctx->h[2] = h2; ctx->h[3] = h3; ctx->h[4] = h4;
+}
+#endif
+
+/**
+ * Adds data to a Poly1305 MAC.
+ *
+ * @param ctx The MAC state.
+ * @param data The data.
+ * @param length The number of bytes.
+ */
+void poly1305_update(poly1305_ctx *ctx, const unsigned char *data, size_t length) {
+    if (ctx->used) {
+        size_t take = 16 - ctx->used < length ? 16 - ctx->used : length;
+        memcpy(ctx->buffer + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        length -= take;
+        if (ctx->used < 16) return;
+        poly1305_blocks(ctx, ctx->buffer, 16, POLY1305_HIBIT);
+        ctx->used = 0;
+    }
+    size_t whole = length & ~(size_t)15;
+    poly1305_blocks(ctx, data, whole, POLY1305_HIBIT);
+    memcpy(ctx->buffer, data + whole, length - whole);
+    ctx->used = length - whole;
+}
+
+/**
+ * Finishes a Poly1305 MAC: fully reduces h and adds s.
+ *
+ * @param ctx The MAC state.
+ * @param tag The 16-byte tag.
+ */
+void poly1305_final(poly1305_ctx *ctx, unsigned char *tag) {
+    if (ctx->used) {
+        ctx->buffer[ctx->used++] = 1;
+        memset(ctx->buffer + ctx->used, 0, 16 - ctx->used);
+        poly1305_blocks(ctx, ctx->buffer, 16, 0);
+    }
+#ifdef POLY1305_LIMBS64
+    uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], c;
+    for (int pass = 0; pass < 2; pass++) {
+        c = h1 >> 44; h1 &= POLY1305_MASK44;
+        h2 += c; c = h2 >> 42; h2 &= POLY1305_MASK42;
+        h0 += c * 5; c = h0 >> 44; h0 &= POLY1305_MASK44;
+        h1 += c;
+    }
+
+    // h - p, chosen instead of h without a branch if it does not go negative
+    uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= POLY1305_MASK44;
+    uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= POLY1305_MASK44;
+    uint64_t g2 = h2 + c - ((uint64_t)1 << 42);
+    uint64_t mask = (g2 >> 63) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    uint64_t t0 = ctx->pad[0], t1 = ctx->pad[1];
+    h0 += t0 & POLY1305_MASK44; c = h0 >> 44; h0 &= POLY1305_MASK44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & POLY1305_MASK44) + c; c = h1 >> 44; h1 &= POLY1305_MASK44;
+    h2 += ((t1 >> 24) & POLY1305_MASK42) + c;
+    uint64_t low = h0 | h1 << 44, high = h1 >> 20 | h2 << 24;
+    store_le32(tag, (uint32_t)low);
+    store_le32(tag + 4, (uint32_t)(low >> 32));
+    store_le32(tag + 8, (uint32_t)high);
+    store_le32(tag + 12, (uint32_t)(high >> 32));
+#else
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4], c;
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    // h - p, chosen instead of h without a branch if it does not go negative
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1u << 26);
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    uint32_t words[4] = { h0 | h1 << 26, h1 >> 6 | h2 << 20, h2 >> 12 | h3 << 14, h3 >> 18 | h4 << 8 };
+    uint64_t f = 0;
+    for (int i = 0; i < 4; i++) {
+        f = (uint64_t)words[i] + ctx->pad[i] + (f >> 32);
+        store_le32(tag + 4 * i, (uint32_t)f);
+    }
+#endif
+}
+
+// ChaCha20-Poly1305 (RFC 8439) over a stream: the text goes through in pieces of any size, and the tag
+// covers the associated data, the ciphertext and both their lengths.
+#define AEAD_KEYSTREAM_BLOCKS 8  // A batch of the widest kernel
+
+typedef struct {
+    uint32_t state[16];  // ChaCha20 input: constants, key, block counter, nonce
+    unsigned char keystream[64 * AEAD_KEYSTREAM_BLOCKS];
+    size_t keystream_used;
+    poly1305_ctx mac;
+    uint64_t aad_length;
+    uint64_t text_length;
+} steg_aead;
+
+/**
+ * Starts an encryption or decryption. Keystream block 0 becomes the Poly1305 key; the text is
+ * enciphered from block 1.
+ *
+ * @param aead The state.
+ * @param key The 32-byte key.
+ * @param nonce The 12-byte nonce, never used twice with one key.
+ * @param aad Data authenticated but not encrypted.
+ * @param aad_length The size of aad.
+ */
+void aead_init(steg_aead *aead, const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, size_t aad_length) {
+    static const uint32_t sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };  // "expand 32-byte k"
+    static const unsigned char zeros[16];
+    memcpy(aead->state, sigma, sizeof(sigma));
+    for (int i = 0; i < 8; i++) {
+        aead->state[4 + i] = load_le32(key + 4 * i);
+    }
+    aead->state[12] = 0;
+    for (int i = 0; i < 3; i++) {
+        aead->state[13 + i] = load_le32(nonce + 4 * i);
+    }
+    chacha20_blocks(aead->state, aead->keystream, 1);
+    poly1305_init(&aead->mac, aead->keystream);
+    aead->state[12] = 1;
+    aead->keystream_used = sizeof(aead->keystream);
+    poly1305_update(&aead->mac, aad, aad_length);
+    poly1305_update(&aead->mac, zeros, (16 - aad_length % 16) % 16);
+    aead->aad_length = aad_length;
+    aead->text_length = 0;
+}
+
+/**
+ * XORs the next keystream bytes into a piece of text; whole keystream buffers are XORed a word at a time.
+ *
+ * @param aead The state.
+ * @param in The input.
+ * @param out The output (may be in).
+ * @param length The number of bytes.
+ */
+static void aead_xor(steg_aead *aead, const unsigned char *in, unsigned char *out, size_t length) {
+    while (length) {
+        if (aead->keystream_used == sizeof(aead->keystream)) {
+            chacha20_blocks(aead->state, aead->keystream, AEAD_KEYSTREAM_BLOCKS);
+            aead->state[12] += AEAD_KEYSTREAM_BLOCKS;
+            aead->keystream_used = 0;
+        }
+        const unsigned char *keystream = aead->keystream + aead->keystream_used;
+        size_t count = sizeof(aead->keystream) - aead->keystream_used;
+        if (count > length) count = length;
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            uint64_t a, k;
+            memcpy(&a, in + i, 8);
+            memcpy(&k, keystream + i, 8);
+            a ^= k;
+            memcpy(out + i, &a, 8);
+        }
+        for (; i < count; i++) {
+            out[i] = in[i] ^ keystream[i];
+        }
+        aead->keystream_used += count;
+        in += count;
+        out += count;
+        length -= count;
+    }
+}
+
+/**
+ * Encrypts the next piece of the text.
+ *
+ * @param aead The state.
+ * @param in The plaintext.
+ * @param out The ciphertext (may be in).
+ * @param length The number of bytes.
+ */
+void aead_encrypt(steg_aead *aead, const unsigned char *in, unsigned char *out, size_t length) {
+    aead_xor(aead, in, out, length);
+    poly1305_update(&aead->mac, out, length);
+    aead->text_length += length;
+}
+
+/**
+ * Decrypts the next piece of the text. The plaintext is not authentic until aead_finish() says so.
+ *
+ * @param aead The state.
+ * @param in The ciphertext.
+ * @param out The plaintext (may be in).
+ * @param length The number of bytes.
+ */
+void aead_decrypt(steg_aead *aead, const unsigned char *in, unsigned char *out, size_t length) {
+    poly1305_update(&aead->mac, in, length);
+    aead_xor(aead, in, out, length);
+    aead->text_length += length;
+}
+
+/**
+ * Computes the tag once the whole text has gone through.
+ *
+ * @param aead The state.
+ * @param tag The 16-byte tag.
+ */
+void aead_finish(steg_aead *aead, unsigned char *tag) {
+    static const unsigned char zeros[16];
+    unsigned char lengths[16];
+    poly1305_update(&aead->mac, zeros, (16 - aead->text_length % 16) % 16);
+    for (int i = 0; i < 8; i++) {
+        lengths[i] = (unsigned char)(aead->aad_length >> (8 * i));
+        lengths[8 + i] = (unsigned char)(aead->text_length >> (8 * i));
+    }
+    poly1305_update(&aead->mac, lengths, 16);
+    poly1305_final(&aead->mac, tag);
+}
+
+/**
+ * Compares two tags in time that does not depend on where they differ.
+ *
+ * @param a A tag.
+ * @param b Another tag.
+ * @return 1 if they match, 0 otherwise.
+ */
+int aead_tag_equal(const unsigned char *a, const unsigned char *b) {
+    unsigned char diff = 0;
+    for (int i = 0; i < POLY1305_TAG_BYTES; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+// A passphrase for payload encryption. Jobs that give the same passphrase share one of these, so a
+// batch derives the key once instead of once per image: encodes reuse the cached key and its salt
+// (every payload still gets a fresh random nonce), and decodes reuse it for images with that salt.
+typedef struct steg_passphrase {
+    char *text;
+    pthread_mutex_t lock;     // Held through a derivation, which also bounds the memory they use
+    int cached;               // 1 once the fields below hold a derived key
+    unsigned char params[4];  // KDF (STEG_KDF_SCRYPT), log2 N, r and p of the cached key
+    unsigned char salt[SCRYPT_SALT_BYTES];
+    unsigned char key[CHACHA_KEY_BYTES];
+    struct steg_passphrase *next;
+} steg_passphrase;
+
+static steg_passphrase *passphrase_list;
+static pthread_mutex_t passphrase_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns the shared object for a passphrase, creating it on first use. It lives until the process exits.
+ *
+ * @param text The passphrase.
+ * @return The passphrase object, or NULL if memory allocation fails.
+ */
+steg_passphrase *passphrase_intern(const char *text) {
+    pthread_mutex_lock(&passphrase_list_lock);
+    steg_passphrase *passphrase = passphrase_list;
+    while (passphrase && strcmp(passphrase->text, text) != 0) {
+        passphrase = passphrase->next;
+    }
+    if (!passphrase) {
+        passphrase = (steg_passphrase *)calloc(1, sizeof(steg_passphrase));
+        if (passphrase) passphrase->text = (char *)malloc(strlen(text) + 1);
+        if (passphrase && passphrase->text) {
+            strcpy(passphrase->text, text);
+            pthread_mutex_init(&passphrase->lock, NULL);
+            passphrase->next = passphrase_list;
+            passphrase_list = passphrase;
+        } else if (passphrase) {
+            free(passphrase);
+            passphrase = NULL;
+        }
+    }
+    pthread_mutex_unlock(&passphrase_list_lock);
+    return passphrase;
+}
+
+/**
+ * Derives the key of a passphrase, or takes it from the cache. To encrypt, the cached key is used if it
+ * has the default parameters, else a new random salt is drawn; to decrypt, the parameters and salt of
+ * the payload are used.
+ *
+ * @param passphrase The passphrase.
+ * @param encrypting 1 to encrypt (params and salt are outputs), 0 to decrypt (they are inputs).
+ * @param params The KDF parameters (4 bytes).
+ * @param salt The salt (SCRYPT_SALT_BYTES bytes).
+ * @param key The key (CHACHA_KEY_BYTES bytes).
+ * @return 1 on success, 0 if the parameters are unsupported or the derivation fails.
+ */
+int passphrase_key(steg_passphrase *passphrase, int encrypting, unsigned char *params, unsigned char *salt, unsigned char *key) {
+    static const unsigned char defaults[4] = { STEG_KDF_SCRYPT, SCRYPT_DEFAULT_LOG_N, SCRYPT_DEFAULT_R, SCRYPT_DEFAULT_P };
+    int ok = 1;
+    pthread_mutex_lock(&passphrase->lock);
+    int hit = passphrase->cached && (encrypting ? memcmp(passphrase->params, defaults, 4) == 0
+                                                : memcmp(passphrase->params, params, 4) == 0 && memcmp(passphrase->salt, salt, SCRYPT_SALT_BYTES) == 0);
+    if (!hit) {
+        if (encrypting) {
+            memcpy(params, defaults, 4);
+            ok = steg_random_bytes(salt, SCRYPT_SALT_BYTES);
+        }
+        ok = ok && params[0] == STEG_KDF_SCRYPT &&
+             scrypt_derive((const unsigned char *)passphrase->text, strlen(passphrase->text), salt, SCRYPT_SALT_BYTES, params[1], params[2], params[3],
+                           passphrase->key, CHACHA_KEY_BYTES);
+        passphrase->cached = ok;
+        if (ok) {
+            memcpy(passphrase->params, params, 4);
+            memcpy(passphrase->salt, salt, SCRYPT_SALT_BYTES);
+        }
+    }
+    if (ok) {
+        memcpy(params, passphrase->params, 4);
+        memcpy(salt, passphrase->salt, SCRYPT_SALT_BYTES);
+        memcpy(key, passphrase->key, CHACHA_KEY_BYTES);
+    }
+    pthread_mutex_unlock(&passphrase->lock);
+    return ok;
+}
+
+// Framed message format, the default for batch encodes. A header goes in front of the payload,
+// stored in the carrier LSBs the same way as the payload itself:
+//   magic "STEG", version (1), flags, payload length (4 bytes, big-endian),
+//   CRC32C of the version, flags, length and payload (4 bytes, big-endian)
+// The length replaces the end marker, so payloads may contain any byte, including 0x07.
+// With STEG_FLAG_FEC, a 15th header byte gives the Reed-Solomon check bytes per block, the header is
+// written three times and read back by a bitwise majority vote, and the payload is stored in its
+// interleaved protected form.
+// With STEG_FLAG_SHARD, the payload is one piece of a larger one and starts with a shard record:
+//   shard index, shard count (4 bytes each), offset of the piece, total payload length (8 bytes each),
+//   CRC32C of the whole payload (4 bytes), manifest hash (8 bytes)
+// all big-endian. The record is part of the payload, so the CRC and error correction cover it too.
+// With STEG_FLAG_ENCRYPTED, the payload is sealed with ChaCha20-Poly1305 and framed as
+//   crypto record: KDF (1 = scrypt), log2 N, r, p (1 byte each), salt (16 bytes), nonce (12 bytes)
+//   ciphertext (of the shard record too, for a shard), Poly1305 tag (16 bytes)
+// The crypto record is the associated data of the tag. The header length and CRC count the framed
+// bytes, so error correction repairs ciphertext like any other payload.
+#define MESSAGE_FORMAT_HEADER 0  // Framed with the header above
+#define MESSAGE_FORMAT_LEGACY 1  // Message, parity checksum and 00000111 end marker
+#define STEG_HEADER_BYTES 14
+#define STEG_FEC_HEADER_BYTES 15
+#define STEG_FEC_HEADER_COPIES 3
+#define STEG_HEADER_VERSION 1
+#define STEG_FLAG_FEC 0x01
+#define STEG_FLAG_SHARD 0x02
+#define STEG_FLAG_ENCRYPTED 0x04
+#define STEG_KNOWN_FLAGS (STEG_FLAG_FEC | STEG_FLAG_SHARD | STEG_FLAG_ENCRYPTED)  // Headers with other flags come from a newer version and are not read
+#define STEG_PLAIN_FLAGS (STEG_FLAG_SHARD | STEG_FLAG_ENCRYPTED)  // The flags a header without error correction may have
+#define STEG_SHARD_BYTES 36
+#define STEG_CRYPTO_RECORD_BYTES 32
+#define STEG_CRYPTO_OVERHEAD (STEG_CRYPTO_RECORD_BYTES + POLY1305_TAG_BYTES)
+
+static const unsigned char steg_magic[4] = { 'S', 'T', 'E', 'G' };
+
+// What it takes to read a payload besides the image: nothing is set for a plain one
+typedef struct {
+    steg_key key;                 // Scatters the embedded bits over the image if set
+    steg_passphrase *passphrase;  // Encrypts the payload if set (header format only)
+} steg_secrets;
+
+// How a payload is laid out in the carriers
+typedef struct {
+    int format;            // MESSAGE_FORMAT_* value
+    int fec_parity;        // Reed-Solomon check bytes per block, 0 for no error correction (header format only)
+    int sharded;           // 1 if the payload starts with a shard record (header format only)
+    steg_secrets secrets;  // Scattering key and encryption passphrase
+} message_layout;
+
+// The shard record of one piece of a payload split over several images
+typedef struct {
+    uint32_t index;        // Sequence number, from 0
+    uint32_t count;        // Number of shards
+    uint64_t offset;       // Position of this piece in the whole payload
+    uint64_t total;        // Size of the whole payload
+    uint32_t payload_crc;  // CRC32C of the whole payload
+    uint64_t manifest;     // shard_manifest_hash() of the whole set, the same in every shard
+} steg_shard;
+
+// What the decoder found, besides the payload itself
+typedef struct {
+    size_t length;
+    int format;          // MESSAGE_FORMAT_* value
+    int checksum_ok;     // 1 if the embedded checksum or CRC matches
+    int fec_parity;      // Reed-Solomon check bytes per block, 0 without error correction
+    long corrected;      // Bytes repaired by error correction, -1 if some block was beyond repair
+    int sharded;         // 1 if the payload is a shard: it starts with the record below
+    steg_shard shard;
+    uint32_t shard_crc;  // CRC32C of the shard's piece of the payload (set by streaming extraction)
+    int encrypted;       // 1 if the payload is encrypted; length is then that of the plaintext
+    int authentic;       // 1 if its Poly1305 tag matches: the passphrase is right and nothing was modified
+} message_info;
+
+/**
+ * Writes a shard record.
+ *
+ * @param shard The shard.
+ * @param out The record (STEG_SHARD_BYTES bytes).
+ */
+void shard_encode(const steg_shard *shard, unsigned char *out) {
+    uint64_t fields[6] = { shard->index, shard->count, shard->offset, shard->total, shard->payload_crc, shard->manifest };
+    static const int sizes[6] = { 4, 4, 8, 8, 4, 8 };
+    for (int f = 0; f < 6; f++) {
+        for (int i = sizes[f] - 1; i >= 0; i--) {
+            *out++ = (unsigned char)(fields[f] >> (8 * i));
+        }
+    }
+}
+
+/**
+ * Reads a shard record.
+ *
+ * @param in The record (STEG_SHARD_BYTES bytes).
+ * @param shard The shard.
+ */
+void shard_decode(const unsigned char *in, steg_shard *shard) {
+    uint64_t fields[6];
+    static const int sizes[6] = { 4, 4, 8, 8, 4, 8 };
+    for (int f = 0; f < 6; f++) {
+        fields[f] = 0;
+        for (int i = 0; i < sizes[f]; i++) {
+            fields[f] = fields[f] << 8 | *in++;
+        }
+    }
+    shard->index = (uint32_t)fields[0];
+    shard->count = (uint32_t)fields[1];
+    shard->offset = fields[2];
+    shard->total = fields[3];
+    shard->payload_crc = (uint32_t)fields[4];
+    shard->manifest = fields[5];
+}
+
+/**
+ * Hashes the manifest of a sharded payload (64-bit FNV-1a over its size, CRC and the size of every
+ * piece, in order). Every shard carries it, so shards of different payloads are never mixed and a
+ * shard that claims the wrong range is caught.
+ *
+ * @param total The size of the whole payload.
+ * @param payload_crc The CRC32C of the whole payload.
+ * @param lengths The size of each piece.
+ * @param count The number of pieces.
+ * @return The hash.
+ */
+uint64_t shard_manifest_hash(uint64_t total, uint32_t payload_crc, const uint64_t *lengths, uint32_t count) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t fields[3] = { total, payload_crc, count };
+    for (uint32_t i = 0; i < count + 3; i++) {
+        uint64_t value = i < 3 ? fields[i] : lengths[i - 3];
+        for (int b = 7; b >= 0; b--) {
+            hash = (hash ^ (unsigned char)(value >> (8 * b))) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Returns the number of carrier bytes' worth of payload (8 carriers each) a payload needs in a layout.
+ *
+ * @param length The size of the payload.
+ * @param layout The layout.
+ * @return The number of embedded bytes, header included.
+ */
+size_t message_embedded_bytes(size_t length, const message_layout *layout) {
+    if (layout->format == MESSAGE_FORMAT_LEGACY) return length + 2;
+    if (layout->secrets.passphrase) length += STEG_CRYPTO_OVERHEAD;
+    if (!layout->fec_parity) return STEG_HEADER_BYTES + length;
+    rs_layout blocks = rs_layout_for(length, layout->fec_parity);
+    return STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES + blocks.blocks * blocks.block_len;
+}
+
+/**
+ * Returns the largest payload that fits in an image in the given layout.
+ *
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param layout The layout.
+ * @return The capacity in bytes (0 if not even the overhead fits).
+ */
+size_t message_capacity(size_t pixel_bytes, int depth, const message_layout *layout) {
+    size_t slots = carrier_slots(pixel_bytes, depth);
+    size_t sealing = layout->format == MESSAGE_FORMAT_HEADER && layout->secrets.passphrase ? STEG_CRYPTO_OVERHEAD : 0;
+    if (layout->format == MESSAGE_FORMAT_LEGACY || !layout->fec_parity) {
+        size_t overhead = (layout->format == MESSAGE_FORMAT_LEGACY ? 2 : STEG_HEADER_BYTES) + sealing;
+        return slots > overhead ? slots - overhead : 0;
+    }
+    size_t overhead = STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES;
+    if (slots <= overhead) return 0;
+    // The payload grows with the block count until the blocks are full, so the best count is next to
+    // available / 255
+    size_t available = slots - overhead, best = 0;
+    size_t full_blocks = available / 255;
+    for (size_t blocks = full_blocks ? full_blocks : 1; blocks <= full_blocks + 1; blocks++) {
+        size_t per_block = available / blocks;
+        if (per_block <= (size_t)layout->fec_parity) continue;
+        per_block -= layout->fec_parity;
+        if (per_block > (size_t)(255 - layout->fec_parity)) per_block = 255 - layout->fec_parity;
+        if (blocks * per_block > best) best = blocks * per_block;
+    }
+    return best > sealing ? best - sealing : 0;
+}
+
+// Streams a payload into the carrier LSBs as it arrives, so a large payload never has to be in memory.
+// The header, which needs the final length and CRC, is written last. An encrypted payload is sealed on
+// the way through, a small piece at a time, so encryption needs no copy of the payload either.
+#define MESSAGE_SEAL_BYTES 4096
+
+typedef struct {
+    steg_frame frame;  // The image rows, modified in place
+    message_layout layout;
+    steg_scatter scatter_state;
+    const steg_scatter *scatter;  // NULL for sequential carriers
+    steg_aead aead;               // Seals the payload if layout.secrets.passphrase is set
+    size_t capacity;     // Largest payload that fits
+    size_t data_offset;  // Position of the first payload byte in the embedded byte stream
+    size_t prefix;       // Framed bytes before the payload (the crypto record of an encrypted one)
+    size_t length;       // Payload bytes written so far
+    uint32_t checksum;   // CRC32C of the framed bytes so far (the payload's bit parity in the legacy format)
+} message_writer;
+
+/**
+ * Starts embedding a payload into the rows of a frame. For an encrypted one, this derives the key (or
+ * takes it from the passphrase's cache), draws a nonce and writes the crypto record. The payload lands
+ * in the same carriers as in the packed image of the same pixels.
+ *
+ * @param writer The writer to initialize.
+ * @param frame The image rows, modified in place; they must outlive the writer.
+ * @param depth The bits per sample (8 or 16).
+ * @param layout The layout.
+ * @return 1 on success, 0 if the layout is invalid or the key cannot be derived.
+ */
+int message_writer_begin_frame(message_writer *writer, const steg_frame *frame, int depth, const message_layout *layout) {
+    size_t pixel_bytes = frame_bytes(frame);
+    writer->frame = *frame;
+    writer->layout = *layout;
+    writer->scatter = scatter_init(&writer->scatter_state, &layout->secrets.key, pixel_bytes, depth);
+    writer->capacity = message_capacity(pixel_bytes, depth, layout);
+    size_t limit = 0xFFFFFFFFu - (layout->secrets.passphrase ? STEG_CRYPTO_OVERHEAD : 0);  // The header's length field
+    if (writer->capacity > limit) writer->capacity = limit;
+    writer->data_offset = layout->format == MESSAGE_FORMAT_LEGACY ? 0
+                          : layout->fec_parity ? STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES : STEG_HEADER_BYTES;
+    writer->prefix = 0;
+    writer->length = 0;
+    writer->checksum = 0;
+    if (layout->format == MESSAGE_FORMAT_LEGACY && (layout->fec_parity || layout->secrets.passphrase)) {
+        return 0;
+    }
+    if (layout->secrets.passphrase) {
+        unsigned char record[STEG_CRYPTO_RECORD_BYTES], key[CHACHA_KEY_BYTES];
+        if (writer->capacity == 0 || !passphrase_key(layout->secrets.passphrase, 1, record, record + 4, key) ||
+            !steg_random_bytes(record + 4 + SCRYPT_SALT_BYTES, CHACHA_NONCE_BYTES)) {
+            return 0;
+        }
+        aead_init(&writer->aead, key, record + 4 + SCRYPT_SALT_BYTES, record, STEG_CRYPTO_RECORD_BYTES);
+        frame_spread(writer->scatter, &writer->frame, writer->data_offset, record, STEG_CRYPTO_RECORD_BYTES);
+        writer->checksum = crc32c(0, record, STEG_CRYPTO_RECORD_BYTES);
+        writer->prefix = STEG_CRYPTO_RECORD_BYTES;
+    }
+    return 1;
+}
+
+/**
+ * Starts embedding a payload into a packed image (see message_writer_begin_frame).
+ *
+ * @param writer The writer to initialize.
+ * @param pixels The image data, modified in place.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param layout The layout.
+ * @return 1 on success, 0 if the layout is invalid or the key cannot be derived.
+ */
+int message_writer_begin(message_writer *writer, unsigned char *pixels, size_t pixel_bytes, int depth, const message_layout *layout) {
+    steg_frame frame = frame_packed(pixels, pixel_bytes);
+    return message_writer_begin_frame(writer, &frame, depth, layout);
+}
+
+/**
+ * Embeds the next piece of the payload.
+ *
+ * @param writer The writer.
+ * @param data The bytes.
+ * @param length The number of bytes.
+ * @return 1 on success, 0 if the payload would no longer fit (nothing is written).
+ */
+int message_writer_write(message_writer *writer, const unsigned char *data, size_t length) {
+    if (length > writer->capacity - writer->length) {
+        return 0;
+    }
+    size_t offset = writer->data_offset + writer->prefix + writer->length;
+    if (writer->layout.secrets.passphrase) {
+        unsigned char sealed[MESSAGE_SEAL_BYTES];
+        for (size_t done = 0; done < length;) {
+            size_t count = length - done < sizeof(sealed) ? length - done : sizeof(sealed);
+            aead_encrypt(&writer->aead, data + done, sealed, count);
+            frame_spread(writer->scatter, &writer->frame, offset + done, sealed, count);
+            writer->checksum = crc32c(writer->checksum, sealed, count);
+            done += count;
+        }
+    } else {
+        frame_spread(writer->scatter, &writer->frame, offset, data, length);
+        if (writer->layout.format == MESSAGE_FORMAT_LEGACY) {
+            writer->checksum ^= legacy_checksum((const char *)data, length);
+        } else {
+            writer->checksum = crc32c(writer->checksum, data, length);
+        }
+    }
+    writer->length += length;
+    return 1;
+}
+
+/**
+ * Finishes a payload: writes the legacy trailer, or the tag of an encrypted payload, the error
+ * correction rows and the header.
+ *
+ * @param writer The writer.
+ * @return 1 on success, 0 on failure.
+ */
+int message_writer_finish(message_writer *writer) {
+    size_t length = writer->length;
+    if (writer->layout.format == MESSAGE_FORMAT_LEGACY) {
+        unsigned char trailer[2] = { (unsigned char)writer->checksum, 0x07 };
+        frame_spread(writer->scatter, &writer->frame, length, trailer, 2);
+        return 1;
+    }
+    if (writer->layout.secrets.passphrase) {
+        unsigned char tag[POLY1305_TAG_BYTES];
+        aead_finish(&writer->aead, tag);
+        frame_spread(writer->scatter, &writer->frame, writer->data_offset + writer->prefix + length, tag, POLY1305_TAG_BYTES);
+        writer->checksum = crc32c(writer->checksum, tag, POLY1305_TAG_BYTES);
+        length += STEG_CRYPTO_OVERHEAD;
+    }
+
+    unsigned char header[STEG_FEC_HEADER_BYTES];
+    memcpy(header, steg_magic, 4);
+    header[4] = STEG_HEADER_VERSION;
+    header[5] = (writer->layout.fec_parity ? STEG_FLAG_FEC : 0) | (writer->layout.sharded ? STEG_FLAG_SHARD : 0) |
+                (writer->layout.secrets.passphrase ? STEG_FLAG_ENCRYPTED : 0);
+    for (int i = 0; i < 4; i++) {
+        header[6 + i] = (unsigned char)(length >> (24 - 8 * i));
+    }
+    uint32_t crc = crc32c_combine(crc32c(0, header + 4, 6), writer->checksum, length);
+    for (int i = 0; i < 4; i++) {
+        header[10 + i] = (unsigned char)(crc >> (24 - 8 * i));
+    }
+    if (!writer->layout.fec_parity) {
+        frame_spread(writer->scatter, &writer->frame, 0, header, STEG_HEADER_BYTES);
+        return 1;
+    }
+
+    // Zero-pad the last data row, then add the check rows
+    static const unsigned char zeros[256];
+    rs_layout blocks = rs_layout_for(length, writer->layout.fec_parity);
+    for (size_t pad = length; pad < blocks.blocks * blocks.data_len; pad += sizeof(zeros)) {
+        size_t count = blocks.blocks * blocks.data_len - pad;
+        frame_spread(writer->scatter, &writer->frame, writer->data_offset + pad, zeros, count < sizeof(zeros) ? count : sizeof(zeros));
+    }
+    if (!rs_encode_carriers(writer->scatter, &writer->frame, writer->data_offset, length, writer->layout.fec_parity)) {
+        return 0;
+    }
+    header[14] = (unsigned char)writer->layout.fec_parity;
+    for (int copy = 0; copy < STEG_FEC_HEADER_COPIES; copy++) {
+        frame_spread(writer->scatter, &writer->frame, (size_t)copy * STEG_FEC_HEADER_BYTES, header, STEG_FEC_HEADER_BYTES);
+    }
+    return 1;
+}
+
+/**
+ * Embeds a payload that is already in memory into the rows of a frame: padded rows, a sub-rectangle or
+ * row pointers. It reads back from the packed image of the same pixels, and the other way round.
+ *
+ * @param frame The image rows, modified in place.
+ * @param depth The bits per sample (8 or 16).
+ * @param payload The payload (for the legacy format, a string without 0x07 bytes).
+ * @param length The size of the payload.
+ * @param layout The layout.
+ * @return 1 on success, 0 if the image is too small, the layout is invalid or the key cannot be derived.
+ */
+int embed_message_frame(const steg_frame *frame, int depth, const unsigned char *payload, size_t length, const message_layout *layout) {
+    message_writer writer;
+    return message_writer_begin_frame(&writer, frame, depth, layout) && message_writer_write(&writer, payload, length) &&
+           message_writer_finish(&writer);
+}
+
+/**
+ * Embeds a payload that is already in memory.
+ *
+ * @param pixels The image data, modified in place.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param payload The payload (for the legacy format, a string without 0x07 bytes).
+ * @param length The size of the payload.
+ * @param layout The layout.
+ * @return 1 on success, 0 if the image is too small, the layout is invalid or the key cannot be derived.
+ */
+int embed_message(unsigned char *pixels, size_t pixel_bytes, int depth, const unsigned char *payload, size_t length, const message_layout *layout) {
+    steg_frame frame = frame_packed(pixels, pixel_bytes);
+    return embed_message_frame(&frame, depth, payload, length, layout);
+}
+
+#define PAYLOAD_CHUNK_BYTES (64 * 1024)
+
+/**
+ * Embeds the contents of a file (or of standard input for "-") as they are read, one chunk at a time,
+ * so only a chunk of the payload is ever in memory. The payload may be any binary data. For a shard,
+ * the shard record is embedded first, followed by the shard's piece of the file.
+ *
+ * @param filename The payload file, or "-" for standard input.
+ * @param shard The shard to embed, or NULL for the whole file.
+ * @param shard_length The size of the shard's piece.
+ * @param pixels The image data, modified in place.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param layout The layout (the header format: the legacy format cannot hold binary data).
+ * @param length A pointer to store the payload size.
+ * @param error A buffer for the reason of a failure.
+ * @param error_size The size of the error buffer.
+ * @return 1 on success, 0 on failure.
+ */
+int embed_payload_file(const char *filename, const steg_shard *shard, size_t shard_length, unsigned char *pixels, size_t pixel_bytes,
+                       int depth, const message_layout *layout, size_t *length, char *error, size_t error_size) {
+    if (layout->format == MESSAGE_FORMAT_LEGACY) {
+        snprintf(error, error_size, "Payload files need the header format.");
+        return 0;
+    }
+    int from_stdin = strcmp(filename, "-") == 0;
+    FILE *file = from_stdin ? stdin : fopen(filename, "rb");
+    if (!file) {
+        snprintf(error, error_size, "Failed to open payload file '%s'.", filename);
+        return 0;
+    }
+#ifdef _WIN32
+    if (from_stdin) _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    unsigned char *chunk = (unsigned char *)malloc(PAYLOAD_CHUNK_BYTES);
+    if (!chunk) {
+        if (!from_stdin) fclose(file);
+        snprintf(error, error_size, "Memory allocation failed!");
+        return 0;
+    }
+
+    message_writer writer;
+    message_layout shard_layout = *layout;
+    shard_layout.sharded = shard != NULL;
+    int ok = message_writer_begin(&writer, pixels, pixel_bytes, depth, &shard_layout);
+    if (!ok) {
+        snprintf(error, error_size, writer.capacity ? "Failed to derive the encryption key." : "Image is too small for an encrypted payload.");
+    }
+    size_t count, left = shard ? shard_length : SIZE_MAX;
+    if (ok && shard) {
+        shard_encode(shard, chunk);
+        if (!message_writer_write(&writer, chunk, STEG_SHARD_BYTES)) {
+            snprintf(error, error_size, "Payload is too large! Maximum payload size: %zu bytes.", writer.capacity);
+            ok = 0;
+        } else if (steg_fseek(file, (steg_off_t)shard->offset, SEEK_SET) != 0) {
+            snprintf(error, error_size, "Failed to read payload file '%s'.", filename);
+            ok = 0;
+        }
+    }
+    while (ok && left && (count = fread(chunk, 1, left < PAYLOAD_CHUNK_BYTES ? left : PAYLOAD_CHUNK_BYTES, file)) > 0) {
+        left -= count;
+        if (!message_writer_write(&writer, chunk, count)) {
+            snprintf(error, error_size, "Payload is too large! Maximum payload size: %zu bytes.", writer.capacity);
+            ok = 0;
+        }
+    }
+    if (ok && ferror(file)) {
+        snprintf(error, error_size, "Failed to read payload file '%s'.", filename);
+        ok = 0;
+    } else if (ok && shard && left) {
+        snprintf(error, error_size, "Payload file '%s' is shorter than when it was split.", filename);
+        ok = 0;
+    }
+    if (ok && !message_writer_finish(&writer)) {
+        snprintf(error, error_size, "Memory allocation failed!");
+        ok = 0;
+    }
+    free(chunk);
+    if (!from_stdin) fclose(file);
+    *length = writer.length;
+    return ok;
+}
+
+/**
+ * Records whether a framed payload is encrypted and whether it is a shard and, if so, reads its shard
+ * record (that of an encrypted payload is read once it is decrypted).
+ *
+ * @param flags The header flags.
+ * @param payload The payload (info->length bytes).
+ * @param info The decoder findings to update.
+ * @return 1 on success, 0 if the payload is too short to be a shard.
+ */
+int message_read_shard(unsigned char flags, const unsigned char *payload, message_info *info) {
+    info->sharded = (flags & STEG_FLAG_SHARD) != 0;
+    info->encrypted = (flags & STEG_FLAG_ENCRYPTED) != 0;
+    if (!info->sharded || info->encrypted) return 1;
+    if (info->length < STEG_SHARD_BYTES) return 0;
+    shard_decode(payload, &info->shard);
+    return 1;
+}
+
+/**
+ * Sets up the decryption of a payload from its crypto record.
+ *
+ * @param secrets The secrets (the passphrase is used), or NULL.
+ * @param record The crypto record (STEG_CRYPTO_RECORD_BYTES bytes).
+ * @param aead The state to initialize.
+ * @return 1 on success, 0 without a passphrase, with unsupported parameters or if the derivation fails.
+ */
+int message_open(const steg_secrets *secrets, const unsigned char *record, steg_aead *aead) {
+    unsigned char params[4], salt[SCRYPT_SALT_BYTES], key[CHACHA_KEY_BYTES];
+    if (!secrets || !secrets->passphrase) return 0;
+    memcpy(params, record, 4);
+    memcpy(salt, record + 4, SCRYPT_SALT_BYTES);
+    if (!passphrase_key(secrets->passphrase, 0, params, salt, key)) return 0;
+    aead_init(aead, key, record + 4 + SCRYPT_SALT_BYTES, record, STEG_CRYPTO_RECORD_BYTES);
+    return 1;
+}
+
+/**
+ * Decrypts an encrypted payload in place and checks its tag. On success the payload holds the
+ * plaintext, followed by a terminating zero, and a shard's record is read.
+ *
+ * @param payload The framed payload (info->length bytes).
+ * @param secrets The secrets, or NULL.
+ * @param info The decoder findings to update.
+ * @return 1 on success, 0 if it cannot be decrypted or is not authentic.
+ */
+int message_decrypt(unsigned char *payload, const steg_secrets *secrets, message_info *info) {
+    steg_aead aead;
+    unsigned char tag[POLY1305_TAG_BYTES];
+    if (info->length < STEG_CRYPTO_OVERHEAD || !message_open(secrets, payload, &aead)) return 0;
+    size_t length = info->length - STEG_CRYPTO_OVERHEAD;
+    aead_decrypt(&aead, payload + STEG_CRYPTO_RECORD_BYTES, payload, length);
+    aead_finish(&aead, tag);
+    info->authentic = aead_tag_equal(tag, payload + STEG_CRYPTO_RECORD_BYTES + length);
+    info->length = length;
+    payload[length] = '\0';
+    if (!info->authentic) return 0;
+    if (info->sharded) {
+        if (length < STEG_SHARD_BYTES) return 0;
+        shard_decode(payload, &info->shard);
+    }
+    return 1;
+}
+
+/**
+ * Describes why an encrypted payload could not be read.
+ *
+ * @param secrets The secrets the decoder had, or NULL.
+ * @return The reason.
+ */
+const char *message_locked_reason(const steg_secrets *secrets) {
+    return secrets && secrets->passphrase ? "Decryption failed: wrong passphrase, or the payload was modified."
+                                          : "The payload is encrypted: decode it with --passphrase.";
+}
+
+/**
+ * Extracts a payload stored without error correction; the CRC is checked in the same pass that
+ * collects the payload bits.
+ *
+ * @param frame The image rows.
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param header The header, already read.
+ * @param info The decoder findings to fill in.
+ * @return The payload followed by a terminating zero (free with free()), or NULL on failure.
+ */
+char *extract_plain_payload(const steg_frame *frame, const steg_scatter *scatter, const unsigned char *header, message_info *info) {
+    size_t pixel_bytes = frame_bytes(frame);
+    message_layout layout = { MESSAGE_FORMAT_HEADER, 0 };
+    size_t payload_len = (size_t)read_be32(header + 6);
+    if (payload_len > message_capacity(pixel_bytes, scatter ? scatter->depth : 8, &layout)) return NULL;
+    char *payload = (char *)malloc(payload_len + 1);
+    if (!payload) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+    uint32_t crc = lsb_gather_crc32c(scatter, frame, STEG_HEADER_BYTES, (unsigned char *)payload, payload_len, crc32c(0, header + 4, 6));
+    payload[payload_len] = '\0';
+    info->length = payload_len;
+    info->checksum_ok = crc == read_be32(header + 10);
+    info->fec_parity = 0;
+    info->corrected = 0;
+    if (!message_read_shard(header[5], (const unsigned char *)payload, info)) {
+        free(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+/**
+ * Reads the header of a payload stored with error correction, by a bitwise majority vote of its copies.
+ *
+ * @param frame The image rows.
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param header The voted header (STEG_FEC_HEADER_BYTES bytes).
+ * @return 1 if it is a valid header of a protected payload that fits the image, 0 otherwise.
+ */
+int read_fec_header(const steg_frame *frame, const steg_scatter *scatter, unsigned char *header) {
+    size_t pixel_bytes = frame_bytes(frame);
+    unsigned char copies[STEG_FEC_HEADER_COPIES][STEG_FEC_HEADER_BYTES];
+    int depth = scatter ? scatter->depth : 8;
+    if (carrier_slots(pixel_bytes, depth) < STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES) return 0;
+    frame_gather(scatter, frame, 0, &copies[0][0], STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES);
+    for (int i = 0; i < STEG_FEC_HEADER_BYTES; i++) {
+        header[i] = (copies[0][i] & copies[1][i]) | (copies[0][i] & copies[2][i]) | (copies[1][i] & copies[2][i]);
+    }
+    if (memcmp(header, steg_magic, 4) != 0 || header[4] != STEG_HEADER_VERSION || (header[5] & ~STEG_KNOWN_FLAGS) || !(header[5] & STEG_FLAG_FEC) ||
+        header[14] < 2 || header[14] > RS_MAX_PARITY) {
+        return 0;
+    }
+    message_layout layout = { MESSAGE_FORMAT_HEADER, header[14] };
+    return (size_t)read_be32(header + 6) <= message_capacity(pixel_bytes, depth, &layout);
+}
+
+/**
+ * Extracts a payload stored with error correction: votes the header copies, repairs the blocks and
+ * checks the CRC of the result.
+ *
+ * @param frame The image rows.
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param info The decoder findings to fill in.
+ * @return The payload followed by a terminating zero (free with free()), or NULL if there is no
+ *         protected payload.
+ */
+char *extract_fec_payload(const steg_frame *frame, const steg_scatter *scatter, message_info *info) {
+    unsigned char header[STEG_FEC_HEADER_BYTES];
+    if (!read_fec_header(frame, scatter, header)) {
+        return NULL;
+    }
+
+    message_layout layout = { MESSAGE_FORMAT_HEADER, header[14] };
+    size_t payload_len = (size_t)read_be32(header + 6);
+    size_t coded_len = message_embedded_bytes(payload_len, &layout) - STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES;
+    unsigned char *coded = (unsigned char *)malloc(coded_len ? coded_len : 1);
+    char *payload = (char *)malloc(payload_len + 1);
+    if (!coded || !payload) {
+        printf("Memory allocation failed!\n");
+        free(coded);
+        free(payload);
+        return NULL;
+    }
+    frame_gather(scatter, frame, STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES, coded, coded_len);
+    int ok = rs_decode_payload(coded, payload_len, layout.fec_parity, &info->corrected);
+    if (ok) memcpy(payload, coded, payload_len);
+    free(coded);
+    if (!ok) {
+        free(payload);
+        return NULL;
+    }
+    payload[payload_len] = '\0';
+    info->length = payload_len;
+    info->checksum_ok = crc32c(crc32c(0, header + 4, 6), (const unsigned char *)payload, payload_len) == read_be32(header + 10);
+    info->fec_parity = layout.fec_parity;
+    if (!message_read_shard(header[5], (const unsigned char *)payload, info)) {
+        free(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+/**
+ * Extracts a framed payload, with or without error correction, and decrypts it if it is encrypted.
+ *
+ * @param frame The image rows.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key and passphrase, or NULL.
+ * @param info The decoder findings to fill in.
+ * @return The payload followed by a terminating zero (free with free()), or NULL if the image has no
+ *         valid header, or if info->encrypted is set, an encrypted payload that cannot be decrypted.
+ */
+char *extract_header_message(const steg_frame *frame, int depth, const steg_secrets *secrets, message_info *info) {
+    size_t pixel_bytes = frame_bytes(frame);
+    unsigned char header[STEG_HEADER_BYTES];
+    char *plain = NULL;
+    message_info plain_info = { 0 };
+    steg_scatter scatter_state;
+    const steg_scatter *scatter = scatter_init(&scatter_state, secrets ? &secrets->key : NULL, pixel_bytes, depth);
+    char *payload = NULL;
+    memset(info, 0, sizeof(*info));
+    if (carrier_slots(pixel_bytes, depth) < STEG_HEADER_BYTES) return NULL;
+    frame_gather(scatter, frame, 0, header, STEG_HEADER_BYTES);
+    if (memcmp(header, steg_magic, 4) == 0 && header[4] == STEG_HEADER_VERSION && (header[5] & ~STEG_PLAIN_FLAGS) == 0) {
+        plain = extract_plain_payload(frame, scatter, header, &plain_info);
+        if (plain && plain_info.checksum_ok) {
+            *info = plain_info;
+            payload = plain;
+        }
+    }
+
+    if (!payload) {
+        // The first header copy may itself be damaged: try the voted header of a protected payload
+        message_info fec_info = { 0 };
+        char *fec = extract_fec_payload(frame, scatter, &fec_info);
+        if (fec && (fec_info.checksum_ok || !plain)) {
+            free(plain);
+            *info = fec_info;
+            payload = fec;
+        } else {
+            free(fec);
+            if (plain) *info = plain_info;
+            payload = plain;
+        }
+    }
+    if (payload) info->format = MESSAGE_FORMAT_HEADER;
+    if (payload && info->encrypted && !message_decrypt((unsigned char *)payload, secrets, info)) {
+        free(payload);
+        payload = NULL;
+    }
+    return payload;
+}
+
+/**
+ * Extracts a payload in either format: a valid header is used if present, the legacy end marker otherwise.
+ *
+ * @param frame The image rows.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key and passphrase, or NULL.
+ * @param info The decoder findings to fill in.
+ * @return The payload followed by a terminating zero (free with free()), or NULL if no message is found
+ *         or, if info->encrypted is set, the payload cannot be decrypted.
+ */
+char *extract_message_frame(const steg_frame *frame, int depth, const steg_secrets *secrets, message_info *info) {
+    size_t pixel_bytes = frame_bytes(frame);
+    char *payload = extract_header_message(frame, depth, secrets, info);
+    if (!payload && !info->encrypted) {
+        steg_scatter scatter;
+        memset(info, 0, sizeof(*info));
+        info->format = MESSAGE_FORMAT_LEGACY;
+        payload = extract_legacy_message(frame, scatter_init(&scatter, secrets ? &secrets->key : NULL, pixel_bytes, depth),
+                                         &info->checksum_ok);
+        if (payload) info->length = strlen(payload);
+    }
+    return payload;
+}
+
+/**
+ * Extracts a payload in either format from a packed image (see extract_message_frame).
+ *
+ * @param pixels The image data.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key and passphrase, or NULL.
+ * @param info The decoder findings to fill in.
+ * @return The payload followed by a terminating zero (free with free()), or NULL if no message is found
+ *         or, if info->encrypted is set, the payload cannot be decrypted.
+ */
+char *extract_message(const unsigned char *pixels, size_t pixel_bytes, int depth, const steg_secrets *secrets, message_info *info) {
+    steg_frame frame = frame_packed(pixels, pixel_bytes);
+    return extract_message_frame(&frame, depth, secrets, info);
+}
+
+/**
+ * Tells whether an image holds the header of a framed payload (or the voted header of a protected one),
+ * without extracting the payload.
+ *
+ * @param pixels The image data.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key, or NULL.
+ * @return 1 if a header is found, 0 otherwise.
+ */
+int message_header_found(const unsigned char *pixels, size_t pixel_bytes, int depth, const steg_secrets *secrets) {
+    unsigned char header[STEG_FEC_HEADER_BYTES];
+    steg_scatter scatter_state;
+    const steg_scatter *scatter = scatter_init(&scatter_state, secrets ? &secrets->key : NULL, pixel_bytes, depth);
+    steg_frame frame = frame_packed(pixels, pixel_bytes);
+    if (carrier_slots(pixel_bytes, depth) < STEG_HEADER_BYTES) return 0;
+    carrier_gather(scatter, pixels, 0, header, STEG_HEADER_BYTES);
+    if (memcmp(header, steg_magic, 4) == 0 && header[4] == STEG_HEADER_VERSION && (header[5] & ~STEG_PLAIN_FLAGS) == 0) {
+        return 1;
+    }
+    return read_fec_header(&frame, scatter, header);
+}
+
+// Streaming extraction: the payload goes to a file in chunks as it is recovered, so extracting it takes
+// the same memory whatever its size, and binary content is written exactly as it was embedded.
+
+// A byte that error correction repaired: the payload position and its corrected value
+typedef struct {
+    size_t position;
+    unsigned char value;
+} rs_correction;
+
+/**
+ * Orders corrections by payload position (qsort comparator).
+ */
+static int rs_correction_compare(const void *a, const void *b) {
+    size_t x = ((const rs_correction *)a)->position, y = ((const rs_correction *)b)->position;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Finds the repairs a protected payload needs without copying it out of the carriers: each strip of
+ * blocks is gathered, checked and, if damaged, decoded on its own. Memory use grows with the damage,
+ * not with the payload.
+ *
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param frame The image rows.
+ * @param offset The embedded byte position of the protected form (after the header copies).
+ * @param length The size of the payload.
+ * @param parity The number of check bytes per block.
+ * @param corrections A pointer to store the repairs to payload bytes, sorted by position (free with free()).
+ * @param count A pointer to store the number of repairs.
+ * @param corrected A pointer to store the number of bytes repaired, or -1 if a block was beyond repair.
+ * @return 1 on success, 0 on failure.
+ */
+int rs_find_corrections(const steg_scatter *scatter, const steg_frame *frame, size_t offset, size_t length, int parity, rs_correction **corrections,
+                        size_t *count, long *corrected) {
+    rs_layout layout = rs_layout_for(length, parity);
+    rs_codec *rs = rs_codec_create(parity);
+    if (!rs) return 0;
+    pthread_once(&rs_kernel_once, rs_kernel_select);
+    *corrections = NULL;
+    *count = 0;
+    *corrected = 0;
+
+    size_t capacity = 0;
+    int ok = 1;
+    unsigned char strip[255 * RS_STRIP], state[RS_MAX_PARITY * RS_STRIP], block[255], syndromes[RS_MAX_PARITY];
+    for (size_t b = 0; ok && b < layout.blocks; b += RS_STRIP) {
+        int width = layout.blocks - b < RS_STRIP ? (int)(layout.blocks - b) : RS_STRIP;
+        for (int j = 0; j < layout.block_len; j++) {
+            frame_gather(scatter, frame, offset + j * layout.blocks + b, strip + j * RS_STRIP, width);
+        }
+        memset(state, 0, (size_t)parity * RS_STRIP);
+        rs_syndrome_rows(rs, strip, RS_STRIP, layout.block_len, width, state);
+        for (int c = 0; ok && c < width; c++) {
+            unsigned char any = 0;
+            for (int i = 0; i < parity; i++) {
+                syndromes[i] = state[i * RS_STRIP + c];
+                any |= syndromes[i];
+            }
+            if (!any) continue;
+            for (int j = 0; j < layout.block_len; j++) {
+                block[j] = strip[j * RS_STRIP + c];
+            }
+            int fixed = rs_decode_block(rs, block, layout.block_len, syndromes);
+            if (fixed < 0) {
+                *corrected = -1;
+                continue;
+            }
+            if (*corrected >= 0) *corrected += fixed;
+            for (int j = 0; j < layout.data_len; j++) {
+                size_t position = j * layout.blocks + b + c;
+                if (block[j] == strip[j * RS_STRIP + c] || position >= length) continue;
+                if (*count == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    rs_correction *grown = (rs_correction *)realloc(*corrections, capacity * sizeof(rs_correction));
+                    if (!grown) {
+                        printf("Memory allocation failed!\n");
+                        ok = 0;
+                        break;
+                    }
+                    *corrections = grown;
+                }
+                (*corrections)[*count].position = position;
+                (*corrections)[*count].value = block[j];
+                (*count)++;
+            }
+        }
+    }
+    free(rs);
+    if (!ok) {
+        free(*corrections);
+        *corrections = NULL;
+        return 0;
+    }
+    if (*count) qsort(*corrections, *count, sizeof(rs_correction), rs_correction_compare);
+    return 1;
+}
+
+/**
+ * Streams payload bytes from carrier LSBs to a file in chunks, applying repairs, updating a checksum
+ * and, for an encrypted payload, decrypting them.
+ *
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param frame The image rows.
+ * @param offset The embedded byte position of the first byte to stream.
+ * @param base The payload position of that byte.
+ * @param length The number of bytes to stream.
+ * @param chunk A buffer of PAYLOAD_CHUNK_BYTES bytes; holds the last chunk afterwards.
+ * @param corrections Repairs sorted by payload position, or NULL.
+ * @param correction_count The number of repairs.
+ * @param format MESSAGE_FORMAT_HEADER to update a CRC32C, MESSAGE_FORMAT_LEGACY for the parity checksum.
+ * @param checksum The checksum of the preceding data; updated with the bytes as stored.
+ * @param aead The decryption state, or NULL to write the bytes as stored.
+ * @param plain_checksum With aead, a CRC32C updated with the decrypted bytes.
+ * @param out The output file, or NULL to compute the checksum only.
+ * @return 1 on success, 0 if writing fails.
+ */
+int stream_payload_bytes(const steg_scatter *scatter, const steg_frame *frame, size_t offset, size_t base, size_t length, unsigned char *chunk, const rs_correction *corrections,
+                         size_t correction_count, int format, uint32_t *checksum, steg_aead *aead, uint32_t *plain_checksum, FILE *out) {
+    size_t next = 0;
+    while (next < correction_count && corrections[next].position < base) next++;
+    for (size_t done = 0; done < length;) {
+        size_t count = length - done < PAYLOAD_CHUNK_BYTES ? length - done : PAYLOAD_CHUNK_BYTES;
+        frame_gather(scatter, frame, offset + done, chunk, count);
+        for (; next < correction_count && corrections[next].position < base + done + count; next++) {
+            chunk[corrections[next].position - base - done] = corrections[next].value;
+        }
+        if (format == MESSAGE_FORMAT_LEGACY) *checksum ^= legacy_checksum((const char *)chunk, count);
+        else *checksum = crc32c(*checksum, chunk, count);
+        if (aead) {
+            aead_decrypt(aead, chunk, chunk, count);
+            *plain_checksum = crc32c(*plain_checksum, chunk, count);
+        }
+        if (out && fwrite(chunk, 1, count, out) != count) return 0;
+        done += count;
+    }
+    return 1;
+}
+
+/**
+ * Streams a framed payload (info->length bytes) to a file and checks its CRC. The shard record of a
+ * shard is not written; with place_shard the piece is written at its offset in the whole payload. An
+ * encrypted payload is authenticated before anything is written: a first pass decrypts it only to
+ * check the tag (and the CRCs), a second one decrypts it to the file.
+ *
+ * @param scatter The carriers, or NULL for sequential carriers in 8-bit samples.
+ * @param frame The image rows.
+ * @param offset The embedded byte position of the first payload byte.
+ * @param header The header (its flags and CRC are used).
+ * @param chunk A buffer of PAYLOAD_CHUNK_BYTES bytes.
+ * @param corrections Repairs sorted by position, or NULL.
+ * @param correction_count The number of repairs.
+ * @param secrets The secrets (the passphrase decrypts), or NULL.
+ * @param out The output file.
+ * @param place_shard 1 to seek to a shard's offset before writing its piece (a payload that is not a
+ *                    shard is then not written).
+ * @param info The decoder findings to update.
+ * @return 1 on success, 0 if the payload is not a usable shard, or cannot be decrypted or authenticated,
+ *         -1 if writing fails.
+ */
+int stream_framed_payload(const steg_scatter *scatter, const steg_frame *frame, size_t offset, const unsigned char *header, unsigned char *chunk,
+                          const rs_correction *corrections, size_t correction_count, const steg_secrets *secrets, FILE *out, int place_shard,
+                          message_info *info) {
+    uint32_t crc = crc32c(0, header + 4, 6);
+    size_t skip = 0, end = info->length;
+    info->sharded = (header[5] & STEG_FLAG_SHARD) != 0;
+    info->encrypted = (header[5] & STEG_FLAG_ENCRYPTED) != 0;
+    if (place_shard && !info->sharded) return 0;
+    if (!info->encrypted) {
+        if (info->sharded) {
+            if (end < STEG_SHARD_BYTES) return 0;
+            stream_payload_bytes(scatter, frame, offset, 0, STEG_SHARD_BYTES, chunk, corrections, correction_count, MESSAGE_FORMAT_HEADER, &crc,
+                                 NULL, NULL, NULL);
+            shard_decode(chunk, &info->shard);
+            skip = STEG_SHARD_BYTES;
+            if (place_shard && steg_fseek(out, (steg_off_t)info->shard.offset, SEEK_SET) != 0) return -1;
+        }
+        uint32_t piece_crc = 0;
+        int ok = stream_payload_bytes(scatter, frame, offset + skip, skip, end - skip, chunk, corrections, correction_count, MESSAGE_FORMAT_HEADER,
+                                      &piece_crc, NULL, NULL, out);
+        info->shard_crc = piece_crc;
+        info->checksum_ok = crc32c_combine(crc, piece_crc, end - skip) == read_be32(header + 10);
+        return ok ? 1 : -1;
+    }
+
+    steg_aead aead, check;
+    unsigned char tag[POLY1305_TAG_BYTES];
+    uint32_t plain_crc = 0, unused = 0;
+    size_t start = STEG_CRYPTO_RECORD_BYTES, records = info->sharded ? STEG_SHARD_BYTES : 0;
+    if (end < STEG_CRYPTO_OVERHEAD + records) return 0;
+    end -= POLY1305_TAG_BYTES;
+    stream_payload_bytes(scatter, frame, offset, 0, start, chunk, corrections, correction_count, MESSAGE_FORMAT_HEADER, &crc, NULL, NULL, NULL);
+    if (!message_open(secrets, chunk, &aead)) return 0;
+    check = aead;
+    if (records) {
+        stream_payload_bytes(scatter, frame, offset + start, start, records, chunk, corrections, correction_count, MESSAGE_FORMAT_HEADER, &crc,
+                             &check, &unused, NULL);
+        shard_decode(chunk, &info->shard);
+    }
+    stream_payload_bytes(scatter, frame, offset + start + records, start + records, end - start - records, chunk, corrections, correction_count,
+                         MESSAGE_FORMAT_HEADER, &crc, &check, &plain_crc, NULL);
+    stream_payload_bytes(scatter, frame, offset + end, end, POLY1305_TAG_BYTES, chunk, corrections, correction_count, MESSAGE_FORMAT_HEADER, &crc,
+                         NULL, NULL, NULL);
+    aead_finish(&check, tag);
+    info->authentic = aead_tag_equal(tag, chunk);
+    info->checksum_ok = crc == read_be32(header + 10);
+    info->shard_crc = plain_crc;
+    info->length = end - start;
+    if (!info->authentic) return 0;
+
+    if (records) {
+        stream_payload_bytes(scatter, frame, offset + start, start, records, chunk, corrections, correction_count, MESSAGE_FORMAT_HEADER, &unused,
+                             &aead, &unused, NULL);
+        if (place_shard && steg_fseek(out, (steg_off_t)info->shard.offset, SEEK_SET) != 0) return -1;
+    }
+    return stream_payload_bytes(scatter, frame, offset + start + records, start + records, end - start - records, chunk, corrections,
+                                correction_count, MESSAGE_FORMAT_HEADER, &unused, &aead, &unused, out) ? 1 : -1;
+}
+
+/**
+ * Extracts a payload in either format and writes it to a file as it is recovered, in chunks. The
+ * format is detected like extract_message() does. The payload is written before its checksum is
+ * known, so the result of the check is only reported in info. A shard's record is read into info and
+ * only its piece of the payload is written. An encrypted payload is written decrypted, and only once
+ * its tag has been checked.
+ *
+ * @param frame The image rows.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key and passphrase, or NULL.
+ * @param out The output file.
+ * @param place_shard 1 to write a shard's piece at its offset in the whole payload (for reassembly);
+ *                    nothing is written for an image that holds no shard.
+ * @param info The decoder findings to fill in.
+ * @return 1 on success, 0 if no message (or no shard) is found or, if info->encrypted is set, the payload
+ *         cannot be decrypted, -1 on a write or allocation failure.
+ */
+int extract_message_to_file_frame(const steg_frame *frame, int depth, const steg_secrets *secrets, FILE *out, int place_shard,
+                                  message_info *info) {
+    size_t pixel_bytes = frame_bytes(frame);
+    unsigned char header[STEG_HEADER_BYTES], fec_header[STEG_FEC_HEADER_BYTES];
+    message_layout plain_layout = { MESSAGE_FORMAT_HEADER, 0 };
+    steg_scatter scatter_state;
+    const steg_scatter *scatter = scatter_init(&scatter_state, secrets ? &secrets->key : NULL, pixel_bytes, depth);
+    size_t slots = carrier_slots(pixel_bytes, depth);
+    memset(info, 0, sizeof(*info));
+    unsigned char *chunk = (unsigned char *)malloc(PAYLOAD_CHUNK_BYTES);
+    if (!chunk) {
+        printf("Memory allocation failed!\n");
+        return -1;
+    }
+
+    int plain = 0;
+    uint32_t crc;
+    if (slots >= STEG_HEADER_BYTES) {
+        frame_gather(scatter, frame, 0, header, STEG_HEADER_BYTES);
+        plain = memcmp(header, steg_magic, 4) == 0 && header[4] == STEG_HEADER_VERSION && (header[5] & ~STEG_PLAIN_FLAGS) == 0 &&
+                (size_t)read_be32(header + 6) <= message_capacity(pixel_bytes, depth, &plain_layout);
+    }
+    int fec = read_fec_header(frame, scatter, fec_header);
+    if (plain && fec) {
+        // The first copy of a protected header may have lost its flag: a plain payload must also match its CRC
+        crc = crc32c(0, header + 4, 6);
+        stream_payload_bytes(scatter, frame, STEG_HEADER_BYTES, 0, read_be32(header + 6), chunk, NULL, 0, MESSAGE_FORMAT_HEADER, &crc, NULL, NULL, NULL);
+        plain = crc == read_be32(header + 10);
+    }
+
+    int result = 1;
+    if (plain) {
+        info->length = read_be32(header + 6);
+        info->format = MESSAGE_FORMAT_HEADER;
+        result = stream_framed_payload(scatter, frame, STEG_HEADER_BYTES, header, chunk, NULL, 0, secrets, out, place_shard, info);
+    } else if (!fec) {
+        // Legacy format: the bytes before the checksum that precedes the first 00000111 byte
+        size_t k = find_legacy_marker(frame, scatter);
+        if (k == 0 || k == slots || place_shard) {
+            result = 0;
+        } else {
+            uint32_t checksum = 0;
+            unsigned char embedded;
+            info->length = k - 1;
+            info->format = MESSAGE_FORMAT_LEGACY;
+            if (!stream_payload_bytes(scatter, frame, 0, 0, k - 1, chunk, NULL, 0, MESSAGE_FORMAT_LEGACY, &checksum, NULL, NULL, out)) {
+                result = -1;
+            }
+            frame_gather(scatter, frame, k - 1, &embedded, 1);
+            info->checksum_ok = embedded == checksum;
+        }
+    } else {
+        rs_correction *corrections;
+        size_t correction_count;
+        size_t offset = STEG_FEC_HEADER_BYTES * STEG_FEC_HEADER_COPIES;
+        info->length = read_be32(fec_header + 6);
+        info->format = MESSAGE_FORMAT_HEADER;
+        info->fec_parity = fec_header[14];
+        if (!rs_find_corrections(scatter, frame, offset, info->length, info->fec_parity, &corrections, &correction_count, &info->corrected)) {
+            result = -1;
+        } else {
+            result = stream_framed_payload(scatter, frame, offset, fec_header, chunk, corrections, correction_count, secrets, out, place_shard, info);
+            free(corrections);
+        }
+    }
+    free(chunk);
+    return result;
+}
+
+/**
+ * Extracts a payload in either format from a packed image to a file (see extract_message_to_file_frame).
+ *
+ * @param pixels The image data.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key and passphrase, or NULL.
+ * @param out The output file.
+ * @param place_shard 1 to write a shard's piece at its offset in the whole payload.
+ * @param info The decoder findings to fill in.
+ * @return 1 on success, 0 if no message (or no shard) is found or the payload cannot be decrypted, -1 on
+ *         a write or allocation failure.
+ */
+int extract_message_to_file(const unsigned char *pixels, size_t pixel_bytes, int depth, const steg_secrets *secrets, FILE *out, int place_shard,
+                            message_info *info) {
+    steg_frame frame = frame_packed(pixels, pixel_bytes);
+    return extract_message_to_file_frame(&frame, depth, secrets, out, place_shard, info);
+}
+
+/**
+ * Returns the number of online processors, used as the default worker count.
+ *
+ * @return The processor count (at least 1).
+ */
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+/**
+ * Returns a monotonic timestamp in seconds, used for batch timing reports.
+ *
+ * @return The current time in seconds.
+ */
+double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Work-stealing task scheduler used by batch mode.
+// Every worker owns a deque: it pushes and pops its own tasks at the tail (newest first, cache-warm)
+// while idle workers steal from the head (oldest first, usually the largest remaining work).
+typedef struct steg_scheduler steg_scheduler;
+typedef void (*steg_task_fn)(steg_scheduler *scheduler, void *context, int begin, int end);
+
+typedef struct {
+    steg_task_fn fn;
+    void *context;
+    int begin;  // Task-specific range, e.g. the first row of a band
+    int end;
+} steg_task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    steg_task *tasks;  // Ring buffer indexed modulo capacity
+    size_t head;       // Steal end
+    size_t tail;       // Owner end
+    size_t capacity;
+} steg_deque;
+
+struct steg_scheduler {
+    int worker_count;
+    steg_deque *deques;
+    pthread_t *threads;
+    atomic_int pending;      // Spawned tasks that have not finished yet
+    atomic_int queued;       // Tasks sitting in a deque, waiting to be picked up
+    atomic_uint next_deque;  // Round-robin target for tasks submitted from outside the pool
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+static _Thread_local int steg_worker_id = -1;
+
+/**
+ * Pushes a task onto the owner end of a deque, growing the ring buffer if it is full.
+ *
+ * @param deque The deque to push onto.
+ * @param task The task to push.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int deque_push(steg_deque *deque, steg_task task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head == deque->capacity) {
+        size_t new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+        steg_task *grown = (steg_task *)malloc(new_capacity * sizeof(steg_task));
+        if (!grown) {
+            pthread_mutex_unlock(&deque->lock);
+            return 0;
+        }
+        // Unwrap the ring so the oldest task lands at index 0
+        size_t count = deque->tail - deque->head;
+        for (size_t i = 0; i < count; i++) {
+            grown[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = grown;
+        deque->capacity = new_capacity;
+        deque->head = 0;
+        deque->tail = count;
+    }
+    deque->tasks[deque->tail % deque->capacity] = task;
+    deque->tail++;
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+/**
+ * Takes a task from a deque, either the newest (owner) or the oldest (thief).
+ *
+ * @param deque The deque to take from.
+ * @param steal Non-zero to take from the head as a thief, zero to pop from the tail as the owner.
+ * @param task Receives the task.
+ * @return 1 if a task was taken, 0 if the deque was empty.
+ */
+int deque_take(steg_deque *deque, int steal, steg_task *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        if (steal) {
+            *task = deque->tasks[deque->head % deque->capacity];
+            deque->head++;
+        } else {
+            deque->tail--;
+            *task = deque->tasks[deque->tail % deque->capacity];
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/**
+ * Spawns a task. Workers push onto their own deque; other threads distribute round-robin.
+ *
+ * @param scheduler The scheduler.
+ * @param fn The task function.
+ * @param context The task context.
+ * @param begin Task-specific range start.
+ * @param end Task-specific range end.
+ * @return 1 on success, 0 if the task could not be queued.
+ */
+int scheduler_spawn(steg_scheduler *scheduler, steg_task_fn fn, void *context, int begin, int end) {
+    steg_task task = { fn, context, begin, end };
+    int target = steg_worker_id >= 0 ? steg_worker_id
+                                     : (int)(atomic_fetch_add(&scheduler->next_deque, 1) % scheduler->worker_count);
+
+    atomic_fetch_add(&scheduler->pending, 1);
+    if (!deque_push(&scheduler->deques[target], task)) {
+        atomic_fetch_sub(&scheduler->pending, 1);
+        printf("Memory allocation failed!\n");
+        return 0;
+    }
+    atomic_fetch_add(&scheduler->queued, 1);
+
+    // Wake a sleeping worker; taking the lock orders this with a worker about to sleep
+    pthread_mutex_lock(&scheduler->idle_lock);
+    pthread_cond_signal(&scheduler->idle_cond);
+    pthread_mutex_unlock(&scheduler->idle_lock);
+    return 1;
+}
+
+/**
+ * Finds the next task for a worker: its own newest task first, otherwise a steal from a victim.
+ *
+ * @param scheduler The scheduler.
+ * @param worker The worker index.
+ * @param seed The worker's random state for victim selection.
+ * @param task Receives the task.
+ * @return 1 if a task was found, 0 otherwise.
+ */
+int scheduler_find_task(steg_scheduler *scheduler, int worker, unsigned int *seed, steg_task *task) {
+    if (deque_take(&scheduler->deques[worker], 0, task)) {
+        return 1;
+    }
+
+    // Start at a random victim so thieves don't all hammer the same deque
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    int start = (int)(*seed % scheduler->worker_count);
+    for (int i = 0; i < scheduler->worker_count; i++) {
+        int victim = (start + i) % scheduler->worker_count;
+        if (victim != worker && deque_take(&scheduler->deques[victim], 1, task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Runs the worker loop until every spawned task (including tasks spawned by tasks) has finished.
+ *
+ * @param scheduler The scheduler.
+ * @param worker The worker index.
+ */
+void scheduler_work(steg_scheduler *scheduler, int worker) {
+    unsigned int seed = 2463534242u + (unsigned int)worker * 7919u;
+    steg_task task;
+
+    steg_worker_id = worker;
+    while (1) {
+        if (scheduler_find_task(scheduler, worker, &seed, &task)) {
+            atomic_fetch_sub(&scheduler->queued, 1);
+            task.fn(scheduler, task.context, task.begin, task.end);
+            if (atomic_fetch_sub(&scheduler->pending, 1) == 1) {
+                // Last task of the batch: release every sleeping worker
+                pthread_mutex_lock(&scheduler->idle_lock);
+                pthread_cond_broadcast(&scheduler->idle_cond);
+                pthread_mutex_unlock(&scheduler->idle_lock);
+            }
+            continue;
+        }
+        if (atomic_load(&scheduler->pending) == 0) {
+            break;
+        }
+        pthread_mutex_lock(&scheduler->idle_lock);
+        while (atomic_load(&scheduler->queued) == 0 && atomic_load(&scheduler->pending) > 0) {
+            pthread_cond_wait(&scheduler->idle_cond, &scheduler->idle_lock);
+        }
+        pthread_mutex_unlock(&scheduler->idle_lock);
+    }
+    steg_worker_id = -1;
+}
+
+typedef struct {
+    steg_scheduler *scheduler;
+    int worker;
+} steg_worker_arg;
+
+/**
+ * Thread entry point for scheduler workers.
+ *
+ * @param arg A steg_worker_arg.
+ * @return Always NULL.
+ */
+void *scheduler_thread_main(void *arg) {
+    steg_worker_arg *worker_arg = (steg_worker_arg *)arg;
+    scheduler_work(worker_arg->scheduler, worker_arg->worker);
+    return NULL;
+}
+
+/**
+ * Initializes a scheduler with the given number of workers (the calling thread becomes worker 0).
+ *
+ * @param scheduler The scheduler to initialize.
+ * @param worker_count The number of workers.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int scheduler_init(steg_scheduler *scheduler, int worker_count) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->worker_count = worker_count > 0 ? worker_count : 1;
+    scheduler->deques = (steg_deque *)calloc(scheduler->worker_count, sizeof(steg_deque));
+    scheduler->threads = (pthread_t *)calloc(scheduler->worker_count, sizeof(pthread_t));
+    if (!scheduler->deques || !scheduler->threads) {
+        printf("Memory allocation failed!\n");
+        free(scheduler->deques);
+        free(scheduler->threads);
+        return 0;
+    }
+    for (int i = 0; i < scheduler->worker_count; i++) {
+        pthread_mutex_init(&scheduler->deques[i].lock, NULL);
+    }
+    atomic_init(&scheduler->pending, 0);
+    atomic_init(&scheduler->queued, 0);
+    atomic_init(&scheduler->next_deque, 0);
+    pthread_mutex_init(&scheduler->idle_lock, NULL);
+    pthread_cond_init(&scheduler->idle_cond, NULL);
+    return 1;
+}
+
+/**
+ * Runs all spawned tasks to completion on the worker pool, using the calling thread as worker 0.
+ *
+ * @param scheduler The scheduler.
+ */
+void scheduler_run(steg_scheduler *scheduler) {
+    steg_worker_arg *args = (steg_worker_arg *)calloc(scheduler->worker_count, sizeof(steg_worker_arg));
+    int started = 1;
+
+    for (int i = 1; args && i < scheduler->worker_count; i++) {
+        args[i].scheduler = scheduler;
+        args[i].worker = i;
+        if (pthread_create(&scheduler->threads[i], NULL, scheduler_thread_main, &args[i]) != 0) {
+            printf("Warning: Could only start %d worker threads.\n", i);
+            break;
+        }
+        started++;
+    }
+    scheduler_work(scheduler, 0);
+    for (int i = 1; i < started; i++) {
+        pthread_join(scheduler->threads[i], NULL);
+    }
+    free(args);
+}
+
+/**
+ * Releases the resources held by a scheduler.
+ *
+ * @param scheduler The scheduler.
+ */
+void scheduler_destroy(steg_scheduler *scheduler) {
+    for (int i = 0; i < scheduler->worker_count; i++) {
+        pthread_mutex_destroy(&scheduler->deques[i].lock);
+        free(scheduler->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&scheduler->idle_lock);
+    pthread_cond_destroy(&scheduler->idle_cond);
+    free(scheduler->deques);
+    free(scheduler->threads);
+}
+
+// PNG encoding settings. They travel with each job instead of living in stb_image_write's globals
+// (stbi_write_png_compression_level / stbi_write_force_png_filter), so concurrent jobs can use different profiles.
+#define PNG_FILTER_ADAPTIVE -1   // Try all five filters per row and keep the cheapest (stb_image_write's default)
+#define PNG_LEVEL_STORE 0        // Stored (uncompressed) deflate blocks
+
+// Deflate implementations. zlib is compiled in with -DSTEG_USE_ZLIB (see the Makefile) and links the
+// system library; stb_image_write's built-in compressor is always available as the fallback.
+#define DEFLATE_AUTO 0        // The fastest compiled-in backend
+#define DEFLATE_BUILTIN 1     // stbi_zlib_compress
+#define DEFLATE_ZLIB 2
+
+typedef struct {
+    int compression_level;  // 0 = store only, otherwise the effort: stb quality, capped at 9 for zlib
+    int filter;             // PNG_FILTER_ADAPTIVE or a fixed filter 0-4 (None, Sub, Up, Average, Paeth)
+    int deflate_backend;    // DEFLATE_* value
+} png_write_options;
+
+static const png_write_options PNG_PROFILE_DEFAULT = { 8, PNG_FILTER_ADAPTIVE, DEFLATE_AUTO };
+static const png_write_options PNG_PROFILE_FAST = { 1, 1, DEFLATE_AUTO };       // Cheapest compressor, Sub filter
+static const png_write_options PNG_PROFILE_ARCHIVE = { 32, PNG_FILTER_ADAPTIVE, DEFLATE_AUTO };  // Maximum effort
+static const png_write_options PNG_PROFILE_STORE = { PNG_LEVEL_STORE, 0, DEFLATE_AUTO };
+
+/**
+ * Returns the backend that DEFLATE_AUTO resolves to in this build.
+ *
+ * @return The fastest compiled-in DEFLATE_* backend.
+ */
+int deflate_default_backend(void) {
+#if defined(STEG_USE_ZLIB)
+    return DEFLATE_ZLIB;
+#else
+    return DEFLATE_BUILTIN;
+#endif
+}
+
+/**
+ * Returns a printable name for a deflate backend.
+ *
+ * @param backend A DEFLATE_* value.
+ * @return The backend name.
+ */
+const char *deflate_backend_name(int backend) {
+    switch (backend == DEFLATE_AUTO ? deflate_default_backend() : backend) {
+        case DEFLATE_ZLIB: return "zlib";
+        default: return "builtin";
+    }
+}
+
+/**
+ * Applies one of the PNG encoding options (--png-level, --png-filter, --png-profile).
+ *
+ * @param name The option name.
+ * @param value The option value.
+ * @param options The options to update.
+ * @return 1 if the option was applied, 0 if it is not a PNG option, -1 if the value is invalid.
+ */
+int png_parse_option(const char *name, const char *value, png_write_options *options) {
+    static const char *filter_names[5] = { "none", "sub", "up", "average", "paeth" };
+
+    if (strcmp(name, "--png-level") == 0) {
+        char *end;
+        long level = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || level < 0 || level > 64) {
+            printf("ERROR: --png-level must be between 0 (store only) and 64.\n");
+            return -1;
+        }
+        options->compression_level = (int)level;
+        return 1;
+    }
+    if (strcmp(name, "--png-filter") == 0) {
+        if (strcmp(value, "adaptive") == 0) {
+            options->filter = PNG_FILTER_ADAPTIVE;
+            return 1;
+        }
+        for (int i = 0; i < 5; i++) {
+            if (strcmp(value, filter_names[i]) == 0 || (i == 3 && strcmp(value, "avg") == 0)) {
+                options->filter = i;
+                return 1;
+            }
+        }
+        printf("ERROR: --png-filter must be adaptive, none, sub, up, average or paeth.\n");
+        return -1;
+    }
+    if (strcmp(name, "--png-profile") == 0) {
+        int backend = options->deflate_backend;  // Profiles choose the effort, not the implementation
+        if (strcmp(value, "default") == 0) *options = PNG_PROFILE_DEFAULT;
+        else if (strcmp(value, "fast") == 0) *options = PNG_PROFILE_FAST;
+        else if (strcmp(value, "archive") == 0) *options = PNG_PROFILE_ARCHIVE;
+        else if (strcmp(value, "store") == 0) *options = PNG_PROFILE_STORE;
+        else {
+            printf("ERROR: --png-profile must be default, fast, archive or store.\n");
+            return -1;
+        }
+        options->deflate_backend = backend;
+        return 1;
+    }
+    if (strcmp(name, "--deflate") == 0) {
+        if (strcmp(value, "auto") == 0) options->deflate_backend = DEFLATE_AUTO;
+        else if (strcmp(value, "builtin") == 0) options->deflate_backend = DEFLATE_BUILTIN;
+#ifdef STEG_USE_ZLIB
+        else if (strcmp(value, "zlib") == 0) options->deflate_backend = DEFLATE_ZLIB;
+#endif
+        else {
+            printf("ERROR: --deflate must be auto, builtin%s (zlib needs a build with USE_ZLIB=1).\n",
+#ifdef STEG_USE_ZLIB
+                   " or zlib"
+#else
+                   ""
+#endif
+            );
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// PNG filter kernels for the encoder. Filtering reads only unfiltered pixels, so every filter type
+// vectorizes across the whole row; each kernel also returns stb_image_write's adaptive score, the sum of
+// the filtered bytes' magnitudes as signed chars. The first row is filtered against a zero row, which
+// gives exactly stb's first-row mapping (Up -> None, Average -> a/2, Paeth -> Sub).
+typedef int (*png_filter_fn)(int type, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp, signed char *out);
+
+/**
+ * Filters one byte.
+ *
+ * @param type The filter type (0-4).
+ * @param x The byte.
+ * @param a The byte one pixel to the left (0 for the first pixel).
+ * @param b The byte above.
+ * @param c The byte above and to the left (0 for the first pixel).
+ * @return The filtered byte.
+ */
+static inline int png_filter_byte(int type, int x, int a, int b, int c) {
+    switch (type) {
+        case 0: return x;
+        case 1: return x - a;
+        case 2: return x - b;
+        case 3: return x - ((a + b) >> 1);
+        default: return x - stbiw__paeth(a, b, c);
+    }
+}
+
+/**
+ * Filters bytes [begin, end) of a row with scalar code.
+ *
+ * @param type The filter type (0-4).
+ * @param row The unfiltered row.
+ * @param prior The unfiltered row above (all zeros for the first row).
+ * @param begin The first byte.
+ * @param end One past the last byte.
+ * @param bpp The number of bytes per pixel.
+ * @param out The filtered row.
+ * @return The adaptive score of the filtered bytes.
+ */
+static inline int png_filter_span_scalar(int type, const unsigned char *row, const unsigned char *prior, int begin, int end, int bpp, signed char *out) {
+    int score = 0;
+    for (int i = begin; i < end; i++) {
+        int a = i >= bpp ? row[i - bpp] : 0, c = i >= bpp ? prior[i - bpp] : 0;
+        out[i] = (signed char)png_filter_byte(type, row[i], a, prior[i], c);
+        score += abs(out[i]);
+    }
+    return score;
+}
+
+/**
+ * Filters one row with scalar code (the reference for the SIMD kernels).
+ *
+ * @param type The filter type (0-4).
+ * @param row The unfiltered row.
+ * @param prior The unfiltered row above (all zeros for the first row).
+ * @param row_bytes The number of bytes per row.
+ * @param bpp The number of bytes per pixel.
+ * @param out The filtered row.
+ * @return The adaptive score of the row.
+ */
+int png_filter_row_scalar(int type, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp, signed char *out) {
+    return png_filter_span_scalar(type, row, prior, 0, row_bytes, bpp, out);
+}
+
+#if defined(STEG_HAVE_SSE2)
+/**
+ * Paeth predictor on eight 16-bit lanes, ties going to a, then b (as stbiw__paeth).
+ *
+ * @param a The bytes to the left.
+ * @param b The bytes above.
+ * @param c The bytes above and to the left.
+ * @return The predictors.
+ */
+static inline __m128i paeth_epi16_sse2(__m128i a, __m128i b, __m128i c) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i use_a = _mm_cmpeq_epi16(smallest, pa), use_b = _mm_cmpeq_epi16(smallest, pb);
+    __m128i b_or_c = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+    return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, b_or_c));
+}
+
+/**
+ * Filters one row 16 bytes at a time with SSE2.
+ *
+ * @param type The filter type (0-4).
+ * @param row The unfiltered row.
+ * @param prior The unfiltered row above (all zeros for the first row).
+ * @param row_bytes The number of bytes per row.
+ * @param bpp The number of bytes per pixel.
+ * @param out The filtered row.
+ * @return The adaptive score of the row.
+ */
+static int png_filter_row_sse2(int type, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp, signed char *out) {
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+    __m128i sum = zero;
+    int i = bpp < row_bytes ? bpp : row_bytes;
+    int score = png_filter_span_scalar(type, row, prior, 0, i, bpp, out);  // The first pixel has no left neighbour
+
+    for (; i + 16 <= row_bytes; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(row + i)), d;
+        __m128i a = _mm_loadu_si128((const __m128i *)(row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prior + i));
+        switch (type) {
+            case 0: d = x; break;
+            case 1: d = _mm_sub_epi8(x, a); break;
+            case 2: d = _mm_sub_epi8(x, b); break;
+            case 3: d = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one))); break;
+            default: {
+                __m128i c = _mm_loadu_si128((const __m128i *)(prior + i - bpp));
+                __m128i lo = paeth_epi16_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+                __m128i hi = paeth_epi16_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+                d = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+            }
+        }
+        _mm_storeu_si128((__m128i *)(out + i), d);
+        // |d| as a signed byte is min(d, -d) as unsigned bytes, also for -128
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_min_epu8(d, _mm_sub_epi8(zero, d)), zero));
+    }
+    score += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+    return score + png_filter_span_scalar(type, row, prior, i, row_bytes, bpp, out);
+}
+#endif
+
+#ifdef STEG_HAVE_X86_DISPATCH
+/**
+ * Paeth predictor on sixteen 16-bit lanes (AVX2 version of paeth_epi16_sse2).
+ *
+ * @param a The bytes to the left.
+ * @param b The bytes above.
+ * @param c The bytes above and to the left.
+ * @return The predictors.
+ */
+__attribute__((target("avx2"))) static inline __m256i paeth_epi16_avx2(__m256i a, __m256i b, __m256i c) {
+    __m256i pa = _mm256_sub_epi16(b, c), pb = _mm256_sub_epi16(a, c);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+    pa = _mm256_abs_epi16(pa);
+    pb = _mm256_abs_epi16(pb);
+    __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+    __m256i b_or_c = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb));
+    return _mm256_blendv_epi8(b_or_c, a, _mm256_cmpeq_epi16(smallest, pa));
+}
+
+/**
+ * Filters one row 32 bytes at a time with AVX2; only called when the CPU reports AVX2.
+ * The 8-to-16-bit unpacks and the pack work within 128-bit lanes, so byte order is preserved.
+ *
+ * @param type The filter type (0-4).
+ * @param row The unfiltered row.
+ * @param prior The unfiltered row above (all zeros for the first row).
+ * @param row_bytes The number of bytes per row.
+ * @param bpp The number of bytes per pixel.
+ * @param out The filtered row.
+ * @return The adaptive score of the row.
+ */
+__attribute__((target("avx2"))) static int png_filter_row_avx2(int type, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp, signed char *out) {
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+    __m256i sum = zero;
+    int i = bpp < row_bytes ? bpp : row_bytes;
+    int score = png_filter_span_scalar(type, row, prior, 0, i, bpp, out);
+
+    for (; i + 32 <= row_bytes; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(row + i)), d;
+        __m256i a = _mm256_loadu_si256((const __m256i *)(row + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prior + i));
+        switch (type) {
+            case 0: d = x; break;
+            case 1: d = _mm256_sub_epi8(x, a); break;
+            case 2: d = _mm256_sub_epi8(x, b); break;
+            case 3: d = _mm256_sub_epi8(x, _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one))); break;
+            default: {
+                __m256i c = _mm256_loadu_si256((const __m256i *)(prior + i - bpp));
+                __m256i lo = paeth_epi16_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+                __m256i hi = paeth_epi16_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+                d = _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi));
+            }
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), d);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_abs_epi8(d), zero));
+    }
+    __m128i sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    score += _mm_cvtsi128_si32(sum128) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum128, sum128));
+    return score + png_filter_span_scalar(type, row, prior, i, row_bytes, bpp, out);
+}
+#endif
+
+static png_filter_fn png_filter_kernel = png_filter_row_scalar;
+static const char *png_filter_isa = "scalar";
+static pthread_once_t png_filter_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the filter kernel for this CPU (called once).
+ */
+void png_filter_select(void) {
+#if defined(STEG_HAVE_SSE2)
+    png_filter_kernel = png_filter_row_sse2;
+    png_filter_isa = "sse2";
+#endif
+#ifdef STEG_HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        png_filter_kernel = png_filter_row_avx2;
+        png_filter_isa = "avx2";
+    }
+#endif
+}
+
+/**
+ * Returns the filter kernel for this CPU.
+ *
+ * @param name A pointer to store the instruction set name, or NULL.
+ * @return The kernel.
+ */
+png_filter_fn png_filter_kernel_for_cpu(const char **name) {
+    pthread_once(&png_filter_once, png_filter_select);
+    if (name) *name = png_filter_isa;
+    return png_filter_kernel;
+}
+
+/**
+ * Applies PNG filtering to a range of rows with a given kernel. The adaptive strategy chooses the filter
+ * per row the same way stb_image_write does: every filter is tried and the first lowest score wins.
+ * Rows only read their own and the previous row of the unfiltered image, so bands can run concurrently.
+ *
+ * @param kernel The filter kernel.
+ * @param pixels The unfiltered image data.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param bpp The bytes per pixel: the channel count, doubled for 16-bit samples (1 for indexed rows).
+ * @param filter PNG_FILTER_ADAPTIVE or a fixed filter type 0-4.
+ * @param row_begin The first row to filter.
+ * @param row_end One past the last row to filter.
+ * @param filtered The output buffer for the whole image ((width * bpp + 1) bytes per row).
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int png_filter_rows_with_kernel(png_filter_fn kernel, const unsigned char *pixels, int width, int height, int bpp, int filter, int row_begin, int row_end, unsigned char *filtered) {
+    int row_bytes = width * bpp;
+    (void)height;
+    // Two candidate buffers: the best row so far and the one being tried
+    signed char *candidates = (signed char *)malloc((size_t)row_bytes * 2);
+    unsigned char *zero_row = (unsigned char *)calloc(row_bytes ? row_bytes : 1, 1);
+    if (!candidates || !zero_row) {
+        printf("Memory allocation failed!\n");
+        free(candidates);
+        free(zero_row);
+        return 0;
+    }
+
+    for (int y = row_begin; y < row_end; y++) {
+        const unsigned char *row = pixels + (size_t)y * row_bytes;
+        const unsigned char *prior = y ? row - row_bytes : zero_row;
+        unsigned char *out = filtered + (size_t)y * (row_bytes + 1);
+        if (filter != PNG_FILTER_ADAPTIVE) {
+            out[0] = (unsigned char)filter;
+            kernel(filter, row, prior, row_bytes, bpp, (signed char *)out + 1);
+            continue;
+        }
+        signed char *best = candidates, *trial = candidates + row_bytes;
+        int best_filter = 0, best_score = kernel(0, row, prior, row_bytes, bpp, best);
+        for (int filter_type = 1; filter_type < 5; filter_type++) {
+            int score = kernel(filter_type, row, prior, row_bytes, bpp, trial);
+            if (score < best_score) {
+                signed char *swap = best;
+                best = trial;
+                trial = swap;
+                best_score = score;
+                best_filter = filter_type;
+            }
+        }
+        out[0] = (unsigned char)best_filter;
+        memcpy(out + 1, best, row_bytes);
+    }
+    free(candidates);
+    free(zero_row);
+    return 1;
+}
+
+/**
+ * Applies PNG filtering to a range of rows with the fastest kernel for this CPU.
+ * The output is identical to stb_image_write's for the same filter choice.
+ *
+ * @param pixels The unfiltered image data.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param bpp The bytes per pixel: the channel count, doubled for 16-bit samples (1 for indexed rows).
+ * @param filter PNG_FILTER_ADAPTIVE or a fixed filter type 0-4.
+ * @param row_begin The first row to filter.
+ * @param row_end One past the last row to filter.
+ * @param filtered The output buffer for the whole image ((width * bpp + 1) bytes per row).
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int png_filter_rows(const unsigned char *pixels, int width, int height, int bpp, int filter, int row_begin, int row_end, unsigned char *filtered) {
+    return png_filter_rows_with_kernel(png_filter_kernel_for_cpu(NULL), pixels, width, height, bpp, filter, row_begin, row_end, filtered);
+}
+
+/**
+ * Updates an Adler-32 checksum (as zlib streams end with) with more data.
+ *
+ * @param adler The checksum so far (1 for no data).
+ * @param data The data.
+ * @param len The length of the data.
+ * @return The updated checksum.
+ */
+unsigned int adler32_update(unsigned int adler, const unsigned char *data, size_t len) {
+    // Reduced every 5552 bytes, before the sums can overflow
+    unsigned int s1 = adler & 0xFFFF, s2 = adler >> 16;
+    for (size_t i = 0; i < len;) {
+        size_t chunk_end = i + 5552 < len ? i + 5552 : len;
+        for (; i < chunk_end; i++) {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+/**
+ * Combines the Adler-32 checksums of two consecutive pieces of data into the checksum of both
+ * (zlib's adler32_combine).
+ *
+ * @param first The checksum of the first piece.
+ * @param second The checksum of the second piece.
+ * @param second_len The length of the second piece.
+ * @return The checksum of the first piece followed by the second.
+ */
+unsigned int adler32_combine_with(unsigned int first, unsigned int second, size_t second_len) {
+    unsigned int rem = (unsigned int)(second_len % 65521);
+    unsigned int s1 = first & 0xFFFF;
+    unsigned int s2 = (unsigned int)(((unsigned long long)rem * s1) % 65521);
+    s1 += (second & 0xFFFF) + 65521 - 1;
+    s2 += (first >> 16) + (second >> 16) + 65521 - rem;
+    if (s1 >= 65521) s1 -= 65521;
+    if (s1 >= 65521) s1 -= 65521;
+    if (s2 >= 65521 * 2) s2 -= 65521 * 2;
+    if (s2 >= 65521) s2 -= 65521;
+    return (s2 << 16) | s1;
+}
+
+/**
+ * Writes data as stored (uncompressed) deflate blocks of up to 65535 bytes.
+ *
+ * @param o Where to write the blocks (room for 5 bytes per block plus the data).
+ * @param data The data.
+ * @param data_len The length of the data.
+ * @param last 1 to mark the last block as the final one of the stream (an empty final block is written for no data).
+ * @return The position after the blocks.
+ */
+unsigned char *deflate_store_blocks(unsigned char *o, const unsigned char *data, int data_len, int last) {
+    if (data_len == 0 && !last) {
+        return o;
+    }
+    int offset = 0;
+    do {
+        int block_len = data_len - offset > 65535 ? 65535 : data_len - offset;
+        *o++ = (unsigned char)(last && offset + block_len == data_len);  // BFINAL, BTYPE = 00 (stored)
+        *o++ = (unsigned char)block_len;
+        *o++ = (unsigned char)(block_len >> 8);
+        *o++ = (unsigned char)~block_len;
+        *o++ = (unsigned char)(~block_len >> 8);
+        memcpy(o, data + offset, block_len);
+        o += block_len;
+        offset += block_len;
+    } while (offset < data_len);
+    return o;
+}
+
+/**
+ * Wraps data into a zlib stream of stored (uncompressed) deflate blocks.
+ *
+ * @param data The data.
+ * @param data_len The length of the data.
+ * @param out_len A pointer to store the length of the zlib stream.
+ * @return The zlib stream, or NULL if memory allocation failed.
+ */
+unsigned char *zlib_store(const unsigned char *data, int data_len, int *out_len) {
+    int block_count = data_len ? (data_len + 65534) / 65535 : 1;
+    unsigned char *out = (unsigned char *)malloc(2 + (size_t)block_count * 5 + data_len + 4);
+    if (!out) {
+        return NULL;
+    }
+
+    unsigned char *o = out;
+    *o++ = 0x78;  // Deflate, 32K window
+    *o++ = 0x01;  // FLEVEL = 0 (fastest), check bits
+    o = deflate_store_blocks(o, data, data_len, 1);
+    stbiw__wp32(o, adler32_update(1, data, data_len));
+    *out_len = (int)(o - out);
+    return out;
+}
+
+/**
+ * Compresses data into a zlib stream with the selected backend.
+ *
+ * @param data The data to compress.
+ * @param data_len The length of the data.
+ * @param compression_level 0 to store the data uncompressed, otherwise the effort.
+ * @param backend A DEFLATE_* value.
+ * @param out_len A pointer to store the length of the zlib stream.
+ * @return The zlib stream (free with free()), or NULL on failure.
+ */
+unsigned char *png_deflate(unsigned char *data, int data_len, int compression_level, int backend, int *out_len) {
+    if (compression_level == PNG_LEVEL_STORE) {
+        return zlib_store(data, data_len, out_len);
+    }
+    if (backend == DEFLATE_AUTO) {
+        backend = deflate_default_backend();
+    }
+
+#ifdef STEG_USE_ZLIB
+    if (backend == DEFLATE_ZLIB) {
+        uLongf bound = compressBound((uLong)data_len);
+        unsigned char *out = (unsigned char *)malloc(bound);
+        if (out && compress2(out, &bound, data, (uLong)data_len, compression_level > 9 ? 9 : compression_level) == Z_OK) {
+            *out_len = (int)bound;
+            return out;
+        }
+        free(out);
+        // Fall through to the built-in compressor
+    }
+#endif
+    return stbi_zlib_compress(data, data_len, out_len, compression_level);
+}
+
+// Banded deflate. Each band of the filtered scanlines is compressed on its own into a raw deflate
+// segment that ends on a byte boundary with no final block, so the segments concatenate into one stream
+// and the last band ends it. Each band is primed with the 32 KB of data before it, so matches still
+// reach across band edges. stbi_zlib_compress always writes a final block and pads it to a byte boundary
+// without saying how many bits it padded, so its output cannot be continued. The built-in backend bands
+// with deflate_band_builtin instead: the same matcher and fixed Huffman codes, ending each band the way
+// zlib's sync flush does.
+typedef struct {
+    unsigned char *data;  // The raw deflate segment
+    int len;              // Its size
+    int data_len;         // The uncompressed bytes it holds
+    unsigned int adler;   // Adler-32 of those bytes
+} deflate_segment;
+
+/**
+ * Tells whether a stream can be deflated in bands with these settings.
+ *
+ * @param compression_level 0 to store the data uncompressed, otherwise the effort.
+ * @param backend A DEFLATE_* value.
+ * @return 1 (every backend compiled in can band).
+ */
+int deflate_can_band(int compression_level, int backend) {
+    (void)compression_level;
+    (void)backend;
+    return 1;
+}
+
+/**
+ * Compresses one band with stb_image_write's compressor (hash chains of up to 2 * quality entries, lazy
+ * matching, fixed Huffman codes) into a raw deflate segment. The hash chains are primed with the 32 KB
+ * before the band. A band that does not end the stream ends with an empty stored block, which byte-aligns
+ * it without a final block, as zlib's sync flush does. Like stbi_zlib_compress, a band that does not
+ * shrink is stored instead.
+ *
+ * @param data The whole stream's data.
+ * @param offset The offset of the band.
+ * @param len The length of the band.
+ * @param last 1 if the band ends the stream.
+ * @param quality The compression effort (stb quality, at least 5).
+ * @param segment Receives the segment data and size.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+static int deflate_band_builtin(unsigned char *data, int offset, int len, int last, int quality, deflate_segment *segment) {
+    static const unsigned short lengthc[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 259 };
+    static const unsigned char lengtheb[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const unsigned short distc[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32768 };
+    static const unsigned char disteb[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    unsigned int bitbuf = 0;
+    int bitcount = 0, end = offset + len, i, j;
+    unsigned char *out = NULL;
+    unsigned char ***hash_table = (unsigned char ***)calloc(stbiw__ZHASH, sizeof(unsigned char **));
+    if (!hash_table) return 0;
+    if (quality < 5) quality = 5;
+
+    // Every position of the window goes into the chains, trimmed the way the matcher trims them
+    for (i = offset < 32768 ? 0 : offset - 32768; i + 3 <= offset; i++) {
+        int h = stbiw__zhash(data + i) & (stbiw__ZHASH - 1);
+        if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2 * quality) {
+            memmove(hash_table[h], hash_table[h] + quality, sizeof(hash_table[h][0]) * quality);
+            stbiw__sbn(hash_table[h]) = quality;
+        }
+        stbiw__sbpush(hash_table[h], data + i);
+    }
+
+    stbiw__zlib_add(last ? 1 : 0, 1);  // BFINAL
+    stbiw__zlib_add(1, 2);             // BTYPE = 1: fixed Huffman
+    i = offset;
+    while (i < end - 3) {
+        int h = stbiw__zhash(data + i) & (stbiw__ZHASH - 1), best = 3;
+        unsigned char *bestloc = NULL;
+        unsigned char **hlist = hash_table[h];
+        int n = stbiw__sbcount(hlist);
+        for (j = 0; j < n; ++j) {
+            if (hlist[j] - data > i - 32768) {
+                int d = stbiw__zlib_countm(hlist[j], data + i, end - i);
+                if (d >= best) {
+                    best = d;
+                    bestloc = hlist[j];
+                }
+            }
+        }
+        if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2 * quality) {
+            memmove(hash_table[h], hash_table[h] + quality, sizeof(hash_table[h][0]) * quality);
+            stbiw__sbn(hash_table[h]) = quality;
+        }
+        stbiw__sbpush(hash_table[h], data + i);
+
+        if (bestloc) {
+            // Lazy matching: a longer match at the next byte makes this byte a literal
+            h = stbiw__zhash(data + i + 1) & (stbiw__ZHASH - 1);
+            hlist = hash_table[h];
+            n = stbiw__sbcount(hlist);
+            for (j = 0; j < n; ++j) {
+                if (hlist[j] - data > i - 32767 && (int)stbiw__zlib_countm(hlist[j], data + i + 1, end - i - 1) > best) {
+                    bestloc = NULL;
+                    break;
+                }
+            }
+        }
+
+        if (bestloc) {
+            int d = (int)(data + i - bestloc);
+            for (j = 0; best > lengthc[j + 1] - 1; ++j);
+            stbiw__zlib_huff(j + 257);
+            if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
+            for (j = 0; d > distc[j + 1] - 1; ++j);
+            stbiw__zlib_add(stbiw__zlib_bitrev(j, 5), 5);
+            if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+            i += best;
+        } else {
+            stbiw__zlib_huffb(data[i]);
+            ++i;
+        }
+    }
+    for (; i < end; ++i) stbiw__zlib_huffb(data[i]);
+    stbiw__zlib_huff(256);  // End of block
+    if (!last) {
+        stbiw__zlib_add(0, 3);  // An empty stored block: BFINAL = 0, BTYPE = 0, then LEN = 0, NLEN = 0xFFFF
+    }
+    while (bitcount) stbiw__zlib_add(0, 1);
+    if (!last) {
+        static const unsigned char empty_stored[4] = { 0x00, 0x00, 0xFF, 0xFF };
+        for (j = 0; j < 4; j++) stbiw__sbpush(out, empty_stored[j]);
+    }
+    for (i = 0; i < stbiw__ZHASH; ++i) (void)stbiw__sbfree(hash_table[i]);
+    free(hash_table);
+    if (!out) return 0;
+
+    int out_len = stbiw__sbn(out);
+    size_t stored_len = (size_t)(len ? (len + 65534) / 65535 : 1) * 5 + len;
+    if ((size_t)out_len > stored_len) {
+        segment->data = (unsigned char *)malloc(stored_len);
+        if (segment->data) segment->len = (int)(deflate_store_blocks(segment->data, data + offset, len, last) - segment->data);
+    } else {
+        segment->data = (unsigned char *)malloc(out_len);
+        if (segment->data) {
+            memcpy(segment->data, out, out_len);
+            segment->len = out_len;
+        }
+    }
+    (void)stbiw__sbfree(out);
+    return segment->data != NULL;
+}
+
+/**
+ * Compresses one band of a stream into a raw deflate segment (see deflate_can_band for the settings
+ * that can be banded).
+ *
+ * @param data The whole stream's data; the 32 KB before the band prime the compressor.
+ * @param offset The offset of the band.
+ * @param len The length of the band.
+ * @param last 1 if the band ends the stream.
+ * @param compression_level 0 to store the data uncompressed, otherwise the effort.
+ * @param backend A DEFLATE_* value.
+ * @param segment Receives the segment (free its data with free()).
+ * @return 1 on success, 0 on failure.
+ */
+int deflate_band(const unsigned char *data, size_t offset, int len, int last, int compression_level, int backend, deflate_segment *segment) {
+    const unsigned char *band = data + offset;
+
+    segment->data = NULL;
+    segment->len = 0;
+    segment->data_len = len;
+    segment->adler = adler32_update(1, band, len);
+    if (compression_level == PNG_LEVEL_STORE) {
+        segment->data = (unsigned char *)malloc((size_t)(len ? (len + 65534) / 65535 : 1) * 5 + len);
+        if (!segment->data) return 0;
+        segment->len = (int)(deflate_store_blocks(segment->data, band, len, last) - segment->data);
+        return 1;
+    }
+    if (backend == DEFLATE_AUTO) backend = deflate_default_backend();
+    if (backend != DEFLATE_ZLIB) {
+        return deflate_band_builtin((unsigned char *)data, (int)offset, len, last, compression_level, segment);
+    }
+
+#ifdef STEG_USE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, compression_level > 9 ? 9 : compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    size_t window = offset < 32768 ? offset : 32768;
+    uLong bound = deflateBound(&stream, (uLong)len) + 16;  // Room for the empty stored block a sync flush ends with
+    segment->data = (unsigned char *)malloc(bound);
+    int ok = segment->data && (window == 0 || deflateSetDictionary(&stream, band - window, (uInt)window) == Z_OK);
+    if (ok) {
+        stream.next_in = (Bytef *)band;
+        stream.avail_in = (uInt)len;
+        stream.next_out = segment->data;
+        stream.avail_out = (uInt)bound;
+        // A sync flush ends the segment on a byte boundary without a final block
+        ok = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH) == (last ? Z_STREAM_END : Z_OK) && stream.avail_in == 0;
+        segment->len = (int)(bound - stream.avail_out);
+    }
+    deflateEnd(&stream);
+    if (!ok) {
+        free(segment->data);
+        segment->data = NULL;
+    }
+    return ok;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Joins the deflate segments of consecutive bands into a zlib stream.
+ *
+ * @param segments The segments, in stream order; the last one ends the stream.
+ * @param count The number of segments.
+ * @param compression_level The level they were compressed at (recorded in the zlib header).
+ * @param out_len A pointer to store the length of the zlib stream.
+ * @return The zlib stream (free with free()), or NULL if memory allocation failed.
+ */
+unsigned char *deflate_join(const deflate_segment *segments, int count, int compression_level, int *out_len) {
+    size_t total = 2 + 4;
+    for (int i = 0; i < count; i++) {
+        total += segments[i].len;
+    }
+    if (total > INT32_MAX) return NULL;
+    unsigned char *out = (unsigned char *)malloc(total);
+    if (!out) return NULL;
+
+    unsigned char *o = out;
+    *o++ = 0x78;                                                // Deflate, 32K window
+    *o++ = compression_level == PNG_LEVEL_STORE ? 0x01 : 0x9C;  // FLEVEL, check bits
+    unsigned int adler = 1;
+    for (int i = 0; i < count; i++) {
+        memcpy(o, segments[i].data, segments[i].len);
+        o += segments[i].len;
+        adler = i ? adler32_combine_with(adler, segments[i].adler, segments[i].data_len) : segments[i].adler;
+    }
+    stbiw__wp32(o, adler);
+    *out_len = (int)(o - out);
+    return out;
+}
+
+// Indexed (palette) images. They are held as one palette index per byte, like a one-channel 8-bit
+// image, next to their palette, and written back indexed at the file's bit depth: the message lives in
+// the index LSBs. Before embedding, the palette is reordered so that the entries 2k and 2k + 1 of each
+// pair look alike, and flipping an index LSB only swaps a color for its partner.
+typedef struct {
+    int entries;  // Colors in the palette (1-256)
+    int bits;     // Bits per index in the file (1, 2, 4 or 8)
+    int alphas;   // Leading entries with an alpha value in tRNS (0: no tRNS)
+    unsigned char rgb[256 * 3];
+    unsigned char alpha[256];  // 255 past the tRNS entries
+} steg_palette;
+
+#define PALETTE_PAIRED_WARNING " (WARNING: over 128 palette colors, so changed pixels take the nearest other color)"
+
+/**
+ * Returns the size of a row of packed palette indices.
+ *
+ * @param width The width of the image.
+ * @param bits The bits per index (1, 2, 4 or 8).
+ * @return The row size in bytes.
+ */
+size_t palette_row_bytes(int width, int bits) {
+    return ((size_t)width * bits + 7) / 8;
+}
+
+/**
+ * Packs rows of one index per byte to the file's bit depth, leftmost pixel in the high bits.
+ *
+ * @param indices The indices (width bytes per row).
+ * @param width The width of the image.
+ * @param height The number of rows.
+ * @param bits The bits per index (1, 2 or 4).
+ * @param packed The output (palette_row_bytes(width, bits) bytes per row).
+ */
+void palette_pack_rows(const unsigned char *indices, int width, int height, int bits, unsigned char *packed) {
+    size_t row_bytes = palette_row_bytes(width, bits);
+    int per_byte = 8 / bits;
+    for (int y = 0; y < height; y++) {
+        const unsigned char *in = indices + (size_t)y * width;
+        unsigned char *out = packed + y * row_bytes;
+        memset(out, 0, row_bytes);
+        for (int x = 0; x < width; x++) {
+            out[x / per_byte] |= (unsigned char)(in[x] << (8 - bits - (x % per_byte) * bits));
+        }
+    }
+}
+
+/**
+ * Unpacks a row of packed indices to one index per byte.
+ *
+ * @param packed The packed row.
+ * @param width The width of the image.
+ * @param bits The bits per index (1, 2 or 4).
+ * @param indices The output (width bytes).
+ */
+void palette_unpack_row(const unsigned char *packed, int width, int bits, unsigned char *indices) {
+    int per_byte = 8 / bits, mask = (1 << bits) - 1;
+    for (int x = 0; x < width; x++) {
+        indices[x] = (unsigned char)((packed[x / per_byte] >> (8 - bits - (x % per_byte) * bits)) & mask);
+    }
+}
+
+/**
+ * Returns the squared distance between two palette entries, alpha included.
+ *
+ * @param palette The palette.
+ * @param a The first entry.
+ * @param b The second entry.
+ * @return The distance.
+ */
+static int palette_distance(const steg_palette *palette, int a, int b) {
+    int distance = (palette->alpha[a] - palette->alpha[b]) * (palette->alpha[a] - palette->alpha[b]);
+    for (int c = 0; c < 3; c++) {
+        int d = palette->rgb[a * 3 + c] - palette->rgb[b * 3 + c];
+        distance += d * d;
+    }
+    return distance;
+}
+
+/**
+ * Removes the palette entries that no pixel uses, keeping the order of the others. Encoders often write
+ * a full-size palette for an image that uses only some of it.
+ *
+ * @param palette The palette, compacted in place.
+ * @param indices The image's indices, remapped in place.
+ * @param count The number of indices.
+ */
+static void palette_drop_unused(steg_palette *palette, unsigned char *indices, size_t count) {
+    unsigned char used[256] = { 0 }, map[256];
+    for (size_t i = 0; i < count; i++) used[indices[i]] = 1;
+    int n = 0;
+    for (int i = 0; i < 256; i++) {
+        if (used[i] && i >= palette->entries) return;  // An index past the palette: leave the image alone
+    }
+    for (int i = 0; i < palette->entries; i++) {
+        if (!used[i]) continue;
+        map[i] = (unsigned char)n;
+        memmove(palette->rgb + n * 3, palette->rgb + i * 3, 3);
+        palette->alpha[n++] = palette->alpha[i];
+    }
+    if (n == palette->entries || n == 0) return;
+    for (size_t i = 0; i < count; i++) indices[i] = map[indices[i]];
+    for (int i = n; i < palette->entries; i++) palette->alpha[i] = 255;
+    palette->entries = n;
+    palette->alphas = 0;
+    for (int i = n - 1; i >= 0 && palette->alphas == 0; i--) {
+        if (palette->alpha[i] != 255) palette->alphas = i + 1;
+    }
+}
+
+/**
+ * Pairs the palette for embedding: afterwards, flipping the LSB of an index selects a color that looks
+ * like the original. The palette is doubled, so each color is paired with a copy of itself and the
+ * change is invisible. A palette too full to double first loses the entries no pixel uses; if it is
+ * still too full, a sub-byte palette moves to the next bit depth (1 to 2, 2 to 4, 4 to 8 bits per index). Only a full 8-bit palette (over 128 colors) cannot be doubled: it is
+ * paired greedily, the darkest unpaired color with the nearest unpaired one, so flipped pixels change
+ * color. A palette that is already doubled is kept, so a carrier can be used again.
+ *
+ * @param palette The palette, reordered in place (its bit depth may grow).
+ * @param indices The image's indices, remapped in place.
+ * @param count The number of indices.
+ * @return 1 if every pixel keeps its exact color, 0 if distinct colors had to be paired.
+ */
+int palette_prepare(steg_palette *palette, unsigned char *indices, size_t count) {
+    steg_palette paired = *palette;
+    unsigned char order[257], map[256];
+    int n = 0;
+
+    int doubled = palette->entries % 2 == 0;
+    for (int k = 0; doubled && k < palette->entries; k += 2) doubled = palette_distance(palette, k, k + 1) == 0;
+    if (doubled) return 1;
+
+    if (palette->entries * 2 > (1 << palette->bits)) {
+        palette_drop_unused(palette, indices, count);
+        paired = *palette;
+    }
+    if (palette->entries * 2 > (1 << palette->bits) && palette->bits < 8) {
+        paired.bits = palette->bits * 2;  // Written back at the larger depth: indices are held a byte each
+    }
+    if (palette->entries * 2 <= (1 << paired.bits)) {
+        for (int i = 0; i < palette->entries; i++) {
+            order[n++] = (unsigned char)i;
+            order[n++] = (unsigned char)i;
+        }
+    } else {
+        unsigned char used[256] = { 0 };
+        while (n < palette->entries) {
+            int a = -1, b = -1, darkest = 0, nearest = 0;
+            for (int i = 0; i < palette->entries; i++) {
+                int luma = 299 * palette->rgb[i * 3] + 587 * palette->rgb[i * 3 + 1] + 114 * palette->rgb[i * 3 + 2];
+                if (!used[i] && (a < 0 || luma < darkest)) {
+                    darkest = luma;
+                    a = i;
+                }
+            }
+            used[a] = 1;
+            order[n++] = (unsigned char)a;
+            for (int i = 0; i < palette->entries; i++) {
+                int distance = used[i] ? 0 : palette_distance(palette, a, i);
+                if (!used[i] && (b < 0 || distance < nearest)) {
+                    nearest = distance;
+                    b = i;
+                }
+            }
+            if (b < 0) {
+                order[n++] = (unsigned char)a;  // An odd palette (short of the bit depth's limit): the last one pairs with itself
+                break;
+            }
+            used[b] = 1;
+            order[n++] = (unsigned char)b;
+        }
+    }
+
+    paired.entries = n;
+    paired.alphas = 0;
+    for (int j = n - 1; j >= 0; j--) {
+        int i = order[j];
+        memcpy(paired.rgb + j * 3, palette->rgb + i * 3, 3);
+        paired.alpha[j] = palette->alpha[i];
+        if (paired.alpha[j] != 255 && paired.alphas == 0) paired.alphas = j + 1;
+        map[i] = (unsigned char)j;  // Ends at the first of two copies
+    }
+    for (size_t i = 0; i < count; i++) indices[i] = map[indices[i]];
+    int exact = n == 2 * palette->entries;
+    *palette = paired;
+    return exact;
+}
+
+// Ancillary chunks carried from an input PNG to its encoded output. They are copied byte for byte
+// (length, tag, data and CRC) without decoding their contents, and written back in the same place
+// relative to PLTE and IDAT. A chunk is kept when embedding cannot make it wrong: known metadata always,
+// chunks that describe the pixel format (sBIT, bKGD) only if the output keeps the input's color type and
+// bit depth, and unknown chunks only if their safe-to-copy bit is set. tRNS and hIST follow the palette
+// and are never copied: the output writes its own tRNS.
+#define PNG_CHUNKS_BEFORE_PLTE 0  // After IHDR
+#define PNG_CHUNKS_BEFORE_IDAT 1  // After PLTE (and tRNS)
+#define PNG_CHUNKS_AFTER_IDAT 2   // Before IEND
+
+#define PNG_PAYLOAD_TAG "stEg"  // The payload chunk of the chunk carrier: ancillary, private, safe to copy
+
+typedef struct {
+    unsigned char *data;  // The kept chunks back to back, grouped by position (NULL if there are none)
+    size_t ends[3];       // End of each PNG_CHUNKS_* group in data
+} png_chunks;
+
+/**
+ * Tells whether an ancillary chunk stays correct in the encoded output.
+ *
+ * @param tag The chunk type.
+ * @param same_format 1 if the output keeps the input's color type and bit depth.
+ * @param indexed 1 if the output is indexed (its palette may be reordered).
+ * @return 1 to copy the chunk, 0 to drop it.
+ */
+static int png_chunk_keep(const unsigned char *tag, int same_format, int indexed) {
+    static const char metadata[][5] = { "cHRM", "gAMA", "iCCP", "sRGB", "cICP", "mDCV", "cLLI", "tEXt", "zTXt", "iTXt",
+                                        "pHYs", "sPLT", "tIME", "eXIf", "oFFs", "pCAL", "sCAL", "sTER", "gIFg", "gIFx" };
+    if (!(tag[0] & 32)) {
+        return 0;  // Critical chunks are written anew
+    }
+    if (memcmp(tag, PNG_PAYLOAD_TAG, 4) == 0) {
+        return 0;  // A payload chunk would be found before the payload now in the pixels
+    }
+    for (size_t i = 0; i < sizeof(metadata) / sizeof(metadata[0]); i++) {
+        if (memcmp(tag, metadata[i], 4) == 0) return 1;
+    }
+    if (memcmp(tag, "sBIT", 4) == 0) return same_format;
+    if (memcmp(tag, "bKGD", 4) == 0) return same_format && !indexed;  // An indexed bKGD names a palette entry
+    return (tag[3] & 32) != 0;  // Unknown: only if safe to copy
+}
+
+/**
+ * Collects the ancillary chunks of an input PNG that its encoded output keeps.
+ *
+ * @param data The input file contents.
+ * @param len The size of the file.
+ * @param channels The channel count the output is written with.
+ * @param depth The bits per sample the output is written with.
+ * @param palette The palette of an indexed output, or NULL.
+ * @param chunks The chunks (free with png_chunks_free()); empty if the input is not a PNG.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int png_chunks_collect(const unsigned char *data, size_t len, int channels, int depth, const steg_palette *palette, png_chunks *chunks) {
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    static const int color_types[5] = { -1, 0, 4, 2, 6 };
+    memset(chunks, 0, sizeof(*chunks));
+    if (len < 8 + 25 || memcmp(data, signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0) {
+        return 1;
+    }
+    int same_format = data[24] == (palette ? palette->bits : depth) && data[25] == (palette ? 3 : color_types[channels]);
+
+    // Two walks over the chunk headers: size the groups, then copy each chunk into its group
+    size_t cursor[3] = { 0, 0, 0 };
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            if (cursor[0] + cursor[1] + cursor[2] == 0) return 1;
+            chunks->ends[0] = cursor[0];
+            chunks->ends[1] = cursor[0] + cursor[1];
+            chunks->ends[2] = cursor[0] + cursor[1] + cursor[2];
+            chunks->data = (unsigned char *)malloc(chunks->ends[2]);
+            if (!chunks->data) {
+                printf("Memory allocation failed!\n");
+                return 0;
+            }
+            cursor[0] = 0;
+            cursor[1] = chunks->ends[0];
+            cursor[2] = chunks->ends[1];
+        }
+        int position = PNG_CHUNKS_BEFORE_PLTE;
+        for (size_t pos = 8; pos + 12 <= len;) {
+            uint32_t chunk_len = read_be32(data + pos);
+            const unsigned char *tag = data + pos + 4;
+            if (chunk_len > len - pos - 12 || memcmp(tag, "IEND", 4) == 0) break;
+            if (memcmp(tag, "PLTE", 4) == 0) {
+                if (position == PNG_CHUNKS_BEFORE_PLTE) position = PNG_CHUNKS_BEFORE_IDAT;
+            } else if (memcmp(tag, "IDAT", 4) == 0) {
+                position = PNG_CHUNKS_AFTER_IDAT;
+            } else if (png_chunk_keep(tag, same_format, palette != NULL)) {
+                if (pass == 1) memcpy(chunks->data + cursor[position], data + pos, 12 + chunk_len);
+                cursor[position] += 12 + chunk_len;
+            }
+            pos += 12 + chunk_len;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Releases collected chunks.
+ *
+ * @param chunks The chunks (left empty).
+ */
+void png_chunks_free(png_chunks *chunks) {
+    free(chunks->data);
+    memset(chunks, 0, sizeof(*chunks));
+}
+
+// Chunk carrier: the framed payload goes in a PNG_PAYLOAD_TAG chunk instead of the pixels, and every
+// other chunk, IDAT included, is copied byte for byte, so an encode or decode is a file copy with no
+// inflate, filtering or deflate. The chunk holds the embedded byte stream the pixel carriers would hold,
+// a byte per byte (CARRIER_DEPTH_BYTES), so the header, error correction, encryption, key scattering and
+// shards work unchanged. The payload is not hidden: any PNG tool lists the chunk.
+
+/**
+ * Finds the payload chunk of a PNG file.
+ *
+ * @param data The file contents.
+ * @param len The size of the file.
+ * @param payload_len A pointer to store the size of the chunk data.
+ * @return The chunk data (inside data), or NULL if the file is not a PNG or has no payload chunk.
+ */
+const unsigned char *png_find_payload_chunk(const unsigned char *data, size_t len, size_t *payload_len) {
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    if (len < 8 || memcmp(data, signature, 8) != 0) {
+        return NULL;
+    }
+    for (size_t pos = 8; pos + 12 <= len;) {
+        uint32_t chunk_len = read_be32(data + pos);
+        const unsigned char *tag = data + pos + 4;
+        if (chunk_len > len - pos - 12 || memcmp(tag, "IEND", 4) == 0) break;
+        if (memcmp(tag, PNG_PAYLOAD_TAG, 4) == 0) {
+            *payload_len = chunk_len;
+            return tag + 4;
+        }
+        pos += 12 + chunk_len;
+    }
+    return NULL;
+}
+
+/**
+ * Copies a PNG file with room for a payload chunk before IEND. Payload chunks already in the file are
+ * dropped, and with strip_metadata so are the ancillary chunks a pixel encode would copy (the chunks
+ * that describe the pixels, such as tRNS, stay).
+ *
+ * @param data The input file contents.
+ * @param len The size of the input file.
+ * @param payload_len The size of the payload chunk data.
+ * @param strip_metadata 1 to drop the metadata chunks.
+ * @param out_len A pointer to store the size of the output file.
+ * @param payload A pointer to store where the chunk data goes in the output (zero-filled); seal the chunk
+ *                with png_payload_chunk_seal() once it is written.
+ * @return The output file (free with free()), or NULL if the input is not a well-formed PNG or memory
+ *         allocation failed.
+ */
+unsigned char *png_payload_chunk_open(const unsigned char *data, size_t len, size_t payload_len, int strip_metadata, size_t *out_len,
+                                      unsigned char **payload) {
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    size_t iend = 0;
+    if (len < 8 + 25 || memcmp(data, signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0 || payload_len > 0x7FFFFFFFu) {
+        return NULL;
+    }
+    for (size_t pos = 8; pos + 12 <= len; pos += 12 + read_be32(data + pos)) {
+        if (read_be32(data + pos) > len - pos - 12) return NULL;
+        if (memcmp(data + pos + 4, "IEND", 4) == 0) {
+            iend = pos;
+            break;
+        }
+    }
+    if (iend == 0) {
+        return NULL;
+    }
+    unsigned char *out = (unsigned char *)malloc(iend + 12 + payload_len + 12);
+    if (!out) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+
+    // Copy each run of kept chunks (the signature starts the first) with one memcpy
+    unsigned char *o = out;
+    size_t run = 0;
+    for (size_t pos = 8;;) {
+        const unsigned char *tag = data + pos + 4;
+        size_t next = pos == iend ? pos : pos + 12 + read_be32(data + pos);
+        if (pos == iend || memcmp(tag, PNG_PAYLOAD_TAG, 4) == 0 || (strip_metadata && png_chunk_keep(tag, 1, 0))) {
+            memcpy(o, data + run, pos - run);
+            o += pos - run;
+            run = next;
+        }
+        if (pos == iend) break;
+        pos = next;
+    }
+    stbiw__wp32(o, (unsigned int)payload_len);
+    stbiw__wptag(o, PNG_PAYLOAD_TAG);
+    *payload = o;
+    memset(o, 0, payload_len);
+    o += payload_len + 4;  // The CRC is written when the chunk is sealed
+    stbiw__wp32(o, 0);
+    stbiw__wptag(o, "IEND");
+    stbiw__wpcrc(&o, 0);
+    *out_len = (size_t)(o - out);
+    return out;
+}
+
+/**
+ * Writes the CRC of a payload chunk once its data is in place.
+ *
+ * @param payload The chunk data, as returned by png_payload_chunk_open().
+ * @param payload_len The size of the chunk data.
+ */
+void png_payload_chunk_seal(unsigned char *payload, size_t payload_len) {
+    unsigned char *o = payload + payload_len;
+    stbiw__wpcrc(&o, (int)payload_len);
+}
+
+/**
+ * Returns the size of a scanline in a PNG file (without the filter byte) and the filter's bytes per
+ * pixel: indexed rows are filtered bytewise (bpp 1), as PNG does for every depth below 8 bits.
+ *
+ * @param width The width of the image.
+ * @param channels The number of channels in the image (1-4; 1 for indexed images).
+ * @param depth The bits per sample (8 or 16).
+ * @param palette The palette of an indexed image, or NULL.
+ * @param bpp A pointer to store the bytes per pixel for the filter.
+ * @return The row size in bytes.
+ */
+size_t png_row_bytes(int width, int channels, int depth, const steg_palette *palette, int *bpp) {
+    *bpp = palette ? 1 : channels * (depth / 8);
+    return palette ? palette_row_bytes(width, palette->bits) : (size_t)width * *bpp;
+}
+
+/**
+ * Returns the filter for an image's rows. The adaptive choice leaves indexed rows unfiltered: the
+ * filters predict smoothly varying samples, which palette indices are not, and None is what the PNG
+ * specification recommends for them.
+ *
+ * @param filter PNG_FILTER_ADAPTIVE or a fixed filter type 0-4.
+ * @param palette The palette of an indexed image, or NULL.
+ * @return The filter to apply.
+ */
+int png_filter_for(int filter, const steg_palette *palette) {
+    return palette && filter == PNG_FILTER_ADAPTIVE ? 0 : filter;
+}
+
+// Adam7 interlacing. An interlaced PNG stores its pixels in seven passes, each a reduced image of every
+// dx-th pixel of every dy-th row starting at (x0, y0). An image in pass order holds the seven reduced
+// images back to back, tightly packed like any image: that is how the file stores them, so an
+// interlaced PNG is decoded to pass order and encoded from it with no deinterlacing in between.
+static const int adam7_x0[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int adam7_y0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int adam7_dx[7] = { 8, 8, 4, 4, 2, 2, 1 };
+static const int adam7_dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+/**
+ * Returns the size of one Adam7 pass of an image.
+ *
+ * @param pass The pass, 0-6.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param pass_width A pointer to store the width of the pass (0 if it is empty).
+ * @param pass_height A pointer to store the height of the pass (0 if it is empty).
+ */
+void adam7_pass_size(int pass, int width, int height, int *pass_width, int *pass_height) {
+    *pass_width = (width - adam7_x0[pass] + adam7_dx[pass] - 1) / adam7_dx[pass];
+    *pass_height = (height - adam7_y0[pass] + adam7_dy[pass] - 1) / adam7_dy[pass];
+}
+
+/**
+ * Copies an image from raster order to Adam7 pass order, or back.
+ *
+ * @param from The image in its current order.
+ * @param to The output (the same size).
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param bpp The bytes per pixel (1 for indices).
+ * @param to_passes 1 to go from raster order to pass order, 0 for the reverse.
+ */
+void adam7_reorder(const unsigned char *from, unsigned char *to, int width, int height, int bpp, int to_passes) {
+    size_t offset = 0;  // Start of the pass in pass order
+    for (int pass = 0; pass < 7; pass++) {
+        int pass_width, pass_height;
+        adam7_pass_size(pass, width, height, &pass_width, &pass_height);
+        size_t pass_row = (size_t)pass_width * bpp, step = (size_t)adam7_dx[pass] * bpp;
+        for (int y = 0; y < pass_height && pass_width > 0; y++) {
+            size_t p = offset + y * pass_row;
+            size_t r = ((size_t)(adam7_y0[pass] + y * adam7_dy[pass]) * width + adam7_x0[pass]) * bpp;
+            if (step == (size_t)bpp) {  // The last pass takes whole rows
+                if (to_passes) memcpy(to + p, from + r, pass_row);
+                else memcpy(to + r, from + p, pass_row);
+                continue;
+            }
+            for (int x = 0; x < pass_width; x++, p += bpp, r += step) {
+                if (to_passes) memcpy(to + p, from + r, bpp);
+                else memcpy(to + r, from + p, bpp);
+            }
+        }
+        offset += pass_row * pass_height;
+    }
+}
+
+/**
+ * Returns a copy of an image in the other pixel order.
+ *
+ * @param pixels The image.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param bpp The bytes per pixel (1 for indices).
+ * @param to_passes 1 if the image is in raster order and the copy goes to pass order, 0 for the reverse.
+ * @return The copy (free with free()), or NULL if memory allocation failed.
+ */
+unsigned char *adam7_reordered(const unsigned char *pixels, int width, int height, int bpp, int to_passes) {
+    unsigned char *copy = (unsigned char *)malloc((size_t)width * height * bpp);
+    if (!copy) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+    adam7_reorder(pixels, copy, width, height, bpp, to_passes);
+    return copy;
+}
+
+/**
+ * Returns the size of an image's filtered scanlines: every row with its filter byte, and for an
+ * interlaced image the rows of each non-empty pass.
+ *
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image (1-4; 1 for indexed images).
+ * @param depth The bits per sample (8 or 16).
+ * @param palette The palette of an indexed image, or NULL.
+ * @param interlaced 1 for an Adam7-interlaced image.
+ * @return The size in bytes.
+ */
+size_t png_filtered_bytes(int width, int height, int channels, int depth, const steg_palette *palette, int interlaced) {
+    int bpp;
+    if (!interlaced) {
+        return (png_row_bytes(width, channels, depth, palette, &bpp) + 1) * height;
+    }
+    size_t total = 0;
+    for (int pass = 0; pass < 7; pass++) {
+        int pass_width, pass_height;
+        adam7_pass_size(pass, width, height, &pass_width, &pass_height);
+        if (pass_width > 0) total += (png_row_bytes(pass_width, channels, depth, palette, &bpp) + 1) * pass_height;
+    }
+    return total;
+}
+
+/**
+ * Packs an image of one index per byte to the file's bit depth, row by row or pass by pass.
+ *
+ * @param indices The indices.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param bits The bits per index (1, 2 or 4).
+ * @param interlaced 1 if the indices are in Adam7 pass order.
+ * @param packed The output.
+ */
+void palette_pack_image(const unsigned char *indices, int width, int height, int bits, int interlaced, unsigned char *packed) {
+    if (!interlaced) {
+        palette_pack_rows(indices, width, height, bits, packed);
+        return;
+    }
+    for (int pass = 0; pass < 7; pass++) {
+        int pass_width, pass_height;
+        adam7_pass_size(pass, width, height, &pass_width, &pass_height);
+        if (pass_width == 0) continue;
+        palette_pack_rows(indices, pass_width, pass_height, bits, packed);
+        indices += (size_t)pass_width * pass_height;
+        packed += palette_row_bytes(pass_width, bits) * pass_height;
+    }
+}
+
+/**
+ * Tells whether a file is an Adam7-interlaced PNG, from its header.
+ *
+ * @param data The file contents.
+ * @param len The size of the file.
+ * @return 1 if it is an interlaced PNG, 0 otherwise.
+ */
+int png_is_interlaced(const unsigned char *data, size_t len) {
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    return len >= 8 + 25 && memcmp(data, signature, 8) == 0 && memcmp(data + 12, "IHDR", 4) == 0 && data[28] == 1;
+}
+
+/**
+ * PNG-filters the seven passes of an image in pass order, each as an image of its own.
+ *
+ * @param rows The passes (packed to the file's bit depth for indices below 8 bits).
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image (1-4; 1 for indexed images).
+ * @param depth The bits per sample (8 or 16).
+ * @param palette The palette of an indexed image, or NULL.
+ * @param filter PNG_FILTER_ADAPTIVE or a fixed filter type 0-4.
+ * @param filtered The output (png_filtered_bytes() bytes).
+ * @return 1 on success, 0 on failure.
+ */
+int png_filter_passes(const unsigned char *rows, int width, int height, int channels, int depth, const steg_palette *palette, int filter,
+                      unsigned char *filtered) {
+    for (int pass = 0; pass < 7; pass++) {
+        int pass_width, pass_height, bpp;
+        adam7_pass_size(pass, width, height, &pass_width, &pass_height);
+        if (pass_width == 0 || pass_height == 0) continue;
+        size_t row_bytes = png_row_bytes(pass_width, channels, depth, palette, &bpp);
+        if (!png_filter_rows(rows, (int)(row_bytes / bpp), pass_height, bpp, png_filter_for(filter, palette), 0, pass_height, filtered)) {
+            return 0;
+        }
+        rows += row_bytes * pass_height;
+        filtered += (row_bytes + 1) * pass_height;
+    }
+    return 1;
+}
+
+/**
+ * Wraps compressed scanlines into a complete PNG file in memory.
+ *
+ * @param zlib The zlib stream of the filtered scanlines; always freed.
+ * @param zlen The length of the zlib stream.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image (1-4).
+ * @param depth The bits per sample (8 or 16).
+ * @param palette The palette of an indexed image (written as PLTE and tRNS), or NULL.
+ * @param interlaced 1 to write an Adam7-interlaced file.
+ * @param chunks Ancillary chunks to copy into the file, or NULL.
+ * @param out_len A pointer to store the size of the PNG file.
+ * @return The PNG file contents, or NULL on failure.
+ */
+unsigned char *png_write_zlib_to_mem(unsigned char *zlib, int zlen, int width, int height, int channels, int depth, const steg_palette *palette,
+                                     int interlaced, const png_chunks *chunks, int *out_len) {
+    static const int color_types[5] = { -1, 0, 4, 2, 6 };
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+    // Signature, IHDR, PLTE and tRNS (indexed images), IDAT and IEND, with the copied chunks in between;
+    // each chunk carries 12 bytes of length/tag/CRC overhead
+    int palette_len = palette ? 12 + palette->entries * 3 + (palette->alphas ? 12 + palette->alphas : 0) : 0;
+    size_t chunks_len = chunks ? chunks->ends[PNG_CHUNKS_AFTER_IDAT] : 0;
+    if (chunks_len > (size_t)(INT32_MAX - 100) - zlen) {
+        printf("ERROR: The encoded image is too large.\n");
+        free(zlib);
+        return NULL;
+    }
+    unsigned char *out = (unsigned char *)malloc(8 + 12 + 13 + palette_len + chunks_len + 12 + zlen + 12);
+    if (!out) {
+        printf("Memory allocation failed!\n");
+        free(zlib);
+        return NULL;
+    }
+    *out_len = 8 + 12 + 13 + palette_len + (int)chunks_len + 12 + zlen + 12;
+
+    unsigned char *o = out;
+    memcpy(o, signature, 8);
+    o += 8;
+    stbiw__wp32(o, 13);
+    stbiw__wptag(o, "IHDR");
+    stbiw__wp32(o, width);
+    stbiw__wp32(o, height);
+    *o++ = (unsigned char)(palette ? palette->bits : depth);
+    *o++ = (unsigned char)(palette ? 3 : color_types[channels]);
+    *o++ = 0;
+    *o++ = 0;
+    *o++ = (unsigned char)(interlaced ? 1 : 0);
+    stbiw__wpcrc(&o, 13);
+
+    size_t before_plte = chunks ? chunks->ends[PNG_CHUNKS_BEFORE_PLTE] : 0, before_idat = chunks ? chunks->ends[PNG_CHUNKS_BEFORE_IDAT] : 0;
+    if (before_plte) {
+        memcpy(o, chunks->data, before_plte);
+        o += before_plte;
+    }
+    if (palette) {
+        stbiw__wp32(o, palette->entries * 3);
+        stbiw__wptag(o, "PLTE");
+        memcpy(o, palette->rgb, palette->entries * 3);
+        o += palette->entries * 3;
+        stbiw__wpcrc(&o, palette->entries * 3);
+        if (palette->alphas) {
+            stbiw__wp32(o, palette->alphas);
+            stbiw__wptag(o, "tRNS");
+            memcpy(o, palette->alpha, palette->alphas);
+            o += palette->alphas;
+            stbiw__wpcrc(&o, palette->alphas);
+        }
+    }
+    if (before_idat > before_plte) {
+        memcpy(o, chunks->data + before_plte, before_idat - before_plte);
+        o += before_idat - before_plte;
+    }
+
+    stbiw__wp32(o, zlen);
+    stbiw__wptag(o, "IDAT");
+    memcpy(o, zlib, zlen);
+    o += zlen;
+    free(zlib);
+    stbiw__wpcrc(&o, zlen);
+    if (chunks_len > before_idat) {
+        memcpy(o, chunks->data + before_idat, chunks_len - before_idat);
+        o += chunks_len - before_idat;
+    }
+
+    stbiw__wp32(o, 0);
+    stbiw__wptag(o, "IEND");
+    stbiw__wpcrc(&o, 0);
+    return out;
+}
+
+/**
+ * Compresses pre-filtered scanlines and wraps them into a complete PNG file in memory.
+ *
+ * @param filtered The filtered scanlines (png_row_bytes + 1 bytes per row; the rows of each pass in turn
+ *                 for an interlaced image).
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image (1-4).
+ * @param depth The bits per sample (8 or 16).
+ * @param palette The palette of an indexed image (written as PLTE and tRNS), or NULL.
+ * @param interlaced 1 to write an Adam7-interlaced file.
+ * @param chunks Ancillary chunks to copy into the file, or NULL.
+ * @param options The PNG encoding settings (the filter was already applied).
+ * @param out_len A pointer to store the size of the PNG file.
+ * @return The PNG file contents, or NULL on failure.
+ */
+unsigned char *png_write_filtered_to_mem(unsigned char *filtered, int width, int height, int channels, int depth, const steg_palette *palette,
+                                         int interlaced, const png_chunks *chunks, const png_write_options *options, int *out_len) {
+    int zlen;
+
+    int filtered_len = (int)png_filtered_bytes(width, height, channels, depth, palette, interlaced);
+    unsigned char *zlib = png_deflate(filtered, filtered_len, options->compression_level, options->deflate_backend, &zlen);
+    if (!zlib) {
+        printf("ERROR: Failed to compress image data.\n");
+        return NULL;
+    }
+    return png_write_zlib_to_mem(zlib, zlen, width, height, channels, depth, palette, interlaced, chunks, out_len);
+}
+
+/**
+ * Encodes an image as a PNG file in memory.
+ *
+ * @param pixels The image data (tightly packed rows; 16-bit samples big-endian; one byte per index).
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image (1-4).
+ * @param depth The bits per sample (8 or 16).
+ * @param palette The palette of an indexed image, or NULL.
+ * @param chunks Ancillary chunks to copy into the file, or NULL.
+ * @param options The PNG encoding settings.
+ * @param out_len A pointer to store the size of the PNG file.
+ * @return The PNG file contents, or NULL on failure.
+ */
+unsigned char *png_encode_to_mem(unsigned char *pixels, int width, int height, int channels, int depth, const steg_palette *palette,
+                                 const png_chunks *chunks, const png_write_options *options, int *out_len) {
+    int bpp;
+    size_t row_bytes = png_row_bytes(width, channels, depth, palette, &bpp);
+    unsigned char *filtered = (unsigned char *)malloc((row_bytes + 1) * height);
+    unsigned char *packed = palette && palette->bits < 8 ? (unsigned char *)malloc(row_bytes * height) : NULL;
+    if (!filtered || (palette && palette->bits < 8 && !packed)) {
+        printf("Memory allocation failed!\n");
+        free(filtered);
+        free(packed);
+        return NULL;
+    }
+    if (packed) palette_pack_rows(pixels, width, height, palette->bits, packed);
+    unsigned char *png = NULL;
+    if (png_filter_rows(packed ? packed : pixels, (int)(row_bytes / bpp), height, bpp, png_filter_for(options->filter, palette), 0, height, filtered)) {
+        png = png_write_filtered_to_mem(filtered, width, height, channels, depth, palette, 0, chunks, options, out_len);
+    }
+    free(filtered);
+    free(packed);
+    return png;
+}
+
+/**
+ * Writes a memory buffer to a file.
+ *
+ * @param filename The output file.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @return 1 on success, 0 on failure.
+ */
+int write_file(const char *filename, const unsigned char *data, size_t length) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        return 0;
+    }
+    size_t written = fwrite(data, 1, length, file);
+    int closed = fclose(file) == 0;
+    return written == length && closed;
+}
+
+// PNG decoding. 8- and 16-bit, non-interlaced grayscale/RGB/gray-alpha/RGBA images without tRNS (the common
+// case) are decoded here so the inflate step can use a faster backend; every other PNG, and every other
+// format, goes through stb_image unchanged. 8-bit output matches stbi_load with desired_channels = 0.
+// 16-bit images keep their samples big-endian, as PNG rows store them (stbi_load_16's output byte-swapped),
+// so they are filtered and unfiltered as rows of 2 * channels-byte pixels. Non-interlaced indexed images
+// are decoded here too when the caller keeps palettes, even with the stb backend (which then only
+// inflates): their packed rows are unfiltered bytewise and spread to one index per byte.
+#define INFLATE_AUTO 0        // The fastest available backend
+#define INFLATE_STB 1         // stb_image's own inflater (stbi_zlib_decode_malloc_guesssize_headerflag)
+#define INFLATE_BUILTIN 2     // The table-driven inflater below
+#define INFLATE_ZLIB 3
+
+/**
+ * Returns the backend that INFLATE_AUTO resolves to in this build.
+ *
+ * @return The fastest available INFLATE_* backend.
+ */
+int inflate_default_backend(void) {
+    return INFLATE_BUILTIN;  // zlib measured slower than the built-in inflater
+}
+
+/**
+ * Returns a printable name for an inflate backend.
+ *
+ * @param backend An INFLATE_* value.
+ * @return The backend name.
+ */
+const char *inflate_backend_name(int backend) {
+    switch (backend == INFLATE_AUTO ? inflate_default_backend() : backend) {
+        case INFLATE_STB: return "stb";
+        case INFLATE_ZLIB: return "zlib";
+        default: return "builtin";
+    }
+}
+
+// Decode table entries (32 bits): bits 0-3 hold the code length to consume, bits 4-7 the kind,
+// bits 8-11 the extra-bit count (or subtable index bits) and bits 16-31 the value.
+// Literal-pair entries pack two literals whose codes fit together in the primary lookup.
+#define HUFF_LITERAL 0
+#define HUFF_PAIR 1
+#define HUFF_LENGTH 2
+#define HUFF_END 3
+#define HUFF_SUBTABLE 4
+#define HUFF_INVALID 5
+
+#define HUFF_ENTRY(kind, extra, value) (((uint32_t)(value) << 16) | ((uint32_t)(extra) << 8) | ((uint32_t)(kind) << 4))
+#define HUFF_LEN(e) ((e) & 15)
+#define HUFF_KIND(e) (((e) >> 4) & 15)
+#define HUFF_EXTRA(e) (((e) >> 8) & 15)
+#define HUFF_VALUE(e) ((e) >> 16)
+
+#define LITLEN_TABLE_BITS 11
+#define DIST_TABLE_BITS 8
+#define CODELEN_TABLE_BITS 7
+#define LITLEN_TABLE_SIZE ((1 << LITLEN_TABLE_BITS) + 288 * (1 << (15 - LITLEN_TABLE_BITS)))
+#define DIST_TABLE_SIZE ((1 << DIST_TABLE_BITS) + 32 * (1 << (15 - DIST_TABLE_BITS)))
+
+static const unsigned short inflate_length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                                        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char inflate_length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                                        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short inflate_dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                                      193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                                      6145, 8193, 12289, 16385, 24577 };
+static const unsigned char inflate_dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                                      6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+/**
+ * Returns the decode-table entry template for a literal/length symbol.
+ *
+ * @param symbol The symbol (0-287).
+ * @return The entry without its code length.
+ */
+uint32_t huff_litlen_entry(int symbol) {
+    if (symbol < 256) return HUFF_ENTRY(HUFF_LITERAL, 0, symbol);
+    if (symbol == 256) return HUFF_ENTRY(HUFF_END, 0, 0);
+    if (symbol < 286) return HUFF_ENTRY(HUFF_LENGTH, inflate_length_extra[symbol - 257], inflate_length_base[symbol - 257]);
+    return HUFF_ENTRY(HUFF_INVALID, 0, 0);
+}
+
+/**
+ * Returns the decode-table entry template for a distance symbol.
+ *
+ * @param symbol The symbol (0-31).
+ * @return The entry without its code length.
+ */
+uint32_t huff_dist_entry(int symbol) {
+    if (symbol < 30) return HUFF_ENTRY(HUFF_LENGTH, inflate_dist_extra[symbol], inflate_dist_base[symbol]);
+    return HUFF_ENTRY(HUFF_INVALID, 0, 0);
+}
+
+/**
+ * Returns the decode-table entry template for a code-length symbol.
+ *
+ * @param symbol The symbol (0-18).
+ * @return The entry without its code length.
+ */
+uint32_t huff_codelen_entry(int symbol) {
+    return HUFF_ENTRY(HUFF_LITERAL, 0, symbol);
+}
+
+/**
+ * Builds a canonical Huffman decode table: a primary table indexed by the next table_bits input bits
+ * plus, for longer codes, subtables indexed by the remaining bits. Unused slots decode as HUFF_INVALID.
+ *
+ * @param table The table to fill.
+ * @param table_bits The number of bits the primary table is indexed with.
+ * @param lengths The code length of every symbol (0 = unused).
+ * @param symbol_count The number of symbols.
+ * @param entry_for Returns the entry template of a symbol.
+ * @return 1 on success, 0 if the code lengths are over-subscribed.
+ */
+int huff_build(uint32_t *table, int table_bits, const unsigned char *lengths, int symbol_count, uint32_t (*entry_for)(int)) {
+    int count[16] = { 0 }, next_code[16], max_length = 0;
+
+    for (int i = 0; i < symbol_count; i++) {
+        count[lengths[i]]++;
+        if (lengths[i] > max_length) max_length = lengths[i];
+    }
+    count[0] = 0;
+    int left = 1;
+    for (int len = 1; len <= 15; len++) {
+        left = (left << 1) - count[len];
+        if (left < 0) return 0;  // Over-subscribed
+    }
+    next_code[1] = 0;
+    for (int len = 2; len <= 15; len++) {
+        next_code[len] = (next_code[len - 1] + count[len - 1]) << 1;
+    }
+
+    int primary_size = 1 << table_bits;
+    int sub_bits = max_length > table_bits ? max_length - table_bits : 0;
+    int next_subtable = primary_size;
+    for (int i = 0; i < primary_size; i++) {
+        table[i] = HUFF_ENTRY(HUFF_INVALID, 0, 0) | 1;
+    }
+
+    for (int symbol = 0; symbol < symbol_count; symbol++) {
+        int len = lengths[symbol];
+        if (!len) continue;
+        // Deflate sends codes LSB-first, so tables are indexed by the bit-reversed code
+        int code = next_code[len]++, reversed = 0;
+        for (int b = 0; b < len; b++) {
+            reversed |= ((code >> b) & 1) << (len - 1 - b);
+        }
+        uint32_t entry = entry_for(symbol);
+        if (len <= table_bits) {
+            for (int i = reversed; i < primary_size; i += 1 << len) {
+                table[i] = entry | len;
+            }
+        } else {
+            int prefix = reversed & (primary_size - 1);
+            if (HUFF_KIND(table[prefix]) != HUFF_SUBTABLE) {
+                table[prefix] = HUFF_ENTRY(HUFF_SUBTABLE, sub_bits, next_subtable) | table_bits;
+                for (int i = 0; i < (1 << sub_bits); i++) {
+                    table[next_subtable + i] = HUFF_ENTRY(HUFF_INVALID, 0, 0) | 1;
+                }
+                next_subtable += 1 << sub_bits;
+            }
+            uint32_t *subtable = table + HUFF_VALUE(table[prefix]);
+            int sub_len = len - table_bits;
+            for (int i = reversed >> table_bits; i < (1 << sub_bits); i += 1 << sub_len) {
+                subtable[i] = entry | sub_len;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Upgrades primary literal entries to literal pairs wherever the following literal's code also fits
+ * in the primary lookup, so runs of literals decode two bytes per table access.
+ *
+ * @param table A literal/length table built with LITLEN_TABLE_BITS.
+ */
+void huff_build_literal_pairs(uint32_t *table) {
+    uint32_t single[1 << LITLEN_TABLE_BITS];
+    memcpy(single, table, sizeof(single));
+
+    for (int i = 0; i < (1 << LITLEN_TABLE_BITS); i++) {
+        uint32_t first = single[i];
+        int first_len = HUFF_LEN(first);
+        if (HUFF_KIND(first) != HUFF_LITERAL || first_len >= LITLEN_TABLE_BITS) continue;
+        uint32_t second = single[i >> first_len];
+        int total_len = first_len + HUFF_LEN(second);
+        if (HUFF_KIND(second) == HUFF_LITERAL && total_len <= LITLEN_TABLE_BITS) {
+            table[i] = HUFF_ENTRY(HUFF_PAIR, 0, HUFF_VALUE(first) | (HUFF_VALUE(second) << 8)) | total_len;
+        }
+    }
+}
+
+typedef struct {
+    const unsigned char *in, *in_end;
+    uint64_t bitbuf;
+    int bitcount;
+    int overrun;  // Zero bytes fed in past the end of the input
+    uint32_t litlen[LITLEN_TABLE_SIZE];
+    uint32_t dist[DIST_TABLE_SIZE];
+} inflate_state;
+
+/**
+ * Tops the bit buffer up to at least 56 bits: eight bytes at a time while input remains, otherwise
+ * byte by byte with zero padding past the end (a valid stream never consumes the padding).
+ *
+ * @param s The inflater state.
+ */
+static inline void inflate_refill(inflate_state *s) {
+    if (s->in_end - s->in >= 8) {
+        uint64_t word;
+        memcpy(&word, s->in, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        s->bitbuf |= word << s->bitcount;
+        s->in += (63 - s->bitcount) >> 3;
+        s->bitcount |= 56;
+        return;
+    }
+    while (s->bitcount <= 56) {
+        uint64_t byte = 0;
+        if (s->in < s->in_end) byte = *s->in++;
+        else s->overrun++;
+        s->bitbuf |= byte << s->bitcount;
+        s->bitcount += 8;
+    }
+}
+
+/**
+ * Reads up to 32 bits from the stream.
+ *
+ * @param s The inflater state.
+ * @param n The number of bits.
+ * @return The bits, first bit in the lowest position.
+ */
+static inline uint32_t inflate_bits(inflate_state *s, int n) {
+    if (s->bitcount < n) inflate_refill(s);
+    uint32_t value = (uint32_t)(s->bitbuf & ((1ull << n) - 1));
+    s->bitbuf >>= n;
+    s->bitcount -= n;
+    return value;
+}
+
+/**
+ * Decodes one symbol with a table (the bit buffer must hold at least 15 bits).
+ *
+ * @param s The inflater state.
+ * @param table The decode table.
+ * @param table_bits The primary index width of the table.
+ * @return The decoded entry.
+ */
+static inline uint32_t inflate_decode(inflate_state *s, const uint32_t *table, int table_bits) {
+    uint32_t entry = table[s->bitbuf & ((1u << table_bits) - 1)];
+    if (HUFF_KIND(entry) == HUFF_SUBTABLE) {
+        s->bitbuf >>= table_bits;
+        s->bitcount -= table_bits;
+        entry = table[HUFF_VALUE(entry) + (s->bitbuf & ((1u << HUFF_EXTRA(entry)) - 1))];
+    }
+    s->bitbuf >>= HUFF_LEN(entry);
+    s->bitcount -= HUFF_LEN(entry);
+    return entry;
+}
+
+/**
+ * Reads the code lengths of a dynamic Huffman block and builds its tables.
+ *
+ * @param s The inflater state.
+ * @return 1 on success, 0 on a malformed header.
+ */
+int inflate_read_dynamic_tables(inflate_state *s) {
+    static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    unsigned char codelen_lengths[19] = { 0 }, lengths[288 + 32];
+    uint32_t codelen_table[1 << CODELEN_TABLE_BITS];
+
+    int litlen_count = (int)inflate_bits(s, 5) + 257;
+    int dist_count = (int)inflate_bits(s, 5) + 1;
+    int codelen_count = (int)inflate_bits(s, 4) + 4;
+    if (litlen_count > 286 || dist_count > 30) return 0;
+
+    for (int i = 0; i < codelen_count; i++) {
+        codelen_lengths[order[i]] = (unsigned char)inflate_bits(s, 3);
+    }
+    if (!huff_build(codelen_table, CODELEN_TABLE_BITS, codelen_lengths, 19, huff_codelen_entry)) return 0;
+
+    for (int i = 0; i < litlen_count + dist_count;) {
+        inflate_refill(s);
+        uint32_t entry = inflate_decode(s, codelen_table, CODELEN_TABLE_BITS);
+        if (HUFF_KIND(entry) != HUFF_LITERAL) return 0;
+        int symbol = (int)HUFF_VALUE(entry), repeat, value = 0;
+        if (symbol < 16) {
+            lengths[i++] = (unsigned char)symbol;
+            continue;
+        }
+        if (symbol == 16) {
+            if (i == 0) return 0;
+            value = lengths[i - 1];
+            repeat = 3 + (int)inflate_bits(s, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + (int)inflate_bits(s, 3);
+        } else {
+            repeat = 11 + (int)inflate_bits(s, 7);
+        }
+        if (i + repeat > litlen_count + dist_count) return 0;
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+    if (lengths[256] == 0) return 0;  // A block must be able to end
+
+    if (!huff_build(s->litlen, LITLEN_TABLE_BITS, lengths, litlen_count, huff_litlen_entry)) return 0;
+    huff_build_literal_pairs(s->litlen);
+    return huff_build(s->dist, DIST_TABLE_BITS, lengths + litlen_count, dist_count, huff_dist_entry);
+}
+
+/**
+ * Inflates a zlib stream into a buffer of known size. Decoding stops early once the buffer is full,
+ * which is all a PNG decoder needs; like stb_image, the Adler-32 trailer is not verified.
+ *
+ * @param in The zlib stream.
+ * @param in_len The length of the stream.
+ * @param out The output buffer.
+ * @param out_len The size of the output buffer.
+ * @param produced A pointer to store the number of bytes written.
+ * @return 1 on success, 0 on a malformed stream.
+ */
+int inflate_zlib_builtin(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len, size_t *produced) {
+    unsigned char *out_start = out, *out_end = out + out_len;
+    int final_block = 0, ok = 1;
+
+    if (in_len < 2 || (in[0] & 15) != 8 || ((in[0] << 8) | in[1]) % 31 != 0 || (in[1] & 32)) {
+        return 0;  // Not deflate, bad check bits or a preset dictionary
+    }
+    inflate_state *s = (inflate_state *)malloc(sizeof(inflate_state));
+    if (!s) {
+        printf("Memory allocation failed!\n");
+        return 0;
+    }
+    s->in = in + 2;
+    s->in_end = in + in_len;
+    s->bitbuf = 0;
+    s->bitcount = 0;
+    s->overrun = 0;
+
+    while (ok && !final_block && out < out_end) {
+        final_block = (int)inflate_bits(s, 1);
+        int type = (int)inflate_bits(s, 2);
+
+        if (type == 0) {
+            // Stored block: drop to a byte boundary and give the buffered whole bytes back to the input
+            inflate_bits(s, s->bitcount & 7);
+            int buffered = (s->bitcount >> 3) - s->overrun;
+            if (buffered < 0) { ok = 0; break; }
+            s->in -= buffered;
+            s->bitbuf = 0;
+            s->bitcount = 0;
+            s->overrun = 0;
+            if (s->in_end - s->in < 4) { ok = 0; break; }
+            size_t len = s->in[0] | (s->in[1] << 8), nlen = s->in[2] | (s->in[3] << 8);
+            s->in += 4;
+            if (len != (~nlen & 0xffff) || (size_t)(s->in_end - s->in) < len) { ok = 0; break; }
+            if (len > (size_t)(out_end - out)) len = (size_t)(out_end - out);
+            memcpy(out, s->in, len);
+            out += len;
+            s->in += len;
+            continue;
+        }
+        if (type == 1) {
+            unsigned char lengths[288 + 32];
+            memset(lengths, 8, 144);
+            memset(lengths + 144, 9, 112);
+            memset(lengths + 256, 7, 24);
+            memset(lengths + 280, 8, 8);
+            memset(lengths + 288, 5, 32);
+            huff_build(s->litlen, LITLEN_TABLE_BITS, lengths, 288, huff_litlen_entry);
+            huff_build_literal_pairs(s->litlen);
+            huff_build(s->dist, DIST_TABLE_BITS, lengths + 288, 32, huff_dist_entry);
+        } else if (type != 2 || !inflate_read_dynamic_tables(s)) {
+            ok = 0;
+            break;
+        }
+
+        // One refill per symbol covers the longest case: 15 + 5 length bits, 15 + 13 distance bits
+        while (1) {
+            inflate_refill(s);
+            uint32_t entry = inflate_decode(s, s->litlen, LITLEN_TABLE_BITS);
+            int kind = HUFF_KIND(entry);
+            if (kind == HUFF_PAIR) {
+                if (out_end - out < 2) {
+                    if (out < out_end) *out++ = (unsigned char)HUFF_VALUE(entry);
+                    break;
+                }
+                out[0] = (unsigned char)HUFF_VALUE(entry);
+                out[1] = (unsigned char)(HUFF_VALUE(entry) >> 8);
+                out += 2;
+                continue;
+            }
+            if (kind == HUFF_LITERAL) {
+                if (out >= out_end) break;
+                *out++ = (unsigned char)HUFF_VALUE(entry);
+                continue;
+            }
+            if (kind == HUFF_END) {
+                break;
+            }
+            if (kind != HUFF_LENGTH) {
+                ok = 0;
+                break;
+            }
+            size_t length = HUFF_VALUE(entry) + (size_t)(s->bitbuf & ((1u << HUFF_EXTRA(entry)) - 1));
+            s->bitbuf >>= HUFF_EXTRA(entry);
+            s->bitcount -= HUFF_EXTRA(entry);
+            entry = inflate_decode(s, s->dist, DIST_TABLE_BITS);
+            if (HUFF_KIND(entry) != HUFF_LENGTH) {
+                ok = 0;
+                break;
+            }
+            size_t distance = HUFF_VALUE(entry) + (size_t)(s->bitbuf & ((1u << HUFF_EXTRA(entry)) - 1));
+            s->bitbuf >>= HUFF_EXTRA(entry);
+            s->bitcount -= HUFF_EXTRA(entry);
+            if (distance > (size_t)(out - out_start)) {
+                ok = 0;
+                break;
+            }
+            if (length > (size_t)(out_end - out)) length = (size_t)(out_end - out);
+
+            const unsigned char *src = out - distance;
+            if (distance >= 8 && (size_t)(out_end - out) >= length + 8) {
+                // Non-overlapping 8-byte steps; the last step may write past the match but stays in the buffer
+                unsigned char *dst = out;
+                for (size_t copied = 0; copied < length; copied += 8) {
+                    memcpy(dst + copied, src + copied, 8);
+                }
+            } else if (distance == 1) {
+                memset(out, out[-1], length);
+            } else {
+                for (size_t i = 0; i < length; i++) {
+                    out[i] = src[i];
+                }
+            }
+            out += length;
+            if (out >= out_end) break;
+        }
+        if (s->overrun > 8) ok = 0;  // Read past the end of the stream
+    }
+
+    free(s);
+    *produced = (size_t)(out - out_start);
+    return ok;
+}
+
+/**
+ * Inflates a zlib stream into a buffer of known size with the selected backend.
+ *
+ * @param in The zlib stream.
+ * @param in_len The length of the stream.
+ * @param out The output buffer.
+ * @param out_len The size of the output buffer.
+ * @param backend An INFLATE_* value.
+ * @return 1 if the buffer was filled completely, 0 otherwise.
+ */
+int png_inflate(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len, int backend) {
+    size_t produced = 0;
+    if (backend == INFLATE_AUTO) {
+        backend = inflate_default_backend();
+    }
+
+#ifdef STEG_USE_ZLIB
+    if (backend == INFLATE_ZLIB) {
+        uLongf dest_len = (uLongf)out_len;
+        int result = uncompress(out, &dest_len, in, (uLong)in_len);
+        return (result == Z_OK || result == Z_BUF_ERROR) && dest_len == out_len;
+    }
+#endif
+    if (backend == INFLATE_STB) {
+        int decoded_len;
+        char *decoded = stbi_zlib_decode_malloc_guesssize_headerflag((const char *)in, (int)in_len, (int)out_len, &decoded_len, 1);
+        int ok = decoded && (size_t)decoded_len >= out_len;
+        if (ok) memcpy(out, decoded, out_len);
+        STBI_FREE(decoded);
+        return ok;
+    }
+    return inflate_zlib_builtin(in, in_len, out, out_len, &produced) && produced == out_len;
+}
+
+/**
+ * Reverses PNG filtering of one scanline (portable scalar code, used for every pixel size).
+ *
+ * @param filter The filter type byte.
+ * @param raw The filtered scanline (without the filter byte).
+ * @param prior The previous unfiltered scanline (all zeros for the first row).
+ * @param out The unfiltered scanline.
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel.
+ * @return 1 on success, 0 on an unknown filter type.
+ */
+int png_unfilter_row_scalar(int filter, const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes, int bpp) {
+    size_t i;
+    switch (filter) {
+        case 0:
+            memcpy(out, raw, row_bytes);
+            return 1;
+        case 1:
+            for (i = 0; i < (size_t)bpp; i++) out[i] = raw[i];
+            for (; i < row_bytes; i++) out[i] = (unsigned char)(raw[i] + out[i - bpp]);
+            return 1;
+        case 2:
+            for (i = 0; i < row_bytes; i++) out[i] = (unsigned char)(raw[i] + prior[i]);
+            return 1;
+        case 3:
+            for (i = 0; i < (size_t)bpp; i++) out[i] = (unsigned char)(raw[i] + (prior[i] >> 1));
+            for (; i < row_bytes; i++) out[i] = (unsigned char)(raw[i] + ((out[i - bpp] + prior[i]) >> 1));
+            return 1;
+        case 4:
+            for (i = 0; i < (size_t)bpp; i++) out[i] = (unsigned char)(raw[i] + prior[i]);
+            for (; i < row_bytes; i++) {
+                int a = out[i - bpp], b = prior[i], c = prior[i - bpp];
+                int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                int predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                out[i] = (unsigned char)(raw[i] + predictor);
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// SIMD unfilter kernels for 3- and 4-byte pixels (8-bit RGB and RGBA), modelled on libpng's SSE2 and NEON
+// filter code. Sub, Average and Paeth depend on the pixel to the left, so they work one pixel per register
+// step; Up has no such dependency and runs 16 bytes at a time. The kernel set is picked once at runtime.
+typedef void (*png_unfilter_fn)(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes);
+typedef void (*png_unfilter_pair_fn)(const unsigned char *raw, const unsigned char *raw_second, const unsigned char *prior, unsigned char *out,
+                                     unsigned char *out_second, size_t row_bytes);
+
+/**
+ * Returns how many bytes to move for the pixel at offset i. 3-byte pixels are moved as 4 bytes whenever
+ * the row has room: the extra lane is independent and the byte stored is overwritten by the next pixel.
+ * The last pixel of a 3-byte row is assembled from single bytes in registers; copying it through a stack
+ * temporary instead costs a store-to-load forwarding stall per pixel.
+ *
+ * @param i The byte offset of the pixel.
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel (3 or 4).
+ * @return 4 or 3.
+ */
+static inline int simd_pixel_bytes(size_t i, size_t row_bytes, int bpp) {
+    return (bpp == 4 || i + 4 <= row_bytes) ? 4 : 3;
+}
+
+/**
+ * Loads a pixel into the low lanes of a 32-bit value.
+ *
+ * @param p The pixel.
+ * @param bytes 4, or 3 for the last pixel of a 3-byte row.
+ * @return The pixel, first byte in the low bits (the SSE2 and NEON targets are little-endian).
+ */
+static inline uint32_t simd_load_pixel(const unsigned char *p, int bytes) {
+    uint32_t value;
+    if (bytes == 4) memcpy(&value, p, 4);
+    else value = p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return value;
+}
+
+/**
+ * Stores the low lanes of a 32-bit value as a pixel.
+ *
+ * @param p The destination.
+ * @param value The pixel.
+ * @param bytes 4, or 3 for the last pixel of a 3-byte row.
+ */
+static inline void simd_store_pixel(unsigned char *p, uint32_t value, int bytes) {
+    if (bytes == 4) {
+        memcpy(p, &value, 4);
+        return;
+    }
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+}
+
+#if defined(STEG_HAVE_SSE2)
+#define sse2_load_pixel(p, bytes) _mm_cvtsi32_si128((int)simd_load_pixel((p), (bytes)))
+#define sse2_store_pixel(p, v, bytes) simd_store_pixel((p), (uint32_t)_mm_cvtsi128_si32(v), (bytes))
+
+/**
+ * Sub: adds the unfiltered pixel to the left.
+ *
+ * @param raw The filtered scanline.
+ * @param out The unfiltered scanline.
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel (3 or 4).
+ */
+static inline void unfilter_sub_sse2(const unsigned char *raw, unsigned char *out, size_t row_bytes, int bpp) {
+    __m128i a = _mm_setzero_si128();
+    for (size_t i = 0; i < row_bytes; i += bpp) {
+        int bytes = simd_pixel_bytes(i, row_bytes, bpp);
+        a = _mm_add_epi8(a, sse2_load_pixel(raw + i, bytes));
+        sse2_store_pixel(out + i, a, bytes);
+    }
+}
+
+/**
+ * Up: adds the pixel above, 16 bytes at a time (any pixel size).
+ *
+ * @param raw The filtered scanline.
+ * @param prior The previous unfiltered scanline.
+ * @param out The unfiltered scanline.
+ * @param row_bytes The number of bytes per scanline.
+ */
+static void unfilter_up_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    size_t i = 0;
+    for (; i + 16 <= row_bytes; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(raw + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prior + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(x, b));
+    }
+    for (; i < row_bytes; i++) out[i] = (unsigned char)(raw[i] + prior[i]);
+}
+
+/**
+ * Average: adds floor((left + above) / 2). _mm_avg_epu8 rounds up, so the carry of odd sums is removed.
+ *
+ * @param raw The filtered scanline.
+ * @param prior The previous unfiltered scanline.
+ * @param out The unfiltered scanline.
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel (3 or 4).
+ */
+static inline void unfilter_avg_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes, int bpp) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (size_t i = 0; i < row_bytes; i += bpp) {
+        int bytes = simd_pixel_bytes(i, row_bytes, bpp);
+        __m128i b = sse2_load_pixel(prior + i, bytes);
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(sse2_load_pixel(raw + i, bytes), avg);
+        sse2_store_pixel(out + i, a, bytes);
+    }
+}
+
+// Branchless Paeth on 16-bit lanes: pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|; the smallest wins,
+// ties going to a, then b. ABS is the absolute-value instruction sequence of the target. The loop is
+// bound by the latency from one pixel to the next, so that path is kept short: a stays in 16-bit lanes
+// (the sum is masked to a byte instead of packed and unpacked) and the choice is two greater-than masks,
+// not a minimum compared back against each distance.
+#define PAETH_SSE_LOOP(ABS)                                                                          \
+    do {                                                                                              \
+        const __m128i zero = _mm_setzero_si128(), low_bytes = _mm_set1_epi16(0x00FF);                \
+        __m128i a = zero, c = zero;                                                                   \
+        for (size_t i = 0; i < row_bytes; i += bpp) {                                                 \
+            int bytes = simd_pixel_bytes(i, row_bytes, bpp);                                          \
+            __m128i b = _mm_unpacklo_epi8(sse2_load_pixel(prior + i, bytes), zero);                   \
+            __m128i x = _mm_unpacklo_epi8(sse2_load_pixel(raw + i, bytes), zero);                     \
+            __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);                               \
+            __m128i pc = ABS(_mm_add_epi16(pa, pb));                                                  \
+            pa = ABS(pa);                                                                             \
+            pb = ABS(pb);                                                                             \
+            __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));           \
+            __m128i not_b = _mm_cmpgt_epi16(pb, pc);                                                  \
+            __m128i b_or_c = _mm_or_si128(_mm_andnot_si128(not_b, b), _mm_and_si128(not_b, c));      \
+            __m128i nearest = _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, b_or_c)); \
+            a = _mm_and_si128(_mm_add_epi16(x, nearest), low_bytes);                                  \
+            sse2_store_pixel(out + i, _mm_packus_epi16(a, a), bytes);                                 \
+            c = b;                                                                                    \
+        }                                                                                             \
+    } while (0)
+
+// Paeth on two rows at once, a diagonal wavefront: step k unfilters pixel k of the first row in lanes 0-3
+// and pixel k - 1 of the second in lanes 4-7. The second row's pixel above is the first row's result of
+// the step before, which is still in the low lanes of a, and its pixel above-left is that of the step
+// before again, so c carries it. One latency chain then yields two pixels. The second row's lanes run on
+// zeros for the first step, which leaves them zero: exactly its a and c at its first pixel.
+#define PAETH_PAIR_SSE_LOOP(ABS)                                                                     \
+    do {                                                                                              \
+        const __m128i zero = _mm_setzero_si128(), low_bytes = _mm_set1_epi16(0x00FF);                \
+        __m128i a = zero, c = zero;                                                                   \
+        for (size_t i = 0; i <= row_bytes; i += bpp) {                                                \
+            __m128i b_first = zero, x_first = zero, x_second = zero;                                  \
+            if (i < row_bytes) {                                                                      \
+                int bytes = simd_pixel_bytes(i, row_bytes, bpp);                                      \
+                b_first = sse2_load_pixel(prior + i, bytes);                                          \
+                x_first = sse2_load_pixel(raw + i, bytes);                                            \
+            }                                                                                         \
+            if (i > 0) x_second = sse2_load_pixel(raw_second + i - bpp, simd_pixel_bytes(i - bpp, row_bytes, bpp)); \
+            __m128i b = _mm_unpacklo_epi64(_mm_unpacklo_epi8(b_first, zero), a);                     \
+            __m128i x = _mm_unpacklo_epi8(_mm_unpacklo_epi32(x_first, x_second), zero);              \
+            __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);                               \
+            __m128i pc = ABS(_mm_add_epi16(pa, pb));                                                  \
+            pa = ABS(pa);                                                                             \
+            pb = ABS(pb);                                                                             \
+            __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));           \
+            __m128i not_b = _mm_cmpgt_epi16(pb, pc);                                                  \
+            __m128i b_or_c = _mm_or_si128(_mm_andnot_si128(not_b, b), _mm_and_si128(not_b, c));      \
+            __m128i nearest = _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, b_or_c)); \
+            a = _mm_and_si128(_mm_add_epi16(x, nearest), low_bytes);                                  \
+            __m128i both = _mm_packus_epi16(a, a);                                                    \
+            if (i < row_bytes) sse2_store_pixel(out + i, both, simd_pixel_bytes(i, row_bytes, bpp));  \
+            if (i > 0) sse2_store_pixel(out_second + i - bpp, _mm_srli_si128(both, 4), simd_pixel_bytes(i - bpp, row_bytes, bpp)); \
+            c = b;                                                                                    \
+        }                                                                                             \
+    } while (0)
+
+#define SSE2_ABS_EPI16(v) _mm_max_epi16((v), _mm_sub_epi16(zero, (v)))
+
+/**
+ * Paeth with SSE2 only.
+ *
+ * @param raw The filtered scanline.
+ * @param prior The previous unfiltered scanline.
+ * @param out The unfiltered scanline.
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel (3 or 4).
+ */
+static inline void unfilter_paeth_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes, int bpp) {
+    PAETH_SSE_LOOP(SSE2_ABS_EPI16);
+}
+
+/**
+ * Paeth on two consecutive rows with SSE2 only.
+ *
+ * @param raw The first filtered scanline.
+ * @param raw_second The second filtered scanline.
+ * @param prior The scanline above the first, unfiltered.
+ * @param out The first unfiltered scanline.
+ * @param out_second The second unfiltered scanline.
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel (3 or 4).
+ */
+static inline void unfilter_paeth_pair_sse2(const unsigned char *raw, const unsigned char *raw_second, const unsigned char *prior, unsigned char *out,
+                                            unsigned char *out_second, size_t row_bytes, int bpp) {
+    PAETH_PAIR_SSE_LOOP(SSE2_ABS_EPI16);
+}
+
+// Fixed pixel-size entry points for the kernel table
+static void unfilter_sub3_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    (void)prior;
+    unfilter_sub_sse2(raw, out, row_bytes, 3);
+}
+static void unfilter_sub4_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    (void)prior;
+    unfilter_sub_sse2(raw, out, row_bytes, 4);
+}
+static void unfilter_avg3_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_avg_sse2(raw, prior, out, row_bytes, 3);
+}
+static void unfilter_avg4_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_avg_sse2(raw, prior, out, row_bytes, 4);
+}
+static void unfilter_paeth3_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_paeth_sse2(raw, prior, out, row_bytes, 3);
+}
+static void unfilter_paeth4_sse2(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_paeth_sse2(raw, prior, out, row_bytes, 4);
+}
+static void unfilter_paeth_pair3_sse2(const unsigned char *raw, const unsigned char *raw_second, const unsigned char *prior, unsigned char *out,
+                                      unsigned char *out_second, size_t row_bytes) {
+    unfilter_paeth_pair_sse2(raw, raw_second, prior, out, out_second, row_bytes, 3);
+}
+static void unfilter_paeth_pair4_sse2(const unsigned char *raw, const unsigned char *raw_second, const unsigned char *prior, unsigned char *out,
+                                      unsigned char *out_second, size_t row_bytes) {
+    unfilter_paeth_pair_sse2(raw, raw_second, prior, out, out_second, row_bytes, 4);
+}
+
+#ifdef STEG_HAVE_X86_DISPATCH
+// Paeth with SSSE3's single-instruction absolute value; only called when the CPU reports SSSE3
+__attribute__((target("ssse3"))) static void unfilter_paeth3_ssse3(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    const int bpp = 3;
+    PAETH_SSE_LOOP(_mm_abs_epi16);
+}
+__attribute__((target("ssse3"))) static void unfilter_paeth4_ssse3(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    const int bpp = 4;
+    PAETH_SSE_LOOP(_mm_abs_epi16);
+}
+__attribute__((target("ssse3"))) static void unfilter_paeth_pair3_ssse3(const unsigned char *raw, const unsigned char *raw_second, const unsigned char *prior,
+                                                                         unsigned char *out, unsigned char *out_second, size_t row_bytes) {
+    const int bpp = 3;
+    PAETH_PAIR_SSE_LOOP(_mm_abs_epi16);
+}
+__attribute__((target("ssse3"))) static void unfilter_paeth_pair4_ssse3(const unsigned char *raw, const unsigned char *raw_second, const unsigned char *prior,
+                                                                         unsigned char *out, unsigned char *out_second, size_t row_bytes) {
+    const int bpp = 4;
+    PAETH_PAIR_SSE_LOOP(_mm_abs_epi16);
+}
+#endif
+#endif
+
+#if defined(STEG_HAVE_NEON)
+#define neon_load_pixel(p, bytes) vreinterpret_u8_u32(vdup_n_u32(simd_load_pixel((p), (bytes))))
+#define neon_store_pixel(p, v, bytes) simd_store_pixel((p), vget_lane_u32(vreinterpret_u32_u8(v), 0), (bytes))
+
+/**
+ * Paeth predictor for a pixel (libpng's NEON formulation).
+ *
+ * @param a The unfiltered pixel to the left.
+ * @param b The pixel above.
+ * @param c The pixel above and to the left.
+ * @return The predicted pixel.
+ */
+static inline uint8x8_t neon_paeth(uint8x8_t a, uint8x8_t b, uint8x8_t c) {
+    uint16x8_t pa = vabdl_u8(b, c), pb = vabdl_u8(a, c);
+    uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+    uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+    uint8x8_t use_b = vmovn_u16(vcleq_u16(pb, pc));
+    return vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+}
+
+// NEON counterparts of the SSE2 kernels; vhadd_u8 already computes floor((a + b) / 2)
+static inline void unfilter_sub_neon(const unsigned char *raw, unsigned char *out, size_t row_bytes, int bpp) {
+    uint8x8_t a = vdup_n_u8(0);
+    for (size_t i = 0; i < row_bytes; i += bpp) {
+        int bytes = simd_pixel_bytes(i, row_bytes, bpp);
+        a = vadd_u8(a, neon_load_pixel(raw + i, bytes));
+        neon_store_pixel(out + i, a, bytes);
+    }
+}
+
+static void unfilter_up_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    size_t i = 0;
+    for (; i + 16 <= row_bytes; i += 16) {
+        vst1q_u8(out + i, vaddq_u8(vld1q_u8(raw + i), vld1q_u8(prior + i)));
+    }
+    for (; i < row_bytes; i++) out[i] = (unsigned char)(raw[i] + prior[i]);
+}
+
+static inline void unfilter_avg_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes, int bpp) {
+    uint8x8_t a = vdup_n_u8(0);
+    for (size_t i = 0; i < row_bytes; i += bpp) {
+        int bytes = simd_pixel_bytes(i, row_bytes, bpp);
+        a = vadd_u8(neon_load_pixel(raw + i, bytes), vhadd_u8(a, neon_load_pixel(prior + i, bytes)));
+        neon_store_pixel(out + i, a, bytes);
+    }
+}
+
+static inline void unfilter_paeth_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes, int bpp) {
+    uint8x8_t a = vdup_n_u8(0), c = a;
+    for (size_t i = 0; i < row_bytes; i += bpp) {
+        int bytes = simd_pixel_bytes(i, row_bytes, bpp);
+        uint8x8_t b = neon_load_pixel(prior + i, bytes);
+        a = vadd_u8(neon_load_pixel(raw + i, bytes), neon_paeth(a, b, c));
+        neon_store_pixel(out + i, a, bytes);
+        c = b;
+    }
+}
+
+// Fixed pixel-size entry points for the kernel table
+static void unfilter_sub3_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    (void)prior;
+    unfilter_sub_neon(raw, out, row_bytes, 3);
+}
+static void unfilter_sub4_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    (void)prior;
+    unfilter_sub_neon(raw, out, row_bytes, 4);
+}
+static void unfilter_avg3_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_avg_neon(raw, prior, out, row_bytes, 3);
+}
+static void unfilter_avg4_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_avg_neon(raw, prior, out, row_bytes, 4);
+}
+static void unfilter_paeth3_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_paeth_neon(raw, prior, out, row_bytes, 3);
+}
+static void unfilter_paeth4_neon(const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes) {
+    unfilter_paeth_neon(raw, prior, out, row_bytes, 4);
+}
+#endif
+
+// Kernels by filter type (1-4) and pixel size (3 or 4 bytes); NULL entries use the scalar code. Two
+// consecutive Paeth rows go to the two-row kernel of their pixel size, where there is one.
+static png_unfilter_fn png_unfilter_kernels[5][2];
+static png_unfilter_pair_fn png_unfilter_paeth_pairs[2];
+static const char *png_unfilter_isa = "scalar";
+static pthread_once_t png_unfilter_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the unfilter kernels for this CPU (called once).
+ */
+void png_unfilter_select(void) {
+#if defined(STEG_HAVE_SSE2)
+    png_unfilter_kernels[1][0] = unfilter_sub3_sse2;
+    png_unfilter_kernels[1][1] = unfilter_sub4_sse2;
+    png_unfilter_kernels[2][0] = png_unfilter_kernels[2][1] = unfilter_up_sse2;
+    png_unfilter_kernels[3][0] = unfilter_avg3_sse2;
+    png_unfilter_kernels[3][1] = unfilter_avg4_sse2;
+    png_unfilter_kernels[4][0] = unfilter_paeth3_sse2;
+    png_unfilter_kernels[4][1] = unfilter_paeth4_sse2;
+    png_unfilter_paeth_pairs[0] = unfilter_paeth_pair3_sse2;
+    png_unfilter_paeth_pairs[1] = unfilter_paeth_pair4_sse2;
+    png_unfilter_isa = "sse2";
+#ifdef STEG_HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        png_unfilter_kernels[4][0] = unfilter_paeth3_ssse3;
+        png_unfilter_kernels[4][1] = unfilter_paeth4_ssse3;
+        png_unfilter_paeth_pairs[0] = unfilter_paeth_pair3_ssse3;
+        png_unfilter_paeth_pairs[1] = unfilter_paeth_pair4_ssse3;
+        png_unfilter_isa = "ssse3";
+    }
+#endif
+#elif defined(STEG_HAVE_NEON)
+    png_unfilter_kernels[1][0] = unfilter_sub3_neon;
+    png_unfilter_kernels[1][1] = unfilter_sub4_neon;
+    png_unfilter_kernels[2][0] = png_unfilter_kernels[2][1] = unfilter_up_neon;
+    png_unfilter_kernels[3][0] = unfilter_avg3_neon;
+    png_unfilter_kernels[3][1] = unfilter_avg4_neon;
+    png_unfilter_kernels[4][0] = unfilter_paeth3_neon;
+    png_unfilter_kernels[4][1] = unfilter_paeth4_neon;
+    png_unfilter_isa = "neon";
+#endif
+}
+
+/**
+ * Returns the instruction set the unfilter kernels use on this CPU.
+ *
+ * @return "sse2", "ssse3", "neon" or "scalar".
+ */
+const char *png_unfilter_kernel_name(void) {
+    pthread_once(&png_unfilter_once, png_unfilter_select);
+    return png_unfilter_isa;
+}
+
+/**
+ * Reverses PNG filtering of one scanline, using the SIMD kernels for 3- and 4-byte pixels.
+ *
+ * @param filter The filter type byte.
+ * @param raw The filtered scanline (without the filter byte).
+ * @param prior The previous unfiltered scanline (all zeros for the first row).
+ * @param out The unfiltered scanline.
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel.
+ * @return 1 on success, 0 on an unknown filter type.
+ */
+int png_unfilter_row(int filter, const unsigned char *raw, const unsigned char *prior, unsigned char *out, size_t row_bytes, int bpp) {
+    pthread_once(&png_unfilter_once, png_unfilter_select);
+    if ((bpp == 3 || bpp == 4) && filter >= 1 && filter <= 4 && png_unfilter_kernels[filter][bpp - 3]) {
+        png_unfilter_kernels[filter][bpp - 3](raw, prior, out, row_bytes);
+        return 1;
+    }
+    return png_unfilter_row_scalar(filter, raw, prior, out, row_bytes, bpp);
+}
+
+/**
+ * Reverses PNG filtering of consecutive scanlines as the IDAT data holds them, each after its filter
+ * byte. Two Paeth rows in a row are unfiltered together when there is a two-row kernel.
+ *
+ * @param lines The filtered scanlines ((row_bytes + 1) bytes each).
+ * @param prior The unfiltered scanline above the first (all zeros for the first row of an image).
+ * @param out The unfiltered scanlines (row_bytes bytes each).
+ * @param row_bytes The number of bytes per scanline.
+ * @param bpp The number of bytes per pixel.
+ * @param rows The number of scanlines.
+ * @return 1 on success, 0 on an unknown filter type.
+ */
+int png_unfilter_rows(const unsigned char *lines, const unsigned char *prior, unsigned char *out, size_t row_bytes, int bpp, int rows) {
+    pthread_once(&png_unfilter_once, png_unfilter_select);
+    png_unfilter_pair_fn pair = bpp == 3 || bpp == 4 ? png_unfilter_paeth_pairs[bpp - 3] : NULL;
+    for (int y = 0; y < rows;) {
+        const unsigned char *line = lines + (size_t)y * (row_bytes + 1);
+        unsigned char *row = out + (size_t)y * row_bytes;
+        if (pair && y + 1 < rows && line[0] == 4 && line[row_bytes + 1] == 4) {
+            pair(line + 1, line + row_bytes + 2, prior, row, row + row_bytes, row_bytes);
+            prior = row + row_bytes;
+            y += 2;
+            continue;
+        }
+        if (!png_unfilter_row(line[0], line + 1, prior, row, row_bytes, bpp)) return 0;
+        prior = row;
+        y++;
+    }
+    return 1;
+}
+
+/**
+ * Unfilters the seven passes of an interlaced image and puts each pass row straight in its place: in
+ * pass order, or spread to its pixels in raster order. No pass is ever held as an image of its own.
+ *
+ * @param raw The inflated scanlines of the passes.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param bpp The filter's bytes per pixel (1 for indices).
+ * @param bits The bits per index of an indexed image below 8 bits, unpacked to a byte each; 0 otherwise.
+ * @param pass_order 1 to return the passes back to back, 0 for raster order.
+ * @param zero_row A row of zeros at least as long as a scanline of the image (the prior row of the first).
+ * @param pixels The output (width * height pixels of bpp bytes).
+ * @return 1 on success, 0 on an invalid filter type or an allocation failure.
+ */
+static int png_unfilter_adam7(const unsigned char *raw, int width, int height, int bpp, int bits, int pass_order, const unsigned char *zero_row,
+                              unsigned char *pixels) {
+    size_t max_row = bits ? palette_row_bytes(width, bits) : (size_t)width * bpp;
+    unsigned char *rows = (unsigned char *)malloc(2 * max_row);  // The current and prior rows of a pass
+    unsigned char *line = bits ? (unsigned char *)malloc(width) : NULL;
+    int ok = rows && (!bits || line);
+    size_t offset = 0;  // Start of the pass in pass order
+
+    for (int pass = 0; ok && pass < 7; pass++) {
+        int pass_width, pass_height;
+        adam7_pass_size(pass, width, height, &pass_width, &pass_height);
+        if (pass_width == 0 || pass_height == 0) continue;
+        size_t row_bytes = bits ? palette_row_bytes(pass_width, bits) : (size_t)pass_width * bpp;
+        size_t pass_row = (size_t)pass_width * bpp;
+        int direct = pass_order && !bits;  // Unfilter straight into the pass
+        for (int y = 0; ok && y < pass_height; y++, raw += row_bytes + 1) {
+            unsigned char *out = direct ? pixels + offset + y * pass_row : rows + (y & 1) * max_row;
+            const unsigned char *prior = y == 0 ? zero_row : direct ? out - pass_row : rows + ((y - 1) & 1) * max_row;
+            ok = png_unfilter_row(raw[0], raw + 1, prior, out, row_bytes, bpp);
+            if (!ok || direct) continue;
+            if (bits) {
+                palette_unpack_row(out, pass_width, bits, line);
+                out = line;
+            }
+            if (pass_order) {
+                memcpy(pixels + offset + y * pass_row, out, pass_row);
+                continue;
+            }
+            unsigned char *target = pixels + ((size_t)(adam7_y0[pass] + y * adam7_dy[pass]) * width + adam7_x0[pass]) * bpp;
+            size_t step = (size_t)adam7_dx[pass] * bpp;
+            for (int x = 0; x < pass_width; x++, target += step) memcpy(target, out + (size_t)x * bpp, bpp);
+        }
+        offset += pass_row * pass_height;
+    }
+    free(rows);
+    free(line);
+    return ok;
+}
+
+// Limits on the images a PNG header may declare. The encoder keeps lengths in ints, so larger images
+// could not be written back anyway. Deflate expands at most 1032:1 (a 258-byte match in two bits), so
+// image data that would have to expand further cannot be genuine.
+#define PNG_MAX_IMAGE_BYTES ((size_t)INT32_MAX)
+#define PNG_MAX_INFLATE_RATIO 1032
+
+/**
+ * Computes a * b + add for sizes read from a file, failing instead of wrapping around (like
+ * stb_image's stbi__mad3sizes_valid).
+ *
+ * @param a The first factor.
+ * @param b The second factor.
+ * @param add The term to add.
+ * @param result A pointer to store the result.
+ * @return 1 on success, 0 if the result does not fit in a size_t.
+ */
+static inline int size_mul_add(size_t a, size_t b, size_t add, size_t *result) {
+    if (b != 0 && a > (SIZE_MAX - add) / b) return 0;
+    *result = a * b + add;
+    return 1;
+}
+
+/**
+ * Decodes a PNG file in memory when it is one of the formats handled natively.
+ *
+ * @param data The PNG file contents.
+ * @param len The size of the file.
+ * @param width A pointer to store the width.
+ * @param height A pointer to store the height.
+ * @param channels A pointer to store the channel count.
+ * @param depth A pointer to store the bits per sample (8 or 16).
+ * @param palette A pointer to store the palette of an indexed image, which is then returned as one index
+ *                per byte (one channel, 8 bits); NULL to leave indexed images to stb_image. Its entry
+ *                count is set to 0 for other images.
+ * @param pass_order NULL to return an interlaced image in raster order. Otherwise 1 on entry asks for
+ *                   an interlaced image in Adam7 pass order, with no deinterlacing, and on return it
+ *                   is 1 if the pixels are in pass order.
+ * @param backend An INFLATE_* value.
+ * @param handled A pointer set to 1 if the file was handled here (even if decoding failed), 0 if the
+ *                caller should fall back to stb_image.
+ * @return The pixels (free with free()), or NULL.
+ */
+unsigned char *png_decode_native(const unsigned char *data, size_t len, int *width, int *height, int *channels, int *depth, steg_palette *palette,
+                                 int *pass_order, int backend, int *handled) {
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    static const int channels_for_type[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    const unsigned char *idat = NULL, *plte = NULL, *trns = NULL;
+    unsigned char *joined = NULL;
+    size_t idat_len = 0, idat_chunks = 0, plte_len = 0, trns_len = 0;
+
+    int passes = pass_order && *pass_order;
+    *handled = 0;
+    if (palette) palette->entries = 0;
+    if (pass_order) *pass_order = 0;
+    if (len < 8 + 25 || memcmp(data, signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0) {
+        return NULL;
+    }
+    uint32_t w = read_be32(data + 16), h = read_be32(data + 20);
+    int bits = data[24], color_type = data[25], interlace = data[28];
+    int indexed = color_type == 3 && palette && (bits == 1 || bits == 2 || bits == 4 || bits == 8);
+    if ((!indexed && bits != 8 && bits != 16) || color_type > 6 || channels_for_type[color_type] == 0 || (color_type == 3 && !indexed) ||
+        interlace > 1 || data[26] || data[27] || w == 0 || h == 0 || w > (1u << 24) || h > (1u << 24)) {
+        return NULL;  // Sub-byte gray, huge, or a palette the caller wants expanded: stb_image handles these
+    }
+    if (backend == INFLATE_STB && !indexed) {
+        return NULL;  // stb_image decodes the rest itself; indices only it cannot return
+    }
+    int n = channels_for_type[color_type], bpp = indexed ? 1 : n * (bits / 8);
+
+    // Collect the IDAT chunks; a single IDAT is used in place
+    for (size_t pos = 8; pos + 12 <= len;) {
+        uint32_t chunk_len = read_be32(data + pos);
+        const unsigned char *tag = data + pos + 4;
+        if (chunk_len > len - pos - 12) return NULL;
+        if (memcmp(tag, "IDAT", 4) == 0) {
+            if (idat_chunks++ == 0) idat = tag + 4;
+            idat_len += chunk_len;
+        } else if (indexed && memcmp(tag, "PLTE", 4) == 0) {
+            plte = tag + 4;
+            plte_len = chunk_len;
+        } else if (indexed && memcmp(tag, "tRNS", 4) == 0) {
+            trns = tag + 4;
+            trns_len = chunk_len;
+        } else if (memcmp(tag, "tRNS", 4) == 0 || memcmp(tag, "CgBI", 4) == 0) {
+            return NULL;  // stb_image adds an alpha channel / undoes Apple's format
+        } else if (memcmp(tag, "IEND", 4) == 0) {
+            break;
+        } else if (!(tag[0] & 32) && memcmp(tag, "IHDR", 4) != 0 && memcmp(tag, "PLTE", 4) != 0) {
+            return NULL;  // Unknown critical chunk: let stb_image report it
+        }
+        pos += 12 + chunk_len;
+    }
+    if (idat_chunks == 0) return NULL;
+    if (indexed && (plte_len == 0 || plte_len % 3 != 0 || plte_len / 3 > (1u << bits) || trns_len > plte_len / 3)) {
+        return NULL;  // Malformed palette: let stb_image report it
+    }
+    *handled = 1;
+
+    // Indices below 8 bits are unfiltered packed, then spread to a byte each. The sizes come from the
+    // header, so they are checked before anything is allocated: for overflow, against the size cap, and
+    // against what the IDAT data can inflate to.
+    size_t row_bytes = indexed ? palette_row_bytes((int)w, bits) : (size_t)w * bpp;
+    size_t raw_len = 0, pixel_bytes = 0;
+    int sizes_ok = size_mul_add(indexed ? w : row_bytes, h, 0, &pixel_bytes);
+    for (int pass = 0; pass < (interlace ? 7 : 1); pass++) {
+        int pass_width = (int)w, pass_height = (int)h;
+        if (interlace) adam7_pass_size(pass, (int)w, (int)h, &pass_width, &pass_height);
+        if (pass_width > 0) {
+            size_t pass_row_bytes = indexed ? palette_row_bytes(pass_width, bits) : (size_t)pass_width * bpp;
+            sizes_ok = sizes_ok && size_mul_add(pass_row_bytes + 1, (size_t)pass_height, raw_len, &raw_len);
+        }
+    }
+    if (!sizes_ok || pixel_bytes > PNG_MAX_IMAGE_BYTES || raw_len > PNG_MAX_IMAGE_BYTES) {
+        printf("ERROR: A %u x %u PNG is too large to decode.\n", w, h);
+        return NULL;
+    }
+    if (raw_len / PNG_MAX_INFLATE_RATIO > idat_len) {
+        printf("ERROR: The PNG's %zu bytes of image data cannot hold a %u x %u image.\n", idat_len, w, h);
+        return NULL;
+    }
+
+    if (idat_chunks > 1) {
+        joined = (unsigned char *)malloc(idat_len);
+        if (!joined) {
+            printf("Memory allocation failed!\n");
+            return NULL;
+        }
+        size_t offset = 0;
+        for (size_t pos = 8; pos + 12 <= len; pos += 12 + read_be32(data + pos)) {
+            uint32_t chunk_len = read_be32(data + pos);
+            if (memcmp(data + pos + 4, "IDAT", 4) == 0) {
+                memcpy(joined + offset, data + pos + 8, chunk_len);
+                offset += chunk_len;
+            } else if (memcmp(data + pos + 4, "IEND", 4) == 0) {
+                break;
+            }
+        }
+        idat = joined;
+    }
+
+    unsigned char *raw = (unsigned char *)malloc(raw_len);
+    unsigned char *pixels = (unsigned char *)malloc(pixel_bytes);
+    unsigned char *packed = !interlace && indexed && bits < 8 ? (unsigned char *)malloc(row_bytes * h) : pixels;
+    unsigned char *zero_row = (unsigned char *)calloc(row_bytes, 1);
+    int ok = raw && pixels && packed && zero_row && png_inflate(idat, idat_len, raw, raw_len, backend);
+
+    if (interlace) {
+        ok = ok && png_unfilter_adam7(raw, (int)w, (int)h, bpp, indexed && bits < 8 ? bits : 0, passes, zero_row, pixels);
+    }
+    if (!interlace) {
+        ok = ok && png_unfilter_rows(raw, zero_row, packed, row_bytes, bpp, (int)h);
+    }
+    if (packed != pixels) {
+        for (uint32_t y = 0; ok && y < h; y++) palette_unpack_row(packed + y * row_bytes, (int)w, bits, pixels + (size_t)y * w);
+        free(packed);
+    }
+    if (indexed && ok) {
+        unsigned char highest = 0;
+        for (size_t i = 0; i < (size_t)w * h; i++) highest = pixels[i] > highest ? pixels[i] : highest;
+        if (highest >= plte_len / 3) {
+            ok = 0;
+            *handled = 0;  // An index past the palette: stb_image expands it as it always did
+        }
+    }
+    if (indexed && ok) {
+        palette->entries = (int)(plte_len / 3);
+        palette->bits = bits;
+        palette->alphas = (int)trns_len;
+        memcpy(palette->rgb, plte, plte_len);
+        memset(palette->alpha, 255, sizeof(palette->alpha));
+        if (trns_len) memcpy(palette->alpha, trns, trns_len);
+        while (palette->alphas > 0 && palette->alpha[palette->alphas - 1] == 255) palette->alphas--;
+    }
+    free(joined);
+    free(raw);
+    free(zero_row);
+    if (!ok) {
+        free(pixels);
+        return NULL;
+    }
+    *width = (int)w;
+    *height = (int)h;
+    *channels = n;
+    *depth = indexed ? 8 : bits;
+    if (pass_order) *pass_order = passes && interlace;
+    return pixels;
+}
+
+/**
+ * Decodes an image file in memory: natively for common PNGs, through stb_image otherwise. A 16-bit
+ * image is returned with big-endian samples, or reduced to its high bytes if the caller takes no depth.
+ * An indexed PNG is returned as its indices if the caller takes a palette, or expanded to RGB(A).
+ *
+ * @param data The file contents.
+ * @param len The size of the file.
+ * @param width A pointer to store the width.
+ * @param height A pointer to store the height.
+ * @param channels A pointer to store the channel count.
+ * @param depth A pointer to store the bits per sample (8 or 16), or NULL for 8-bit samples only.
+ * @param palette A pointer to store the palette (0 entries unless the indices are returned), or NULL.
+ * @param pass_order NULL for raster order, or as for png_decode_native(): 1 on entry asks for an
+ *                   interlaced PNG in Adam7 pass order, and on return tells whether it came back so
+ *                   (stb_image always deinterlaces).
+ * @param backend The INFLATE_* backend for natively decoded PNGs.
+ * @return The pixels (free with stbi_image_free()), or NULL on failure.
+ */
+unsigned char *image_load_from_memory(const unsigned char *data, size_t len, int *width, int *height, int *channels, int *depth, steg_palette *palette,
+                                      int *pass_order, int backend) {
+    int handled = 0, bits = 8;
+    unsigned char *pixels = NULL;
+    if (palette) palette->entries = 0;
+    if (backend != INFLATE_STB || palette) {
+        pixels = png_decode_native(data, len, width, height, channels, &bits, palette, pass_order, backend, &handled);
+    }
+    if (pass_order && !handled) *pass_order = 0;
+    if (!handled && depth && stbi_is_16_bit_from_memory(data, (int)len)) {
+        stbi_us *samples = stbi_load_16_from_memory(data, (int)len, width, height, channels, 0);
+        pixels = (unsigned char *)samples;
+        for (size_t i = 0, count = samples ? (size_t)*width * *height * *channels : 0; i < count; i++) {
+            stbi_us sample = samples[i];
+            pixels[i * 2] = (unsigned char)(sample >> 8);
+            pixels[i * 2 + 1] = (unsigned char)sample;
+        }
+        bits = 16;
+    } else if (!handled) {
+        pixels = stbi_load_from_memory(data, (int)len, width, height, channels, 0);
+    }
+    if (pixels && bits == 16 && !depth) {
+        for (size_t i = 0, count = (size_t)*width * *height * *channels; i < count; i++) pixels[i] = pixels[i * 2];
+        bits = 8;
+    }
+    if (depth) *depth = bits;
+    return pixels;
+}
+
+/**
+ * Reads a whole file into memory.
+ *
+ * @param filename The file to read.
+ * @param length A pointer to store the file size.
+ * @return The file contents (free with free()), or NULL on failure.
+ */
+unsigned char *read_file(const char *filename, size_t *length) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return NULL;
+    }
+    unsigned char *data = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long size = ftell(file);
+        if (size >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+            data = (unsigned char *)malloc(size ? (size_t)size : 1);
+            if (data && fread(data, 1, (size_t)size, file) != (size_t)size) {
+                free(data);
+                data = NULL;
+            }
+            *length = (size_t)size;
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+/**
+ * Loads an image file: natively decoded for common PNGs, through stb_image otherwise.
+ *
+ * @param filename The image file.
+ * @param width A pointer to store the width.
+ * @param height A pointer to store the height.
+ * @param channels A pointer to store the channel count.
+ * @param depth A pointer to store the bits per sample (8 or 16), or NULL for 8-bit samples only.
+ * @param palette A pointer to store the palette of an indexed PNG, returned as its indices, or NULL.
+ * @param chunks A pointer to store the ancillary chunks an encoded copy keeps (free with png_chunks_free()),
+ *               or NULL.
+ * @return The pixels (free with stbi_image_free()), or NULL on failure.
+ */
+unsigned char *image_load(const char *filename, int *width, int *height, int *channels, int *depth, steg_palette *palette, png_chunks *chunks) {
+    size_t length;
+    unsigned char *data = read_file(filename, &length);
+    if (!data) {
+        return NULL;
+    }
+    unsigned char *pixels = image_load_from_memory(data, length, width, height, channels, depth, palette, NULL, INFLATE_AUTO);
+    if (pixels && chunks &&
+        !png_chunks_collect(data, length, *channels, depth ? *depth : 8, palette && palette->entries ? palette : NULL, chunks)) {
+        stbi_image_free(pixels);
+        pixels = NULL;
+    }
+    free(data);
+    return pixels;
+}
+
+/**
+ * Puts a decoded image in the pixel order its message was embedded in (see --embed-order). The image
+ * is reordered only if the order it is held in has no message header and the other Adam7 order has
+ * one, so a message in the usual order costs nothing extra.
+ *
+ * @param pixels A pointer to the image data; replaced, and the old data freed, if the image is reordered.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The channel count (1 for indices).
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key, or NULL.
+ * @param pass_order A pointer to the order the image is held in (1 for Adam7 pass order); updated.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int adam7_find_message_order(unsigned char **pixels, int width, int height, int channels, int depth, const steg_secrets *secrets, int *pass_order) {
+    int bpp = channels * (depth / 8);
+    size_t pixel_bytes = (size_t)width * height * bpp;
+    if (message_header_found(*pixels, pixel_bytes, depth, secrets)) {
+        return 1;
+    }
+    unsigned char *other = adam7_reordered(*pixels, width, height, bpp, !*pass_order);
+    if (!other) {
+        return 0;
+    }
+    if (message_header_found(other, pixel_bytes, depth, secrets)) {
+        stbi_image_free(*pixels);
+        *pixels = other;
+        *pass_order = !*pass_order;
+    } else {
+        free(other);
+    }
+    return 1;
+}
+
+// Asynchronous file I/O for batch mode. Inputs are prefetched whole into memory (decoded with
+// stbi_load_from_memory) and encoded PNGs are handed off for writing, so disk time overlaps with CPU work.
+// On Linux the io_uring backend drives the kernel ring directly through its system calls; elsewhere,
+// or when the kernel refuses io_uring, a small thread pool performs blocking pread/pwrite calls. Both the
+// inputs read ahead and the encoded PNGs waiting to be written are limited to the batch's --queue-depth,
+// so the memory they hold does not grow with the batch.
+#define IO_BACKEND_SYNC 0
+#define IO_BACKEND_THREADS 1
+#define IO_BACKEND_URING 2
+#define IO_BACKEND_AUTO 3
+
+#define IO_POOL_THREADS 4       // Threads in the pread/pwrite pool
+#define IO_MAX_IN_FLIGHT 64     // Requests submitted but not yet completed (also the io_uring ring size)
+
+typedef struct steg_io_request steg_io_request;
+struct steg_io_request {
+    int is_write;
+    const char *filename;
+    unsigned char *data;       // Read: allocated by the backend; write: owned by the backend until completion
+    size_t length;
+    size_t done;               // Bytes transferred so far (reads and writes may complete partially)
+    int fd;
+    atomic_int state;          // IO_REQUEST_* below
+    int error;                 // errno of a failed request
+    steg_io_request *next;     // Thread-pool queue link
+};
+
+#define IO_REQUEST_IDLE 0       // Not submitted yet
+#define IO_REQUEST_PENDING 1    // Claimed or in flight
+#define IO_REQUEST_DONE 2
+#define IO_REQUEST_FAILED 3
+
+typedef struct {
+    int backend;
+    int in_flight;
+    int writes_in_flight;        // Writes submitted but not yet completed; each holds its whole file
+    int write_limit;             // Writes that may be in flight at once
+    pthread_mutex_t lock;        // Guards the counts, the thread-pool queue and completion waits
+    pthread_cond_t done_cond;    // Signalled whenever a request completes
+
+    // Thread-pool backend
+    pthread_cond_t work_cond;
+    steg_io_request *queue_head, *queue_tail;
+    pthread_t threads[IO_POOL_THREADS];
+    int thread_count;
+    int stopping;
+
+#ifdef STEG_HAVE_IO_URING
+    // io_uring backend
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t submit_lock;  // Serializes writers of the submission queue
+    pthread_t reaper;
+#endif
+} steg_io;
+
+/**
+ * Marks a request finished and wakes every waiter.
+ *
+ * @param io The I/O context.
+ * @param request The request.
+ * @param error 0 on success, otherwise the errno of the failure.
+ */
+void io_complete(steg_io *io, steg_io_request *request, int error) {
+    if (request->fd >= 0) {
+        close(request->fd);
+        request->fd = -1;
+    }
+    if (request->is_write) {
+        free(request->data);  // The encoded PNG is no longer needed once written
+        request->data = NULL;
+    } else if (error) {
+        free(request->data);
+        request->data = NULL;
+    }
+    pthread_mutex_lock(&io->lock);
+    request->error = error;
+    atomic_store(&request->state, error ? IO_REQUEST_FAILED : IO_REQUEST_DONE);
+    io->in_flight--;
+    if (request->is_write) io->writes_in_flight--;
+    pthread_cond_broadcast(&io->done_cond);
+    pthread_mutex_unlock(&io->lock);
+}
+
+#ifdef _WIN32
+// Windows has no pread/pwrite; every request owns its descriptor, so seeking first is equivalent
+ssize_t pread(int fd, void *buffer, size_t count, off_t offset) {
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) return -1;
+    return _read(fd, buffer, (unsigned)count);
+}
+
+ssize_t pwrite(int fd, const void *buffer, size_t count, off_t offset) {
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) return -1;
+    return _write(fd, buffer, (unsigned)count);
+}
+#endif
+
+/**
+ * Performs the remainder of a request with blocking pread/pwrite calls.
+ *
+ * @param request The request.
+ * @return 0 on success, otherwise an errno value.
+ */
+int io_transfer_blocking(steg_io_request *request) {
+    while (request->done < request->length) {
+        ssize_t n = request->is_write
+                        ? pwrite(request->fd, request->data + request->done, request->length - request->done, (off_t)request->done)
+                        : pread(request->fd, request->data + request->done, request->length - request->done, (off_t)request->done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (n == 0) {
+            return EIO;  // The file shrank while we were reading it
+        }
+        request->done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Opens the file of a request and, for reads, allocates a buffer for the whole file.
+ *
+ * @param request The request.
+ * @return 0 on success, otherwise an errno value.
+ */
+int io_open_request(steg_io_request *request) {
+    request->fd = request->is_write ? open(request->filename, O_WRONLY | O_CREAT | O_TRUNC | STEG_O_BINARY, 0644)
+                                    : open(request->filename, O_RDONLY | STEG_O_BINARY);
+    if (request->fd < 0) {
+        return errno;
+    }
+    if (!request->is_write) {
+        struct stat st;
+        if (fstat(request->fd, &st) != 0) {
+            return errno;
+        }
+        request->length = (size_t)st.st_size;
+        request->data = (unsigned char *)malloc(request->length ? request->length : 1);
+        if (!request->data) {
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Thread-pool worker: runs queued requests with blocking calls until the pool stops.
+ */
+void *io_pool_thread(void *arg) {
+    steg_io *io = (steg_io *)arg;
+    while (1) {
+        pthread_mutex_lock(&io->lock);
+        while (!io->queue_head && !io->stopping) {
+            pthread_cond_wait(&io->work_cond, &io->lock);
+        }
+        steg_io_request *request = io->queue_head;
+        if (!request) {
+            pthread_mutex_unlock(&io->lock);
+            return NULL;
+        }
+        io->queue_head = request->next;
+        if (!io->queue_head) io->queue_tail = NULL;
+        pthread_mutex_unlock(&io->lock);
+
+        int error = io_open_request(request);
+        if (!error) {
+            error = io_transfer_blocking(request);
+        }
+        io_complete(io, request, error);
+    }
+}
+
+#ifdef STEG_HAVE_IO_URING
+/**
+ * Queues one read or write SQE for the untransferred part of a request and submits it to the kernel.
+ *
+ * @param io The I/O context.
+ * @param request The request.
+ * @return 0 on success, otherwise an errno value.
+ */
+int io_uring_queue(steg_io *io, steg_io_request *request) {
+    pthread_mutex_lock(&io->submit_lock);
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(request->data + request->done);
+    sqe->len = (unsigned)(request->length - request->done > 0x7ffff000u ? 0x7ffff000u : request->length - request->done);
+    sqe->off = request->done;
+    sqe->user_data = (unsigned long long)(uintptr_t)request;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int result = (int)syscall(__NR_io_uring_enter, io->ring_fd, 1, 0, 0, NULL, 0);
+    pthread_mutex_unlock(&io->submit_lock);
+    return result < 0 ? errno : 0;
+}
+
+/**
+ * Reaper thread: waits for completions and finishes, resubmits or falls back on each request.
+ * A completion with user_data 0 (a NOP queued by io_shutdown) ends the thread.
+ */
+void *io_uring_reaper(void *arg) {
+    steg_io *io = (steg_io *)arg;
+    int running = 1;
+
+    while (running) {
+        if (syscall(__NR_io_uring_enter, io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            break;
+        }
+        unsigned head = *io->cq_head;
+        unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+            steg_io_request *request = (steg_io_request *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+
+            if (!request) {
+                running = 0;
+                continue;
+            }
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                // Kernel without IORING_OP_READ/WRITE: finish this request with blocking calls
+                io_complete(io, request, io_transfer_blocking(request));
+            } else if (res < 0) {
+                io_complete(io, request, -res);
+            } else if (res == 0 && request->done < request->length) {
+                io_complete(io, request, EIO);
+            } else {
+                request->done += (size_t)res;
+                int error = request->done < request->length ? io_uring_queue(io, request) : 0;
+                if (request->done >= request->length || error) {
+                    io_complete(io, request, error);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Sets up an io_uring instance and maps its submission and completion rings.
+ *
+ * @param io The I/O context.
+ * @return 1 on success, 0 if io_uring is unavailable.
+ */
+int io_uring_start(steg_io *io) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    io->ring_fd = (int)syscall(__NR_io_uring_setup, IO_MAX_IN_FLIGHT, &params);
+    if (io->ring_fd < 0) {
+        return 0;
+    }
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_ring_size > io->sq_ring_size) io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = io->sq_ring_size;
+    }
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    io->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                      ? io->sq_ring
+                      : mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+    io->sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        close(io->ring_fd);
+        return 0;
+    }
+
+    unsigned char *sq = (unsigned char *)io->sq_ring, *cq = (unsigned char *)io->cq_ring;
+    io->sq_head = (unsigned *)(sq + params.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + params.sq_off.array);
+    io->cq_head = (unsigned *)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    pthread_mutex_init(&io->submit_lock, NULL);
+    if (pthread_create(&io->reaper, NULL, io_uring_reaper, io) != 0) {
+        pthread_mutex_destroy(&io->submit_lock);
+        close(io->ring_fd);
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+/**
+ * Starts an I/O context, falling back from io_uring to the thread pool to blocking calls.
+ *
+ * @param io The I/O context.
+ * @param backend The requested IO_BACKEND_* value.
+ * @param write_limit The number of writes that may be in flight at once.
+ */
+void io_start(steg_io *io, int backend, int write_limit) {
+    memset(io, 0, sizeof(*io));
+    io->write_limit = write_limit;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->done_cond, NULL);
+    pthread_cond_init(&io->work_cond, NULL);
+
+    if (backend == IO_BACKEND_URING || backend == IO_BACKEND_AUTO) {
+#ifdef STEG_HAVE_IO_URING
+        if (io_uring_start(io)) {
+            io->backend = IO_BACKEND_URING;
+            return;
+        }
+#endif
+        if (backend == IO_BACKEND_URING) {
+            printf("Warning: io_uring is unavailable; using the thread-pool I/O backend.\n");
+        }
+        backend = IO_BACKEND_THREADS;
+    }
+    if (backend == IO_BACKEND_THREADS) {
+        for (int i = 0; i < IO_POOL_THREADS; i++) {
+            if (pthread_create(&io->threads[i], NULL, io_pool_thread, io) != 0) break;
+            io->thread_count++;
+        }
+        if (io->thread_count > 0) {
+            io->backend = IO_BACKEND_THREADS;
+            return;
+        }
+    }
+    io->backend = IO_BACKEND_SYNC;
+}
+
+/**
+ * Returns a printable name for the active backend.
+ *
+ * @param io The I/O context.
+ * @return The backend name.
+ */
+const char *io_backend_name(const steg_io *io) {
+    switch (io->backend) {
+        case IO_BACKEND_URING: return "io_uring";
+        case IO_BACKEND_THREADS: return "thread pool";
+        default: return "synchronous";
+    }
+}
+
+/**
+ * Submits a request. Blocks only while IO_MAX_IN_FLIGHT requests are already outstanding, or, for a
+ * write, while the write limit is reached.
+ * The caller must have claimed the request (state IO_REQUEST_PENDING).
+ *
+ * @param io The I/O context.
+ * @param request The request.
+ */
+void io_submit(steg_io *io, steg_io_request *request) {
+    pthread_mutex_lock(&io->lock);
+    while (io->in_flight >= IO_MAX_IN_FLIGHT || (request->is_write && io->writes_in_flight >= io->write_limit)) {
+        pthread_cond_wait(&io->done_cond, &io->lock);
+    }
+    io->in_flight++;
+    if (request->is_write) io->writes_in_flight++;
+    if (io->backend == IO_BACKEND_THREADS) {
+        request->next = NULL;
+        if (io->queue_tail) io->queue_tail->next = request;
+        else io->queue_head = request;
+        io->queue_tail = request;
+        pthread_cond_signal(&io->work_cond);
+        pthread_mutex_unlock(&io->lock);
+        return;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    int error = io_open_request(request);
+#ifdef STEG_HAVE_IO_URING
+    if (!error && io->backend == IO_BACKEND_URING) {
+        if (request->length == 0) {
+            io_complete(io, request, 0);
+        } else if ((error = io_uring_queue(io, request)) != 0) {
+            io_complete(io, request, error);
+        }
+        return;
+    }
+#endif
+    if (!error) {
+        error = io_transfer_blocking(request);
+    }
+    io_complete(io, request, error);
+}
+
+/**
+ * Claims an idle request for submission. Prefetching and the consuming load race for the same request;
+ * whoever claims it first submits it.
+ *
+ * @param request The request.
+ * @return 1 if the caller claimed the request, 0 if it was already claimed.
+ */
+int io_claim(steg_io_request *request) {
+    int expected = IO_REQUEST_IDLE;
+    return atomic_compare_exchange_strong(&request->state, &expected, IO_REQUEST_PENDING);
+}
+
+/**
+ * Starts reading a whole file into memory, unless the read was already started.
+ *
+ * @param io The I/O context.
+ * @param request The request to use.
+ * @param filename The file to read (must stay valid until the request completes).
+ */
+void io_read_async(steg_io *io, steg_io_request *request, const char *filename) {
+    if (!io_claim(request)) return;
+    request->is_write = 0;
+    request->filename = filename;
+    request->data = NULL;
+    request->length = request->done = 0;
+    request->fd = -1;
+    io_submit(io, request);
+}
+
+/**
+ * Starts writing a buffer to a file. The I/O context takes ownership of the buffer.
+ *
+ * @param io The I/O context.
+ * @param request The request to use.
+ * @param filename The file to write (must stay valid until the request completes).
+ * @param data The data (freed once written).
+ * @param length The number of bytes to write.
+ */
+void io_write_async(steg_io *io, steg_io_request *request, const char *filename, unsigned char *data, size_t length) {
+    atomic_store(&request->state, IO_REQUEST_PENDING);
+    request->is_write = 1;
+    request->filename = filename;
+    request->data = data;
+    request->length = length;
+    request->done = 0;
+    request->fd = -1;
+    io_submit(io, request);
+}
+
+/**
+ * Waits for a submitted request to finish.
+ *
+ * @param io The I/O context.
+ * @param request The request.
+ * @return 1 if the request succeeded, 0 if it failed (request->error holds the errno).
+ */
+int io_wait(steg_io *io, steg_io_request *request) {
+    pthread_mutex_lock(&io->lock);
+    while (atomic_load(&request->state) == IO_REQUEST_PENDING) {
+        pthread_cond_wait(&io->done_cond, &io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return atomic_load(&request->state) == IO_REQUEST_DONE;
+}
+
+/**
+ * Waits for every outstanding request and stops the backend threads.
+ *
+ * @param io The I/O context.
+ */
+void io_shutdown(steg_io *io) {
+    pthread_mutex_lock(&io->lock);
+    while (io->in_flight > 0) {
+        pthread_cond_wait(&io->done_cond, &io->lock);
+    }
+    io->stopping = 1;
+    pthread_cond_broadcast(&io->work_cond);
+    pthread_mutex_unlock(&io->lock);
+
+    for (int i = 0; i < io->thread_count; i++) {
+        pthread_join(io->threads[i], NULL);
+    }
+#ifdef STEG_HAVE_IO_URING
+    if (io->backend == IO_BACKEND_URING) {
+        // A NOP with user_data 0 tells the reaper to exit
+        pthread_mutex_lock(&io->submit_lock);
+        unsigned tail = *io->sq_tail;
+        unsigned index = tail & *io->sq_mask;
+        memset(&io->sqes[index], 0, sizeof(io->sqes[index]));
+        io->sqes[index].opcode = IORING_OP_NOP;
+        io->sq_array[index] = index;
+        __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        syscall(__NR_io_uring_enter, io->ring_fd, 1, 0, 0, NULL, 0);
+        pthread_mutex_unlock(&io->submit_lock);
+        pthread_join(io->reaper, NULL);
+        pthread_mutex_destroy(&io->submit_lock);
+        munmap(io->sqes, (*io->sq_mask + 1) * sizeof(struct io_uring_sqe));
+        if (io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+        munmap(io->sq_ring, io->sq_ring_size);
+        close(io->ring_fd);
+    }
+#endif
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->done_cond);
+    pthread_cond_destroy(&io->work_cond);
+}
+
+// Batch mode: a job file lists one encode or decode job per line, which are run on the work-stealing scheduler.
+// Each job runs as a chain of stages; the per-row stages of large images are split into row bands so idle
+// workers can steal them, while small images run every stage as a single task.
+#define BATCH_BAND_BYTES (1 << 20)          // Target pixel bytes per row-band subtask
+#define BATCH_SMALL_IMAGE_BYTES (4 << 20)   // Images below this size run each stage whole
+
+typedef struct steg_batch_job steg_batch_job;
+
+// Round-trip checks of an encode job, done in memory instead of decoding the written file again
+#define VERIFY_OFF 0      // Trust the encoder
+#define VERIFY_PIXELS 1   // Extract the message from the stego pixels before compression
+#define VERIFY_PNG 2      // Also decode the compressed PNG from memory and compare every pixel
+
+// Where an encode job puts the message
+#define CARRIER_PIXELS 0  // The low bits of the pixels
+#define CARRIER_CHUNK 1   // A payload chunk, with the rest of the PNG copied as is
+
+// Whether an encode writes an Adam7-interlaced PNG
+#define INTERLACE_OFF 0    // Never (the encoder's output before interlaced input was read natively)
+#define INTERLACE_KEEP 1   // If the input is interlaced
+#define INTERLACE_ADAM7 2  // Always
+
+// The order in which an encode's carriers take the message
+#define EMBED_ORDER_RASTER 0  // Row by row from the top left pixel
+#define EMBED_ORDER_PASSES 1  // Adam7 pass by pass, so the header is in the first pass a progressive viewer shows
+
+// Settings that may differ per job: the command line sets the defaults and each job line may override them
+typedef struct {
+    png_write_options png;
+    int inflate_backend;  // INFLATE_* value used to decode the input PNG
+    int verify;           // VERIFY_* value
+    message_layout layout;  // How encodes lay out the payload
+    int strip_metadata;     // 1 to drop the input's ancillary chunks instead of copying them to the output
+    int carrier;            // CARRIER_* value
+    int interlace;          // INTERLACE_* value
+    int embed_order;        // EMBED_ORDER_* value
+} steg_job_options;
+
+char *read_line(FILE *file);
+
+/**
+ * Reads a passphrase that is not given on the command line, where the process list and the shell
+ * history would show it: the first line of a file (--passphrase-file), an environment variable
+ * (--passphrase-env) or, for --passphrase -, a line typed at the terminal with echo off.
+ *
+ * @param name The option name.
+ * @param value The option value: the file, the variable name, or "-".
+ * @return The passphrase (free with free()), or NULL on failure (reported).
+ */
+char *passphrase_read(const char *name, const char *value) {
+    char *text = NULL;
+    if (strcmp(name, "--passphrase-env") == 0) {
+        const char *variable = getenv(value);
+        if (!variable) {
+            printf("ERROR: The environment variable '%s' is not set.\n", value);
+            return NULL;
+        }
+        text = strdup(variable);
+    } else if (strcmp(name, "--passphrase-file") == 0) {
+        FILE *file = fopen(value, "r");
+        if (!file) {
+            printf("ERROR: Failed to read passphrase file '%s'.\n", value);
+            return NULL;
+        }
+        text = read_line(file);
+        fclose(file);
+        if (!text) text = strdup("");
+    } else {
+#ifdef _WIN32
+        printf("ERROR: --passphrase - cannot prompt on this platform; use --passphrase-file or --passphrase-env.\n");
+        return NULL;
+#else
+        // The terminal, not standard input, which may carry a payload or a list of paths
+        FILE *tty = fopen("/dev/tty", "r+");
+        struct termios saved, quiet;
+        if (!tty || tcgetattr(fileno(tty), &saved) != 0) {
+            if (tty) fclose(tty);
+            printf("ERROR: --passphrase - needs a terminal; use --passphrase-file or --passphrase-env.\n");
+            return NULL;
+        }
+        quiet = saved;
+        quiet.c_lflag &= ~(tcflag_t)ECHO;
+        fputs("Passphrase: ", tty);
+        fflush(tty);
+        tcsetattr(fileno(tty), TCSAFLUSH, &quiet);
+        text = read_line(tty);
+        tcsetattr(fileno(tty), TCSAFLUSH, &saved);
+        fputs("\n", tty);
+        fclose(tty);
+        if (!text) text = strdup("");
+#endif
+    }
+    if (!text) printf("Memory allocation failed!\n");
+    return text;
+}
+
+/**
+ * Applies one per-job option given as a name/value pair.
+ *
+ * @param name The option name (e.g. "--png-level").
+ * @param value The option value.
+ * @param options The options to update.
+ * @return 1 if the option was applied, 0 if it is unknown, -1 if the value is invalid.
+ */
+int job_parse_option(const char *name, const char *value, steg_job_options *options) {
+    if (strcmp(name, "--format") == 0) {
+        if (strcmp(value, "header") == 0) options->layout.format = MESSAGE_FORMAT_HEADER;
+        else if (strcmp(value, "legacy") == 0) options->layout.format = MESSAGE_FORMAT_LEGACY;
+        else {
+            printf("ERROR: --format must be header or legacy.\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(name, "--fec") == 0) {
+        int parity = strcmp(value, "off") == 0 ? 0 : atoi(value);
+        if (parity != 0 && (parity < 2 || parity > RS_MAX_PARITY)) {
+            printf("ERROR: --fec must be off or a number of check bytes per block from 2 to %d.\n", RS_MAX_PARITY);
+            return -1;
+        }
+        options->layout.fec_parity = parity;
+        return 1;
+    }
+    if (strcmp(name, "--key") == 0) {
+        steg_key_derive(value, &options->layout.secrets.key);
+        return 1;
+    }
+    if (strcmp(name, "--passphrase") == 0 || strcmp(name, "--passphrase-file") == 0 || strcmp(name, "--passphrase-env") == 0) {
+        int indirect = strcmp(name, "--passphrase") != 0 || strcmp(value, "-") == 0;
+        char *text = indirect ? passphrase_read(name, value) : NULL;
+        if (indirect && (!text || !*text)) {
+            if (text) printf("ERROR: The passphrase from %s is empty.\n", name);
+            free(text);
+            return -1;
+        }
+        if (text) value = text;
+        options->layout.secrets.passphrase = *value ? passphrase_intern(value) : NULL;
+        int ok = !*value || options->layout.secrets.passphrase;
+        if (text) {
+            memset(text, 0, strlen(text));  // The interned copy is the only one kept
+            free(text);
+        }
+        if (!ok) {
+            printf("Memory allocation failed!\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(name, "--verify") == 0) {
+        if (strcmp(value, "off") == 0) options->verify = VERIFY_OFF;
+        else if (strcmp(value, "pixels") == 0) options->verify = VERIFY_PIXELS;
+        else if (strcmp(value, "png") == 0) options->verify = VERIFY_PNG;
+        else {
+            printf("ERROR: --verify must be off, pixels or png.\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(name, "--carrier") == 0) {
+        if (strcmp(value, "pixels") == 0) options->carrier = CARRIER_PIXELS;
+        else if (strcmp(value, "chunk") == 0) options->carrier = CARRIER_CHUNK;
+        else {
+            printf("ERROR: --carrier must be pixels or chunk.\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(name, "--interlace") == 0) {
+        if (strcmp(value, "off") == 0) options->interlace = INTERLACE_OFF;
+        else if (strcmp(value, "keep") == 0) options->interlace = INTERLACE_KEEP;
+        else if (strcmp(value, "adam7") == 0) options->interlace = INTERLACE_ADAM7;
+        else {
+            printf("ERROR: --interlace must be off, keep or adam7.\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(name, "--embed-order") == 0) {
+        if (strcmp(value, "raster") == 0) options->embed_order = EMBED_ORDER_RASTER;
+        else if (strcmp(value, "passes") == 0) options->embed_order = EMBED_ORDER_PASSES;
+        else {
+            printf("ERROR: --embed-order must be raster or passes.\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(name, "--metadata") == 0) {
+        if (strcmp(value, "keep") == 0) options->strip_metadata = 0;
+        else if (strcmp(value, "strip") == 0) options->strip_metadata = 1;
+        else {
+            printf("ERROR: --metadata must be keep or strip.\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(name, "--inflate") == 0) {
+        if (strcmp(value, "auto") == 0) options->inflate_backend = INFLATE_AUTO;
+        else if (strcmp(value, "stb") == 0) options->inflate_backend = INFLATE_STB;
+        else if (strcmp(value, "builtin") == 0) options->inflate_backend = INFLATE_BUILTIN;
+#ifdef STEG_USE_ZLIB
+        else if (strcmp(value, "zlib") == 0) options->inflate_backend = INFLATE_ZLIB;
+#endif
+        else {
+            printf("ERROR: --inflate must be auto, stb, builtin, or zlib in a build with USE_ZLIB=1.\n");
+            return -1;
+        }
+        return 1;
+    }
+    return png_parse_option(name, value, &options->png);
+}
+
+// Shared state of a running batch: the I/O backend and the load and input prefetch cursors
+typedef struct {
+    steg_io io;
+    steg_batch_job *jobs;
+    int job_count;
+    atomic_int next_prefetch;  // Index of the next job whose input has not been requested yet
+    atomic_int next_load;      // Index of the next job a pool load task takes
+    int prefetch_window;       // Inputs read ahead of the job being loaded (the queue depth)
+} steg_batch;
+
+typedef void (*steg_stage_fn)(steg_scheduler *scheduler, steg_batch_job *job);
+typedef void (*steg_band_fn)(steg_batch_job *job, int row_begin, int row_end);
+
+struct steg_batch_job {
+    int choice;  // 1 = Encode, 2 = Decode (same numbering as the interactive menu)
+    int line_number;
+    steg_batch *batch;
+    char *input_filename;
+    char *output_filename;
+    char *message;
+    char *payload_filename;  // Encode: payload streamed from this file ("-" = standard input); decode: payload written to it
+    size_t payload_length;
+    int shard_job;           // Encode: embed only the shard below; decode: write the shard's piece at its offset
+    int palette_paired;      // Encode: a full 8-bit palette was paired with nearest colors, so flipped pixels change color
+    steg_shard shard;
+    size_t shard_length;
+    steg_job_options options;
+
+    int width, height, channels;
+    int depth;  // Bits per sample: 8, or 16 (big-endian samples)
+    int interlaced;  // The input PNG is Adam7-interlaced
+    int pass_order;  // The image is held in Adam7 pass order (and an encode writes it interlaced)
+    steg_palette *palette;  // Indexed images: the palette (the image holds one index per byte); NULL otherwise
+    png_chunks chunks;      // Encode: the input's ancillary chunks, copied into the output
+    unsigned char *image;
+    unsigned char *reconstructed_image;  // The stego pixels: the loaded image with the message embedded in place
+    unsigned char *packed;               // Indices below 8 bits packed to the file's bit depth for the filter
+    unsigned char *filtered;
+    deflate_segment *segments;  // Banded deflate: one segment per band, joined into the zlib stream by the write
+    int segment_count;
+    unsigned char *file;     // Chunk carrier encode: the input file, copied to the output around the payload chunk
+    size_t file_bytes;
+    unsigned char *encoded;  // Chunk carrier encode: the output file
+    size_t encoded_bytes;
+    size_t carrier_bytes;    // Decode from a payload chunk: its size (image holds the chunk data, depth is CARRIER_DEPTH_BYTES)
+    char *ascii_message;
+    message_info decoded;
+    steg_io_request read_request;
+    steg_io_request write_request;
+
+    steg_band_fn band_fn;      // Per-band work of the current stage
+    steg_stage_fn next_stage;  // Runs once every band of the current stage has finished
+    int band_rows;             // Rows per band of the current stage
+    atomic_int bands_left;
+    atomic_int failed;
+    char error[320];
+};
+
+/**
+ * Records a job failure; only the first error message is kept.
+ *
+ * @param job The job.
+ * @param message The error message.
+ */
+void batch_fail(steg_batch_job *job, const char *message) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&job->failed, &expected, 1)) {
+        snprintf(job->error, sizeof(job->error), "%s", message);
+    }
+}
+
+/**
+ * Task body for one band of a banded stage: runs job->band_fn, and the last band to finish runs job->next_stage.
+ */
+void batch_band_task(steg_scheduler *scheduler, void *context, int begin, int end) {
+    steg_batch_job *job = (steg_batch_job *)context;
+
+    if (!atomic_load(&job->failed)) {
+        job->band_fn(job, begin, end);
+    }
+    if (atomic_fetch_sub(&job->bands_left, 1) == 1) {
+        job->next_stage(scheduler, job);
+    }
+}
+
+/**
+ * Returns the number of rows in each row band of a job's image (all of them for small images).
+ *
+ * @param job The job.
+ * @return The rows per band.
+ */
+int batch_band_rows(const steg_batch_job *job) {
+    size_t row_bytes = (size_t)job->width * job->channels * (job->depth / 8);
+    int rows_per_band = job->height;
+
+    if (row_bytes * job->height >= BATCH_SMALL_IMAGE_BYTES && !job->pass_order) {  // Passes are filtered in one band
+        rows_per_band = (int)(BATCH_BAND_BYTES / row_bytes);
+        if (rows_per_band < 1) rows_per_band = 1;
+    }
+    return rows_per_band;
+}
+
+/**
+ * Splits a per-row stage into row-band subtasks (or a single task for small images).
+ * When the last band finishes, job->next_stage runs on the worker that finished it.
+ *
+ * @param scheduler The scheduler.
+ * @param job The job.
+ * @param band_fn The per-band work.
+ * @param next_stage The stage to run after all bands are done.
+ */
+void batch_spawn_bands(steg_scheduler *scheduler, steg_batch_job *job, steg_band_fn band_fn, steg_stage_fn next_stage) {
+    int rows_per_band = batch_band_rows(job);
+    int band_count = (job->height + rows_per_band - 1) / rows_per_band;
+
+    job->band_fn = band_fn;
+    job->next_stage = next_stage;
+    job->band_rows = rows_per_band;
+    atomic_store(&job->bands_left, band_count);
+    for (int y = 0; y < job->height; y += rows_per_band) {
+        int y_end = y + rows_per_band < job->height ? y + rows_per_band : job->height;
+        if (!scheduler_spawn(scheduler, batch_band_task, job, y, y_end)) {
+            // Run the band inline so the band count still reaches zero
+            batch_band_task(scheduler, job, y, y_end);
+        }
+    }
+}
+
+void batch_stage_embed(steg_scheduler *scheduler, steg_batch_job *job);
+void batch_stage_filter(steg_scheduler *scheduler, steg_batch_job *job);
+void batch_stage_deflate(steg_scheduler *scheduler, steg_batch_job *job);
+void batch_stage_write(steg_scheduler *scheduler, steg_batch_job *job);
+void batch_stage_decode(steg_scheduler *scheduler, steg_batch_job *job);
+
+/**
+ * Band work: PNG-filters the job's reconstructed image rows (all its passes if it is in pass order).
+ */
+void batch_band_filter(steg_batch_job *job, int row_begin, int row_end) {
+    int bpp;
+    if (job->pass_order) {
+        if (!png_filter_passes(job->packed ? job->packed : job->reconstructed_image, job->width, job->height, job->channels, job->depth, job->palette,
+                               job->options.png.filter, job->filtered)) {
+            batch_fail(job, "Failed to filter image rows.");
+        }
+        return;
+    }
+    size_t row_bytes = png_row_bytes(job->width, job->channels, job->depth, job->palette, &bpp);
+    if (!png_filter_rows(job->packed ? job->packed : job->reconstructed_image, (int)(row_bytes / bpp), job->height, bpp,
+                         png_filter_for(job->options.png.filter, job->palette), row_begin, row_end, job->filtered)) {
+        batch_fail(job, "Failed to filter image rows.");
+    }
+}
+
+/**
+ * Band work: deflates the job's filtered rows into the band's segment of the zlib stream.
+ */
+void batch_band_deflate(steg_batch_job *job, int row_begin, int row_end) {
+    int bpp;
+    size_t line_bytes = png_row_bytes(job->width, job->channels, job->depth, job->palette, &bpp) + 1;
+    if (!deflate_band(job->filtered, (size_t)row_begin * line_bytes, (int)((size_t)(row_end - row_begin) * line_bytes), row_end == job->height,
+                      job->options.png.compression_level, job->options.png.deflate_backend, &job->segments[row_begin / job->band_rows])) {
+        batch_fail(job, "Failed to compress image data.");
+    }
+}
+
+/**
+ * Requests the inputs of every job below a limit that has not been requested yet.
+ *
+ * @param batch The batch.
+ * @param limit One past the last job index to prefetch.
+ */
+void batch_prefetch(steg_batch *batch, int limit) {
+    int next = atomic_load(&batch->next_prefetch);
+    if (limit > batch->job_count) limit = batch->job_count;
+    while (next < limit) {
+        if (atomic_compare_exchange_weak(&batch->next_prefetch, &next, next + 1)) {
+            io_read_async(&batch->io, &batch->jobs[next].read_request, batch->jobs[next].input_filename);
+            next++;
+        }
+    }
+}
+
+/**
+ * Job step: loads the input image.
+ *
+ * @param job The job.
+ * @return 1 on success, 0 on failure (recorded in the job).
+ */
+int job_load(steg_batch_job *job) {
+    steg_batch *batch = job->batch;
+    char error[320];
+
+    // Keep the reads of the next inputs in flight while this one is decoded. Jobs are loaded in file
+    // order, so at most prefetch_window inputs have been read ahead of the loads that consume them.
+    batch_prefetch(batch, (int)(job - batch->jobs) + 1 + batch->prefetch_window);
+    io_read_async(&batch->io, &job->read_request, job->input_filename);  // No-op if already prefetched
+    if (!io_wait(&batch->io, &job->read_request)) {
+        snprintf(error, sizeof(error), "Failed to read image '%s': %s.", job->input_filename, strerror(job->read_request.error));
+        batch_fail(job, error);
+        return 0;
+    }
+    if (job->choice == 1 && job->options.carrier == CARRIER_CHUNK) {
+        job->file = job->read_request.data;  // No pixels are decoded: the file is copied as it is
+        job->file_bytes = job->read_request.length;
+        job->read_request.data = NULL;
+        return 1;
+    }
+    size_t chunk_len;
+    const unsigned char *chunk = job->choice == 2 ? png_find_payload_chunk(job->read_request.data, job->read_request.length, &chunk_len) : NULL;
+    if (chunk) {
+        // The payload chunk is the carrier: move it to the front of the file buffer instead of decoding the pixels
+        memmove(job->read_request.data, chunk, chunk_len);
+        job->image = job->read_request.data;
+        job->carrier_bytes = chunk_len;
+        job->depth = CARRIER_DEPTH_BYTES;
+        job->read_request.data = NULL;
+        return 1;
+    }
+
+    // A decode looks for the message in the file's own order first, so an interlaced PNG is not deinterlaced
+    steg_palette palette;
+    job->interlaced = png_is_interlaced(job->read_request.data, job->read_request.length);
+    job->pass_order = job->choice == 2 || job->options.embed_order == EMBED_ORDER_PASSES;
+    job->image = image_load_from_memory(job->read_request.data, job->read_request.length, &job->width, &job->height, &job->channels, &job->depth,
+                                        &palette, &job->pass_order, job->options.inflate_backend);
+    int chunks_ok = !job->image || job->choice != 1 || job->options.strip_metadata ||
+                    png_chunks_collect(job->read_request.data, job->read_request.length, job->channels, job->depth, palette.entries ? &palette : NULL,
+                                       &job->chunks);
+    free(job->read_request.data);
+    job->read_request.data = NULL;
+    if (!job->image) {
+        snprintf(error, sizeof(error), "Failed to load image '%s'.", job->input_filename);
+        batch_fail(job, error);
+        return 0;
+    }
+    if (!chunks_ok) {
+        batch_fail(job, "Memory allocation failed!");
+        return 0;
+    }
+    if (palette.entries) {
+        job->palette = (steg_palette *)malloc(sizeof(steg_palette));
+        if (!job->palette) {
+            batch_fail(job, "Memory allocation failed!");
+            return 0;
+        }
+        *job->palette = palette;
+    }
+    return 1;
+}
+
+int job_embed_chunk(steg_batch_job *job);
+
+/**
+ * Moves one of a job's images to the other Adam7 order.
+ *
+ * @param job The job (its pass_order flag is flipped).
+ * @param pixels A pointer to the image; replaced, and the old data freed.
+ * @return 1 on success, 0 on failure (recorded in the job).
+ */
+int job_reorder(steg_batch_job *job, unsigned char **pixels) {
+    unsigned char *other = adam7_reordered(*pixels, job->width, job->height, job->channels * (job->depth / 8), !job->pass_order);
+    if (!other) {
+        batch_fail(job, "Memory allocation failed!");
+        return 0;
+    }
+    stbi_image_free(*pixels);
+    *pixels = other;
+    job->pass_order = !job->pass_order;
+    return 1;
+}
+
+/**
+ * Job step: embeds the message straight into the loaded image's LSBs, which then becomes the
+ * reconstructed image (the same pixels the binary-string encoder produces). With the chunk carrier,
+ * it embeds the message in a payload chunk of a copy of the file instead.
+ *
+ * @param job The job.
+ * @return 1 on success, 0 on failure (recorded in the job).
+ */
+int job_embed(steg_batch_job *job) {
+    if (atomic_load(&job->failed)) return 0;
+
+    size_t pixel_bytes = (size_t)job->width * job->height * job->channels * (job->depth / 8);
+    if (job->options.layout.format == MESSAGE_FORMAT_LEGACY && job->options.layout.fec_parity) {
+        batch_fail(job, "Error correction (--fec) needs the header format.");
+        return 0;
+    }
+    if (job->options.layout.format == MESSAGE_FORMAT_LEGACY && job->options.layout.secrets.passphrase) {
+        batch_fail(job, "Encryption (--passphrase) needs the header format.");
+        return 0;
+    }
+    if (job->options.layout.format == MESSAGE_FORMAT_LEGACY && job->options.embed_order == EMBED_ORDER_PASSES) {
+        batch_fail(job, "Pass-order embedding (--embed-order passes) needs the header format.");
+        return 0;
+    }
+    if (job->options.carrier == CARRIER_CHUNK && job->options.interlace == INTERLACE_ADAM7) {
+        batch_fail(job, "The chunk carrier copies the image data as is, so it cannot be combined with --interlace adam7.");
+        return 0;
+    }
+    if (job->options.carrier == CARRIER_CHUNK && job->options.embed_order == EMBED_ORDER_PASSES) {
+        batch_fail(job, "The chunk carrier has no pixels to embed in, so it cannot be combined with --embed-order passes.");
+        return 0;
+    }
+    if (job->options.carrier == CARRIER_CHUNK) {
+        return job_embed_chunk(job);
+    }
+    if (job->options.embed_order == EMBED_ORDER_PASSES && !job->pass_order && !job_reorder(job, &job->image)) {
+        return 0;  // A non-interlaced input (or one stb_image decoded) is put in pass order for the message
+    }
+    if (job->palette) {
+        job->palette_paired = !palette_prepare(job->palette, job->image, pixel_bytes);
+    }
+    if (job->payload_filename) {
+        char error[320];
+        if (!embed_payload_file(job->payload_filename, job->shard_job ? &job->shard : NULL, job->shard_length, job->image, pixel_bytes, job->depth,
+                                &job->options.layout, &job->payload_length, error, sizeof(error))) {
+            batch_fail(job, error);
+            return 0;
+        }
+        job->reconstructed_image = job->image;
+        job->image = NULL;
+        return 1;
+    }
+    size_t capacity = message_capacity(pixel_bytes, job->depth, &job->options.layout);
+    if (strlen(job->message) > capacity) {
+        char error[320];
+        snprintf(error, sizeof(error), "Message is too long! Maximum message length: %zu characters.", capacity);
+        batch_fail(job, error);
+        return 0;
+    }
+    if (!embed_message(job->image, pixel_bytes, job->depth, (const unsigned char *)job->message, strlen(job->message), &job->options.layout)) {
+        batch_fail(job, job->options.layout.secrets.passphrase ? "Failed to derive the encryption key." : "Failed to encode message into binary data.");
+        return 0;
+    }
+    job->reconstructed_image = job->image;  // stb_image allocates with malloc, so free() releases it
+    job->image = NULL;
+    return 1;
+}
+
+/**
+ * Checks that decoding the pixels would return the message, with the same extraction the decoder uses.
+ *
+ * @param pixels The stego image data.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key and passphrase, or NULL.
+ * @param message The message that was embedded.
+ * @param error A buffer for the reason of a failure.
+ * @param error_size The size of the error buffer.
+ * @return 1 if the decoder would return exactly the message with a matching checksum, 0 otherwise.
+ */
+int verify_embedded_message(const unsigned char *pixels, size_t pixel_bytes, int depth, const steg_secrets *secrets, const char *message, char *error,
+                            size_t error_size) {
+    int ok = 0;
+    message_info info;
+    char *decoded = extract_message(pixels, pixel_bytes, depth, secrets, &info);
+    size_t decoded_len = info.length;
+    size_t message_len = strlen(message);
+
+    if (!decoded) {
+        snprintf(error, error_size, "Verification failed: the decoder finds no message.");
+    } else if (decoded_len != message_len || memcmp(decoded, message, message_len) != 0) {
+        if (decoded_len < message_len && memcmp(decoded, message, decoded_len) == 0) {
+            snprintf(error, error_size, "Verification failed: the decoder would return %zu of %zu bytes (a 0x07 byte ends the message early).",
+                     decoded_len, message_len);
+        } else {
+            snprintf(error, error_size, "Verification failed: the message reads back differently.");
+        }
+    } else if (!info.checksum_ok) {
+        snprintf(error, error_size, "Verification failed: the embedded checksum does not match.");
+    } else {
+        ok = 1;
+    }
+    free(decoded);
+    return ok;
+}
+
+/**
+ * Checks that decoding the pixels would return a payload streamed from a file. The payload is no
+ * longer in memory, so its size and the CRC32C computed while it was read are checked instead.
+ *
+ * @param pixels The stego image data.
+ * @param pixel_bytes The size of the image data.
+ * @param depth The bits per sample (8 or 16).
+ * @param secrets The scattering key and passphrase, or NULL.
+ * @param length The size of the payload that was embedded.
+ * @param error A buffer for the reason of a failure.
+ * @param error_size The size of the error buffer.
+ * @return 1 if the decoder would return a payload of that size with a matching CRC, 0 otherwise.
+ */
+int verify_embedded_payload(const unsigned char *pixels, size_t pixel_bytes, int depth, const steg_secrets *secrets, size_t length, char *error,
+                            size_t error_size) {
+    message_info info;
+    char *decoded = extract_message(pixels, pixel_bytes, depth, secrets, &info);
+    int ok = decoded && info.length == length && info.checksum_ok;
+    if (!decoded) {
+        snprintf(error, error_size, "Verification failed: the decoder finds no message.");
+    } else if (!ok) {
+        snprintf(error, error_size, "Verification failed: the payload reads back differently.");
+    }
+    free(decoded);
+    return ok;
+}
+
+/**
+ * Gets the size of a payload file before it is read.
+ *
+ * @param filename The payload file, or "-" for standard input.
+ * @param size A pointer to store the size.
+ * @return 1 on success, 0 if the file is missing or is not a regular file (a pipe has no size).
+ */
+int payload_file_size(const char *filename, size_t *size) {
+    struct stat st;
+    int found = strcmp(filename, "-") == 0 ? fstat(fileno(stdin), &st) == 0 : stat(filename, &st) == 0;
+    if (!found || (st.st_mode & S_IFMT) != S_IFREG) {
+        return 0;
+    }
+    *size = (size_t)st.st_size;
+    return 1;
+}
+
+/**
+ * Job step for the chunk carrier: copies the input file with a payload chunk sized for the message,
+ * embeds the message in the chunk and verifies it if requested. The output is written by job_write().
+ *
+ * @param job The job.
+ * @return 1 on success, 0 on failure (recorded in the job).
+ */
+int job_embed_chunk(steg_batch_job *job) {
+    char error[320];
+    const message_layout *layout = &job->options.layout;
+    size_t length;
+
+    // The chunk is sized for the payload, so its size must be known before it is read
+    if (!job->payload_filename) {
+        length = strlen(job->message);
+    } else if (job->shard_job) {
+        length = STEG_SHARD_BYTES + job->shard_length;
+    } else if (!payload_file_size(job->payload_filename, &length)) {
+        snprintf(error, sizeof(error), "The chunk carrier needs a payload of known size: '%s' must be a regular file.", job->payload_filename);
+        batch_fail(job, error);
+        return 0;
+    }
+    size_t carrier_bytes = message_embedded_bytes(length, layout);
+    while (message_capacity(carrier_bytes, CARRIER_DEPTH_BYTES, layout) < length) carrier_bytes++;
+    if (carrier_bytes > 0x7FFFFFFFu) {
+        batch_fail(job, "Payload is too large for a PNG chunk.");
+        return 0;
+    }
+
+    unsigned char *carriers;
+    job->encoded = png_payload_chunk_open(job->file, job->file_bytes, carrier_bytes, job->options.strip_metadata, &job->encoded_bytes, &carriers);
+    free(job->file);
+    job->file = NULL;
+    if (!job->encoded) {
+        snprintf(error, sizeof(error), "Failed to copy image '%s': the chunk carrier needs a well-formed PNG file.", job->input_filename);
+        batch_fail(job, error);
+        return 0;
+    }
+    if (job->payload_filename) {
+        if (!embed_payload_file(job->payload_filename, job->shard_job ? &job->shard : NULL, job->shard_length, carriers, carrier_bytes,
+                                CARRIER_DEPTH_BYTES, layout, &job->payload_length, error, sizeof(error))) {
+            batch_fail(job, error);
+            return 0;
+        }
+    } else if (!embed_message(carriers, carrier_bytes, CARRIER_DEPTH_BYTES, (const unsigned char *)job->message, length, layout)) {
+        batch_fail(job, layout->secrets.passphrase ? "Failed to derive the encryption key." : "Failed to encode message into binary data.");
+        return 0;
+    }
+    if (job->options.verify != VERIFY_OFF &&
+        !(job->payload_filename
+              ? verify_embedded_payload(carriers, carrier_bytes, CARRIER_DEPTH_BYTES, &layout->secrets, job->payload_length, error, sizeof(error))
+              : verify_embedded_message(carriers, carrier_bytes, CARRIER_DEPTH_BYTES, &layout->secrets, job->message, error, sizeof(error)))) {
+        batch_fail(job, error);
+        return 0;
+    }
+    png_payload_chunk_seal(carriers, carrier_bytes);
+    return 1;
+}
+
+/**
+ * Job step: verifies the stego pixels if requested, puts them in the order of the output (Adam7 passes
+ * if it is interlaced), packs indices below 8 bits and allocates the buffer for the filtered scanlines.
+ *
+ * @param job The job.
+ * @return 1 on success, 0 on failure (recorded in the job).
+ */
+int job_prepare_filter(steg_batch_job *job) {
+    if (atomic_load(&job->failed)) return 0;
+
+    char error[320];
+    size_t pixel_bytes = (size_t)job->width * job->height * job->channels * (job->depth / 8);
+    const steg_secrets *secrets = &job->options.layout.secrets;
+    if (job->options.verify != VERIFY_OFF &&
+        !(job->payload_filename ? verify_embedded_payload(job->reconstructed_image, pixel_bytes, job->depth, secrets, job->payload_length, error, sizeof(error))
+                                : verify_embedded_message(job->reconstructed_image, pixel_bytes, job->depth, secrets, job->message, error, sizeof(error)))) {
+        batch_fail(job, error);
+        return 0;
+    }
+
+    int interlace = job->options.interlace == INTERLACE_ADAM7 || (job->options.interlace == INTERLACE_KEEP && job->interlaced);
+    if (interlace != job->pass_order && !job_reorder(job, &job->reconstructed_image)) {
+        return 0;
+    }
+    size_t filtered_bytes = png_filtered_bytes(job->width, job->height, job->channels, job->depth, job->palette, job->pass_order);
+    if (job->palette && job->palette->bits < 8) {
+        job->packed = (unsigned char *)malloc(filtered_bytes);  // A little more than the packed rows take
+        if (job->packed) palette_pack_image(job->reconstructed_image, job->width, job->height, job->palette->bits, job->pass_order, job->packed);
+    }
+    job->filtered = (unsigned char *)malloc(filtered_bytes);
+    if (!job->filtered || (job->palette && job->palette->bits < 8 && !job->packed)) {
+        batch_fail(job, "Memory allocation failed!");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Decodes an encoded PNG from memory and compares it with the stego pixels it was made from.
+ *
+ * @param job The job (its reconstructed image is still allocated).
+ * @param png The PNG file contents.
+ * @param png_len The size of the PNG file.
+ * @return 1 if every pixel (and the palette of an indexed image) matches, 0 otherwise (recorded in the job).
+ */
+int job_verify_png(steg_batch_job *job, const unsigned char *png, int png_len) {
+    int width, height, channels, depth, pass_order = job->pass_order;
+    steg_palette palette;
+    unsigned char *decoded = image_load_from_memory(png, (size_t)png_len, &width, &height, &channels, &depth, &palette, &pass_order,
+                                                    job->options.inflate_backend);
+    int ok = decoded && width == job->width && height == job->height && channels == job->channels && depth == job->depth;
+    if (ok && pass_order != job->pass_order) {
+        unsigned char *reordered = adam7_reordered(decoded, width, height, channels * (depth / 8), 1);  // stb_image deinterlaced it
+        stbi_image_free(decoded);
+        decoded = reordered;
+        ok = decoded != NULL;
+    }
+    ok = ok && memcmp(decoded, job->reconstructed_image, (size_t)width * height * channels * (depth / 8)) == 0;
+    if (job->palette) {
+        ok = ok && palette.entries == job->palette->entries && memcmp(palette.rgb, job->palette->rgb, palette.entries * 3) == 0 &&
+             memcmp(palette.alpha, job->palette->alpha, palette.entries) == 0;
+    } else {
+        ok = ok && palette.entries == 0;
+    }
+    stbi_image_free(decoded);
+    if (!ok) {
+        batch_fail(job, "Verification failed: the compressed PNG does not decode to the stego pixels.");
+    }
+    return ok;
+}
+
+/**
+ * Job step: deflates the filtered scanlines, hands the PNG to the I/O backend for writing
+ * and releases the remaining buffers. Write errors are collected when the batch finishes.
+ *
+ * @param job The job.
+ */
+void job_write(steg_batch_job *job) {
+    int png_len;
+
+    if (job->options.verify != VERIFY_PNG) {
+        free(job->reconstructed_image);
+        job->reconstructed_image = NULL;
+    }
+    if (!atomic_load(&job->failed) && job->encoded) {
+        io_write_async(&job->batch->io, &job->write_request, job->output_filename, job->encoded, job->encoded_bytes);
+        job->encoded = NULL;
+    } else if (!atomic_load(&job->failed)) {
+        unsigned char *png = NULL;
+        if (job->segments) {
+            int zlen;
+            unsigned char *zlib = deflate_join(job->segments, job->segment_count, job->options.png.compression_level, &zlen);
+            if (zlib) {
+                png = png_write_zlib_to_mem(zlib, zlen, job->width, job->height, job->channels, job->depth, job->palette, job->pass_order, &job->chunks,
+                                            &png_len);
+            }
+        } else {
+            png = png_write_filtered_to_mem(job->filtered, job->width, job->height, job->channels, job->depth, job->palette, job->pass_order,
+                                            &job->chunks, &job->options.png, &png_len);
+        }
+        if (!png) {
+            batch_fail(job, "Failed to compress encoded image.");
+        } else if (job->options.verify == VERIFY_PNG && !job_verify_png(job, png, png_len)) {
+            free(png);
+        } else {
+            io_write_async(&job->batch->io, &job->write_request, job->output_filename, png, png_len);
+        }
+    }
+    stbi_image_free(job->image);  // Still set if the embed step failed
+    job->image = NULL;
+    free(job->reconstructed_image);
+    job->reconstructed_image = NULL;
+    free(job->palette);
+    job->palette = NULL;
+    png_chunks_free(&job->chunks);
+    free(job->packed);
+    job->packed = NULL;
+    free(job->filtered);
+    job->filtered = NULL;
+    for (int i = 0; i < job->segment_count; i++) {
+        free(job->segments[i].data);
+    }
+    free(job->segments);
+    job->segments = NULL;
+    job->segment_count = 0;
+    free(job->file);
+    job->file = NULL;
+    free(job->encoded);
+    job->encoded = NULL;
+}
+
+/**
+ * Tells whether a decoded legacy message is noise rather than a message: its checksum fails and it holds
+ * control bytes, which typed text does not. This is what a wrong --key or an empty image gives, since
+ * the legacy format has no header to reject them.
+ *
+ * @param message The decoded message.
+ * @param info The decoder findings.
+ * @return 1 if the message is noise, 0 otherwise.
+ */
+int legacy_message_is_noise(const char *message, const message_info *info) {
+    if (info->format != MESSAGE_FORMAT_LEGACY || info->checksum_ok) return 0;
+    for (const unsigned char *c = (const unsigned char *)message; *c; c++) {
+        if ((*c < 0x20 && *c != '\t' && *c != '\n' && *c != '\r') || *c == 0x7F) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Job step: extracts the message straight from the image's LSBs, in the pixel order it was embedded in,
+ * or from its payload chunk (streaming it to the payload file if the job has one) and releases the image.
+ *
+ * @param job The job.
+ */
+void job_decode(steg_batch_job *job) {
+    if (!atomic_load(&job->failed) && job->depth != CARRIER_DEPTH_BYTES &&
+        !adam7_find_message_order(&job->image, job->width, job->height, job->channels, job->depth, &job->options.layout.secrets, &job->pass_order)) {
+        batch_fail(job, "Memory allocation failed!");
+    }
+    size_t pixel_bytes = job->depth == CARRIER_DEPTH_BYTES ? job->carrier_bytes : (size_t)job->width * job->height * job->channels * (job->depth / 8);
+    if (!atomic_load(&job->failed) && job->payload_filename) {
+        FILE *out = fopen(job->payload_filename, job->shard_job ? "r+b" : "wb");  // Shards share the output file
+        int result = out ? extract_message_to_file(job->image, pixel_bytes, job->depth, &job->options.layout.secrets, out, job->shard_job, &job->decoded)
+                         : -1;
+        if (out && fclose(out) != 0) result = -1;
+        if (result >= 0 && job->decoded.encrypted && !job->decoded.authentic) {
+            if (!job->shard_job) remove(job->payload_filename);
+            batch_fail(job, message_locked_reason(&job->options.layout.secrets));
+        } else if (result == 0) {
+            if (!job->shard_job) remove(job->payload_filename);
+            batch_fail(job, job->shard_job ? "No shard found in this image." : "No message found encoded in this image or decoding failed.");
+        } else if (result < 0) {
+            char error[320];
+            snprintf(error, sizeof(error), "Failed to write the payload to '%s'.", job->payload_filename);
+            batch_fail(job, error);
+        }
+    } else if (!atomic_load(&job->failed)) {
+        job->ascii_message = extract_message(job->image, pixel_bytes, job->depth, &job->options.layout.secrets, &job->decoded);
+        if (job->ascii_message && legacy_message_is_noise(job->ascii_message, &job->decoded)) {
+            free(job->ascii_message);  // Not printed: it would be raw binary on the terminal
+            job->ascii_message = NULL;
+            batch_fail(job, job->options.layout.secrets.key.set ? "No message found encoded in this image or decoding failed (wrong --key?)."
+                                                                : "No message found encoded in this image or decoding failed.");
+        } else if (!job->ascii_message) {
+            batch_fail(job, job->decoded.encrypted ? message_locked_reason(&job->options.layout.secrets)
+                                                   : "No message found encoded in this image or decoding failed.");
+        }
+    }
+    stbi_image_free(job->image);
+    job->image = NULL;
+    free(job->palette);
+    job->palette = NULL;
+}
+
+/**
+ * Stage 1 (whole image): loads the next image in file order, then embeds or extracts the message.
+ * Each job has a load task, but a task takes whichever job is next rather than a fixed one: workers pop
+ * their newest task first, and loading from the end of the batch would leave the inputs prefetched at
+ * its start in memory until the end.
+ */
+void batch_stage_load(steg_scheduler *scheduler, void *context, int begin, int end) {
+    steg_batch *batch = (steg_batch *)context;
+    steg_batch_job *job = &batch->jobs[atomic_fetch_add(&batch->next_load, 1)];
+    (void)begin;
+    (void)end;
+
+    if (job_load(job)) {
+        if (job->choice == 1) batch_stage_embed(scheduler, job);
+        else batch_stage_decode(scheduler, job);
+    }
+}
+
+/**
+ * Stage 2 of encode (whole image): embeds the message, then starts the filtering (or, with the chunk
+ * carrier, writes the file copy).
+ */
+void batch_stage_embed(steg_scheduler *scheduler, steg_batch_job *job) {
+    if (job_embed(job)) {
+        if (job->encoded) job_write(job);  // The chunk carrier has no pixels to filter
+        else batch_stage_filter(scheduler, job);
+    } else {
+        job_write(job);  // Only releases the buffers of a failed job
+    }
+}
+
+/**
+ * Stage 3 of encode: starts the banded PNG filtering of the reconstructed image.
+ */
+void batch_stage_filter(steg_scheduler *scheduler, steg_batch_job *job) {
+    if (job_prepare_filter(job)) {
+        batch_spawn_bands(scheduler, job, batch_band_filter, batch_stage_deflate);
+    } else {
+        job_write(job);
+    }
+}
+
+/**
+ * Stage 4 of encode: starts the banded deflate of the filtered rows, when the image has more than one
+ * band and the backend can write the stream in segments. Otherwise the write stage deflates it whole.
+ */
+void batch_stage_deflate(steg_scheduler *scheduler, steg_batch_job *job) {
+    int rows_per_band = batch_band_rows(job);
+    int band_count = (job->height + rows_per_band - 1) / rows_per_band;
+
+    if (atomic_load(&job->failed) || band_count < 2 || !deflate_can_band(job->options.png.compression_level, job->options.png.deflate_backend)) {
+        job_write(job);
+        return;
+    }
+    job->segments = (deflate_segment *)calloc(band_count, sizeof(deflate_segment));
+    if (!job->segments) {
+        batch_fail(job, "Memory allocation failed!");
+        job_write(job);
+        return;
+    }
+    job->segment_count = band_count;
+    batch_spawn_bands(scheduler, job, batch_band_deflate, batch_stage_write);
+}
+
+/**
+ * Stage 5 of encode (whole image): joins the deflated bands, or deflates the filtered rows whole, and
+ * writes the PNG file.
+ */
+void batch_stage_write(steg_scheduler *scheduler, steg_batch_job *job) {
+    (void)scheduler;
+    job_write(job);
+}
+
+/**
+ * Stage 2 of decode (whole image): extracts the message from the binary data.
+ */
+void batch_stage_decode(steg_scheduler *scheduler, steg_batch_job *job) {
+    (void)scheduler;
+    job_decode(job);
+}
+
+/**
+ * Reads one line of arbitrary length from a file.
+ *
+ * @param file The file to read from.
+ * @return The line without its trailing newline, or NULL at end of file.
+ */
+char *read_line(FILE *file) {
+    size_t capacity = 256, length = 0;
+    char *line = (char *)malloc(capacity);
+    if (!line) {
+        printf("Memory allocation failed!\n");
+        return NULL;
+    }
+    while (fgets(line + length, (int)(capacity - length), file)) {
+        length += strlen(line + length);
+        if (length > 0 && line[length - 1] == '\n') break;
+        if (length + 1 == capacity) {
+            char *grown = (char *)realloc(line, capacity * 2);
+            if (!grown) {
+                printf("Memory allocation failed!\n");
+                free(line);
+                return NULL;
+            }
+            line = grown;
+            capacity *= 2;
+        }
+    }
+    if (length == 0 && feof(file)) {
+        free(line);
+        return NULL;
+    }
+    line[strcspn(line, "\r\n")] = 0;
+    return line;
+}
+
+/**
+ * Splits the next whitespace-separated token off a line.
+ *
+ * @param cursor A pointer to the current position; advanced past the token.
+ * @return The token (null-terminated in place), or NULL if the line is exhausted.
+ */
+char *next_token(char **cursor) {
+    char *p = *cursor;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\0') {
+        *cursor = p;
+        return NULL;
+    }
+    char *token = p;
+    while (*p && *p != ' ' && *p != '\t') p++;
+    if (*p) *p++ = '\0';
+    *cursor = p;
+    return token;
+}
+
+/**
+ * Parses the per-job options of a job line ("--name value" pairs, optionally ended by "--").
+ *
+ * @param cursor A pointer to the current position; advanced past the options.
+ * @param options The job's options, initialized to the command-line defaults.
+ * @param payload_filename A pointer to store the value of --payload, which only a job line can give.
+ * @param filename The job file (for error messages).
+ * @param line_number The line number (for error messages).
+ * @return 1 on success, 0 on an invalid option.
+ */
+int parse_job_options(char **cursor, steg_job_options *options, char **payload_filename, const char *filename, int line_number) {
+    while (1) {
+        while (**cursor == ' ' || **cursor == '\t') (*cursor)++;
+        if (strncmp(*cursor, "--", 2) != 0) {
+            return 1;
+        }
+        char *name = next_token(cursor);
+        if (strcmp(name, "--") == 0) {
+            while (**cursor == ' ' || **cursor == '\t') (*cursor)++;
+            return 1;
+        }
+        char *value = next_token(cursor);
+        int result;
+        if (value && strcmp(name, "--payload") == 0) {
+            *payload_filename = value;
+            result = 1;
+        } else {
+            result = value ? job_parse_option(name, value, options) : 0;
+        }
+        if (result <= 0) {
+            if (result == 0) {
+                printf("ERROR: %s:%d: unknown or incomplete option '%s'.\n", filename, line_number, name);
+            } else {
+                printf("ERROR: %s:%d: invalid value for '%s'.\n", filename, line_number, name);
+            }
+            return 0;
+        }
+    }
+}
+
+/**
+ * Parses a batch job file. Each non-empty line not starting with '#' is one of:
+ *   encode <input.png> <output.png> [--option value ...] [--] <message...>
+ *   encode <input.png> <output.png> --payload <file|-> [--option value ...]
+ *   decode <input.png> [--payload <file>]
+ *
+ * @param filename The job file.
+ * @param defaults The per-job options given on the command line.
+ * @param job_count A pointer to store the number of jobs.
+ * @return The parsed jobs, or NULL on failure.
+ */
+steg_batch_job *parse_batch_file(const char *filename, const steg_job_options *defaults, int *job_count) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("ERROR: Failed to open batch file '%s'.\n", filename);
+        return NULL;
+    }
+
+    steg_batch_job *jobs = NULL;
+    int count = 0, capacity = 0, line_number = 0, ok = 1, stdin_payloads = 0;
+    char *line;
+    while (ok && (line = read_line(file)) != NULL) {
+        char *cursor = line;
+        char *command = next_token(&cursor);
+        line_number++;
+        if (!command || command[0] == '#') {
+            free(line);
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            steg_batch_job *grown = (steg_batch_job *)realloc(jobs, capacity * sizeof(steg_batch_job));
+            if (!grown) {
+                printf("Memory allocation failed!\n");
+                free(line);
+                ok = 0;
+                break;
+            }
+            jobs = grown;
+        }
+        steg_batch_job *job = &jobs[count];
+        memset(job, 0, sizeof(*job));
+        job->line_number = line_number;
+        job->options = *defaults;
+
+        char *input = next_token(&cursor);
+        if (strcmp(command, "encode") == 0) {
+            char *output = next_token(&cursor);
+            char *payload = NULL;
+            if (output && !parse_job_options(&cursor, &job->options, &payload, filename, line_number)) {
+                ok = 0;
+            } else if (!input || !output || (*cursor == '\0') == !payload) {
+                printf("ERROR: %s:%d: expected 'encode <input> <output> <message>' or 'encode <input> <output> --payload <file>'.\n",
+                       filename, line_number);
+                ok = 0;
+            } else if (payload && job->options.layout.format == MESSAGE_FORMAT_LEGACY) {
+                printf("ERROR: %s:%d: --payload needs the header format.\n", filename, line_number);
+                ok = 0;
+            } else if (payload && strcmp(payload, "-") == 0 && stdin_payloads++) {
+                printf("ERROR: %s:%d: only one job can read its payload from standard input.\n", filename, line_number);
+                ok = 0;
+            } else {
+                job->choice = 1;
+                job->input_filename = strdup(input);
+                job->output_filename = strdup(output);
+                if (payload) job->payload_filename = strdup(payload);
+                else job->message = strdup(cursor);
+            }
+        } else if (strcmp(command, "decode") == 0) {
+            char *payload = NULL;
+            if (input && !parse_job_options(&cursor, &job->options, &payload, filename, line_number)) {
+                ok = 0;
+            } else if (!input || *cursor != '\0') {
+                printf("ERROR: %s:%d: expected 'decode <input> [--payload <file>]'.\n", filename, line_number);
+                ok = 0;
+            } else if (payload && strcmp(payload, "-") == 0) {
+                printf("ERROR: %s:%d: batch reports go to standard output; use --extract to write a payload there.\n", filename, line_number);
+                ok = 0;
+            } else {
+                job->choice = 2;
+                job->input_filename = strdup(input);
+                if (payload) job->payload_filename = strdup(payload);
+            }
+        } else {
+            printf("ERROR: %s:%d: unknown command '%s' (expected 'encode' or 'decode').\n", filename, line_number, command);
+            ok = 0;
+        }
+        if (ok) count++;
+        free(line);
+    }
+    fclose(file);
+
+    if (!ok) {
+        for (int i = 0; i < count; i++) {
+            free(jobs[i].input_filename);
+            free(jobs[i].output_filename);
+            free(jobs[i].message);
+            free(jobs[i].payload_filename);
+        }
+        free(jobs);
+        return NULL;
+    }
+    *job_count = count;
+    return jobs;
+}
+
+// Pipelined batch execution: a reader, a transformer and a writer thread connected by bounded
+// single-producer/single-consumer queues. Loading file N+1 and compressing/writing file N-1 overlap with
+// embedding file N. At most queue_depth jobs wait between two stages; with the read-ahead and write
+// limits of the I/O backend, which use the same depth, this caps memory use.
+typedef struct {
+    void **slots;
+    size_t capacity;
+    _Alignas(64) atomic_size_t head;  // Next slot to pop; written only by the consumer
+    _Alignas(64) atomic_size_t tail;  // Next slot to push; written only by the producer
+} steg_spsc_queue;
+
+/**
+ * Initializes a bounded lock-free single-producer/single-consumer queue.
+ *
+ * @param queue The queue.
+ * @param capacity The maximum number of queued items.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int spsc_init(steg_spsc_queue *queue, size_t capacity) {
+    queue->slots = (void **)calloc(capacity, sizeof(void *));
+    if (!queue->slots) {
+        printf("Memory allocation failed!\n");
+        return 0;
+    }
+    queue->capacity = capacity;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return 1;
+}
+
+/**
+ * Backs off while a queue is full or empty: spin briefly, then yield the CPU to the other stages.
+ *
+ * @param spins The number of consecutive failed attempts.
+ */
+void spsc_backoff(int spins) {
+    if (spins < 64) {
+        return;
+    }
+    if (spins < 256) {
+        sched_yield();
+        return;
+    }
+    struct timespec pause = { 0, 50000 };  // 50 microseconds
+    nanosleep(&pause, NULL);
+}
+
+/**
+ * Pushes an item, waiting while the queue is full. Only the producer thread may call this.
+ *
+ * @param queue The queue.
+ * @param item The item (NULL marks the end of the stream).
+ */
+void spsc_push(steg_spsc_queue *queue, void *item) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    for (int spins = 0; tail - atomic_load_explicit(&queue->head, memory_order_acquire) == queue->capacity; spins++) {
+        spsc_backoff(spins);
+    }
+    queue->slots[tail % queue->capacity] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * Pops an item, waiting while the queue is empty. Only the consumer thread may call this.
+ *
+ * @param queue The queue.
+ * @return The item.
+ */
+void *spsc_pop(steg_spsc_queue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (int spins = 0; atomic_load_explicit(&queue->tail, memory_order_acquire) == head; spins++) {
+        spsc_backoff(spins);
+    }
+    void *item = queue->slots[head % queue->capacity];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
+
+typedef struct {
+    steg_batch_job *jobs;
+    int job_count;
+    steg_spsc_queue loaded;       // Reader -> transformer
+    steg_spsc_queue transformed;  // Transformer -> writer
+} steg_pipeline;
+
+/**
+ * Reader stage: loads every input image in file order.
+ */
+void *pipeline_reader(void *arg) {
+    steg_pipeline *pipeline = (steg_pipeline *)arg;
+    for (int i = 0; i < pipeline->job_count; i++) {
+        job_load(&pipeline->jobs[i]);
+        spsc_push(&pipeline->loaded, &pipeline->jobs[i]);
+    }
+    spsc_push(&pipeline->loaded, NULL);
+    return NULL;
+}
+
+/**
+ * Transformer work for one job: embeds (encode) or extracts (decode) the message in memory.
+ *
+ * @param job The job.
+ */
+void pipeline_transform_job(steg_batch_job *job) {
+    if (atomic_load(&job->failed)) return;
+
+    if (job->choice == 1) {
+        job_embed(job);
+    } else {
+        job_decode(job);
+    }
+}
+
+/**
+ * Writer work for one job: filters, compresses and writes an encoded image.
+ *
+ * @param job The job.
+ */
+void pipeline_write_job(steg_batch_job *job) {
+    if (job->choice != 1) return;
+
+    if (!job->encoded && job_prepare_filter(job)) {
+        batch_band_filter(job, 0, job->height);
+    }
+    job_write(job);
+}
+
+/**
+ * Transformer stage thread.
+ */
+void *pipeline_transformer(void *arg) {
+    steg_pipeline *pipeline = (steg_pipeline *)arg;
+    steg_batch_job *job;
+    while ((job = (steg_batch_job *)spsc_pop(&pipeline->loaded)) != NULL) {
+        pipeline_transform_job(job);
+        spsc_push(&pipeline->transformed, job);
+    }
+    spsc_push(&pipeline->transformed, NULL);
+    return NULL;
+}
+
+/**
+ * Runs the jobs through the three-stage pipeline; the calling thread acts as the writer.
+ *
+ * @param jobs The jobs.
+ * @param job_count The number of jobs.
+ * @param queue_depth The capacity of each inter-stage queue.
+ * @return 1 on success, 0 if the pipeline could not be started.
+ */
+int run_pipeline(steg_batch_job *jobs, int job_count, int queue_depth) {
+    steg_pipeline pipeline;
+    pthread_t reader, transformer;
+    steg_batch_job *job;
+
+    pipeline.jobs = jobs;
+    pipeline.job_count = job_count;
+    if (!spsc_init(&pipeline.loaded, queue_depth)) {
+        return 0;
+    }
+    if (!spsc_init(&pipeline.transformed, queue_depth)) {
+        free(pipeline.loaded.slots);
+        return 0;
+    }
+    if (pthread_create(&reader, NULL, pipeline_reader, &pipeline) != 0) {
+        printf("ERROR: Failed to start the reader thread.\n");
+        free(pipeline.loaded.slots);
+        free(pipeline.transformed.slots);
+        return 0;
+    }
+
+    if (pthread_create(&transformer, NULL, pipeline_transformer, &pipeline) == 0) {
+        while ((job = (steg_batch_job *)spsc_pop(&pipeline.transformed)) != NULL) {
+            pipeline_write_job(job);
+        }
+        pthread_join(transformer, NULL);
+    } else {
+        // No transformer thread: this thread transforms and writes each job itself
+        printf("Warning: Failed to start the transformer thread; running it on the writer thread.\n");
+        while ((job = (steg_batch_job *)spsc_pop(&pipeline.loaded)) != NULL) {
+            pipeline_transform_job(job);
+            pipeline_write_job(job);
+        }
+    }
+    pthread_join(reader, NULL);
+    free(pipeline.loaded.slots);
+    free(pipeline.transformed.slots);
+    return 1;
+}
+
+// Batch-wide settings from the command line
+typedef struct {
+    int thread_count;
+    int pipeline;     // Non-zero to use the reader/transformer/writer pipeline instead of the work-stealing pool
+    int queue_depth;  // Capacity of each pipeline queue, and the inputs read ahead and outputs being written
+    int io_backend;   // IO_BACKEND_* value
+    steg_job_options job_defaults;
+} steg_batch_options;
+
+/**
+ * Runs jobs on the thread pool or the pipeline, then records write errors in the jobs.
+ *
+ * @param batch The batch state to set up (its I/O backend can still be named afterwards).
+ * @param jobs The jobs.
+ * @param job_count The number of jobs.
+ * @param options The batch settings.
+ * @return 1 if the jobs ran, 0 if the executor could not start.
+ */
+int batch_execute(steg_batch *batch, steg_batch_job *jobs, int job_count, const steg_batch_options *options) {
+    int ok;
+    batch->jobs = jobs;
+    batch->job_count = job_count;
+    atomic_init(&batch->next_prefetch, 0);
+    atomic_init(&batch->next_load, 0);
+    for (int i = 0; i < job_count; i++) {
+        jobs[i].batch = batch;
+        atomic_init(&jobs[i].bands_left, 0);
+        atomic_init(&jobs[i].failed, 0);
+        atomic_init(&jobs[i].read_request.state, IO_REQUEST_IDLE);
+        atomic_init(&jobs[i].write_request.state, IO_REQUEST_IDLE);
+    }
+
+    batch->prefetch_window = options->queue_depth;
+    io_start(&batch->io, options->io_backend, options->queue_depth);
+    batch_prefetch(batch, batch->prefetch_window);
+    if (options->pipeline) {
+        ok = run_pipeline(jobs, job_count, options->queue_depth);
+    } else {
+        steg_scheduler scheduler;
+        ok = scheduler_init(&scheduler, options->thread_count);
+        if (ok) {
+            int spawned = 0;
+            while (spawned < job_count && scheduler_spawn(&scheduler, batch_stage_load, batch, 0, 0)) {
+                spawned++;
+            }
+            scheduler_run(&scheduler);
+            scheduler_destroy(&scheduler);
+            for (int i = spawned; i < job_count; i++) {
+                batch_fail(&jobs[i], "Failed to schedule job.");  // The load tasks took the jobs before these
+            }
+        }
+    }
+    io_shutdown(&batch->io);
+
+    for (int i = 0; i < job_count; i++) {
+        steg_batch_job *job = &jobs[i];
+        free(job->read_request.data);  // Prefetched but never consumed (e.g. the pool failed to start)
+        job->read_request.data = NULL;
+        if (atomic_load(&job->write_request.state) == IO_REQUEST_FAILED) {
+            char error[320];
+            snprintf(error, sizeof(error), "Failed to write encoded image to '%s': %s.", job->output_filename, strerror(job->write_request.error));
+            batch_fail(job, error);
+        }
+    }
+    return ok;
+}
+
+/**
+ * Releases the strings and results held by a finished job.
+ *
+ * @param job The job.
+ */
+void batch_release_job(steg_batch_job *job) {
+    free(job->input_filename);
+    free(job->output_filename);
+    free(job->message);
+    free(job->payload_filename);
+    free(job->ascii_message);
+}
+
+/**
+ * Runs every job in a batch file and reports the results in file order.
+ *
+ * @param filename The job file.
+ * @param options The batch settings.
+ * @return 0 if every job succeeded, 1 otherwise.
+ */
+int run_batch(const char *filename, const steg_batch_options *options) {
+    int job_count = 0, failures = 0;
+    steg_batch_job *jobs = parse_batch_file(filename, &options->job_defaults, &job_count);
+    if (!jobs) {
+        return 1;
+    }
+    steg_batch batch;
+    double start = now_seconds();
+    int ok = batch_execute(&batch, jobs, job_count, options);
+    double elapsed = now_seconds() - start;
+
+    for (int i = 0; i < job_count; i++) {
+        steg_batch_job *job = &jobs[i];
+        if (!ok) {
+            // Nothing ran
+        } else if (atomic_load(&job->failed)) {
+            printf("[line %d] ERROR: %s\n", job->line_number, job->error);
+            failures++;
+        } else if (job->choice == 1) {
+            static const char *verified[3] = { "", " (verified: pixels)", " (verified: pixels, png)" };
+            printf("[line %d] SUCCESS: '%s' encoded to '%s'%s%s\n", job->line_number, job->input_filename, job->output_filename,
+                   verified[job->options.verify], job->palette_paired ? PALETTE_PAIRED_WARNING : "");
+        } else {
+            char repair[64] = "";
+            if (job->decoded.corrected > 0) {
+                snprintf(repair, sizeof(repair), " (error correction repaired %ld byte(s))", job->decoded.corrected);
+            }
+            const char *warning = job->decoded.checksum_ok ? "" : " (WARNING: checksum verification failed, message may be corrupted)";
+            if (job->decoded.sharded) {
+                printf("[line %d] '%s' holds shard %u of %u (%zu bytes at offset %llu of %llu); use --reassemble to rebuild the payload%s%s\n",
+                       job->line_number, job->input_filename, job->decoded.shard.index + 1, job->decoded.shard.count,
+                       job->decoded.length - STEG_SHARD_BYTES, (unsigned long long)job->decoded.shard.offset,
+                       (unsigned long long)job->decoded.shard.total, repair, warning);
+            } else if (job->payload_filename) {
+                printf("[line %d] Extracted %zu bytes from '%s' to '%s'%s%s\n", job->line_number, job->decoded.length, job->input_filename,
+                       job->payload_filename, repair, warning);
+            } else {
+                printf("[line %d] Decoded message from '%s': \"%s\"%s%s\n", job->line_number, job->input_filename, job->ascii_message,
+                       repair, warning);
+            }
+        }
+        batch_release_job(job);
+    }
+    free(jobs);
+    if (!ok) {
+        return 1;
+    }
+    if (options->pipeline) {
+        printf("Batch finished: %d job(s), %d failed, pipeline (queue depth %d), %s I/O, %.3f s.\n", job_count, failures,
+               options->queue_depth, io_backend_name(&batch.io), elapsed);
+    } else {
+        printf("Batch finished: %d job(s), %d failed, %d thread(s), %s I/O, %.3f s.\n", job_count, failures,
+               options->thread_count, io_backend_name(&batch.io), elapsed);
+    }
+    return failures ? 1 : 0;
+}
+
+// Benchmarks (--bench <name> <files...>) report throughput on a caller-supplied image corpus
+
+/**
+ * Loads a benchmark image and returns its PNG-filtered scanlines (adaptive filtering, as the encoder does).
+ *
+ * @param filename The image file.
+ * @param width A pointer to store the width.
+ * @param height A pointer to store the height.
+ * @param channels A pointer to store the channel count.
+ * @param filtered_len A pointer to store the size of the filtered data.
+ * @return The filtered scanlines, or NULL on failure.
+ */
+unsigned char *bench_load_filtered(const char *filename, int *width, int *height, int *channels, int *filtered_len) {
+    unsigned char *image = image_load(filename, width, height, channels, NULL, NULL, NULL);
+    if (!image) {
+        printf("ERROR: Failed to load image '%s'.\n", filename);
+        return NULL;
+    }
+    *filtered_len = (*width * *channels + 1) * *height;
+    unsigned char *filtered = (unsigned char *)malloc(*filtered_len);
+    if (filtered && !png_filter_rows(image, *width, *height, *channels, PNG_FILTER_ADAPTIVE, 0, *height, filtered)) {
+        free(filtered);
+        filtered = NULL;
+    }
+    stbi_image_free(image);
+    return filtered;
+}
+
+/**
+ * Benchmarks every compiled-in deflate backend at the store/fast/default/archive levels:
+ * encode time, throughput and compressed size. Every stream is inflated again to check it.
+ *
+ * @param files The image corpus.
+ * @param count The number of images.
+ * @return 0 on success, 1 on failure.
+ */
+int bench_deflate(char **files, int count) {
+    static const int levels[4] = { PNG_LEVEL_STORE, 1, 8, 32 };
+    int backends[2], backend_count = 0;
+    double total_seconds[2][4] = { { 0 } };
+    long long total_bytes[2][4] = { { 0 } }, total_input = 0;
+
+    backends[backend_count++] = DEFLATE_BUILTIN;
+#ifdef STEG_USE_ZLIB
+    backends[backend_count++] = DEFLATE_ZLIB;
+#endif
+
+    for (int f = 0; f < count; f++) {
+        int width, height, channels, filtered_len;
+        unsigned char *filtered = bench_load_filtered(files[f], &width, &height, &channels, &filtered_len);
+        if (!filtered) return 1;
+        total_input += filtered_len;
+        printf("%s (%dx%d, %d channels, %d filtered bytes)\n", files[f], width, height, channels, filtered_len);
+        printf("  %-10s %5s %10s %9s %11s %7s\n", "backend", "level", "time ms", "MB/s", "bytes", "ratio");
+
+        for (int b = 0; b < backend_count; b++) {
+            for (int l = 0; l < 4; l++) {
+                // Best of three runs
+                double best = 1e30;
+                int zlen = 0, ok = 1;
+                for (int run = 0; run < 3 && ok; run++) {
+                    double start = now_seconds();
+                    unsigned char *zlib = png_deflate(filtered, filtered_len, levels[l], backends[b], &zlen);
+                    double elapsed = now_seconds() - start;
+                    if (elapsed < best) best = elapsed;
+                    if (!zlib) {
+                        ok = 0;
+                        break;
+                    }
+                    if (run == 0) {
+                        int inflated_len;
+                        char *inflated = stbi_zlib_decode_malloc((const char *)zlib, zlen, &inflated_len);
+                        ok = inflated && inflated_len == filtered_len && memcmp(inflated, filtered, filtered_len) == 0;
+                        free(inflated);
+                    }
+                    free(zlib);
+                }
+                if (!ok) {
+                    printf("ERROR: %s level %d produced an invalid stream.\n", deflate_backend_name(backends[b]), levels[l]);
+                    free(filtered);
+                    return 1;
+                }
+                total_seconds[b][l] += best;
+                total_bytes[b][l] += zlen;
+                printf("  %-10s %5d %10.2f %9.1f %11d %6.1f%%\n", deflate_backend_name(backends[b]), levels[l], best * 1000,
+                       filtered_len / best / 1e6, zlen, 100.0 * zlen / filtered_len);
+            }
+        }
+        free(filtered);
+    }
+
+    printf("\nCorpus total (%d image(s), %lld filtered bytes)\n", count, total_input);
+    printf("  %-10s %5s %10s %9s %11s %7s\n", "backend", "level", "time ms", "MB/s", "bytes", "ratio");
+    for (int b = 0; b < backend_count; b++) {
+        for (int l = 0; l < 4; l++) {
+            printf("  %-10s %5d %10.2f %9.1f %11lld %6.1f%%\n", deflate_backend_name(backends[b]), levels[l], total_seconds[b][l] * 1000,
+                   total_input / total_seconds[b][l] / 1e6, total_bytes[b][l], 100.0 * total_bytes[b][l] / total_input);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Benchmarks PNG input decoding with every available inflate backend against plain stb_image:
+ * decode time and throughput (decoded pixel bytes). Every result is compared with stb_image's pixels.
+ *
+ * @param files The image corpus.
+ * @param count The number of images.
+ * @return The process exit code.
+ */
+int bench_inflate(char **files, int count) {
+    int backends[3], backend_count = 0;
+    double total_seconds[3] = { 0 };
+    long long total_output = 0;
+
+    backends[backend_count++] = INFLATE_STB;
+    backends[backend_count++] = INFLATE_BUILTIN;
+#ifdef STEG_USE_ZLIB
+    backends[backend_count++] = INFLATE_ZLIB;
+#endif
+
+    for (int f = 0; f < count; f++) {
+        size_t file_len;
+        int width, height, channels, depth, handled;
+        unsigned char *file = read_file(files[f], &file_len);
+        unsigned char *reference = file ? stbi_load_from_memory(file, (int)file_len, &width, &height, &channels, 0) : NULL;
+        if (!reference) {
+            printf("ERROR: Failed to load image '%s'.\n", files[f]);
+            free(file);
+            return 1;
+        }
+        size_t pixel_len = (size_t)width * height * channels;
+        total_output += (long long)pixel_len;
+        unsigned char *native = png_decode_native(file, file_len, &width, &height, &channels, &depth, NULL, NULL, INFLATE_BUILTIN, &handled);
+        free(native);
+        printf("%s (%dx%d, %d channels, %zu file bytes, %s)\n", files[f], width, height, channels, file_len,
+               handled ? "native decoder" : "not a native format, stb_image fallback");
+        printf("  %-10s %10s %9s\n", "backend", "time ms", "MB/s");
+
+        for (int b = 0; b < backend_count; b++) {
+            // Best of three runs
+            double best = 1e30;
+            int ok = 1;
+            for (int run = 0; run < 3 && ok; run++) {
+                int w, h, c;
+                double start = now_seconds();
+                unsigned char *pixels = image_load_from_memory(file, file_len, &w, &h, &c, NULL, NULL, NULL, backends[b]);
+                double elapsed = now_seconds() - start;
+                if (elapsed < best) best = elapsed;
+                ok = pixels && w == width && h == height && c == channels && memcmp(pixels, reference, pixel_len) == 0;
+                stbi_image_free(pixels);
+            }
+            if (!ok) {
+                printf("ERROR: %s decoded '%s' differently from stb_image.\n", inflate_backend_name(backends[b]), files[f]);
+                stbi_image_free(reference);
+                free(file);
+                return 1;
+            }
+            total_seconds[b] += best;
+            printf("  %-10s %10.2f %9.1f\n", inflate_backend_name(backends[b]), best * 1000, pixel_len / best / 1e6);
+        }
+        stbi_image_free(reference);
+        free(file);
+    }
+
+    printf("\nCorpus total (%d image(s), %lld decoded bytes)\n", count, total_output);
+    printf("  %-10s %10s %9s %8s\n", "backend", "time ms", "MB/s", "speedup");
+    for (int b = 0; b < backend_count; b++) {
+        printf("  %-10s %10.2f %9.1f %7.2fx\n", inflate_backend_name(backends[b]), total_seconds[b] * 1000,
+               total_output / total_seconds[b] / 1e6, total_seconds[0] / total_seconds[b]);
+    }
+    return 0;
+}
+
+/**
+ * Unfilters a whole image with either the scalar code or the dispatched kernels.
+ *
+ * @param filtered The filtered scanlines (filter byte first).
+ * @param pixels The output pixels.
+ * @param zero_row A zeroed scanline used as the row above the first row.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels.
+ * @param simd 1 to use png_unfilter_rows, 0 for png_unfilter_row_scalar.
+ * @return 1 on success, 0 on an invalid filter byte.
+ */
+int bench_unfilter_image(const unsigned char *filtered, unsigned char *pixels, const unsigned char *zero_row, int width, int height, int channels, int simd) {
+    size_t row_bytes = (size_t)width * channels;
+    if (simd) {
+        return png_unfilter_rows(filtered, zero_row, pixels, row_bytes, channels, height);
+    }
+    for (int y = 0; y < height; y++) {
+        const unsigned char *line = filtered + y * (row_bytes + 1);
+        const unsigned char *prior = y ? pixels + (y - 1) * row_bytes : zero_row;
+        if (!png_unfilter_row_scalar(line[0], line + 1, prior, pixels + y * row_bytes, row_bytes, channels)) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Benchmarks scanline unfiltering: each image is filtered with Sub, Up, Average and Paeth in turn and
+ * unfiltered with the scalar code and the SIMD kernels, checking both reproduce the image.
+ *
+ * @param files The image corpus.
+ * @param count The number of images.
+ * @return The process exit code.
+ */
+int bench_unfilter(char **files, int count) {
+    static const char *filter_names[5] = { "none", "sub", "up", "average", "paeth" };
+    double total_seconds[5][2] = { { 0 } };
+    long long total_bytes = 0;
+
+    printf("Unfilter kernels: %s\n", png_unfilter_kernel_name());
+    for (int f = 0; f < count; f++) {
+        int width, height, channels;
+        unsigned char *image = image_load(files[f], &width, &height, &channels, NULL, NULL, NULL);
+        if (!image) {
+            printf("ERROR: Failed to load image '%s'.\n", files[f]);
+            return 1;
+        }
+        size_t row_bytes = (size_t)width * channels, pixel_len = row_bytes * height;
+        unsigned char *filtered = (unsigned char *)malloc((row_bytes + 1) * height);
+        unsigned char *pixels = (unsigned char *)malloc(pixel_len);
+        unsigned char *zero_row = (unsigned char *)calloc(row_bytes, 1);
+        if (!filtered || !pixels || !zero_row) {
+            printf("Memory allocation failed!\n");
+            free(filtered);
+            free(pixels);
+            free(zero_row);
+            stbi_image_free(image);
+            return 1;
+        }
+        total_bytes += (long long)pixel_len;
+        printf("%s (%dx%d, %d channels%s)\n", files[f], width, height, channels,
+               channels == 3 || channels == 4 ? "" : ", no SIMD kernels for this pixel size");
+        printf("  %-8s %10s %10s %9s %8s\n", "filter", "scalar ms", "simd ms", "MB/s", "speedup");
+
+        for (int filter = 1; filter <= 4; filter++) {
+            double best[2] = { 1e30, 1e30 };
+            int ok = png_filter_rows(image, width, height, channels, filter, 0, height, filtered);
+            for (int simd = 0; simd < 2 && ok; simd++) {
+                // Best of three runs
+                for (int run = 0; run < 3 && ok; run++) {
+                    memset(pixels, 0, pixel_len);
+                    double start = now_seconds();
+                    ok = bench_unfilter_image(filtered, pixels, zero_row, width, height, channels, simd);
+                    double elapsed = now_seconds() - start;
+                    if (elapsed < best[simd]) best[simd] = elapsed;
+                }
+                ok = ok && memcmp(pixels, image, pixel_len) == 0;
+            }
+            if (!ok) {
+                printf("ERROR: Unfiltering '%s' with %s did not reproduce the image.\n", files[f], filter_names[filter]);
+                free(filtered);
+                free(pixels);
+                free(zero_row);
+                stbi_image_free(image);
+                return 1;
+            }
+            total_seconds[filter][0] += best[0];
+            total_seconds[filter][1] += best[1];
+            printf("  %-8s %10.2f %10.2f %9.1f %7.2fx\n", filter_names[filter], best[0] * 1000, best[1] * 1000,
+                   pixel_len / best[1] / 1e6, best[0] / best[1]);
+        }
+        free(filtered);
+        free(pixels);
+        free(zero_row);
+        stbi_image_free(image);
+    }
+
+    printf("\nCorpus total (%d image(s), %lld bytes)\n", count, total_bytes);
+    printf("  %-8s %10s %10s %9s %8s\n", "filter", "scalar ms", "simd ms", "MB/s", "speedup");
+    for (int filter = 1; filter <= 4; filter++) {
+        printf("  %-8s %10.2f %10.2f %9.1f %7.2fx\n", filter_names[filter], total_seconds[filter][0] * 1000,
+               total_seconds[filter][1] * 1000, total_bytes / total_seconds[filter][1] / 1e6,
+               total_seconds[filter][0] / total_seconds[filter][1]);
+    }
+    return 0;
+}
+
+/**
+ * Adaptive filtering exactly as stbi_write_png does it (stbiw__encode_png_line for all five filters,
+ * then again for the winner); the baseline and reference output for the filter benchmark.
+ *
+ * @param pixels The unfiltered image data.
+ * @param width The width of the image.
+ * @param height The height of the image.
+ * @param channels The number of channels in the image.
+ * @param filtered The output buffer ((width * channels + 1) bytes per row).
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int bench_filter_stb(unsigned char *pixels, int width, int height, int channels, unsigned char *filtered) {
+    int row_bytes = width * channels;
+    signed char *line_buffer = (signed char *)malloc(row_bytes ? row_bytes : 1);
+    if (!line_buffer) {
+        printf("Memory allocation failed!\n");
+        return 0;
+    }
+    for (int y = 0; y < height; y++) {
+        int best_filter = 0, best_filter_val = 0x7fffffff;
+        for (int filter_type = 0; filter_type < 5; filter_type++) {
+            stbiw__encode_png_line(pixels, row_bytes, width, height, y, channels, filter_type, line_buffer);
+            int est = 0;
+            for (int i = 0; i < row_bytes; i++) {
+                est += abs(line_buffer[i]);
+            }
+            if (est < best_filter_val) {
+                best_filter_val = est;
+                best_filter = filter_type;
+            }
+        }
+        if (best_filter != 4) {
+            stbiw__encode_png_line(pixels, row_bytes, width, height, y, channels, best_filter, line_buffer);
+        }
+        unsigned char *out = filtered + (size_t)y * (row_bytes + 1);
+        out[0] = (unsigned char)best_filter;
+        memcpy(out + 1, line_buffer, row_bytes);
+    }
+    free(line_buffer);
+    return 1;
+}
+
+/**
+ * Benchmarks adaptive PNG filtering: stb_image_write's code against the scalar and SIMD kernels
+ * available on this CPU. Every kernel's output is compared with stb's byte for byte.
+ *
+ * @param files The image corpus.
+ * @param count The number of images.
+ * @return The process exit code.
+ */
+int bench_filter(char **files, int count) {
+    const char *names[4] = { "stb", "scalar", NULL, NULL };
+    png_filter_fn kernels[4] = { NULL, png_filter_row_scalar, NULL, NULL };
+    double total_seconds[4] = { 0 };
+    long long total_bytes = 0;
+    int kernel_count = 2;
+
+#if defined(STEG_HAVE_SSE2)
+    names[kernel_count] = "sse2";
+    kernels[kernel_count++] = png_filter_row_sse2;
+#endif
+    const char *best_name;
+    png_filter_fn best = png_filter_kernel_for_cpu(&best_name);
+    if (best != kernels[kernel_count - 1]) {
+        names[kernel_count] = best_name;
+        kernels[kernel_count++] = best;
+    }
+
+    for (int f = 0; f < count; f++) {
+        int width, height, channels;
+        unsigned char *image = image_load(files[f], &width, &height, &channels, NULL, NULL, NULL);
+        if (!image) {
+            printf("ERROR: Failed to load image '%s'.\n", files[f]);
+            return 1;
+        }
+        size_t filtered_len = ((size_t)width * channels + 1) * height;
+        unsigned char *reference = (unsigned char *)malloc(filtered_len);
+        unsigned char *filtered = (unsigned char *)malloc(filtered_len);
+        int ok = reference && filtered;
+        if (!ok) printf("Memory allocation failed!\n");
+        double stb_seconds = 0;
+        total_bytes += (long long)width * height * channels;
+        printf("%s (%dx%d, %d channels)\n", files[f], width, height, channels);
+        printf("  %-8s %10s %9s %8s\n", "kernel", "time ms", "MB/s", "speedup");
+
+        for (int k = 0; k < kernel_count && ok; k++) {
+            // Best of three runs
+            double elapsed = 1e30;
+            for (int run = 0; run < 3 && ok; run++) {
+                double start = now_seconds();
+                ok = k == 0 ? bench_filter_stb(image, width, height, channels, reference)
+                            : png_filter_rows_with_kernel(kernels[k], image, width, height, channels, PNG_FILTER_ADAPTIVE, 0, height, filtered);
+                double run_time = now_seconds() - start;
+                if (run_time < elapsed) elapsed = run_time;
+            }
+            if (ok && k > 0 && memcmp(filtered, reference, filtered_len) != 0) {
+                printf("ERROR: The %s kernel filtered '%s' differently from stb_image_write.\n", names[k], files[f]);
+                ok = 0;
+            }
+            if (!ok) break;
+            if (k == 0) stb_seconds = elapsed;
+            total_seconds[k] += elapsed;
+            printf("  %-8s %10.2f %9.1f %7.2fx\n", names[k], elapsed * 1000, (double)width * height * channels / elapsed / 1e6,
+                   stb_seconds / elapsed);
+        }
+        free(reference);
+        free(filtered);
+        stbi_image_free(image);
+        if (!ok) return 1;
+    }
+
+    printf("\nCorpus total (%d image(s), %lld bytes)\n", count, total_bytes);
+    printf("  %-8s %10s %9s %8s\n", "kernel", "time ms", "MB/s", "speedup");
+    for (int k = 0; k < kernel_count; k++) {
+        printf("  %-8s %10.2f %9.1f %7.2fx\n", names[k], total_seconds[k] * 1000, total_bytes / total_seconds[k] / 1e6,
+               total_seconds[0] / total_seconds[k]);
+    }
+    return 0;
+}
+
+/**
+ * Per-bit reference: the '0'/'1' expansion messageToBinary and image_to_binary used to do.
+ *
+ * @param bytes The bytes.
+ * @param count The number of bytes.
+ * @param chars The output (8 * count characters).
+ */
+void bench_bits_to_chars_reference(const unsigned char *bytes, size_t count, char *chars) {
+    for (size_t i = 0; i < count; i++) {
+        for (int j = 7; j >= 0; j--) {
+            chars[i * 8 + (7 - j)] = ((bytes[i] >> j) & 1) ? '1' : '0';
+        }
+    }
+}
+
+/**
+ * Per-bit reference: the packing binaryToAscii and binary_to_image used to do.
+ *
+ * @param chars The '0'/'1' characters.
+ * @param count The number of bytes to produce.
+ * @param bytes The output.
+ */
+void bench_chars_to_bits_reference(const char *chars, size_t count, unsigned char *bytes) {
+    for (size_t i = 0; i < count; i++) {
+        unsigned char value = 0;
+        for (int j = 0; j < 8; j++) {
+            value = (value << 1) | (chars[i * 8 + j] - '0');
+        }
+        bytes[i] = value;
+    }
+}
+
+/**
+ * Per-bit reference: the legacy checksum computed over the '0'/'1' characters of each payload bit.
+ *
+ * @param bytes The payload.
+ * @param count The number of payload bytes.
+ * @return The checksum.
+ */
+unsigned char bench_checksum_reference(const unsigned char *bytes, size_t count) {
+    unsigned char checksum = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (int j = 7; j >= 0; j--) {
+            checksum ^= (unsigned char)('0' + ((bytes[i] >> j) & 1));
+        }
+    }
+    return checksum;
+}
+
+/**
+ * Per-bit reference: writes payload bits into carrier LSBs one at a time.
+ *
+ * @param carriers The carrier bytes.
+ * @param bytes The payload.
+ * @param count The number of payload bytes.
+ */
+void bench_spread_reference(unsigned char *carriers, const unsigned char *bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        for (int j = 0; j < 8; j++) {
+            carriers[i * 8 + j] = (carriers[i * 8 + j] & 0xFE) | ((bytes[i] >> (7 - j)) & 1);
+        }
+    }
+}
+
+/**
+ * Per-bit reference: reads payload bits from carrier LSBs one at a time.
+ *
+ * @param carriers The carrier bytes.
+ * @param bytes The output.
+ * @param count The number of payload bytes.
+ */
+void bench_gather_reference(const unsigned char *carriers, unsigned char *bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        unsigned char value = 0;
+        for (int j = 0; j < 8; j++) {
+            value = (value << 1) | (carriers[i * 8 + j] & 1);
+        }
+        bytes[i] = value;
+    }
+}
+
+/**
+ * Benchmarks the byte<->bit conversions on a synthetic 1 MB payload: the old per-bit loops against
+ * the table-driven and word-at-a-time versions, in nanoseconds per payload byte. Every pair of results
+ * is compared. Then keyed scattering of the same payload over 64 MB of carriers (far larger than the
+ * caches, like a large image) is timed against sequential embedding and read back, and so are 16-bit
+ * carriers, sequential and keyed, and embedding into padded rows and row pointers against packing them
+ * into a temporary buffer. Last, whole messages are embedded and extracted through those kinds of frames
+ * and a sub-rectangle, and checked against the packed image. Needs no image files.
+ *
+ * @return The process exit code.
+ */
+int bench_bits(void) {
+    enum { BENCH_BITS_BYTES = 1 << 20 };
+    static const char *names[5] = { "to chars", "from chars", "checksum", "spread", "gather" };
+    unsigned char *payload = (unsigned char *)malloc(BENCH_BITS_BYTES);
+    unsigned char *bytes_a = (unsigned char *)malloc(BENCH_BITS_BYTES);
+    unsigned char *bytes_b = (unsigned char *)malloc(BENCH_BITS_BYTES);
+    char *chars_a = (char *)malloc((size_t)BENCH_BITS_BYTES * 8);
+    char *chars_b = (char *)malloc((size_t)BENCH_BITS_BYTES * 8);
+    unsigned char *carriers_a = (unsigned char *)malloc((size_t)BENCH_BITS_BYTES * 8);
+    unsigned char *carriers_b = (unsigned char *)malloc((size_t)BENCH_BITS_BYTES * 8);
+    int ok = payload && bytes_a && bytes_b && chars_a && chars_b && carriers_a && carriers_b;
+    if (!ok) printf("Memory allocation failed!\n");
+
+    uint32_t seed = 0x12345678u;
+    for (size_t i = 0; ok && i < (size_t)BENCH_BITS_BYTES * 8; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        if (i < BENCH_BITS_BYTES) payload[i] = (unsigned char)(seed >> 24);
+        carriers_a[i] = carriers_b[i] = (unsigned char)(seed >> 16);
+    }
+
+    if (ok) {
+        printf("%d payload bytes\n", BENCH_BITS_BYTES);
+        printf("  %-11s %12s %12s %8s\n", "conversion", "per-bit ns/B", "table ns/B", "speedup");
+    }
+    for (int n = 0; n < 5 && ok; n++) {
+        double seconds[2] = { 1e30, 1e30 };
+        unsigned char sums[2] = { 0, 0 };
+        for (int v = 0; v < 2; v++) {
+            // Best of five runs
+            for (int run = 0; run < 5; run++) {
+                double start = now_seconds();
+                switch (n) {
+                case 0:
+                    if (v == 0) bench_bits_to_chars_reference(payload, BENCH_BITS_BYTES, chars_a);
+                    else bytes_to_bit_chars(payload, BENCH_BITS_BYTES, chars_b);
+                    break;
+                case 1:
+                    if (v == 0) bench_chars_to_bits_reference(chars_a, BENCH_BITS_BYTES, bytes_a);
+                    else bit_chars_to_bytes(chars_b, BENCH_BITS_BYTES, bytes_b);
+                    break;
+                case 2:
+                    sums[v] = v == 0 ? bench_checksum_reference(payload, BENCH_BITS_BYTES)
+                                     : legacy_checksum((const char *)payload, BENCH_BITS_BYTES);
+                    break;
+                case 3:
+                    if (v == 0) bench_spread_reference(carriers_a, payload, BENCH_BITS_BYTES);
+                    else lsb_spread(carriers_b, payload, BENCH_BITS_BYTES);
+                    break;
+                default:
+                    if (v == 0) bench_gather_reference(carriers_a, bytes_a, BENCH_BITS_BYTES);
+                    else lsb_gather(carriers_b, bytes_b, BENCH_BITS_BYTES);
+                    break;
+                }
+                double run_time = now_seconds() - start;
+                if (run_time < seconds[v]) seconds[v] = run_time;
+            }
+        }
+        if (n == 0 || n == 3) {
+            ok = n == 0 ? memcmp(chars_a, chars_b, (size_t)BENCH_BITS_BYTES * 8) == 0
+                        : memcmp(carriers_a, carriers_b, (size_t)BENCH_BITS_BYTES * 8) == 0;
+        } else if (n == 2) {
+            ok = sums[0] == sums[1];
+        } else {
+            ok = memcmp(bytes_a, payload, BENCH_BITS_BYTES) == 0 && memcmp(bytes_b, payload, BENCH_BITS_BYTES) == 0;
+        }
+        if (!ok) {
+            printf("ERROR: The table-driven '%s' conversion differs from the per-bit loop.\n", names[n]);
+            break;
+        }
+        printf("  %-11s %12.3f %12.3f %7.2fx\n", names[n], seconds[0] * 1e9 / BENCH_BITS_BYTES,
+               seconds[1] * 1e9 / BENCH_BITS_BYTES, seconds[0] / seconds[1]);
+    }
+
+    // Keyed scattering: one Feistel evaluation per bit and a random carrier access each
+    size_t scatter_bytes = (size_t)BENCH_BITS_BYTES * 64;
+    unsigned char *image = ok ? (unsigned char *)calloc(scatter_bytes, 1) : NULL;
+    if (ok && !image) {
+        printf("Memory allocation failed!\n");
+        ok = 0;
+    }
+    if (ok) {
+        steg_key key;
+        steg_scatter scatter_state;
+        steg_key_derive("bench", &key);
+        const steg_scatter *scatter = scatter_init(&scatter_state, &key, scatter_bytes, 8);
+        printf("\nKeyed scattering of %d payload bytes over %zu carriers\n", BENCH_BITS_BYTES, scatter_bytes);
+        printf("  %-11s %12s %12s %8s\n", "conversion", "sequential", "keyed ns/B", "slowdown");
+        for (int n = 3; n < 5 && ok; n++) {
+            double seconds[2] = { 1e30, 1e30 };
+            for (int v = 0; v < 2; v++) {
+                for (int run = 0; run < 3; run++) {
+                    double start = now_seconds();
+                    if (n == 3) carrier_spread(v ? scatter : NULL, image, 0, payload, BENCH_BITS_BYTES);
+                    else carrier_gather(v ? scatter : NULL, image, 0, v ? bytes_b : bytes_a, BENCH_BITS_BYTES);
+                    double run_time = now_seconds() - start;
+                    if (run_time < seconds[v]) seconds[v] = run_time;
+                }
+            }
+            if (n == 4) {
+                // The keyed bits were written last, so they must all read back
+                ok = memcmp(bytes_b, payload, BENCH_BITS_BYTES) == 0;
+                if (!ok) printf("ERROR: Keyed scattering does not read back what it wrote.\n");
+            }
+            if (ok) {
+                printf("  %-11s %12.3f %12.3f %7.2fx\n", names[n], seconds[0] * 1e9 / BENCH_BITS_BYTES, seconds[1] * 1e9 / BENCH_BITS_BYTES,
+                       seconds[1] / seconds[0]);
+            }
+        }
+    }
+
+    // 16-bit carriers: a whole payload byte per sample, sequentially and keyed, over the same 64 MB
+    if (ok) {
+        static const char *layouts[3] = { "8-bit", "16-bit", "16-bit keyed" };
+        double seconds[3][2];
+        steg_key key;
+        steg_scatter scatter_state;
+        steg_key_derive("bench", &key);
+        for (int v = 0; v < 3 && ok; v++) {
+            memset(image, 0xA5, scatter_bytes);
+            const steg_scatter *scatter = v == 0 ? NULL : scatter_init(&scatter_state, v == 2 ? &key : NULL, scatter_bytes, 16);
+            for (int n = 0; n < 2; n++) {
+                seconds[v][n] = 1e30;
+                for (int run = 0; run < 3; run++) {
+                    double start = now_seconds();
+                    if (n == 0) carrier_spread(scatter, image, 0, payload, BENCH_BITS_BYTES);
+                    else carrier_gather(scatter, image, 0, bytes_a, BENCH_BITS_BYTES);
+                    double run_time = now_seconds() - start;
+                    if (run_time < seconds[v][n]) seconds[v][n] = run_time;
+                }
+            }
+            ok = memcmp(bytes_a, payload, BENCH_BITS_BYTES) == 0;
+            for (size_t i = 0; ok && v > 0 && i < scatter_bytes; i += 2) ok = image[i] == 0xA5;  // The high bytes never change
+            if (!ok) printf("ERROR: %s carriers do not read back what was written.\n", layouts[v]);
+        }
+        if (ok) {
+            printf("\nCarrier sample depth, %d payload bytes (ns/B)\n", BENCH_BITS_BYTES);
+            printf("  %-11s %12s %12s %12s\n", "conversion", layouts[0], layouts[1], layouts[2]);
+            for (int n = 0; n < 2; n++) {
+                printf("  %-11s %12.3f %12.3f %12.3f\n", names[3 + n], seconds[0][n] * 1e9 / BENCH_BITS_BYTES, seconds[1][n] * 1e9 / BENCH_BITS_BYTES,
+                       seconds[2][n] * 1e9 / BENCH_BITS_BYTES);
+            }
+        }
+    }
+    // Frames: 8-bit rows padded to a 64-byte stride, embedded in place and through bottom-up row
+    // pointers, against packing the rows into a temporary buffer and copying them back. The rows are
+    // not a whole number of embedded bytes long, so some bytes straddle two rows.
+    if (ok) {
+        static const char *ways[3] = { "pack+copy", "strided", "row ptrs" };
+        size_t row_bytes = 1999 * 3, stride = (row_bytes + 63) & ~(size_t)63;
+        size_t height = ((size_t)BENCH_BITS_BYTES * 8 + row_bytes - 1) / row_bytes;
+        unsigned char *packed = (unsigned char *)malloc(height * row_bytes);
+        unsigned char **rows = (unsigned char **)malloc(height * sizeof(*rows));
+        double seconds[3][2];
+        steg_frame strided, pointers;
+        ok = packed && rows;
+        if (!ok) printf("Memory allocation failed!\n");
+        for (size_t y = 0; ok && y < height; y++) rows[y] = image + (height - 1 - y) * stride;
+        if (ok) {
+            steg_frame_strided(&strided, image, row_bytes, height, stride);
+            steg_frame_rows(&pointers, rows, row_bytes, height);
+        }
+        for (int v = 0; v < 3 && ok; v++) {
+            memset(image, 0xA5, height * stride);
+            memset(bytes_a, 0, BENCH_BITS_BYTES);
+            const steg_frame *frame = v == 2 ? &pointers : &strided;
+            for (int n = 0; n < 2; n++) {
+                seconds[v][n] = 1e30;
+                for (int run = 0; run < 3; run++) {
+                    double start = now_seconds();
+                    if (v == 0) {
+                        for (size_t y = 0; y < height; y++) memcpy(packed + y * row_bytes, image + y * stride, row_bytes);
+                        if (n == 0) {
+                            lsb_spread(packed, payload, BENCH_BITS_BYTES);
+                            for (size_t y = 0; y < height; y++) memcpy(image + y * stride, packed + y * row_bytes, row_bytes);
+                        } else {
+                            lsb_gather(packed, bytes_a, BENCH_BITS_BYTES);
+                        }
+                    } else if (n == 0) {
+                        frame_spread(NULL, frame, 0, payload, BENCH_BITS_BYTES);
+                    } else {
+                        frame_gather(NULL, frame, 0, bytes_a, BENCH_BITS_BYTES);
+                    }
+                    double run_time = now_seconds() - start;
+                    if (run_time < seconds[v][n]) seconds[v][n] = run_time;
+                }
+            }
+            ok = memcmp(bytes_a, payload, BENCH_BITS_BYTES) == 0;
+            for (size_t y = 0; ok && y < height; y++) {
+                // Every frame holds the packed result row for row, and the padding never changes
+                unsigned char *row = frame_row(frame, y);
+                ok = memcmp(row, packed + y * row_bytes, row_bytes) == 0;
+                for (size_t x = row_bytes; ok && x < stride; x++) ok = row[x] == 0xA5;
+            }
+            if (!ok) printf("ERROR: %s frame carriers do not match the packed image.\n", ways[v]);
+        }
+        if (ok) {
+            printf("\nFrames of %zu-byte rows at a %zu-byte stride, %d payload bytes (ns/B)\n", row_bytes, stride, BENCH_BITS_BYTES);
+            printf("  %-11s %12s %12s %12s\n", "conversion", ways[0], ways[1], ways[2]);
+            for (int n = 0; n < 2; n++) {
+                printf("  %-11s %12.3f %12.3f %12.3f\n", names[3 + n], seconds[0][n] * 1e9 / BENCH_BITS_BYTES, seconds[1][n] * 1e9 / BENCH_BITS_BYTES,
+                       seconds[2][n] * 1e9 / BENCH_BITS_BYTES);
+            }
+        }
+        free(packed);
+        free(rows);
+    }
+    // Frames, whole messages: embedded and extracted through padded rows, a sub-rectangle of a larger
+    // canvas and bottom-up row pointers, in 8- and 16-bit samples, sequentially and keyed with error
+    // correction. Each must change its rows exactly as embedding into their packed image does, leave the
+    // rest of the canvas alone and read the payload back, in memory and streamed to a file.
+    if (ok) {
+        enum { CANVAS_WIDTH = 700, CANVAS_HEIGHT = 300, FRAME_WIDTH = 517, FRAME_HEIGHT = 211, FRAME_X = 37, FRAME_Y = 41, MESSAGE_BYTES = 2000 };
+        static const char *shapes[3] = { "padded", "sub-rectangle", "row pointer" };
+        size_t canvas_bytes = (size_t)CANVAS_WIDTH * 3 * 2 * CANVAS_HEIGHT;
+        unsigned char *canvas = (unsigned char *)malloc(canvas_bytes);
+        unsigned char *expected = (unsigned char *)malloc(canvas_bytes);
+        unsigned char *packed = (unsigned char *)malloc(canvas_bytes);
+        unsigned char *rows[FRAME_HEIGHT];
+        steg_key key;
+        steg_key_derive("bench", &key);
+        ok = canvas && expected && packed;
+        if (!ok) printf("Memory allocation failed!\n");
+        for (int c = 0; c < 12 && ok; c++) {
+            int shape = c % 3, depth = c / 3 % 2 ? 16 : 8, keyed = c / 6;
+            size_t sample = depth / 8, row_bytes = FRAME_WIDTH * 3 * sample, canvas_stride = CANVAS_WIDTH * 3 * sample;
+            message_layout layout = { MESSAGE_FORMAT_HEADER, keyed ? 32 : 0 };
+            if (keyed) layout.secrets.key = key;
+            for (size_t i = 0; i < canvas_bytes; i++) canvas[i] = (unsigned char)((i * 2654435761u) >> 13);
+            memcpy(expected, canvas, canvas_bytes);
+
+            steg_frame frame;
+            if (shape == 0) {
+                steg_frame_strided(&frame, canvas, row_bytes, FRAME_HEIGHT, (row_bytes + 63) & ~(size_t)63);
+            } else if (shape == 1) {
+                steg_frame_strided(&frame, canvas + FRAME_Y * canvas_stride + FRAME_X * 3 * sample, row_bytes, FRAME_HEIGHT, canvas_stride);
+            } else {
+                for (size_t y = 0; y < FRAME_HEIGHT; y++) rows[y] = canvas + (FRAME_HEIGHT - 1 - y) * canvas_stride + 5;
+                steg_frame_rows(&frame, rows, row_bytes, FRAME_HEIGHT);
+            }
+            for (size_t y = 0; y < FRAME_HEIGHT; y++) memcpy(packed + y * row_bytes, frame_row(&frame, y), row_bytes);
+
+            message_info info;
+            ok = embed_message(packed, row_bytes * FRAME_HEIGHT, depth, payload, MESSAGE_BYTES, &layout) &&
+                 embed_message_frame(&frame, depth, payload, MESSAGE_BYTES, &layout);
+            for (size_t y = 0; ok && y < FRAME_HEIGHT; y++) {
+                memcpy(expected + (frame_row(&frame, y) - canvas), packed + y * row_bytes, row_bytes);
+            }
+            ok = ok && memcmp(canvas, expected, canvas_bytes) == 0;
+            char *extracted = ok ? extract_message_frame(&frame, depth, &layout.secrets, &info) : NULL;
+            ok = extracted && info.checksum_ok && info.length == MESSAGE_BYTES && memcmp(extracted, payload, MESSAGE_BYTES) == 0;
+            free(extracted);
+            FILE *file = ok ? tmpfile() : NULL;
+            if (file) {
+                ok = extract_message_to_file_frame(&frame, depth, &layout.secrets, file, 0, &info) == 1 && info.checksum_ok &&
+                     ftell(file) == MESSAGE_BYTES;
+                rewind(file);
+                ok = ok && fread(bytes_a, 1, MESSAGE_BYTES, file) == MESSAGE_BYTES && memcmp(bytes_a, payload, MESSAGE_BYTES) == 0;
+                fclose(file);
+            }
+            if (!ok) printf("ERROR: A message in a %d-bit %s frame%s does not round-trip.\n", depth, shapes[shape], keyed ? " (keyed, FEC)" : "");
+        }
+        if (ok) {
+            printf("\nFrame messages: %d-byte payloads round-trip through padded, sub-rectangle and row pointer frames\n", MESSAGE_BYTES);
+            printf("  (8- and 16-bit samples, sequential and keyed with FEC), matching the packed image byte for byte\n");
+        }
+        free(canvas);
+        free(expected);
+        free(packed);
+    }
+    free(image);
+
+    free(payload);
+    free(bytes_a);
+    free(bytes_b);
+    free(chars_a);
+    free(chars_b);
+    free(carriers_a);
+    free(carriers_b);
+    return ok ? 0 : 1;
+}
+
+/**
+ * Benchmarks message integrity checks without image files. It times the CRC32C kernels against the
+ * legacy parity checksum, then a full extraction of a 1 MB payload from 8 MB of carriers in each
+ * format. The header path checks the CRC while it gathers the bits; the legacy path scans for the end
+ * marker and then gathers. Every kernel's CRC is compared with the slicing-by-8 result.
+ *
+ * @return The process exit code.
+ */
+int bench_crc(void) {
+    enum { BENCH_CRC_BYTES = 1 << 20 };
+    const char *names[3] = { "slice8", NULL, NULL };
+    crc32c_fn kernels[3] = { crc32c_slice8, NULL, NULL };
+    int kernel_count = 1;
+    crc32c_kernel_name();  // Builds the tables
+#if defined(STEG_HAVE_X86_DISPATCH) && defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        names[kernel_count] = "sse4.2";
+        kernels[kernel_count++] = crc32c_sse42;
+    }
+#elif defined(STEG_HAVE_ARM_CRC32)
+    names[kernel_count] = "armv8";
+    kernels[kernel_count++] = crc32c_armv8;
+#endif
+
+    unsigned char *payload = (unsigned char *)malloc(BENCH_CRC_BYTES + 1);
+    unsigned char *pixels = (unsigned char *)malloc(((size_t)BENCH_CRC_BYTES + STEG_HEADER_BYTES) * 8);
+    if (!payload || !pixels) {
+        printf("Memory allocation failed!\n");
+        free(payload);
+        free(pixels);
+        return 1;
+    }
+    uint32_t seed = 0x9E3779B9u;
+    for (size_t i = 0; i < ((size_t)BENCH_CRC_BYTES + STEG_HEADER_BYTES) * 8; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        pixels[i] = (unsigned char)(seed >> 24);
+        if (i < BENCH_CRC_BYTES) {
+            payload[i] = (unsigned char)(seed >> 16);
+            if (payload[i] == 0x07 || payload[i] == 0) payload[i] = 'x';  // Keep the payload valid for the legacy format
+        }
+    }
+    payload[BENCH_CRC_BYTES] = '\0';
+
+    int ok = 1;
+    uint32_t reference = 0;
+    printf("Checksum of %d bytes\n", BENCH_CRC_BYTES);
+    printf("  %-8s %10s %9s\n", "kernel", "ns/byte", "GB/s");
+    for (int k = 0; k <= kernel_count; k++) {
+        double best = 1e30;
+        uint32_t crc = 0;
+        for (int run = 0; run < 5; run++) {
+            double start = now_seconds();
+            crc = k == kernel_count ? legacy_checksum((const char *)payload, BENCH_CRC_BYTES) : ~kernels[k](~0u, payload, BENCH_CRC_BYTES);
+            double run_time = now_seconds() - start;
+            if (run_time < best) best = run_time;
+        }
+        if (k == 0) reference = crc;
+        if (k < kernel_count && crc != reference) {
+            printf("ERROR: The %s CRC32C kernel disagrees with slicing-by-8.\n", names[k]);
+            ok = 0;
+        }
+        printf("  %-8s %10.3f %9.2f\n", k == kernel_count ? "parity" : names[k], best * 1e9 / BENCH_CRC_BYTES, BENCH_CRC_BYTES / best / 1e9);
+    }
+
+    printf("\nExtraction of a %d-byte payload (CRC32C kernel: %s)\n", BENCH_CRC_BYTES, crc32c_kernel_name());
+    printf("  %-8s %10s %9s\n", "format", "ns/byte", "MB/s");
+    for (int format = MESSAGE_FORMAT_HEADER; format <= MESSAGE_FORMAT_LEGACY && ok; format++) {
+        size_t pixel_bytes = ((size_t)BENCH_CRC_BYTES + STEG_HEADER_BYTES) * 8;
+        message_layout layout = { format, 0 };
+        ok = embed_message(pixels, pixel_bytes, 8, payload, BENCH_CRC_BYTES, &layout);
+        double best = 1e30;
+        for (int run = 0; run < 5 && ok; run++) {
+            message_info info;
+            double start = now_seconds();
+            char *extracted = extract_message(pixels, pixel_bytes, 8, NULL, &info);
+            double run_time = now_seconds() - start;
+            if (run_time < best) best = run_time;
+            ok = extracted && info.checksum_ok && info.length == BENCH_CRC_BYTES && memcmp(extracted, payload, info.length) == 0;
+            free(extracted);
+        }
+        if (!ok) {
+            printf("ERROR: The %s payload did not read back intact.\n", format == MESSAGE_FORMAT_LEGACY ? "legacy" : "header");
+            break;
+        }
+        printf("  %-8s %10.3f %9.1f\n", format == MESSAGE_FORMAT_LEGACY ? "legacy" : "header", best * 1e9 / BENCH_CRC_BYTES, BENCH_CRC_BYTES / best / 1e6);
+    }
+    free(payload);
+    free(pixels);
+    return ok ? 0 : 1;
+}
+
+/**
+ * Benchmarks Reed-Solomon error correction on a synthetic 4 MB payload without image files: adding the
+ * check rows to a payload already in carrier LSBs (as the encoder does), checking an undamaged payload,
+ * and repairing one with a quarter of each block's capacity used.
+ * Every decode is compared with the original payload.
+ *
+ * @return The process exit code.
+ */
+int bench_fec(void) {
+    enum { BENCH_FEC_BYTES = 4 << 20 };
+    static const int parities[3] = { 8, 32, 64 };
+    unsigned char *payload = (unsigned char *)malloc(BENCH_FEC_BYTES);
+    unsigned char *coded = (unsigned char *)malloc((size_t)BENCH_FEC_BYTES * 2);
+    unsigned char *damaged = (unsigned char *)malloc((size_t)BENCH_FEC_BYTES * 2);
+    unsigned char *carriers = (unsigned char *)calloc((size_t)BENCH_FEC_BYTES * 2, 8);
+    steg_frame carrier_frame = frame_packed(carriers, (size_t)BENCH_FEC_BYTES * 2 * 8);
+    int ok = payload && coded && damaged && carriers;
+    if (!ok) printf("Memory allocation failed!\n");
+    uint32_t seed = 0x2545F491u;
+    for (size_t i = 0; ok && i < BENCH_FEC_BYTES; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        payload[i] = (unsigned char)(seed >> 24);
+    }
+
+    if (ok) {
+        printf("%d payload bytes\n", BENCH_FEC_BYTES);
+        printf("  %-6s %9s %11s %11s %11s %9s\n", "parity", "overhead", "encode MB/s", "clean MB/s", "repair MB/s", "repaired");
+    }
+    for (int p = 0; p < 3 && ok; p++) {
+        int parity = parities[p];
+        rs_layout layout = rs_layout_for(BENCH_FEC_BYTES, parity);
+        size_t coded_len = layout.blocks * layout.block_len;
+        double seconds[3] = { 1e30, 1e30, 1e30 };
+        long corrected = 0;
+
+        // Damage parity / 8 bytes of every block, at positions that differ from block to block
+        for (int pass = 0; pass < 3 && ok; pass++) {
+            for (int run = 0; run < 3 && ok; run++) {
+                if (pass == 0) {
+                    lsb_spread(carriers, payload, BENCH_FEC_BYTES);  // The padding carriers stay zero
+                } else {
+                    memcpy(damaged, coded, coded_len);
+                }
+                if (pass == 2) {
+                    for (size_t b = 0; b < layout.blocks; b++) {
+                        for (int e = 0; e < parity / 8; e++) {
+                            damaged[(size_t)((b * 7 + e * 37) % layout.block_len) * layout.blocks + b] ^= 0x5A;
+                        }
+                    }
+                }
+                double start = now_seconds();
+                if (pass == 0) ok = rs_encode_carriers(NULL, &carrier_frame, 0, BENCH_FEC_BYTES, parity);
+                else ok = rs_decode_payload(damaged, BENCH_FEC_BYTES, parity, &corrected);
+                double run_time = now_seconds() - start;
+                if (run_time < seconds[pass]) seconds[pass] = run_time;
+                if (ok && pass > 0) ok = corrected >= 0 && memcmp(damaged, payload, BENCH_FEC_BYTES) == 0;
+            }
+            if (pass == 0) lsb_gather(carriers, coded, coded_len);
+        }
+        if (!ok) {
+            printf("ERROR: Reed-Solomon with %d check bytes did not restore the payload.\n", parity);
+            break;
+        }
+        printf("  %-6d %8.1f%% %11.1f %11.1f %11.1f %9ld\n", parity, 100.0 * (coded_len - BENCH_FEC_BYTES) / BENCH_FEC_BYTES,
+               BENCH_FEC_BYTES / seconds[0] / 1e6, BENCH_FEC_BYTES / seconds[1] / 1e6, BENCH_FEC_BYTES / seconds[2] / 1e6, corrected);
+    }
+    free(payload);
+    free(coded);
+    free(damaged);
+    free(carriers);
+    return ok ? 0 : 1;
+}
+
 /**
- * Calculates a simple XOR checksum over a given data.
+ * Compares bytes with a hexadecimal string.
  *
- * @param data The data to calculate the checksum over.
- * @param length The length of the data.
- * @return The XOR checksum of the data.
+ * @param bytes The bytes.
+ * @param hex The expected bytes in hexadecimal.
+ * @return 1 if they match, 0 otherwise.
  */
-unsigned char calculate_checksum(const char* data, size_t length) {
-    unsigned char checksum = 0;
-    // Iterate over the data and apply XOR operation to each byte
-    for (size_t i = 0; i < length; i++) {
-        checksum ^= data[i];
+static int bytes_match_hex(const unsigned char *bytes, const char *hex) {
+    for (size_t i = 0; hex[2 * i]; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1 || bytes[i] != byte) return 0;
     }
-    return checksum;
+    return 1;
 }
 
 /**
- * Converts an image into its binary representation.
+ * Checks the crypto primitives against published test vectors: SHA-256 (the FIPS 180-2 examples, the
+ * long one fed in pieces), scrypt (RFC 7914 section 12, all but the 1 GB vector) and ChaCha20-Poly1305
+ * (RFC 8439 section 2.8.2, sealed and opened in two pieces).
  *
- * @param image The image data.
- * @param width The width of the image.
- * @param height The height of the image.
- * @param channels The number of channels in the image.
- * @param binary_size A pointer to store the size of the resulting binary data.
- * @return The binary representation of the image.
+ * @return 1 if every vector matches, 0 otherwise (the failing one is reported).
  */
-char *image_to_binary(unsigned char *image, int width, int height, int channels, int *binary_size) {
-    int buffer_size = width * height * channels * 8;  // Each pixel's value represented in 8 bits
-    char *binary_data = (char *)malloc(buffer_size);
-    
-    if (!binary_data) {
+int crypto_known_answers(void) {
+    static const struct { const char *text; int repeat; const char *digest; } sha256_vectors[3] = {
+        { "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+        { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 10000,
+          "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    };
+    static const struct { const char *password, *salt; int log_n; uint32_t r, p; const char *key; } scrypt_vectors[3] = {
+        { "", "", 4, 1, 1,
+          "77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906" },
+        { "password", "NaCl", 10, 8, 16,
+          "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640" },
+        { "pleaseletmein", "SodiumChloride", 14, 8, 1,
+          "7023bdcb3afd7348461c06cd81fd38ebfda8fbba904f8e3ea9b543f6545da1f2d5432955613f0fcf62d49705242a9af9e61e85dc0d651e40dfcf017b45575887" },
+    };
+    static const char aead_plaintext[] =
+        "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+    static const char aead_ciphertext[] =
+        "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+        "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc3ff4def08e4b7a9de576d26586cec64b6116";
+    static const unsigned char aead_nonce[CHACHA_NONCE_BYTES] = { 0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47 };
+    static const unsigned char aead_aad[12] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7 };
+    unsigned char digest[64], sealed[sizeof(aead_plaintext)], opened[sizeof(aead_plaintext)], key[CHACHA_KEY_BYTES], tag[POLY1305_TAG_BYTES];
+
+    for (int v = 0; v < 3; v++) {
+        sha256_ctx ctx;
+        sha256_init(&ctx);
+        for (int i = 0; i < sha256_vectors[v].repeat; i++) {
+            sha256_update(&ctx, (const unsigned char *)sha256_vectors[v].text, strlen(sha256_vectors[v].text));
+        }
+        sha256_final(&ctx, digest);
+        if (!bytes_match_hex(digest, sha256_vectors[v].digest)) {
+            printf("ERROR: SHA-256 test vector %d does not match.\n", v + 1);
+            return 0;
+        }
+    }
+    for (int v = 0; v < 3; v++) {
+        if (!scrypt_derive((const unsigned char *)scrypt_vectors[v].password, strlen(scrypt_vectors[v].password),
+                           (const unsigned char *)scrypt_vectors[v].salt, strlen(scrypt_vectors[v].salt), scrypt_vectors[v].log_n,
+                           scrypt_vectors[v].r, scrypt_vectors[v].p, digest, 64) ||
+            !bytes_match_hex(digest, scrypt_vectors[v].key)) {
+            printf("ERROR: scrypt test vector %d (RFC 7914) does not match.\n", v + 1);
+            return 0;
+        }
+    }
+    size_t length = sizeof(aead_plaintext) - 1, split = 50;
+    for (int i = 0; i < CHACHA_KEY_BYTES; i++) key[i] = (unsigned char)(0x80 + i);
+    steg_aead aead;
+    aead_init(&aead, key, aead_nonce, aead_aad, sizeof(aead_aad));
+    aead_encrypt(&aead, (const unsigned char *)aead_plaintext, sealed, split);
+    aead_encrypt(&aead, (const unsigned char *)aead_plaintext + split, sealed + split, length - split);
+    aead_finish(&aead, tag);
+    int ok = bytes_match_hex(sealed, aead_ciphertext) && bytes_match_hex(tag, "1ae10b594f09e26a7e902ecbd0600691");
+    aead_init(&aead, key, aead_nonce, aead_aad, sizeof(aead_aad));
+    aead_decrypt(&aead, sealed, opened, split);
+    aead_decrypt(&aead, sealed + split, opened + split, length - split);
+    aead_finish(&aead, digest);
+    if (!ok || !aead_tag_equal(tag, digest) || memcmp(opened, aead_plaintext, length) != 0) {
+        printf("ERROR: The ChaCha20-Poly1305 test vector (RFC 8439 2.8.2) does not match.\n");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Benchmarks payload encryption without image files, after checking the primitives against published
+ * test vectors: the ChaCha20 kernels (compared with each other),
+ * Poly1305, sealing and opening in the 4 KB pieces the message writer uses, embedding a 4 MB payload
+ * with and without encryption, and one scrypt derivation with the default parameters.
+ *
+ * @return The process exit code.
+ */
+int bench_crypto(void) {
+    enum { BENCH_CRYPTO_BYTES = 16 << 20, BENCH_EMBED_BYTES = 4 << 20 };
+    const char *names[3] = { "scalar", NULL, NULL };
+    chacha20_fn kernels[3] = { chacha20_blocks_scalar, NULL, NULL };
+    int kernel_count = 1;
+#if defined(STEG_HAVE_SSE2)
+    names[kernel_count] = "sse2";
+    kernels[kernel_count++] = chacha20_blocks_sse2;
+#endif
+#ifdef STEG_HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        names[kernel_count] = "avx2";
+        kernels[kernel_count++] = chacha20_blocks_avx2;
+    }
+#endif
+    unsigned char *data = (unsigned char *)malloc(BENCH_CRYPTO_BYTES);
+    unsigned char *reference = (unsigned char *)malloc(BENCH_CRYPTO_BYTES);
+    unsigned char *output = (unsigned char *)malloc(BENCH_CRYPTO_BYTES);
+    unsigned char *pixels = (unsigned char *)malloc(((size_t)BENCH_EMBED_BYTES + 256) * 8);
+    int ok = data && reference && output && pixels;
+    if (!ok) printf("Memory allocation failed!\n");
+    uint32_t seed = 0x6C8E9CF5u, state[16];
+    for (size_t i = 0; ok && i < BENCH_CRYPTO_BYTES; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        data[i] = (unsigned char)(seed >> 24);
+        if (i < ((size_t)BENCH_EMBED_BYTES + 256) * 8) pixels[i] = (unsigned char)(seed >> 16);
+    }
+    unsigned char key[CHACHA_KEY_BYTES], nonce[CHACHA_NONCE_BYTES], tag[POLY1305_TAG_BYTES], opened[POLY1305_TAG_BYTES];
+    if (ok) {
+        memcpy(key, data, sizeof(key));
+        memcpy(nonce, data + sizeof(key), sizeof(nonce));
+        for (int i = 0; i < 16; i++) state[i] = read_be32(data + 64 + 4 * i);
+        printf("Known-answer tests: SHA-256, scrypt (RFC 7914), ChaCha20-Poly1305 (RFC 8439): ");
+        ok = crypto_known_answers();
+        if (ok) printf("all match\n\n");
+    }
+    if (ok) {
+        printf("%d bytes (sealing uses the %s ChaCha20 kernel)\n", BENCH_CRYPTO_BYTES, chacha20_kernel_name());
+        printf("  %-16s %10s %9s\n", "step", "ns/byte", "MB/s");
+    }
+    for (int k = 0; k < kernel_count && ok; k++) {
+        double best = 1e30;
+        for (int run = 0; run < 3; run++) {
+            double start = now_seconds();
+            kernels[k](state, k ? output : reference, BENCH_CRYPTO_BYTES / 64);
+            double run_time = now_seconds() - start;
+            if (run_time < best) best = run_time;
+        }
+        if (k && memcmp(output, reference, BENCH_CRYPTO_BYTES) != 0) {
+            printf("ERROR: The %s ChaCha20 kernel disagrees with the scalar one.\n", names[k]);
+            ok = 0;
+            break;
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "chacha20 %s", names[k]);
+        printf("  %-16s %10.3f %9.1f\n", label, best * 1e9 / BENCH_CRYPTO_BYTES, BENCH_CRYPTO_BYTES / best / 1e6);
+    }
+    for (int step = 0; step < 3 && ok; step++) {
+        static const char *steps[3] = { "poly1305", "seal (4 KB)", "open (4 KB)" };
+        double best = 1e30;
+        for (int run = 0; run < 3; run++) {
+            steg_aead aead;
+            poly1305_ctx mac;
+            double start = now_seconds();
+            if (step == 0) {
+                poly1305_init(&mac, key);
+                poly1305_update(&mac, data, BENCH_CRYPTO_BYTES);
+                poly1305_final(&mac, tag);
+            } else {
+                aead_init(&aead, key, nonce, NULL, 0);
+                for (size_t done = 0; done < BENCH_CRYPTO_BYTES; done += MESSAGE_SEAL_BYTES) {
+                    if (step == 1) aead_encrypt(&aead, data + done, output + done, MESSAGE_SEAL_BYTES);
+                    else aead_decrypt(&aead, output + done, reference + done, MESSAGE_SEAL_BYTES);
+                }
+                aead_finish(&aead, step == 1 ? tag : opened);
+            }
+            double run_time = now_seconds() - start;
+            if (run_time < best) best = run_time;
+        }
+        if (step == 2 && (!aead_tag_equal(tag, opened) || memcmp(reference, data, BENCH_CRYPTO_BYTES) != 0)) {
+            printf("ERROR: Opening the sealed data did not restore it.\n");
+            ok = 0;
+            break;
+        }
+        printf("  %-16s %10.3f %9.1f\n", steps[step], best * 1e9 / BENCH_CRYPTO_BYTES, BENCH_CRYPTO_BYTES / best / 1e6);
+    }
+
+    // The first derivation is timed on its own; the embeds below take the key from the cache
+    steg_passphrase *passphrase = ok ? passphrase_intern("bench passphrase") : NULL;
+    if (ok && !passphrase) {
         printf("Memory allocation failed!\n");
-        return NULL;
+        ok = 0;
+    }
+    if (ok) {
+        unsigned char params[4], salt[SCRYPT_SALT_BYTES];
+        double start = now_seconds();
+        ok = passphrase_key(passphrase, 1, params, salt, key);
+        double derive_time = now_seconds() - start;
+        printf("\nscrypt (N = %d, r = %d, p = %d, %d MB): %.1f ms\n", 1 << SCRYPT_DEFAULT_LOG_N, SCRYPT_DEFAULT_R, SCRYPT_DEFAULT_P,
+               (128 * SCRYPT_DEFAULT_R << SCRYPT_DEFAULT_LOG_N) >> 20, derive_time * 1e3);
+        if (!ok) printf("ERROR: The key derivation failed.\n");
     }
 
-    int index = 0;
-    // Convert each pixel value to its binary equivalent
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            for (int c = 0; c < channels; c++) {
-                unsigned char pixel_value = image[(y * width + x) * channels + c];
-                for (int i = 7; i >= 0; i--) {
-                    binary_data[index++] = ((pixel_value >> i) & 1) ? '1' : '0';
+    if (ok) {
+        printf("\nEmbedding and extracting a %d-byte payload\n", BENCH_EMBED_BYTES);
+        printf("  %-10s %11s %12s\n", "payload", "embed MB/s", "extract MB/s");
+    }
+    size_t pixel_bytes = ((size_t)BENCH_EMBED_BYTES + 256) * 8;
+    for (int encrypted = 0; encrypted < 2 && ok; encrypted++) {
+        message_layout layout = { MESSAGE_FORMAT_HEADER, 0 };
+        layout.secrets.passphrase = encrypted ? passphrase : NULL;
+        double best[2] = { 1e30, 1e30 };
+        for (int run = 0; run < 3 && ok; run++) {
+            message_info info;
+            double start = now_seconds();
+            ok = embed_message(pixels, pixel_bytes, 8, data, BENCH_EMBED_BYTES, &layout);
+            double middle = now_seconds();
+            char *extracted = ok ? extract_message(pixels, pixel_bytes, 8, &layout.secrets, &info) : NULL;
+            double end = now_seconds();
+            if (middle - start < best[0]) best[0] = middle - start;
+            if (end - middle < best[1]) best[1] = end - middle;
+            ok = extracted && info.checksum_ok && info.length == BENCH_EMBED_BYTES && memcmp(extracted, data, BENCH_EMBED_BYTES) == 0 &&
+                 info.encrypted == encrypted && (!encrypted || info.authentic);
+            free(extracted);
+        }
+        if (!ok) {
+            printf("ERROR: The %s payload did not read back intact.\n", encrypted ? "encrypted" : "plain");
+            break;
+        }
+        printf("  %-10s %11.1f %12.1f\n", encrypted ? "encrypted" : "plain", BENCH_EMBED_BYTES / best[0] / 1e6, BENCH_EMBED_BYTES / best[1] / 1e6);
+    }
+    free(data);
+    free(reference);
+    free(output);
+    free(pixels);
+    return ok ? 0 : 1;
+}
+
+int bench_select(char **files, int count);
+
+/**
+ * Runs a named benchmark.
+ *
+ * @param name The benchmark name.
+ * @param files The image corpus.
+ * @param count The number of images.
+ * @return The process exit code.
+ */
+int run_benchmark(const char *name, char **files, int count) {
+    if (strcmp(name, "bits") == 0) {
+        return bench_bits();
+    }
+    if (strcmp(name, "crc") == 0) {
+        return bench_crc();
+    }
+    if (strcmp(name, "fec") == 0) {
+        return bench_fec();
+    }
+    if (strcmp(name, "crypto") == 0) {
+        return bench_crypto();
+    }
+    if (count == 0) {
+        printf("ERROR: --bench needs at least one image.\n");
+        return 1;
+    }
+    if (strcmp(name, "deflate") == 0) {
+        return bench_deflate(files, count);
+    }
+    if (strcmp(name, "inflate") == 0) {
+        return bench_inflate(files, count);
+    }
+    if (strcmp(name, "unfilter") == 0) {
+        return bench_unfilter(files, count);
+    }
+    if (strcmp(name, "filter") == 0) {
+        return bench_filter(files, count);
+    }
+    if (strcmp(name, "select") == 0) {
+        return bench_select(files, count);
+    }
+    printf("ERROR: Unknown benchmark '%s' (expected deflate, inflate, unfilter, filter, select, bits, crc, fec or crypto).\n", name);
+    return 1;
+}
+
+/**
+ * Prints the command-line usage.
+ *
+ * @param program The program name.
+ */
+void print_usage(const char *program) {
+    printf("Usage:\n");
+    printf("  %s                                   Interactive mode\n", program);
+    printf("  %s --batch <jobs.txt> [options]      Run a batch of jobs\n", program);
+    printf("  %s --extract <image> <file|-> [--key <k>] [--passphrase <p>]\n", program);
+    printf("                                       Write the hidden payload to a file or standard output\n");
+    printf("  %s --capacity [--cache <file>] [--format <f>] [--fec <n>] <images...|->\n", program);
+    printf("                                       Print payload capacity, width, height, channels and path per image\n");
+    printf("  %s --select <payload|bytes> [--cache <file>] [--threads <n>] [--format <f>] [--fec <n>] <images...|->\n", program);
+    printf("                                       Choose the carrier(s) with the smallest estimated output for a payload\n");
+    printf("  %s --shard <payload> <prefix> [--threads <n>] [job options] <carriers...|->\n", program);
+    printf("                                       Split a payload over carriers into <prefix>-0001.png, <prefix>-0002.png, ...\n");
+    printf("  %s --reassemble <output> [--threads <n>] [--key <k>] [--passphrase <p>] <images...|->\n", program);
+    printf("                                       Rebuild a sharded payload from its images, in any order\n");
+    printf("  %s --bench <name> <images...>        Run a benchmark (deflate, inflate, unfilter, filter, select, bits, crc, fec, crypto)\n", program);
+    printf("\nBatch job file lines:\n");
+    printf("  encode <input.png> <output.png> [job options] [--] <message...>\n");
+    printf("  encode <input.png> <output.png> --payload <file|-> [job options]   Hide a file's bytes (- = standard input)\n");
+    printf("  decode <input.png> [--payload <file>]                             Write the payload to a file\n");
+    printf("\nOptions:\n");
+    printf("  --threads <n>       Number of worker threads (default: number of CPUs)\n");
+    printf("  --pipeline          Run jobs through overlapping load/embed/save stages instead of the thread pool\n");
+    printf("  --queue-depth <n>   Jobs buffered between pipeline stages, inputs read ahead and encoded images waiting to be\n");
+    printf("                      written (default: 4); bounds memory use\n");
+    printf("  --io <backend>      File I/O: auto (default), uring (Linux io_uring), threads (pread/pwrite pool) or sync\n");
+    printf("\nJob options (defaults for every job, or per job line):\n");
+    printf("  --png-level <n>     Deflate effort: 0 = store only, 1-64 (default: 8)\n");
+    printf("  --png-filter <f>    adaptive (default), none, sub, up, average or paeth\n");
+    printf("  --png-profile <p>   default (level 8, adaptive), fast (level 1, sub), archive (level 32, adaptive)\n");
+    printf("                      or store (no compression, no filter)\n");
+    printf("  --deflate <b>       Deflate implementation: auto (default: %s), builtin or zlib\n", deflate_backend_name(DEFLATE_AUTO));
+    printf("  --verify <v>        Check each encode in memory: off (default), pixels (extract the message from the stego\n");
+    printf("                      pixels before compression) or png (also decode the compressed PNG and compare pixels)\n");
+    printf("  --format <f>        Message layout for encodes: header (default: magic, length and CRC32C) or legacy\n");
+    printf("                      (checksum and end marker, as in interactive mode); decoding detects either\n");
+    printf("  --fec <n>           Reed-Solomon check bytes per 255-byte block (2-%d; repairs n/2 damaged bytes per\n", RS_MAX_PARITY);
+    printf("                      block) or off (default); header format only\n");
+    printf("  --key <passphrase>  Scatter the embedded bits over the image in a keyed pseudo-random order instead of\n");
+    printf("                      from the first pixel on; decoding needs the same key (not encryption)\n");
+    printf("  --passphrase <p>    Encrypt and authenticate the payload (ChaCha20-Poly1305, scrypt key); header format\n");
+    printf("                      only; decoding needs the same passphrase. - prompts for it on the terminal\n");
+    printf("  --passphrase-file <f>\n");
+    printf("                      Read the passphrase from the first line of a file instead of the command line\n");
+    printf("  --passphrase-env <v>\n");
+    printf("                      Read the passphrase from an environment variable instead of the command line\n");
+    printf("  --metadata <m>      keep (default: copy the input's ancillary chunks, such as ICC profiles, text and pHYs,\n");
+    printf("                      to the output) or strip\n");
+    printf("  --carrier <c>       pixels (default: hide the message in the pixels) or chunk (store it in a private stEg\n");
+    printf("                      chunk and copy the rest of the PNG as is; fast, but not hidden); decoding detects either\n");
+    printf("  --interlace <i>     off (default: write a non-interlaced PNG), keep (interlace the output if the input was\n");
+    printf("                      Adam7-interlaced) or adam7\n");
+    printf("  --embed-order <o>   raster (default: embed along the image rows) or passes (along the Adam7 passes, the\n");
+    printf("                      order an interlaced file stores its pixels in); header format only; decoding detects either\n");
+    printf("  --inflate <b>       PNG input decoding: auto (default: %s), builtin, stb or zlib\n", inflate_backend_name(INFLATE_AUTO));
+    printf("\nJobs in a batch run concurrently, so a job must not read a file written by another job in the same batch.\n");
+    printf("Indexed PNGs stay indexed: the palette is doubled so the message changes no color, at a larger bit depth if\n");
+    printf("needed. A palette with over 128 used colors cannot be doubled; its pixels then change to the nearest color.\n");
+}
+
+// Capacity queries. Only the image header is read (stbi_info), and an optional cache file remembers the
+// dimensions of every image by path, size and modification time, so a repeated query over a large
+// corpus costs one stat() per image. Capacity follows from the dimensions and sample depth for every
+// layout, so the cache stays valid whatever --format or --fec a query uses. An indexed PNG counts as one
+// channel: its message goes into the palette indices.
+#define CAPACITY_CACHE_MAGIC "# steg capacity cache v4"
+#define CAPACITY_CACHE_MAGIC_V1 "# steg capacity cache v1"  // No sample depths: read as empty, so its images are probed again
+#define CAPACITY_CACHE_MAGIC_V2 "# steg capacity cache v2"  // Indexed images as RGB(A): read as empty too
+#define CAPACITY_CACHE_MAGIC_V3 "# steg capacity cache v3"  // Unescaped paths: read as empty too
+
+typedef struct {
+    char *path;
+    long long size, mtime;
+    int width, height, channels;
+    int depth;  // Bits per sample (8 or 16)
+} capacity_entry;
+
+/**
+ * Tells whether a file is an indexed PNG that loads as its palette indices, from its IHDR alone.
+ *
+ * @param path The image file.
+ * @return 1 if it is a non-interlaced indexed PNG, 0 otherwise.
+ */
+int png_file_is_indexed(const char *path) {
+    unsigned char header[29];
+    FILE *file = fopen(path, "rb");
+    size_t got = file ? fread(header, 1, sizeof(header), file) : 0;
+    if (file) fclose(file);
+    return got == sizeof(header) && memcmp(header + 1, "PNG", 3) == 0 && memcmp(header + 12, "IHDR", 4) == 0 && header[25] == 3 && header[28] == 0;
+}
+
+typedef struct {
+    capacity_entry *entries;
+    size_t count, capacity;
+    size_t *slots;  // Open-addressing hash table of entry index + 1, 0 = empty
+    size_t slot_count;
+    int dirty;      // Entries were added or changed since the cache file was read
+} capacity_cache;
+
+/**
+ * Hashes a path (FNV-1a).
+ *
+ * @param path The path.
+ * @return The hash.
+ */
+static size_t capacity_hash(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+/**
+ * Finds the hash slot of a path: the slot that holds it, or the empty slot where it belongs.
+ *
+ * @param cache The cache (slot_count is a power of two).
+ * @param path The path.
+ * @return The slot index.
+ */
+static size_t capacity_slot(const capacity_cache *cache, const char *path) {
+    size_t slot = capacity_hash(path) & (cache->slot_count - 1);
+    while (cache->slots[slot] && strcmp(cache->entries[cache->slots[slot] - 1].path, path) != 0) {
+        slot = (slot + 1) & (cache->slot_count - 1);
+    }
+    return slot;
+}
+
+/**
+ * Looks up an image in the cache.
+ *
+ * @param cache The cache.
+ * @param path The image path.
+ * @return The entry, or NULL if the image is not cached.
+ */
+capacity_entry *capacity_cache_find(const capacity_cache *cache, const char *path) {
+    if (!cache->slot_count) return NULL;
+    size_t slot = capacity_slot(cache, path);
+    return cache->slots[slot] ? &cache->entries[cache->slots[slot] - 1] : NULL;
+}
+
+/**
+ * Adds or updates an image in the cache.
+ *
+ * @param cache The cache.
+ * @param entry The image; its path is copied.
+ * @return 1 on success, 0 on failure.
+ */
+int capacity_cache_put(capacity_cache *cache, const capacity_entry *entry) {
+    capacity_entry *existing = capacity_cache_find(cache, entry->path);
+    if (existing) {
+        char *path = existing->path;
+        *existing = *entry;
+        existing->path = path;
+        return 1;
+    }
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 256;
+        capacity_entry *grown = (capacity_entry *)realloc(cache->entries, capacity * sizeof(capacity_entry));
+        if (!grown) return 0;
+        cache->entries = grown;
+        cache->capacity = capacity;
+    }
+    if ((cache->count + 1) * 2 > cache->slot_count) {
+        // Keep the table at most half full
+        size_t slot_count = cache->slot_count ? cache->slot_count * 2 : 512;
+        size_t *slots = (size_t *)calloc(slot_count, sizeof(size_t));
+        if (!slots) return 0;
+        free(cache->slots);
+        cache->slots = slots;
+        cache->slot_count = slot_count;
+        for (size_t i = 0; i < cache->count; i++) {
+            cache->slots[capacity_slot(cache, cache->entries[i].path)] = i + 1;
+        }
+    }
+    capacity_entry *added = &cache->entries[cache->count];
+    *added = *entry;
+    added->path = strdup(entry->path);
+    if (!added->path) return 0;
+    cache->slots[capacity_slot(cache, added->path)] = ++cache->count;
+    return 1;
+}
+
+/**
+ * Releases a cache.
+ *
+ * @param cache The cache.
+ */
+void capacity_cache_free(capacity_cache *cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        free(cache->entries[i].path);
+    }
+    free(cache->entries);
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * Gets the value of a hexadecimal digit.
+ *
+ * @param c The character.
+ * @return The value (0-15), or -1 if c is not a hexadecimal digit.
+ */
+static int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Writes a path to a cache file, percent-encoding '%' and line breaks so every entry stays on one line.
+ *
+ * @param file The cache file.
+ * @param path The path.
+ */
+static void cache_path_write(FILE *file, const char *path) {
+    if (strpbrk(path, "%\n\r") == NULL) {
+        fputs(path, file);
+        return;
+    }
+    for (; *path; path++) {
+        if (*path == '%' || *path == '\n' || *path == '\r') {
+            fprintf(file, "%%%02X", (unsigned char)*path);
+        } else {
+            fputc(*path, file);
+        }
+    }
+}
+
+/**
+ * Decodes a path escaped by cache_path_write, in place.
+ *
+ * @param path The escaped path.
+ * @return 1 on success, 0 if an escape is malformed.
+ */
+static int cache_path_unescape(char *path) {
+    char *out = strchr(path, '%');
+    if (!out) return 1;
+    for (const char *in = out; *in; in++) {
+        if (*in != '%') {
+            *out++ = *in;
+            continue;
+        }
+        int high = hex_digit_value(in[1]), low = high < 0 ? -1 : hex_digit_value(in[2]);
+        if (low < 0) return 0;
+        *out++ = (char)(high * 16 + low);
+        in += 2;
+    }
+    *out = '\0';
+    return 1;
+}
+
+/**
+ * Reads a cache file. A missing file gives an empty cache; a file that is not a cache is an error.
+ * Each line after the first holds: size, modification time, width, height, channels, bits per sample
+ * and the path, escaped by cache_path_write.
+ *
+ * @param cache The cache to fill (empty).
+ * @param filename The cache file.
+ * @return 1 on success, 0 on failure.
+ */
+int capacity_cache_load(capacity_cache *cache, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        return errno == ENOENT;
+    }
+    int ok = 1;
+    char *line = read_line(file);
+    int old_version = line && (strcmp(line, CAPACITY_CACHE_MAGIC_V1) == 0 || strcmp(line, CAPACITY_CACHE_MAGIC_V2) == 0 ||
+                               strcmp(line, CAPACITY_CACHE_MAGIC_V3) == 0);
+    if (!line || (strcmp(line, CAPACITY_CACHE_MAGIC) != 0 && !old_version)) {
+        printf("ERROR: '%s' is not a capacity cache file.\n", filename);
+        ok = 0;
+    }
+    while (ok && !old_version) {
+        free(line);
+        if ((line = read_line(file)) == NULL) break;
+        // strtoll rather than sscanf halves the time to load a cache of 100k images
+        capacity_entry entry;
+        long long fields[6];
+        char *cursor = line, *end;
+        int field = 0;
+        for (; field < 6; field++, cursor = end) {
+            fields[field] = strtoll(cursor, &end, 10);
+            if (end == cursor || *end != ' ') break;
+            end++;
+        }
+        if (field < 6 || *cursor == '\0' || (fields[5] != 8 && fields[5] != 16) || !cache_path_unescape(cursor)) {
+            continue;  // Skip damaged lines: the image is simply probed again
+        }
+        entry.size = fields[0];
+        entry.mtime = fields[1];
+        entry.width = (int)fields[2];
+        entry.height = (int)fields[3];
+        entry.channels = (int)fields[4];
+        entry.depth = (int)fields[5];
+        entry.path = cursor;
+        ok = capacity_cache_put(cache, &entry);
+    }
+    free(line);
+    fclose(file);
+    cache->dirty = 0;
+    return ok;
+}
+
+/**
+ * Writes a cache file, through a temporary file so an interrupted write leaves the old cache intact.
+ *
+ * @param cache The cache.
+ * @param filename The cache file.
+ * @return 1 on success, 0 on failure.
+ */
+int capacity_cache_save(const capacity_cache *cache, const char *filename) {
+    size_t name_len = strlen(filename);
+    char *temp = (char *)malloc(name_len + 5);
+    if (!temp) return 0;
+    memcpy(temp, filename, name_len);
+    memcpy(temp + name_len, ".tmp", 5);
+    FILE *file = fopen(temp, "w");
+    int ok = file != NULL;
+    if (ok) {
+        fprintf(file, "%s\n", CAPACITY_CACHE_MAGIC);
+        for (size_t i = 0; i < cache->count; i++) {
+            const capacity_entry *entry = &cache->entries[i];
+            fprintf(file, "%lld %lld %d %d %d %d ", entry->size, entry->mtime, entry->width, entry->height, entry->channels, entry->depth);
+            cache_path_write(file, entry->path);
+            fputc('\n', file);
+        }
+        ok = fclose(file) == 0;
+    }
+#ifdef _WIN32
+    if (ok) remove(filename);  // rename() does not replace an existing file on Windows
+#endif
+    ok = ok && rename(temp, filename) == 0;
+    if (!ok) remove(temp);
+    free(temp);
+    return ok;
+}
+
+/**
+ * Gets the dimensions of an image from the cache, or from its header if the cache has no current entry.
+ * The cache is only read, so several threads may probe at once.
+ *
+ * @param path The image path.
+ * @param cache The cache, or NULL.
+ * @param entry The dimensions (entry->path is the given path).
+ * @return 2 if the cache had them, 1 if the header was read, 0 if the file is missing or is not a
+ *         readable image.
+ */
+int capacity_probe(const char *path, const capacity_cache *cache, capacity_entry *entry) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    entry->path = (char *)path;
+    if (cache) {
+        capacity_entry *cached = capacity_cache_find(cache, path);
+        if (cached && cached->size == (long long)st.st_size && cached->mtime == (long long)st.st_mtime) {
+            *entry = *cached;
+            entry->path = (char *)path;
+            return 2;
+        }
+    }
+    entry->size = (long long)st.st_size;
+    entry->mtime = (long long)st.st_mtime;
+    if (!stbi_info(path, &entry->width, &entry->height, &entry->channels)) return 0;
+    entry->depth = stbi_is_16_bit(path) ? 16 : 8;
+    if (png_file_is_indexed(path)) entry->channels = 1;  // One index per pixel
+    return 1;
+}
+
+/**
+ * Returns the largest payload an image holds in a layout.
+ *
+ * @param entry The image's dimensions.
+ * @param layout The layout.
+ * @return The capacity in bytes.
+ */
+size_t capacity_of(const capacity_entry *entry, const message_layout *layout) {
+    return message_capacity((size_t)entry->width * entry->height * entry->channels * (entry->depth / 8), entry->depth, layout);
+}
+
+/**
+ * Gets the dimensions of an image from the cache, or from its header, and records new ones in the cache.
+ *
+ * @param path The image path.
+ * @param cache The cache, or NULL.
+ * @param entry The dimensions (entry->path is the given path).
+ * @return 1 on success, 0 if the file is missing or is not a readable image.
+ */
+int image_dimensions(const char *path, capacity_cache *cache, capacity_entry *entry) {
+    int found = capacity_probe(path, cache, entry);
+    if (found == 1 && cache && capacity_cache_put(cache, entry)) {
+        cache->dirty = 1;
+    }
+    return found != 0;
+}
+
+/**
+ * Parses the options of a capacity query or carrier selection: --cache, --threads (if allowed) and
+ * the job options that set the layout.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @param options The job options to update.
+ * @param cache_filename A pointer to store the value of --cache.
+ * @param threads A pointer to store the value of --threads, or NULL if the command has no such option.
+ * @return The index of the first argument after the options, or -1 on an invalid option.
+ */
+int parse_query_options(int argc, char **argv, steg_job_options *options, const char **cache_filename, int *threads) {
+    int first = 0, parsed;
+    while (first + 1 < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (strcmp(argv[first], "--cache") == 0) {
+            *cache_filename = argv[first + 1];
+        } else if (threads && strcmp(argv[first], "--threads") == 0) {
+            *threads = atoi(argv[first + 1]);
+            if (*threads < 1) {
+                printf("ERROR: --threads must be at least 1.\n");
+                return -1;
+            }
+        } else if ((parsed = job_parse_option(argv[first], argv[first + 1], options)) <= 0) {
+            if (parsed == 0) printf("ERROR: Unknown option '%s'.\n", argv[first]);
+            return -1;
+        }
+        first += 2;
+    }
+    if (options->layout.format == MESSAGE_FORMAT_LEGACY && options->layout.fec_parity) {
+        printf("ERROR: Error correction (--fec) needs the header format.\n");
+        return -1;
+    }
+    if (options->layout.format == MESSAGE_FORMAT_LEGACY && options->layout.secrets.passphrase) {
+        printf("ERROR: Encryption (--passphrase) needs the header format.\n");
+        return -1;
+    }
+    return first;
+}
+
+/**
+ * Prints the capacity of each image as a tab-separated line: capacity in bytes, width, height,
+ * channels and path. "-" in the list reads more paths from standard input, one per line.
+ *
+ * @param argc The number of arguments after --capacity.
+ * @param argv The arguments: [--cache <file>] [job options] <images...>
+ * @return The process exit code: 0 if every image was read, 1 otherwise.
+ */
+int run_capacity(int argc, char **argv) {
+    steg_job_options options = { PNG_PROFILE_DEFAULT, INFLATE_AUTO, VERIFY_OFF, { MESSAGE_FORMAT_HEADER, 0 } };
+    const char *cache_filename = NULL;
+    capacity_cache cache = { 0 };
+    int first = parse_query_options(argc, argv, &options, &cache_filename, NULL);
+    if (first < 0) {
+        return 1;
+    }
+    if (cache_filename && !capacity_cache_load(&cache, cache_filename)) {
+        capacity_cache_free(&cache);
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = first; i < argc; i++) {
+        char *line = NULL;
+        int from_stdin = strcmp(argv[i], "-") == 0;
+        while (1) {
+            const char *path = argv[i];
+            if (from_stdin) {
+                free(line);
+                if ((line = read_line(stdin)) == NULL) break;
+                if (line[0] == '\0') continue;
+                path = line;
+            }
+            capacity_entry entry;
+            if (image_dimensions(path, cache_filename ? &cache : NULL, &entry)) {
+                size_t capacity = capacity_of(&entry, &options.layout);
+                printf("%zu\t%d\t%d\t%d\t%s\n", capacity, entry.width, entry.height, entry.channels, path);
+            } else {
+                fprintf(stderr, "ERROR: Failed to read image header of '%s'.\n", path);
+                failures++;
+            }
+            if (!from_stdin) break;
+        }
+    }
+    if (cache_filename && cache.dirty && !capacity_cache_save(&cache, cache_filename)) {
+        fprintf(stderr, "ERROR: Failed to write capacity cache '%s'.\n", cache_filename);
+        failures++;
+    }
+    capacity_cache_free(&cache);
+    return failures ? 1 : 0;
+}
+
+// Carrier selection. Candidates are probed in parallel (headers or the capacity cache only) and scored
+// by the estimated size of the encoded output: the input file, plus one byte per embedded byte, since
+// every payload byte turns the LSBs of 8 carriers into noise that deflate cannot shrink. Ties go to the
+// image with fewer samples, which is also the faster one to decode, filter and compress.
+#define SELECT_PROBE_BATCH 256  // Candidates per scheduler task
+
+typedef struct {
+    capacity_entry entry;
+    int found;        // capacity_probe() result
+    size_t capacity;  // Largest payload for the layout
+} carrier_candidate;
+
+typedef struct {
+    char **paths;
+    carrier_candidate *candidates;
+    const capacity_cache *cache;
+    const message_layout *layout;
+} carrier_probe_context;
+
+/**
+ * Scheduler task: probes candidates [begin, end).
+ */
+void carrier_probe_task(steg_scheduler *scheduler, void *context, int begin, int end) {
+    carrier_probe_context *probe = (carrier_probe_context *)context;
+    (void)scheduler;
+    for (int i = begin; i < end; i++) {
+        carrier_candidate *candidate = &probe->candidates[i];
+        candidate->found = capacity_probe(probe->paths[i], probe->cache, &candidate->entry);
+        candidate->capacity = candidate->found ? capacity_of(&candidate->entry, probe->layout) : 0;
+    }
+}
+
+/**
+ * Gets how many payload bytes a carrier holds as one shard of a split payload: its capacity less the
+ * shard record every shard starts with (see run_shard).
+ *
+ * @param capacity The carrier's capacity for the layout.
+ * @return The shard capacity, 0 if the carrier cannot hold a shard.
+ */
+size_t shard_capacity(size_t capacity) {
+    return capacity > STEG_SHARD_BYTES ? capacity - STEG_SHARD_BYTES : 0;
+}
+
+/**
+ * Estimates the size of a carrier's encoded output.
+ *
+ * @param candidate The carrier.
+ * @param share The payload bytes it carries.
+ * @param layout The layout.
+ * @return The estimated output size in bytes.
+ */
+static double carrier_cost(const carrier_candidate *candidate, size_t share, const message_layout *layout) {
+    return (double)candidate->entry.size + (double)message_embedded_bytes(share, layout);
+}
+
+/**
+ * Orders candidates by how cheaply they carry a split payload: output bytes per byte of shard capacity
+ * (qsort comparator).
+ */
+static int carrier_ratio_compare(const void *a, const void *b) {
+    const carrier_candidate *x = *(carrier_candidate *const *)a, *y = *(carrier_candidate *const *)b;
+    double rx = (double)x->entry.size / (double)shard_capacity(x->capacity), ry = (double)y->entry.size / (double)shard_capacity(y->capacity);
+    return rx < ry ? -1 : rx > ry;
+}
+
+/**
+ * Tells whether a carrier is a better choice than another for the same share of the payload.
+ *
+ * @param a The carrier.
+ * @param b The carrier to beat, or NULL.
+ * @return 1 if a is better.
+ */
+static int carrier_better(const carrier_candidate *a, const carrier_candidate *b) {
+    if (!b) return 1;
+    if (a->entry.size != b->entry.size) return a->entry.size < b->entry.size;
+    return (size_t)a->entry.width * a->entry.height * a->entry.channels < (size_t)b->entry.width * b->entry.height * b->entry.channels;
+}
+
+/**
+ * Plans a payload split over carriers, as shards that --shard writes in the planned order: every carrier
+ * but the last is filled to its shard capacity, and the last, smaller share goes to the cheapest
+ * carrier that still holds it.
+ *
+ * @param order The carriers that can hold a shard, reordered so the chosen ones come first in shard order.
+ * @param usable The number of carriers.
+ * @param payload_len The payload size.
+ * @return The number of carriers chosen, or 0 if together they cannot hold the payload.
+ */
+int select_split(carrier_candidate **order, int usable, size_t payload_len) {
+    size_t total = 0;
+    for (int i = 0; i < usable; i++) total += shard_capacity(order[i]->capacity);
+    if (total < payload_len) return 0;
+    qsort(order, usable, sizeof(carrier_candidate *), carrier_ratio_compare);
+    int chosen = 0;
+    size_t offset = 0;
+    while (payload_len - offset > shard_capacity(order[chosen]->capacity)) {
+        offset += shard_capacity(order[chosen]->capacity);
+        chosen++;
+    }
+    // The last share is usually small: any remaining carrier that holds it may be cheaper
+    for (int i = chosen + 1; i < usable; i++) {
+        if (shard_capacity(order[i]->capacity) >= payload_len - offset && carrier_better(order[i], order[chosen])) {
+            carrier_candidate *swap = order[chosen];
+            order[chosen] = order[i];
+            order[i] = swap;
+        }
+    }
+    return chosen + 1;
+}
+
+/**
+ * Reads a list of paths; "-" reads more paths from standard input, one per line.
+ *
+ * @param args The arguments.
+ * @param count The number of arguments.
+ * @param path_count A pointer to store the number of paths.
+ * @return The paths (free each and the array with free()), or NULL on failure.
+ */
+char **collect_paths(char **args, int count, int *path_count) {
+    char **paths = NULL;
+    int total = 0, capacity = 0;
+    for (int i = 0; i < count; i++) {
+        int from_stdin = strcmp(args[i], "-") == 0;
+        char *line;
+        while ((line = from_stdin ? read_line(stdin) : strdup(args[i])) != NULL) {
+            if (line[0] != '\0') {
+                if (total == capacity) {
+                    capacity = capacity ? capacity * 2 : 1024;
+                    char **grown = (char **)realloc(paths, capacity * sizeof(char *));
+                    if (!grown) {
+                        printf("Memory allocation failed!\n");
+                        free(line);
+                        for (int j = 0; j < total; j++) free(paths[j]);
+                        free(paths);
+                        return NULL;
+                    }
+                    paths = grown;
                 }
+                paths[total++] = line;
+            } else {
+                free(line);
             }
+            if (!from_stdin) break;
         }
     }
-    *binary_size = index;  // Store the size of the binary data
-    return binary_data;
+    *path_count = total;
+    return paths ? paths : (char **)calloc(1, sizeof(char *));
 }
 
 /**
- * Converts a given message into its binary representation.
+ * Chooses carriers for a payload. One carrier is used if any can hold the whole payload; otherwise the
+ * payload is split over the carriers that store it most cheaply (see select_split), with room for the
+ * shard record in each. Prints one tab-separated line per carrier: payload offset, length, estimated
+ * output bytes and path.
  *
- * @param message The ASCII message to be converted into binary.
- * @return The binary representation of the message as a string.
+ * @param argc The number of arguments after --select.
+ * @param argv The arguments: <payload file|size in bytes> [--cache <file>] [--threads <n>] [job options] <images...|->
+ * @return The process exit code: 0 if carriers were found, 1 otherwise.
  */
-char *messageToBinary(const char *message) {
-    int length = strlen(message);
-    int binaryLength = length * 8 + 1;  // Each character is 8 bits
+int run_select(int argc, char **argv) {
+    steg_job_options options = { PNG_PROFILE_DEFAULT, INFLATE_AUTO, VERIFY_OFF, { MESSAGE_FORMAT_HEADER, 0 } };
+    const char *cache_filename = NULL;
+    int threads = cpu_count();
+    struct stat st;
+    size_t payload_len;
+    char *end;
 
-    char *messageBinary = (char *)malloc(binaryLength);
-    if (!messageBinary) {
+    if (stat(argv[0], &st) == 0) {
+        payload_len = (size_t)st.st_size;
+    } else {
+        payload_len = (size_t)strtoull(argv[0], &end, 10);
+        if (end == argv[0] || *end != '\0') {
+            printf("ERROR: '%s' is neither a payload file nor a size in bytes.\n", argv[0]);
+            return 1;
+        }
+    }
+    int first = parse_query_options(argc - 1, argv + 1, &options, &cache_filename, &threads);
+    if (first < 0) {
+        return 1;
+    }
+    int count;
+    char **paths = collect_paths(argv + 1 + first, argc - 1 - first, &count);
+    if (!paths) {
+        return 1;
+    }
+
+    capacity_cache cache = { 0 };
+    carrier_candidate *candidates = (carrier_candidate *)calloc(count ? count : 1, sizeof(carrier_candidate));
+    carrier_candidate **order = (carrier_candidate **)malloc((count ? count : 1) * sizeof(carrier_candidate *));
+    steg_scheduler scheduler;
+    int ok = candidates && order && (!cache_filename || capacity_cache_load(&cache, cache_filename));
+    if (ok && !scheduler_init(&scheduler, threads)) {
         printf("Memory allocation failed!\n");
-        return NULL;
+        ok = 0;
+    }
+    if (ok) {
+        carrier_probe_context probe = { paths, candidates, cache_filename ? &cache : NULL, &options.layout };
+        for (int i = 0; ok && i < count; i += SELECT_PROBE_BATCH) {
+            ok = scheduler_spawn(&scheduler, carrier_probe_task, &probe, i, i + SELECT_PROBE_BATCH < count ? i + SELECT_PROBE_BATCH : count);
+        }
+        scheduler_run(&scheduler);
+        scheduler_destroy(&scheduler);
     }
 
-    // Convert each character of the message into its binary form
-    for (int i = 0; i < length; i++) {
-        for (int j = 7; j >= 0; j--) {
-            messageBinary[i * 8 + 7 - j] = ((message[i] >> j) & 1) ? '1' : '0';
+    // Record newly probed images, pick the single best carrier and rank the rest for a split
+    int usable = 0, probed = 0, cached = 0;
+    const carrier_candidate *best = NULL;
+    size_t total_capacity = 0;  // Shard capacity of all candidates, for a split
+    for (int i = 0; ok && i < count; i++) {
+        carrier_candidate *candidate = &candidates[i];
+        if (!candidate->found) {
+            fprintf(stderr, "ERROR: Failed to read image header of '%s'.\n", paths[i]);
+            continue;
         }
+        if (candidate->found == 2) {
+            cached++;
+        } else {
+            probed++;
+            if (cache_filename && capacity_cache_put(&cache, &candidate->entry)) cache.dirty = 1;
+        }
+        if (candidate->capacity >= payload_len && carrier_better(candidate, best)) best = candidate;
+        if (shard_capacity(candidate->capacity) == 0) continue;
+        order[usable++] = candidate;
+        total_capacity += shard_capacity(candidate->capacity);
     }
 
-    messageBinary[binaryLength - 1] = '\0';  // Null-terminate the string
-    return messageBinary;
+    int chosen = 0;
+    double estimate = 0;
+    if (ok && best) {
+        chosen = 1;
+        estimate = carrier_cost(best, payload_len, &options.layout);
+        printf("0\t%zu\t%.0f\t%s\n", payload_len, estimate, best->entry.path);
+    } else if (ok && total_capacity < payload_len) {
+        printf("ERROR: The candidates can hold at most %zu bytes of shards in total; the payload is %zu bytes.\n", total_capacity, payload_len);
+        ok = 0;
+    } else if (ok) {
+        chosen = select_split(order, usable, payload_len);
+        size_t offset = 0;
+        for (int i = 0; i < chosen; i++) {
+            size_t share = i + 1 < chosen ? shard_capacity(order[i]->capacity) : payload_len - offset;
+            double cost = carrier_cost(order[i], STEG_SHARD_BYTES + share, &options.layout);
+            printf("%zu\t%zu\t%.0f\t%s\n", offset, share, cost, order[i]->entry.path);
+            estimate += cost;
+            offset += share;
+        }
+    }
+    if (ok) {
+        fprintf(stderr, "Selected %d of %d candidate(s) (%d header(s) read, %d from the cache) for %zu bytes; estimated output %.0f bytes.\n",
+                chosen, count, probed, cached, payload_len, estimate);
+    }
+
+    if (cache_filename && cache.dirty && !capacity_cache_save(&cache, cache_filename)) {
+        fprintf(stderr, "ERROR: Failed to write capacity cache '%s'.\n", cache_filename);
+    }
+    capacity_cache_free(&cache);
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    free(candidates);
+    free(order);
+    return ok ? 0 : 1;
 }
 
+// Sharding: a payload too large for one image is split over several. Every shard carries a shard record
+// (see STEG_FLAG_SHARD) with its sequence number, its offset and the manifest hash of the set. The
+// shards are encoded, and later decoded, as ordinary batch jobs, so carriers are processed in parallel.
+// Each decoded piece is streamed straight to its offset in the output file, in whatever order the
+// images are given.
+
 /**
- * Encodes a binary string with the given message and appends the checksum.
- * This function is now modified to correctly embed individual bits of the message.
+ * Computes the CRC32C of a file, reading it in chunks.
  *
- * @param binary_data The binary data to which the message is to be encoded.
- * @param message The message to be encoded in binary.
- * @return The binary string with the encoded message and checksum appended.
+ * @param filename The file.
+ * @param length A pointer to store the file size.
+ * @param crc A pointer to store the CRC.
+ * @return 1 on success, 0 if the file cannot be read.
  */
-char *encode_binary(char *binary_data, const char *message) {
-    char *binary_message = messageToBinary(message);
-    if (!binary_message) {
-        return NULL;
-    }
-
-    // Convert checksum to binary string
-    unsigned char checksum_val = calculate_checksum(binary_message, strlen(binary_message));
-    char checksum_binary[9]; // 8 bits + null terminator
-    for (int j = 0; j < 8; j++) {
-        checksum_binary[j] = ((checksum_val >> (7 - j)) & 1) ? '1' : '0';
+int file_crc32c(const char *filename, uint64_t *length, uint32_t *crc) {
+    FILE *file = fopen(filename, "rb");
+    unsigned char *chunk = (unsigned char *)malloc(PAYLOAD_CHUNK_BYTES);
+    int ok = file && chunk;
+    size_t count;
+    *length = 0;
+    *crc = 0;
+    while (ok && (count = fread(chunk, 1, PAYLOAD_CHUNK_BYTES, file)) > 0) {
+        *crc = crc32c(*crc, chunk, count);
+        *length += count;
     }
-    checksum_binary[8] = '\0';
-
-    char end_marker_binary[] = "00000111"; // ASCII for BEL character (Bell)
-
-    int message_bits_len = strlen(binary_message);
-    int checksum_bits_len = strlen(checksum_binary);
-    int end_marker_bits_len = strlen(end_marker_binary);
-
-    int total_bits_to_embed = message_bits_len + checksum_bits_len + end_marker_bits_len;
+    if (ok && ferror(file)) ok = 0;
+    if (file) fclose(file);
+    free(chunk);
+    return ok;
+}
 
-    int original_image_binary_len = strlen(binary_data); // Total number of '0'/'1' characters for the image
+/**
+ * Plans the next shard of a payload: the carrier is filled to its shard capacity, or takes the rest of
+ * the payload if that is smaller.
+ *
+ * @param capacity The carrier's capacity for the layout.
+ * @param total The payload size.
+ * @param planned The payload bytes planned so far (updated).
+ * @return The shard length, 0 if the carrier cannot hold a shard.
+ */
+uint64_t shard_plan_next(size_t capacity, uint64_t total, uint64_t *planned) {
+    uint64_t length = shard_capacity(capacity);
+    if (length > total - *planned) length = total - *planned;
+    *planned += length;
+    return length;
+}
 
-    // Check if the image is large enough to embed the entire message + checksum + end marker
-    // We modify 1 LSB per 8-bit component representation in binary_data.
-    // So, we need at least `total_bits_to_embed` LSB positions.
-    if (original_image_binary_len < (total_bits_to_embed * 8)) { // Must have enough `char`s in `binary_data`
-        printf("Error: Image is too small to embed the message. Needs at least %d pixel LSBs (total %d image binary bits).\n", 
-               total_bits_to_embed, total_bits_to_embed * 8);
-        free(binary_message);
-        return NULL;
+/**
+ * Splits a payload file over carriers, in the given order: every carrier but the last is filled to its
+ * capacity (the plan --select prints). The shards are written to <prefix>-0001.png, <prefix>-0002.png, ...
+ *
+ * @param argc The number of arguments after --shard.
+ * @param argv The arguments: <payload> <output prefix> [--cache <file>] [--threads <n>] [job options] <carriers...|->
+ * @return The process exit code: 0 if every shard was written, 1 otherwise.
+ */
+int run_shard(int argc, char **argv) {
+    steg_batch_options options = { cpu_count(), 0, 4, IO_BACKEND_AUTO, { PNG_PROFILE_DEFAULT, INFLATE_AUTO, VERIFY_OFF, { MESSAGE_FORMAT_HEADER, 0 } } };
+    const char *cache_filename = NULL;
+    if (argc < 3) {
+        printf("ERROR: expected --shard <payload> <output prefix> [options] <carriers...>.\n");
+        return 1;
+    }
+    const char *payload_filename = argv[0], *prefix = argv[1];
+    int first = parse_query_options(argc - 2, argv + 2, &options.job_defaults, &cache_filename, &options.thread_count);
+    if (first < 0) {
+        return 1;
+    }
+    if (options.job_defaults.layout.format == MESSAGE_FORMAT_LEGACY) {
+        printf("ERROR: Sharding needs the header format.\n");
+        return 1;
+    }
+    uint64_t total;
+    uint32_t payload_crc;
+    if (strcmp(payload_filename, "-") == 0 || !file_crc32c(payload_filename, &total, &payload_crc)) {
+        printf("ERROR: Failed to read payload file '%s' (sharding needs a file it can read twice).\n", payload_filename);
+        return 1;
+    }
+    int count;
+    char **paths = collect_paths(argv + 2 + first, argc - 2 - first, &count);
+    if (!paths) {
+        return 1;
     }
 
-    int current_embed_idx = 0; // Index for bits in `binary_message` / `checksum_binary` / `end_marker_binary`
-    int binary_data_lsb_idx = 7; // Index for LSB position in `binary_data` (0-7 for first byte, 8-15 for second, etc.)
-
-    // Embed message bits
-    for (int i = 0; i < message_bits_len; i++) {
-        // Embed the actual bit from binary_message (e.g., '0' or '1')
-        binary_data[binary_data_lsb_idx] = binary_message[current_embed_idx++];
-        binary_data_lsb_idx += 8; // Move to the LSB of the next 8-bit component
+    // Plan the shards from the image headers
+    capacity_cache cache = { 0 };
+    uint64_t *lengths = (uint64_t *)malloc((count ? count : 1) * sizeof(uint64_t));
+    int *carriers = (int *)malloc((count ? count : 1) * sizeof(int));
+    int ok = lengths && carriers && (!cache_filename || capacity_cache_load(&cache, cache_filename));
+    uint32_t shard_count = 0;
+    uint64_t planned = 0, capacity_total = 0;
+    for (int i = 0; ok && i < count && (planned < total || shard_count == 0); i++) {
+        capacity_entry entry;
+        if (!image_dimensions(paths[i], cache_filename ? &cache : NULL, &entry)) {
+            printf("ERROR: Failed to read image header of '%s'.\n", paths[i]);
+            ok = 0;
+            break;
+        }
+        size_t capacity = capacity_of(&entry, &options.job_defaults.layout);
+        if (shard_capacity(capacity) == 0) continue;
+        capacity_total += shard_capacity(capacity);
+        lengths[shard_count] = shard_plan_next(capacity, total, &planned);
+        carriers[shard_count++] = i;
+    }
+    if (ok && planned < total) {
+        printf("ERROR: The carriers can hold at most %llu bytes of shards; the payload is %llu bytes.\n",
+               (unsigned long long)capacity_total, (unsigned long long)total);
+        ok = 0;
     }
 
-    // Embed checksum bits
-    for (int i = 0; i < checksum_bits_len; i++) {
-        binary_data[binary_data_lsb_idx] = checksum_binary[i];
-        binary_data_lsb_idx += 8;
+    steg_batch_job *jobs = ok ? (steg_batch_job *)calloc(shard_count, sizeof(steg_batch_job)) : NULL;
+    int failures = 0;
+    if (ok && !jobs) {
+        printf("Memory allocation failed!\n");
+        ok = 0;
+    }
+    if (ok) {
+        uint64_t manifest = shard_manifest_hash(total, payload_crc, lengths, shard_count);
+        uint64_t offset = 0;
+        size_t name_len = strlen(prefix) + 16;
+        for (uint32_t i = 0; i < shard_count; i++) {
+            steg_batch_job *job = &jobs[i];
+            job->choice = 1;
+            job->line_number = (int)i + 1;
+            job->options = options.job_defaults;
+            job->input_filename = strdup(paths[carriers[i]]);
+            job->output_filename = (char *)malloc(name_len);
+            job->payload_filename = strdup(payload_filename);
+            if (job->output_filename) snprintf(job->output_filename, name_len, "%s-%04u.png", prefix, i + 1);
+            job->shard_job = 1;
+            job->shard.index = i;
+            job->shard.count = shard_count;
+            job->shard.offset = offset;
+            job->shard.total = total;
+            job->shard.payload_crc = payload_crc;
+            job->shard.manifest = manifest;
+            job->shard_length = (size_t)lengths[i];
+            offset += lengths[i];
+            if (!job->input_filename || !job->output_filename || !job->payload_filename) ok = 0;
+        }
+        steg_batch batch;
+        double start = now_seconds();
+        if (!ok) {
+            printf("Memory allocation failed!\n");
+        } else if (!batch_execute(&batch, jobs, shard_count, &options)) {
+            ok = 0;
+        }
+        double elapsed = now_seconds() - start;
+        for (uint32_t i = 0; i < shard_count; i++) {
+            steg_batch_job *job = &jobs[i];
+            if (!ok) {
+                // Nothing ran
+            } else if (atomic_load(&job->failed)) {
+                printf("[shard %u/%u] ERROR: '%s': %s\n", i + 1, shard_count, job->input_filename, job->error);
+                failures++;
+            } else {
+                printf("[shard %u/%u] SUCCESS: %zu bytes at offset %llu embedded in '%s', written to '%s'\n", i + 1, shard_count,
+                       job->shard_length, (unsigned long long)job->shard.offset, job->input_filename, job->output_filename);
+            }
+            batch_release_job(job);
+        }
+        if (ok) {
+            printf("Sharding finished: %llu bytes over %u image(s), %d failed, %d thread(s), %.3f s.\n", (unsigned long long)total,
+                   shard_count, failures, options.thread_count, elapsed);
+        }
     }
 
-    // Embed end marker bits
-    for (int i = 0; i < end_marker_bits_len; i++) {
-        binary_data[binary_data_lsb_idx] = end_marker_binary[i];
-        binary_data_lsb_idx += 8;
+    if (cache_filename && cache.dirty && !capacity_cache_save(&cache, cache_filename)) {
+        printf("ERROR: Failed to write capacity cache '%s'.\n", cache_filename);
     }
-    
-    free(binary_message);
-    return binary_data; // Return the modified binary_data string
+    capacity_cache_free(&cache);
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    free(lengths);
+    free(carriers);
+    free(jobs);
+    return ok && !failures ? 0 : 1;
 }
 
 /**
- * Converts binary data back into an image representation.
+ * Checks carrier selection against sharding near the capacity limit, for the images given as candidates:
+ * for payloads just below, at and just above what the images hold as shards, the --select split is
+ * planned and fed to the --shard planner in the printed order. Every split plan must shard into exactly
+ * the same lengths, every shard must fit its carrier with the shard flag set, and a payload above the
+ * limit must be refused. This is done without and with error correction and encryption. Payloads one
+ * carrier holds alone are not split and are skipped.
  *
- * @param binary_data The binary data to convert into an image.
- * @param width The width of the image.
- * @param height The height of the image.
- * @param channels The number of channels in the image.
- * @return The image data created from the binary data.
+ * @param files The candidate images.
+ * @param count The number of images.
+ * @return The process exit code.
  */
-unsigned char *binary_to_image(char *binary_data, int width, int height, int channels) {
-    unsigned char *image = (unsigned char *)malloc(width * height * channels);
-    
-    if (!image) {
-        printf("Memory allocation failed!\n");
-        return NULL;
+int bench_select(char **files, int count) {
+    static const char *labels[3] = { "plain", "fec 16", "sealed" };
+    carrier_candidate *candidates = (carrier_candidate *)calloc(count, sizeof(carrier_candidate));
+    carrier_candidate **order = (carrier_candidate **)malloc(count * sizeof(carrier_candidate *));
+    int ok = candidates && order;
+    if (!ok) printf("Memory allocation failed!\n");
+    for (int i = 0; ok && i < count; i++) {
+        if (!capacity_probe(files[i], NULL, &candidates[i].entry)) {
+            printf("ERROR: Failed to read image header of '%s'.\n", files[i]);
+            ok = 0;
+        }
     }
-
-    int binary_index = 0;
-    // Store strlen(binary_data) once to avoid repeated calls in the loop (PERFORMANCE FIX)
-    size_t binary_data_len = strlen(binary_data); 
-
-    // Convert binary data back to image format
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            for (int c = 0; c < channels; c++) {
-                unsigned char pixel_value = 0;
-                for (int i = 0; i < 8; i++) {
-                    // Ensure we don't read beyond the allocated binary_data
-                    if (binary_index >= binary_data_len) { 
-                        printf("Warning: Ran out of binary data before filling image pixels. Image might be incomplete.\n");
-                        free(image); 
-                        return NULL;
-                    }
-                    pixel_value = (pixel_value << 1) | (binary_data[binary_index++] - '0');
+    if (ok) printf("  %-6s %12s %12s %9s %s\n", "layout", "limit", "payload", "carriers", "result");
+    for (int p = 0; ok && p < 3; p++) {
+        message_layout layout = { MESSAGE_FORMAT_HEADER, p == 1 ? 16 : 0 };
+        layout.secrets.passphrase = p == 2 ? passphrase_intern("bench passphrase") : NULL;  // Capacity only: no key is derived
+        message_layout sharded = layout;
+        sharded.sharded = 1;
+        size_t limit = 0, single = 0;
+        int usable = 0;
+        for (int i = 0; i < count; i++) {
+            candidates[i].capacity = capacity_of(&candidates[i].entry, &layout);
+            if (candidates[i].capacity > single) single = candidates[i].capacity;
+            limit += shard_capacity(candidates[i].capacity);
+        }
+        const size_t payloads[5] = { limit - 37, limit - 36, limit - 1, limit, limit + 1 };
+        for (int t = 0; ok && t < 5; t++) {
+            size_t payload_len = payloads[t];
+            if (payload_len <= single || payload_len > limit + 1) continue;
+            usable = 0;
+            for (int i = 0; i < count; i++) {
+                if (shard_capacity(candidates[i].capacity) > 0) order[usable++] = &candidates[i];
+            }
+            int chosen = select_split(order, usable, payload_len);
+            const char *result = "refused";
+            if (payload_len > limit) {
+                ok = chosen == 0;
+            } else {
+                // Shard the plan as --shard does, in order, and compare the lengths with the printed shares
+                uint64_t planned = 0;
+                size_t offset = 0;
+                ok = chosen > 0;
+                for (int i = 0; ok && i < chosen; i++) {
+                    size_t share = i + 1 < chosen ? shard_capacity(order[i]->capacity) : payload_len - offset;
+                    const capacity_entry *entry = &order[i]->entry;
+                    size_t pixel_bytes = (size_t)entry->width * entry->height * entry->channels * (entry->depth / 8);
+                    ok = shard_plan_next(order[i]->capacity, payload_len, &planned) == share &&
+                         message_capacity(pixel_bytes, entry->depth, &sharded) >= STEG_SHARD_BYTES + share;
+                    offset += share;
                 }
-                image[(y * width + x) * channels + c] = pixel_value;
+                ok = ok && planned == payload_len;
+                result = "sharded";
             }
+            printf("  %-6s %12zu %12zu %9d %s\n", labels[p], limit, payload_len, chosen, ok ? result : "MISMATCH");
+            if (!ok) printf("ERROR: The --select plan for %zu bytes does not shard as planned.\n", payload_len);
         }
     }
-    return image;
+    free(candidates);
+    free(order);
+    return ok ? 0 : 1;
 }
 
 /**
- * Decodes the binary data embedded in an image and extracts the message.
+ * Rebuilds a sharded payload from its images, given in any order. Every image is decoded as a batch job
+ * that streams its piece to its offset in the output file; the set is then checked against the
+ * manifest hash and the CRC32C of the whole payload.
  *
- * @param image The binary data embedded in the image.
- * @param width The width of the image.
- * @param height The height of the image.
- * @param channels The number of channels in the image.
- * @return The decoded message in binary format.
+ * @param argc The number of arguments after --reassemble.
+ * @param argv The arguments: <output> [--threads <n>] [job options] <images...|->
+ * @return The process exit code: 0 if the payload was rebuilt and verified, 1 otherwise.
  */
-char *decode_image(char *image, int width, int height, int channels) {
-    int length = strlen(image);
-    // Allocate memory for the potential decoded message (max possible bits = total LSBs in image data)
-    char *result = (char *)malloc((length / 8) + 1); 
-    
-    if (!result) {
+int run_reassemble(int argc, char **argv) {
+    steg_batch_options options = { cpu_count(), 0, 4, IO_BACKEND_AUTO, { PNG_PROFILE_DEFAULT, INFLATE_AUTO, VERIFY_OFF, { MESSAGE_FORMAT_HEADER, 0 } } };
+    const char *cache_filename = NULL;
+    const char *output_filename = argv[0];
+    int first = parse_query_options(argc - 1, argv + 1, &options.job_defaults, &cache_filename, &options.thread_count);
+    if (first < 0) {
+        return 1;
+    }
+    int count;
+    char **paths = collect_paths(argv + 1 + first, argc - 1 - first, &count);
+    if (!paths) {
+        return 1;
+    }
+    FILE *out = fopen(output_filename, "wb");  // Created empty here; every job writes its piece into it
+    steg_batch_job *jobs = (steg_batch_job *)calloc(count ? count : 1, sizeof(steg_batch_job));
+    int ok = out && jobs;
+    if (out && fclose(out) != 0) ok = 0;
+    if (!out) {
+        printf("ERROR: Failed to create '%s'.\n", output_filename);
+    } else if (!jobs) {
         printf("Memory allocation failed!\n");
-        return NULL;
     }
+    for (int i = 0; ok && i < count; i++) {
+        jobs[i].choice = 2;
+        jobs[i].line_number = i + 1;
+        jobs[i].options = options.job_defaults;
+        jobs[i].input_filename = paths[i];
+        jobs[i].payload_filename = strdup(output_filename);
+        jobs[i].shard_job = 1;
+        paths[i] = NULL;
+        if (!jobs[i].payload_filename) ok = 0;
+    }
+    steg_batch batch;
+    double start = now_seconds();
+    if (ok && count == 0) {
+        printf("ERROR: No images given.\n");
+        ok = 0;
+    } else if (ok) {
+        ok = batch_execute(&batch, jobs, count, &options);
+    }
+    double elapsed = now_seconds() - start;
 
-    int result_index = 0;
-    char byte[9];
-    unsigned char extracted_checksum = 0;
-    
-    for (int i = 7; i < length; i += 8) {
-        result[result_index++] = image[i];
-
-        if ((result_index) % 8 == 0) {
-            strncpy(byte, result + result_index - 8, 8);
-            byte[8] = '\0';
-            
-            // Check for end marker in the binary data
-            if (strcmp(byte, "00000111") == 0) {
-                // End marker found.
-                // The structure is: [MESSAGE BITS] [CHECKSUM BITS (8)] [END MARKER BITS (8)]
-                // `result_index` now includes the 8 bits of the end marker.
-
-                // Ensure enough bits for checksum (8) + end marker (8)
-                if (result_index < 16) { 
-                    printf("Error: End marker found, but not enough preceding data for checksum (requires 16 bits).\n");
-                    free(result);
-                    return NULL;
-                }
-
-                // Extract checksum (8 bits just before the end marker)
-                strncpy(byte, result + result_index - 16, 8);
-                byte[8] = '\0';
-                extracted_checksum = 0;
-                for (int k = 0; k < 8; k++) {
-                    extracted_checksum = (extracted_checksum << 1) | (byte[k] - '0');
-                }
-
-                // The message bits are everything before the checksum
-                int message_bit_length = result_index - 16;
-                if (message_bit_length < 0) { 
-                    // This scenario should ideally be caught by the result_index < 16 check above,
-                    // but as a safeguard.
-                    printf("Error: Negative message length calculated after extraction.\n");
-                    free(result);
-                    return NULL;
-                }
-
-                // Null-terminate the result string at the end of the actual message bits
-                result[message_bit_length] = '\0';
-
-                // Calculate checksum of the extracted message content (which is still in binary string format)
-                unsigned char calculated_checksum = calculate_checksum(result, message_bit_length);
-                
-                // Verify the checksum
-                if (calculated_checksum != extracted_checksum) {
-                    printf("Warning: Checksum verification failed! Message may be corrupted.\n");
-                    printf("Expected checksum: %02X, Got: %02X\n", extracted_checksum, calculated_checksum);
-                } else {
-                    printf("Checksum verification successful!\n");
-                }
-                
-                return result; // Return the binary string of the message
+    // Check the set: one manifest, every sequence number once, contiguous pieces, matching CRCs
+    const steg_shard *reference = NULL;
+    steg_batch_job **by_index = NULL;
+    int damaged = 0;
+    for (int i = 0; ok && i < count; i++) {
+        steg_batch_job *job = &jobs[i];
+        const steg_shard *shard = &job->decoded.shard;
+        if (atomic_load(&job->failed)) {
+            printf("ERROR: '%s': %s\n", job->input_filename, job->error);
+            ok = 0;
+        } else if (!reference) {
+            reference = shard;
+            by_index = (steg_batch_job **)calloc(shard->count ? shard->count : 1, sizeof(steg_batch_job *));
+            if (!by_index) {
+                printf("Memory allocation failed!\n");
+                ok = 0;
+            }
+        }
+        if (!ok) break;
+        if (shard->manifest != reference->manifest || shard->count != reference->count || shard->total != reference->total ||
+            shard->payload_crc != reference->payload_crc || shard->index >= shard->count) {
+            printf("ERROR: '%s' holds a shard of a different payload.\n", job->input_filename);
+            ok = 0;
+        } else if (by_index[shard->index]) {
+            printf("ERROR: '%s' and '%s' hold the same shard (%u of %u).\n", by_index[shard->index]->input_filename, job->input_filename,
+                   shard->index + 1, shard->count);
+            ok = 0;
+        } else {
+            by_index[shard->index] = job;
+            if (!job->decoded.checksum_ok) {
+                printf("WARNING: '%s': shard %u of %u failed CRC32C verification.\n", job->input_filename, shard->index + 1, shard->count);
+                damaged++;
+            }
+        }
+    }
+    uint32_t payload_crc = 0;
+    if (ok) {
+        uint64_t *lengths = (uint64_t *)malloc(reference->count * sizeof(uint64_t));
+        uint64_t offset = 0;
+        uint32_t missing = 0;
+        for (uint32_t i = 0; i < reference->count; i++) {
+            if (!by_index[i]) missing++;
+        }
+        if (missing) {
+            printf("ERROR: %u of %u shard(s) missing.\n", missing, reference->count);
+            ok = 0;
+        } else if (!lengths) {
+            printf("Memory allocation failed!\n");
+            ok = 0;
+        }
+        for (uint32_t i = 0; ok && i < reference->count; i++) {
+            const message_info *decoded = &by_index[i]->decoded;
+            lengths[i] = decoded->length - STEG_SHARD_BYTES;
+            if (decoded->shard.offset != offset) {
+                printf("ERROR: '%s' does not continue where the previous shard ends.\n", by_index[i]->input_filename);
+                ok = 0;
             }
+            payload_crc = crc32c_combine(payload_crc, decoded->shard_crc, (size_t)lengths[i]);
+            offset += lengths[i];
         }
+        if (ok && (offset != reference->total || shard_manifest_hash(reference->total, reference->payload_crc, lengths, reference->count) !=
+                                                     reference->manifest)) {
+            printf("ERROR: The shards do not match their manifest.\n");
+            ok = 0;
+        }
+        free(lengths);
     }
 
-    // If end marker is NOT found after iterating through all possible LSBs
-    printf("Error: End marker '00000111' not found in the image's LSBs.\n");
-    free(result); // Free the allocated memory since no message was found
-    return NULL;
+    if (ok && (payload_crc != reference->payload_crc || damaged)) {
+        printf("WARNING: CRC32C verification of the payload failed! '%s' may be corrupted.\n", output_filename);
+        ok = 0;
+    } else if (ok) {
+        printf("Reassembled %llu bytes from %u shard(s) into '%s' (CRC32C verified), %d thread(s), %.3f s.\n",
+               (unsigned long long)reference->total, reference->count, output_filename, options.thread_count, elapsed);
+    } else if (out) {
+        remove(output_filename);
+    }
+    for (int i = 0; jobs && i < count; i++) batch_release_job(&jobs[i]);
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    free(by_index);
+    free(jobs);
+    return ok ? 0 : 1;
 }
 
 /**
- * Converts binary data into its corresponding ASCII characters.
+ * Extracts the payload of one image to a file, or to standard output for "-". The payload is written
+ * in chunks as it is recovered; reports go to standard error so they never mix with it.
  *
- * @param binary_data The binary data to be converted.
- * @return The corresponding ASCII representation of the binary data.
+ * @param argc The number of arguments after --extract.
+ * @param argv The arguments: <image> <file|-> [--key <k>] [--passphrase <p>]
+ * @return The process exit code: 0 on success, 1 on failure or a checksum mismatch.
  */
-char *binaryToAscii(const char *binary_data) {
-    int length = strlen(binary_data);
-    if (length % 8 != 0) {
-        printf("Error: Binary data length should be a multiple of 8.\n");
-        return NULL;
+int run_extract(int argc, char **argv) {
+    steg_job_options options = { PNG_PROFILE_DEFAULT, INFLATE_AUTO, VERIFY_OFF, { MESSAGE_FORMAT_HEADER, 0 } };
+    const char *image_filename = argv[0], *output_filename = argv[1];
+    for (int i = 2; i < argc; i += 2) {
+        int parsed = i + 1 < argc ? job_parse_option(argv[i], argv[i + 1], &options) : 0;
+        if (parsed <= 0) {
+            if (parsed == 0) fprintf(stderr, "ERROR: Unknown option '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+    const steg_secrets *secrets = &options.layout.secrets;
+    int width, height, channels, depth;
+    steg_palette palette;  // An indexed image's message is in its indices
+    size_t file_len, carrier_bytes;
+    unsigned char *image = read_file(image_filename, &file_len);
+    const unsigned char *chunk = image ? png_find_payload_chunk(image, file_len, &carrier_bytes) : NULL;
+    if (chunk) {
+        memmove(image, chunk, carrier_bytes);  // The payload chunk is the carrier: no pixels are decoded
+        depth = CARRIER_DEPTH_BYTES;
+    } else if (image) {
+        unsigned char *file = image;
+        int pass_order = 1;  // An interlaced PNG is read in its own order first
+        image = image_load_from_memory(file, file_len, &width, &height, &channels, &depth, &palette, &pass_order, INFLATE_AUTO);
+        free(file);
+        if (image && !adam7_find_message_order(&image, width, height, channels, depth, secrets, &pass_order)) {
+            stbi_image_free(image);
+            image = NULL;
+        }
+        carrier_bytes = image ? (size_t)width * height * channels * (depth / 8) : 0;
+    }
+    if (!image) {
+        fprintf(stderr, "ERROR: Failed to load image '%s'.\n", image_filename);
+        return 1;
     }
+    int to_stdout = strcmp(output_filename, "-") == 0;
+#ifdef _WIN32
+    if (to_stdout) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    FILE *out = to_stdout ? stdout : fopen(output_filename, "wb");
+    message_info info;
+    int result = out ? extract_message_to_file(image, carrier_bytes, depth, secrets, out, 0, &info) : -1;
+    if (out && (to_stdout ? fflush(out) : fclose(out)) != 0) result = -1;
+    stbi_image_free(image);
 
-    int asciiLength = length / 8;
-    char *ascii_data = (char *)malloc(asciiLength + 1);
-    
-    if (!ascii_data) {
-        printf("Memory allocation failed!\n");
-        return NULL;
+    if (result >= 0 && info.encrypted && !info.authentic) {
+        if (!to_stdout) remove(output_filename);
+        fprintf(stderr, "ERROR: %s\n", message_locked_reason(secrets));
+        return 1;
+    }
+    if (result == 0) {
+        if (!to_stdout) remove(output_filename);
+        fprintf(stderr, "RESULT: No message found encoded in this image or decoding failed.\n");
+        return 1;
+    }
+    if (result < 0) {
+        fprintf(stderr, "ERROR: Failed to write the payload to '%s'.\n", output_filename);
+        return 1;
+    }
+    if (info.sharded) {
+        fprintf(stderr, "Extracted shard %u of %u from '%s': %zu bytes for offset %llu of a %llu-byte payload (use --reassemble to rebuild it).\n",
+                info.shard.index + 1, info.shard.count, image_filename, info.length - STEG_SHARD_BYTES,
+                (unsigned long long)info.shard.offset, (unsigned long long)info.shard.total);
+    } else {
+        fprintf(stderr, "Extracted %zu bytes from '%s'%s.\n", info.length, image_filename, info.encrypted ? " (decrypted and authenticated)" : "");
+    }
+    if (info.corrected > 0) {
+        fprintf(stderr, "Error correction repaired %ld byte(s).\n", info.corrected);
+    }
+    if (!info.checksum_ok) {
+        fprintf(stderr, "Warning: checksum verification failed! Payload may be corrupted.\n");
+        return 1;
     }
+    return 0;
+}
 
-    // Convert each 8-bit segment into a corresponding ASCII character
-    for (int i = 0; i < asciiLength; i++) {
-        char ascii_char = 0;
-        for (int j = 0; j < 8; j++) {
-            ascii_char = ascii_char << 1;
-            if (binary_data[i * 8 + j] == '1') {
-                ascii_char = ascii_char | 1;
+/**
+ * Handles the non-interactive command line.
+ *
+ * @param argc The argument count.
+ * @param argv The arguments.
+ * @return The process exit code.
+ */
+int run_command_line(int argc, char **argv) {
+    const char *batch_filename = NULL;
+    steg_batch_options options = { cpu_count(), 0, 4, IO_BACKEND_AUTO, { PNG_PROFILE_DEFAULT, INFLATE_AUTO, VERIFY_OFF, { MESSAGE_FORMAT_HEADER, 0 } } };
+    int parsed;
+
+    if (argc > 2 && strcmp(argv[1], "--bench") == 0) {
+        return run_benchmark(argv[2], argv + 3, argc - 3);
+    }
+    if (argc > 3 && strcmp(argv[1], "--shard") == 0) {
+        return run_shard(argc - 2, argv + 2);
+    }
+    if (argc > 3 && strcmp(argv[1], "--reassemble") == 0) {
+        return run_reassemble(argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--select") == 0) {
+        return run_select(argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--capacity") == 0) {
+        return run_capacity(argc - 2, argv + 2);
+    }
+    if (argc > 3 && strcmp(argv[1], "--extract") == 0) {
+        return run_extract(argc - 2, argv + 2);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_filename = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.thread_count = atoi(argv[++i]);
+            if (options.thread_count < 1) {
+                printf("ERROR: --threads must be at least 1.\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            options.pipeline = 1;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            options.queue_depth = atoi(argv[++i]);
+            if (options.queue_depth < 1) {
+                printf("ERROR: --queue-depth must be at least 1.\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            const char *backend = argv[++i];
+            if (strcmp(backend, "auto") == 0) options.io_backend = IO_BACKEND_AUTO;
+            else if (strcmp(backend, "uring") == 0) options.io_backend = IO_BACKEND_URING;
+            else if (strcmp(backend, "threads") == 0) options.io_backend = IO_BACKEND_THREADS;
+            else if (strcmp(backend, "sync") == 0) options.io_backend = IO_BACKEND_SYNC;
+            else {
+                printf("ERROR: Unknown I/O backend '%s' (expected auto, uring, threads or sync).\n", backend);
+                return 1;
             }
+        } else if (i + 1 < argc && (parsed = job_parse_option(argv[i], argv[i + 1], &options.job_defaults)) != 0) {
+            if (parsed < 0) {
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            printf("ERROR: Unknown or incomplete option '%s'.\n\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
         }
-        ascii_data[i] = ascii_char;
     }
 
-    ascii_data[asciiLength] = '\0';  // Null-terminate the string
-    return ascii_data;
+    if (!batch_filename) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    return run_batch(batch_filename, &options);
 }
 
-int main() {
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        return run_command_line(argc, argv);
+    }
+
     // Declare pointers for dynamically allocated memory, initialized to NULL for safety
     unsigned char *image = NULL;
     char *binary_image_data = NULL;
@@ -344,12 +11513,19 @@ int main() {
 
     // Declare necessary integer variables for image properties
     int width, height, channels;
+    int depth; // Bits per sample: 8, or 16 for 16-bit PNGs (loaded with their full precision)
+    steg_palette palette; // Indexed PNGs are loaded as one palette index per pixel and saved indexed again
+    png_chunks chunks = { NULL, { 0, 0, 0 } }; // Ancillary chunks of the input PNG, copied into the encoded image
     int binary_size; // Declare binary_size here
 
+    // Typed messages keep the legacy layout; payload files need the header's length and CRC32C
+    const message_layout text_layout = { MESSAGE_FORMAT_LEGACY, 0 };
+    const message_layout payload_layout = { MESSAGE_FORMAT_HEADER, 0 };
+
     char input_filename_buffer[256];
     char output_filename_buffer[256];
     char choice_str[10];
-    char message_to_encode[1024]; // Increased buffer for message
+    char *message_to_encode = NULL; // Read with read_line, so its length is limited only by the image
 
     printf("Welcome to the Image Steganography CLI!\n");
     printf("Press 'q' at any time to quit.\n\n"); // Display quit instruction once at the beginning
@@ -361,6 +11537,7 @@ int main() {
         reconstructed_image = NULL;
         decoded_binary_message = NULL;
         ascii_message = NULL;
+        message_to_encode = NULL;
 
         // --- Get input image filename ---
         printf("Enter the input image filename (e.g., images/IMAGEASCII.png): ");
@@ -391,25 +11568,70 @@ int main() {
         printf("\n"); // Add newline for spacing
 
         // --- Load image ---
-        image = stbi_load(input_filename_buffer, &width, &height, &channels, 0);
+        image = image_load(input_filename_buffer, &width, &height, &channels, &depth, &palette, choice == 1 ? &chunks : NULL);
         if (image == NULL) {
             printf("ERROR: Failed to load image '%s'. Please ensure the file exists and is accessible.\n", input_filename_buffer);
             goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
         }
-        printf("Image '%s' loaded successfully! Dimensions: %d x %d, Channels: %d\n", input_filename_buffer, width, height, channels);
+        char format_note[40] = "";
+        if (depth == 16) snprintf(format_note, sizeof(format_note), " (16-bit)");
+        if (palette.entries) snprintf(format_note, sizeof(format_note), " (indexed, %d colors)", palette.entries);
+        printf("Image '%s' loaded successfully! Dimensions: %d x %d, Channels: %d%s\n", input_filename_buffer, width, height, channels, format_note);
+        size_t pixel_bytes = (size_t)width * height * channels * (depth / 8);
 
-        // --- Convert image to binary data ---
-        binary_image_data = image_to_binary(image, width, height, channels, &binary_size);
-        stbi_image_free(image); // Free original image data
-        image = NULL; // Set to NULL after freeing
-        if (!binary_image_data) {
-            printf("ERROR: Failed to convert image to binary data.\n");
-            goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
+        // --- Messages framed with a header (the batch default) are read straight from the pixels ---
+        // 16-bit images have no binary-string form, so a legacy message in one is read from the carriers too,
+        // and so is a message in a payload chunk (--carrier chunk), which takes the place of the pixels
+        if (choice == 2) {
+            message_info info;
+            size_t file_len, chunk_len;
+            unsigned char *file = read_file(input_filename_buffer, &file_len);
+            const unsigned char *chunk = file ? png_find_payload_chunk(file, file_len, &chunk_len) : NULL;
+            int pass_order = 0;
+            if (chunk) {
+                ascii_message = extract_message(chunk, chunk_len, CARRIER_DEPTH_BYTES, NULL, &info);
+            } else if (!adam7_find_message_order(&image, width, height, channels, depth, NULL, &pass_order)) {
+                free(file);
+                goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
+            } else {
+                steg_frame frame = frame_packed(image, pixel_bytes);
+                ascii_message = depth == 16 ? extract_message_frame(&frame, depth, NULL, &info) : extract_header_message(&frame, depth, NULL, &info);
+            }
+            free(file);
+            if (ascii_message) {
+                const char *check = info.format == MESSAGE_FORMAT_LEGACY ? "Checksum" : "CRC32C";
+                printf("--- Decoding Mode ---\n"); // Section header
+                if (info.corrected > 0) {
+                    printf("Error correction repaired %ld byte(s).\n", info.corrected);
+                }
+                if (info.checksum_ok) {
+                    printf("%s verification successful!\n", check);
+                } else {
+                    printf("Warning: %s verification failed! Message may be corrupted.\n", check);
+                }
+                if (info.sharded) {
+                    printf("This image holds shard %u of %u of a %llu-byte payload; rebuild it with --reassemble <file> <images...>.\n",
+                           info.shard.index + 1, info.shard.count, (unsigned long long)info.shard.total);
+                } else if (memchr(ascii_message, '\0', info.length)) {
+                    printf("The message is %zu bytes of binary data; save it with --extract <image> <file>.\n", info.length);
+                } else {
+                    printf("Decoded message: \"%s\"\n", ascii_message);
+                }
+                goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
+            }
+            if (info.encrypted) {
+                printf("The message is encrypted; decode it with --extract <image> <file> --passphrase <p>.\n");
+                goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
+            }
+            if (depth == 16) {
+                printf("RESULT: No message found encoded in this image or decoding failed (e.g., end marker not found, corrupted data).\n");
+                goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
+            }
         }
 
-        if (choice == 1) { // Encode path
-            // Calculate max character length based on the image's binary data
-            int total_lsb_positions = strlen(binary_image_data) / 8; 
+        if (choice == 1) { // Encode path: the message is embedded straight into the pixels
+            // Calculate max character length based on the image's LSB positions (8 per sample in 16-bit images)
+            int total_lsb_positions = (int)(carrier_slots(pixel_bytes, depth) * 8);
             int overhead_bits = 8 + 8; // 8 bits for checksum, 8 bits for end marker
             int available_message_bits = total_lsb_positions - overhead_bits;
             int max_char_length = available_message_bits / 8; // Each char is 8 bits
@@ -421,21 +11643,30 @@ int main() {
             
             printf("--- Encoding Mode ---\n"); // Section header
             printf("Maximum message length: %d characters.\n", max_char_length); // Clearer label
+            printf("To hide a file instead, enter @ and its name (e.g., @archive.zip); up to %zu bytes.\n",
+                   message_capacity(pixel_bytes, depth, &payload_layout));
             
             while (1) { // Loop for message input
                 printf("Enter the message you want to encode: ");
-                if (fgets(message_to_encode, sizeof(message_to_encode), stdin) == NULL) {
+                free(message_to_encode);
+                message_to_encode = read_line(stdin);
+                if (message_to_encode == NULL) {
                     printf("ERROR: Failed to read message.\n");
                     goto cleanup_iteration_and_continue;
                 }
-                message_to_encode[strcspn(message_to_encode, "\n")] = 0; // Remove trailing newline
 
                 if (strcmp(message_to_encode, "q") == 0 || strcmp(message_to_encode, "Q") == 0) {
                     printf("Quitting program.\n");
                     goto full_program_exit;
                 }
 
-                if (strlen(message_to_encode) * 8 > available_message_bits) {
+                if (message_to_encode[0] == '@') {
+                    if (strcmp(message_to_encode, "@-") == 0 || message_to_encode[1] == '\0') {
+                        printf("WARNING: Please enter a file name after @ (standard input is used for these prompts).\n");
+                    } else {
+                        break; // A payload file, checked while it is embedded
+                    }
+                } else if (strlen(message_to_encode) * 8 > (size_t)available_message_bits) {
                     printf("WARNING: Message is too long! Please enter a message up to %d characters.\n", max_char_length);
                 } else {
                     break; // Valid message, exit inner loop
@@ -454,23 +11685,33 @@ int main() {
                 goto full_program_exit;
             }
 
-            // Call encode_binary with the original binary_data and user's message
-            char *encoded_binary_data = encode_binary(binary_image_data, message_to_encode); 
-            if (!encoded_binary_data) {
-                printf("ERROR: Failed to encode message into binary data.\n");
-                goto cleanup_iteration_and_continue;
+            // Embed the message (or stream the payload file) into the pixels, or the indices of a paired palette
+            if (palette.entries && !palette_prepare(&palette, image, pixel_bytes)) {
+                printf("WARNING: The palette has over 128 colors, too many to double, so changed pixels take the nearest other color.\n");
             }
-            // binary_image_data now holds the encoded data.
-
-            // Reconstruct the image from the modified binary data
-            reconstructed_image = binary_to_image(encoded_binary_data, width, height, channels);
-            if (!reconstructed_image) {
-                printf("ERROR: Failed to reconstruct image from binary data.\n");
+            if (message_to_encode[0] == '@') {
+                char error[320];
+                size_t payload_length;
+                if (!embed_payload_file(message_to_encode + 1, NULL, 0, image, pixel_bytes, depth, &payload_layout, &payload_length, error,
+                                        sizeof(error))) {
+                    printf("ERROR: %s\n", error);
+                    goto cleanup_iteration_and_continue;
+                }
+                printf("Embedded %zu bytes from '%s'.\n", payload_length, message_to_encode + 1);
+            } else if (!embed_message(image, pixel_bytes, depth, (const unsigned char *)message_to_encode, strlen(message_to_encode), &text_layout)) {
+                printf("ERROR: Failed to encode message into binary data.\n");
                 goto cleanup_iteration_and_continue;
             }
+            reconstructed_image = image;
+            image = NULL;
 
             // Save the reconstructed image
-            if (!stbi_write_png(output_filename_buffer, width, height, channels, reconstructed_image, width * channels)) {
+            int png_len;
+            unsigned char *png = png_encode_to_mem(reconstructed_image, width, height, channels, depth, palette.entries ? &palette : NULL, &chunks,
+                                                   &PNG_PROFILE_DEFAULT, &png_len);
+            int saved = png && write_file(output_filename_buffer, png, png_len);
+            free(png);
+            if (!saved) {
                 printf("ERROR: Failed to write encoded image to '%s'. Ensure you have write permissions.\n", output_filename_buffer);
                 goto cleanup_iteration_and_continue;
             }
@@ -479,6 +11720,15 @@ int main() {
             goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
 
         } else if (choice == 2) { // Decode
+            // --- Convert image to binary data ---
+            binary_image_data = image_to_binary(image, width, height, channels, &binary_size);
+            stbi_image_free(image); // Free original image data
+            image = NULL; // Set to NULL after freeing
+            if (!binary_image_data) {
+                printf("ERROR: Failed to convert image to binary data.\n");
+                goto cleanup_iteration_and_continue; // Go to cleanup and continue loop
+            }
+
             printf("--- Decoding Mode ---\n"); // Section header
             printf("Attempting to decode message...\n");
             // Call decode_image to extract the binary message
@@ -517,6 +11767,8 @@ int main() {
         if (reconstructed_image) free(reconstructed_image);
         if (decoded_binary_message) free(decoded_binary_message);
         if (ascii_message) free(ascii_message);
+        if (message_to_encode) free(message_to_encode);
+        png_chunks_free(&chunks);
         printf("\n----------------------------------------\n\n"); // Separator for next iteration
         continue; // Continue to the next iteration of the main loop
 
@@ -528,6 +11780,8 @@ int main() {
         if (reconstructed_image) free(reconstructed_image);
         if (decoded_binary_message) free(decoded_binary_message);
         if (ascii_message) free(ascii_message);
+        if (message_to_encode) free(message_to_encode);
+        png_chunks_free(&chunks);
         return 0; // Exit the program gracefully
     }
 }